@@ -245,6 +245,113 @@ select * from veil.int4array_get('array2', 24);
 \echo TEST 1.30 = #0#Checking array2 variable(3)
 select * from veil.int4array_get('array2', 23);
 
+\echo TEST 1.31 = #t#Extend int4 array
+select veil.int4array_extend('array2', 40);
+
+\echo TEST 1.32 = #11#Check existing element of extended array
+select * from veil.int4array_get('array2', 24);
+
+\echo TEST 1.33 = #0#Check new element of extended array
+select * from veil.int4array_get('array2', 40);
+
+\echo TEST 1.34 = #3#Bulk load int4 array
+select veil.int4array_load('array2', array[12, 13, 40], array[1, 2, 3]);
+
+\echo TEST 1.35 = #{1,2,3,11}#Bulk fetch from int4 array
+select veil.int4array_get('array2', array[12, 13, 40, 24]);
+
+\echo TEST 1.36 ~ #^.11:40.=.24,1,2,0#Fetch whole int4 array
+select veil.int4array_to_array('array2');
+
+\echo TEST 1.37 = #3#Binary serialise and de-serialise several variables
+select veil.deserialise_bin(veil.serialise_bin('sess_int4') ||
+                            veil.serialise_bin('sess_range') ||
+                            veil.serialise_bin('array2'));
+
+\echo TEST 1.38 = #{1,2,3,11}#Check int4 array after binary de-ser.
+select veil.int4array_get('array2', array[12, 13, 40, 24]);
+
+\echo TEST 1.39 ~ #ERROR.*truncated#De-serialise truncated binary stream
+select veil.deserialise_bin(substr(veil.serialise_bin('array2'), 1, 20));
+
+\echo PREP
+select veil.int4_set('sess_int4', 42);
+create temp table sess_stream as
+select veil.serialise_session('sess%') as stream;
+select veil.int4_set('sess_int4', 7);
+
+\echo TEST 1.40 = #3#De-serialise session variables
+select veil.deserialise_session(stream) from sess_stream;
+
+\echo TEST 1.41 = #42#Check int4 after session de-serialisation
+select veil.int4_get('sess_int4');
+
+\echo TEST 1.42 ~ #ERROR.*corrupt#De-serialise corrupted session stream
+select veil.deserialise_session(
+           set_byte(stream, length(stream) - 1, 
+                    (get_byte(stream, length(stream) - 1) + 1) % 256))
+from   sess_stream;
+
+\echo TEST 1.43 = #t#Save snapshot of shared variables
+select veil.save_shared_snapshot() >= 3;
+
+\echo TEST 1.44 ~ #ERROR.*truncated#De-serialise truncated text stream
+select veil.deserialise(substr(veil.serialise('array2'), 1, 20));
+
+\echo TEST 1.45 ~ #ERROR.*Unsupported#De-serialise stream with bad type
+select veil.deserialise('?' || veil.serialise('sess_int4'));
+
+\echo PREP
+-- The session cache is only enabled if veil.session_cache_entries is
+-- set in postgresql.conf.  These tests need at least 2 entries: see
+-- the -c option of regress.sh.
+create or replace
+function regress_session_cache() returns bool as '
+begin
+    perform veil.int4_set(''sess_int4'', 42);
+    perform veil.int4_set(''shared_int4'', 1);
+    perform veil.cache_session(1, ''%'');
+    perform veil.int4_set(''sess_int4'', 43);
+    perform veil.int4_set(''shared_int4'', 2);
+    return veil.restore_cached_session(1) is not null and
+           veil.int4_get(''sess_int4'') = 42 and
+           veil.int4_get(''shared_int4'') = 2;
+end;
+' language plpgsql;
+
+create or replace
+function regress_session_cache_lru() returns bool as '
+declare
+    entries integer := 
+        current_setting(''veil.session_cache_entries'')::integer;
+begin
+    -- Fill the cache, then use its oldest entry so that the next
+    -- oldest becomes the least recently used.
+    perform veil.uncache_session(1);
+    for i in 1 .. entries loop
+        perform veil.cache_session(100 + i, ''sess_int4'');
+    end loop;
+    perform veil.restore_cached_session(101);
+    perform veil.cache_session(101 + entries, ''sess_int4'');
+    return veil.restore_cached_session(101) is not null and
+           veil.restore_cached_session(102) is null and
+           veil.restore_cached_session(101 + entries) is not null;
+end;
+' language plpgsql;
+
+\echo TEST 1.46 = #t#Session cache restores session, not shared, variables
+select regress_session_cache();
+
+\echo TEST 1.47 = #t#Session cache replaces least recently used entry
+select regress_session_cache_lru();
+
+\echo PREP
+select veil.cache_session(2, 'sess_int4');
+select veil.veil_perform_reset();
+
+\echo TEST 1.48 = #t#Session cache entries are discarded by reset
+select veil.restore_cached_session(2) is null;
+
 EOF
 }
 
@@ -345,6 +452,97 @@ select veil.bitmap_intersect('privs_bmap', 'privs2_bmap'),
 select min(veil.bitmap_bits), max(veil.bitmap_bits), count(*)
 from   veil.bitmap_bits('privs_bmap');
 
+-- Extend tests
+\echo TEST 2.15 = #t#Extend bitmap
+select veil.bitmap_extend('privs_bmap', 20200);
+
+\echo TEST 2.16 ~ #20001.*|.*20200#Test range of extended bitmap
+select * from veil.bitmap_range('privs_bmap');
+
+\echo TEST 2.17 = #t#Set new bit and test old and new bits
+select veil.bitmap_setbit('privs_bmap', 20150) and
+       veil.bitmap_testbit('privs_bmap', 20150) and
+       veil.bitmap_testbit('privs_bmap', 20002);
+
+\echo PREP
+select veil.bitmap_union('privs_bmap', 'privs3_bmap');
+
+\echo TEST 2.18 ~ #20002 *| *20150 *| *3#Union smaller bitmap into extended bitmap
+select min(veil.bitmap_bits), max(veil.bitmap_bits), count(*)
+from   veil.bitmap_bits('privs_bmap');
+
+-- Bit enumeration across word boundaries
+\echo PREP
+select veil.init_range('edge_range', -40, 200);
+select veil.init_bitmap('edge_bmap', 'edge_range');
+select count(veil.bitmap_setbit('edge_bmap', b))
+from   unnest(array[-40, -1, 0, 31, 32, 63, 64, 127, 200]) b;
+
+\echo TEST 2.19 = #-40,-1,0,31,32,63,64,127,200#Enumerate bits across word boundaries
+select string_agg(b::text, ',' order by b)
+from   (select veil.bitmap_bits('edge_bmap') b) x;
+
+-- Serialisation of a bitmap spanning many lines of base64 output
+\echo PREP
+select veil.init_range('big_range', 1, 10000);
+select veil.init_bitmap('big_bmap', 'big_range');
+select veil.bitmap_setbit('big_bmap', 1), 
+       veil.bitmap_setbit('big_bmap', 5000),
+       veil.bitmap_setbit('big_bmap', 10000);
+
+\echo TEST 2.20 = #1#Serialise and de-serialise large bitmap
+select veil.deserialise(veil.serialise('big_bmap'));
+
+\echo TEST 2.21 = #1,5000,10000#Check large bitmap after de-ser.
+select string_agg(b::text, ',' order by b)
+from   (select veil.bitmap_bits('big_bmap') b) x;
+
+-- Compressed serialisation
+\echo PREP
+set veil.compress_bitmaps = on;
+
+\echo TEST 2.22 = #t#Check compressed bitmap is small
+select length(veil.serialise('big_bmap')) < 100 and
+       length(veil.serialise_bin('big_bmap')) < 50;
+
+\echo TEST 2.23 = #2#De-serialise compressed bitmap
+select veil.deserialise(veil.serialise('big_bmap')) +
+       veil.deserialise_bin(veil.serialise_bin('big_bmap'));
+
+\echo TEST 2.24 = #1,5000,10000#Check bits after compressed de-ser.
+select string_agg(b::text, ',' order by b)
+from   (select veil.bitmap_bits('big_bmap') b) x;
+
+\echo TEST 2.25 ~ #ERROR.*corrupt#De-serialise corrupt compressed bitmap
+select veil.deserialise_bin(
+           set_byte(stream, length(stream) - 1, 127))
+from   (select veil.serialise_bin('big_bmap') as stream) x;
+
+\echo TEST 2.26 ~ #ERROR.*corrupt#De-serialise corrupt compressed text bitmap
+select veil.deserialise(overlay(stream placing '/w==' 
+                                from length(stream) - 3 for 4))
+from   (select veil.serialise('big_bmap') as stream) x;
+
+\echo TEST 2.27 = #1,5000,10000#Check corrupt streams left bitmap intact
+select string_agg(b::text, ',' order by b)
+from   (select veil.bitmap_bits('big_bmap') b) x;
+
+\echo PREP
+set veil.compress_bitmaps = off;
+
+\echo TEST 2.28 = #t#Clone shared bitmap
+select veil.clone_bitmap('privs_clone', 'privs_bmap');
+
+\echo TEST 2.29 = #t#Test bit in unmodified clone
+select veil.bitmap_testbit('privs_clone', 20070);
+
+\echo PREP
+select veil.bitmap_clearbit('privs_clone', 20070);
+
+\echo TEST 2.30 = #t#Update clone without changing shared bitmap
+select not veil.bitmap_testbit('privs_clone', 20070) and
+       veil.bitmap_testbit('privs_bmap', 20070);
+
 EOF
 }
 
@@ -513,6 +711,172 @@ select * from veil.bitmap_array_brange('role_privs');
 \echo 'TEST 3.18 ~ #1 *\\\| *20003 *\\\| *20003#Check bits in array after de-ser.'
 select count(*), min(bitmap_array_bits), max(bitmap_array_bits)
 from   veil.bitmap_array_bits('role_privs', 10002);
+
+-- Sparse bitmap arrays
+\echo PREP
+select veil.init_range('wide_range', 1, 100000000);
+
+\echo TEST 3.19 = #t#Create sparse bitmap array
+select veil.init_sparse_bitmap_array('sparse_privs', 'wide_range', 
+       'privs_range');
+
+\echo TEST 3.20 = #f#Test bit in unpopulated element
+select veil.bitmap_array_testbit('sparse_privs', 50000000, 20001);
+
+\echo TEST 3.21 = #t#Set bit in sparse bitmap array
+select veil.bitmap_array_setbit('sparse_privs', 50000000, 20003);
+
+\echo 'TEST 3.22 ~ #1 *\\\| *20003 *\\\| *20003#Check bits in sparse array'
+select count(*), min(bitmap_array_bits), max(bitmap_array_bits)
+from   veil.bitmap_array_bits('sparse_privs', 50000000);
+
+\echo TEST 3.23 = #0#Check bits in unpopulated element
+select count(*) from veil.bitmap_array_bits('sparse_privs', 7);
+
+\echo TEST 3.24 = #1#Serialise and de-serialise sparse array
+select veil.deserialise(veil.serialise('sparse_privs'));
+
+\echo TEST 3.25 = #t#Test bit in sparse array after de-ser.
+select veil.bitmap_array_testbit('sparse_privs', 50000000, 20003);
+
+\echo TEST 3.26 = #1#Binary serialise and de-serialise sparse array
+select veil.deserialise_bin(veil.serialise_bin('sparse_privs'));
+
+\echo TEST 3.27 = #t#Test bit in sparse array after binary de-ser.
+select veil.bitmap_array_testbit('sparse_privs', 50000000, 20003);
+
+\echo PREP
+create temp table array_chunks as
+select n, c from veil.serialise_chunks('role_privs', 1) with ordinality x(c, n);
+select veil.clear_bitmap_array('role_privs');
+
+\echo TEST 3.28 = #2#Serialise bitmap array in chunks
+select count(*) from array_chunks;
+
+\echo TEST 3.29 = #2#De-serialise bitmap array chunks one at a time
+select sum(veil.deserialise_bin(c)) from (select c from array_chunks order by n) x;
+
+\echo TEST 3.30 = #t#Test bit in bitmap array after chunked de-ser.
+select veil.bitmap_array_testbit('role_privs', 10002, 20002);
+
+\echo TEST 3.31 = #2#Save bitmap array image
+select veil.save_bitmap_array_image('role_privs', 'role_privs.img');
+
+\echo TEST 3.32 = #t#Map bitmap array image
+select veil.map_bitmap_array('mapped_privs', 'role_privs.img');
+
+\echo TEST 3.33 = #t#Test bit in mapped bitmap array
+select veil.bitmap_array_testbit('mapped_privs', 10002, 20002);
+
+\echo TEST 3.34 ~ #10001.*10002#Check mapped array range
+select * from veil.bitmap_array_arange('mapped_privs');
+
+\echo TEST 3.35 ~ #ERROR.*mismatch#Attempt to set bit in mapped array
+select veil.bitmap_array_setbit('mapped_privs', 10002, 20001);
+
+\echo TEST 3.36 = #t#Clone shared bitmap array
+select veil.clone_bitmap_array('role_clone', 'shared_role_privs');
+
+\echo TEST 3.37 = #t#Test bit in unmodified clone
+select veil.bitmap_array_testbit('role_clone', 10002, 20003);
+
+\echo PREP
+select veil.bitmap_array_setbit('role_clone', 10001, 20005);
+
+\echo TEST 3.38 = #t#Update clone without changing shared bitmap array
+select veil.bitmap_array_testbit('role_clone', 10001, 20005) and
+       not veil.bitmap_array_testbit('shared_role_privs', 10001, 20005);
+
+\echo PREP
+select veil.init_bitmap_array('loaded_privs', 'roles_range', 'privs_range');
+
+\echo TEST 3.39 = #t#Load bitmap array directly from table
+select veil.load_bitmap_array('loaded_privs', 'role_privileges', 
+                              'role_id', 'privilege_id', null) = 
+       (select count(*) from role_privileges);
+
+\echo TEST 3.40 = #t#Check bits loaded from table
+select bool_and(veil.bitmap_array_testbit('loaded_privs', 
+                                          role_id, privilege_id))
+from   role_privileges;
+
+\echo PREP
+select veil.clear_bitmap_array('loaded_privs');
+
+\echo TEST 3.41 = #t#Load bitmap array through filter
+select veil.load_bitmap_array('loaded_privs', 'role_privileges', 
+                              'role_id', 'privilege_id', 'role_id = 10001') =
+       (select count(*) from role_privileges where role_id = 10001);
+
+\echo PREP
+create table maintained_privs (
+    role_id       integer,
+    privilege_id  integer
+);
+create trigger maintained_privs__maintain
+after insert or update or delete on maintained_privs
+for each row execute procedure
+    veil.maintain_bitmap_array('shared_role_privs', 'role_id', 
+                               'privilege_id');
+insert into maintained_privs values (10002, 20010);
+
+\echo TEST 3.42 = #t#Insert maintains shared bitmap array
+select veil.bitmap_array_testbit('shared_role_privs', 10002, 20010);
+
+\echo PREP
+begin;
+insert into maintained_privs values (10002, 20011);
+rollback;
+
+\echo TEST 3.43 = #f#Rolled back insert does not change bitmap array
+select veil.bitmap_array_testbit('shared_role_privs', 10002, 20011);
+
+\echo PREP
+delete from maintained_privs;
+
+\echo TEST 3.44 = #f#Delete maintains shared bitmap array
+select veil.bitmap_array_testbit('shared_role_privs', 10002, 20010);
+
+\echo PREP
+drop table maintained_privs;
+select veil.clear_bitmap_array('loaded_privs');
+create table parent_privs (
+    role_id       integer,
+    privilege_id  integer
+);
+create table child_privs () inherits (parent_privs);
+insert into child_privs values (10002, 20012);
+
+\echo TEST 3.45 = #t#Load bitmap array from inheritance parent
+select veil.load_bitmap_array('loaded_privs', 'parent_privs', 
+                              'role_id', 'privilege_id', null) = 1 and
+       veil.bitmap_array_testbit('loaded_privs', 10002, 20012);
+
+\echo PREP
+drop table parent_privs cascade;
+
+\echo PREP
+create temp table sparse_image as
+select veil.serialise('sparse_privs') as image;
+
+\echo TEST 3.46 = #f#Reference unpopulated sparse array element
+select veil.bitmap_testbit(
+           veil.bitmap_from_array('session_bitmap_ref', 'sparse_privs', 9),
+           20001);
+
+\echo TEST 3.47 = #t#Referencing sparse element does not populate it
+select veil.serialise('sparse_privs') = image from sparse_image;
+
+\echo PREP
+select veil.bitmap_array_setbit('sparse_privs', 9, 20001);
+
+\echo TEST 3.48 = #t#Reference populated sparse array element
+select veil.bitmap_testbit(
+           veil.bitmap_from_array('session_bitmap_ref', 'sparse_privs', 9),
+           20001);
+
+\echo PREP
+drop table sparse_image;
 EOF
 }
 
@@ -646,6 +1010,64 @@ select veil.bitmap_hash_key_exists('role_privs', 'rubble') || 'x';
 
 \echo TEST 4.19 ~ #falsex#Check for undefined bitmap in hash
 select veil.bitmap_hash_key_exists('role_privs', 'bubble') || 'x';
+
+\echo TEST 4.22 ~ #5 *| *4#Nested scans of a bitmap hash
+select (select count(*)
+        from   veil.bitmap_hash_entries('role_privs') e,
+               veil.bitmap_hash_bits('role_privs', e) b),
+       (select count(*)
+        from   veil.bitmap_hash_entries('role_privs') a,
+               veil.bitmap_hash_entries('role_privs') b);
+
+\echo TEST 4.23 = #1#Binary serialise and de-serialise bitmap hash
+select veil.deserialise_bin(veil.serialise_bin('role_privs'));
+
+\echo TEST 4.24 ~ #3.*20001.*20003#Test bitmap hash after binary de-ser.
+select count(*), min(bitmap_hash_bits), max(bitmap_hash_bits)
+from veil.bitmap_hash_bits('role_privs', 'rubble');
+
+\echo PREP
+set veil.compress_bitmaps = on;
+
+\echo TEST 4.25 = #1#Compressed serialise and de-serialise bitmap hash
+select veil.deserialise(veil.serialise('role_privs'));
+
+\echo TEST 4.26 ~ #3.*20001.*20003#Test bitmap hash after compressed de-ser.
+select count(*), min(bitmap_hash_bits), max(bitmap_hash_bits)
+from veil.bitmap_hash_bits('role_privs', 'rubble');
+
+\echo PREP
+select count(veil.bitmap_hash_setbit('role_privs', 'key' || i, 
+                                     20001 + i % 50))
+from   generate_series(1, 500) i;
+
+\echo TEST 4.27 = #1#De-serialise a large bitmap hash
+select veil.deserialise(veil.serialise('role_privs'));
+
+\echo TEST 4.28 ~ #502 *| *t#Check entries in large bitmap hash
+select count(*), veil.bitmap_hash_testbit('role_privs', 'key50', 20001) and
+                 veil.bitmap_hash_testbit('role_privs', 'key7', 20008)
+from   veil.bitmap_hash_entries('role_privs');
+
+\echo PREP
+create temp table hash_chunks as
+select n, c from veil.serialise_chunks('role_privs', 1000) 
+                 with ordinality x(c, n);
+
+\echo TEST 4.29 = #t#Serialise bitmap hash in chunks
+select count(*) > 1 from hash_chunks;
+
+\echo TEST 4.30 = #t#De-serialise concatenated bitmap hash chunks
+select veil.deserialise_bin(string_agg(c, ''::bytea order by n)) = count(*)
+from   hash_chunks;
+
+\echo TEST 4.31 ~ #502 *| *t#Check entries after chunked de-ser.
+select count(*), veil.bitmap_hash_testbit('role_privs', 'key50', 20001) and
+                 veil.bitmap_hash_testbit('role_privs', 'key7', 20008)
+from   veil.bitmap_hash_entries('role_privs');
+
+\echo PREP
+set veil.compress_bitmaps = off;
 EOF
 
     do_test 4b <<EOF	
@@ -967,6 +1389,212 @@ select * from veil.veil_variables();
 \echo TEST 6.5 ~ #shared1.*Int4.*t#Defined shared variable
 select * from veil.veil_variables();
 
+\echo PREP IGNORE
+-- Init functions of the same priority, registered as parallel.
+create or replace
+function veil.veil_init3(bool) returns bool as '
+begin
+    perform veil.share(''shared3'');
+    perform veil.init_range(''shared3'', 1, 10);
+    return true;
+end
+'
+language plpgsql;
+
+update veil.veil_init_fns
+   set parallel = true
+ where fn_name = 'veil.veil_init2';
+
+insert into veil.veil_init_fns
+       (fn_name, priority, parallel)
+values ('veil.veil_init3', 2, true);
+
+select veil.veil_perform_reset();
+
+\echo TEST 6.6 ~ #shared1.*Int4.*t#Parallel init functions
+select * from veil.veil_variables();
+\echo TEST 6.7 ~ #shared3.*Range.*t#Parallel init functions
+select * from veil.veil_variables();
+
+\echo PREP IGNORE
+-- Lazy initialisation of a single session variable.
+create or replace
+function veil.veil_init_lazy(bool) returns bool as '
+begin
+    perform veil.int4_set(''lazy_int4'', 99);
+    return true;
+end
+'
+language plpgsql;
+
+insert into veil.veil_variable_init_fns
+       (var_name, fn_name)
+values ('lazy_int4', 'veil.veil_init_lazy');
+
+\c regressdb
+set veil.lazy_init = on;
+
+\echo TEST 6.8 = #99#Lazy variable initialisation
+select veil.int4_get('lazy_int4');
+\echo TEST 6.9 = #99#Lazily initialised variable
+select veil.int4_get('lazy_int4');
+
+\echo PREP IGNORE
+-- Rebuild of a derived session variable after a reset.
+insert into veil.veil_derived_variables
+       (var_name)
+values ('lazy_int4');
+select veil.int4_set('lazy_int4', 1);
+select veil.veil_perform_reset();
+
+\echo TEST 6.10 = #99#Derived variable rebuilt after reset
+select veil.int4_get('lazy_int4');
+
+\echo PREP IGNORE
+-- Asynchronous session initialisation.  The session variable records
+-- the backend that built it.
+create or replace
+function veil.veil_init4(bool) returns bool as '
+begin
+    perform veil.int4_set(''init_pid'', pg_backend_pid());
+    return true;
+end
+'
+language plpgsql;
+
+insert into veil.veil_init_fns
+       (fn_name, priority)
+values ('veil.veil_init4', 3);
+
+\c regressdb
+select veil.init_async();
+
+\echo TEST 6.11 = #t#Session variables restored from async init
+select veil.int4_get('init_pid') <> pg_backend_pid();
+\echo TEST 6.12 = #f#Async init of initialised session
+select veil.init_async();
+
+\echo PREP IGNORE
+-- The parallel init functions, run by background workers.
+set veil.init_workers = 2;
+select veil.veil_perform_reset();
+
+\echo TEST 6.13 ~ #shared1.*Int4.*t#Init functions run by workers
+select * from veil.veil_variables();
+\echo TEST 6.14 ~ #shared3.*Range.*t#Init functions run by workers
+select * from veil.veil_variables();
+
+\echo PREP IGNORE
+-- An init function returning NULL, called directly through the fmgr.
+create or replace
+function veil.veil_init5(bool) returns bool as '
+begin
+    perform veil.share(''shared5'');
+    perform veil.int4_set(''shared5'', 5);
+    return null;
+end
+'
+language plpgsql;
+
+insert into veil.veil_init_fns
+       (fn_name, priority)
+values ('veil.veil_init5', 4);
+
+set veil.init_workers = 0;
+select veil.veil_perform_reset();
+
+\echo TEST 6.15 ~ #shared5.*Int4.*t#Init function returning NULL
+select * from veil.veil_variables();
+
+\echo PREP IGNORE
+-- A clone of a shared bitmap array whose source is rebuilt, with a
+-- different range, by two resets.  The second reset returns to the
+-- same shared memory context, so the new source may occupy the same
+-- address as the original.
+create table clone_range (hi integer);
+insert into clone_range values (10);
+
+create or replace
+function veil.veil_init6(bool) returns bool as '
+begin
+    if $1 then
+        perform veil.share(''clone_src'');
+        perform veil.init_range(''clone_rows'', 1, 
+                                (select hi from clone_range));
+        perform veil.init_range(''clone_bits'', 1, 10);
+        perform veil.init_bitmap_array(''clone_src'', ''clone_rows'', 
+                                       ''clone_bits'');
+    end if;
+    return true;
+end
+'
+language plpgsql;
+
+insert into veil.veil_init_fns
+       (fn_name, priority)
+values ('veil.veil_init6', 5);
+
+select veil.veil_perform_reset();
+select veil.clone_bitmap_array('clone_view', 'clone_src');
+update clone_range set hi = 20;
+select veil.veil_perform_reset();
+select veil.veil_perform_reset();
+
+\echo TEST 6.16 ~ #ERROR.*has changed#Clone source rebuilt after two resets
+select veil.bitmap_array_testbit('clone_view', 1, 1);
+
+\echo PREP IGNORE
+-- A reset by a transaction holding a lock that a parallel init
+-- function needs must not wait for its workers.
+update veil.veil_init_fns
+   set priority = 2, parallel = true
+ where fn_name = 'veil.veil_init6';
+set veil.init_workers = 2;
+begin;
+lock table clone_range in access exclusive mode;
+select veil.veil_perform_reset();
+commit;
+
+\echo TEST 6.17 ~ #clone_src.*BitmapArray.*t#Reset while holding a table lock
+select * from veil.veil_variables();
+
+\echo PREP IGNORE
+-- Shared variables extended by an init function.
+create or replace
+function veil.veil_init7(bool) returns bool as '
+begin
+    perform veil.share(''ext_bmap'');
+    perform veil.share(''ext_array'');
+    perform veil.init_range(''ext_range'', 1, 10);
+    perform veil.init_bitmap(''ext_bmap'', ''ext_range'');
+    perform veil.init_int4array(''ext_array'', ''ext_range'');
+    perform veil.bitmap_extend(''ext_bmap'', 20);
+    perform veil.bitmap_setbit(''ext_bmap'', 20);
+    perform veil.int4array_extend(''ext_array'', 20);
+    perform veil.int4array_set(''ext_array'', 20, 7);
+    return true;
+end
+'
+language plpgsql;
+
+insert into veil.veil_init_fns
+       (fn_name, priority)
+values ('veil.veil_init7', 6);
+
+select veil.veil_perform_reset();
+
+\echo TEST 6.18 = #t#Extend shared bitmap in init function
+select veil.bitmap_testbit('ext_bmap', 20);
+
+\echo TEST 6.19 = #7#Extend shared int4 array in init function
+select veil.int4array_get('ext_array', 20);
+
+\echo TEST 6.20 ~ #ERROR.*cannot extend#Extend shared bitmap outside init
+select veil.bitmap_extend('ext_bmap', 30);
+
+\echo TEST 6.21 ~ #ERROR.*cannot extend#Extend shared int4 array outside init
+select veil.int4array_extend('ext_array', 30);
+
 EOF
 }
 
@@ -1080,7 +1708,8 @@ case the parser eats something important.
 
 The -h option prints this usage message.
 -b causes the test database to just be created
--c runs the preload library check and reports on status
+-c runs the preload library and session cache checks and reports on
+   status
 -d causes the test database to be dropped
 -t runs specified test sets against an already created database
 -T runs specified test sets against an already created database with 
@@ -1157,6 +1786,30 @@ EOF`
     fi	
 }
 
+# Check whether the session cache has enough entries for the
+# regression tests.  Returns 0 if it does, 1 otherwise.
+#
+check_session_cache()
+{
+    entries=`psql -d template1 -q -t <<EOF
+select setting from pg_settings where name = 'veil.session_cache_entries';
+EOF`
+    entries=`echo ${entries}`
+    if [ "x${entries}" = "x" ] || [ ${entries} -lt 2 ]; then
+	return 1
+    fi
+}
+
+session_cache_message()
+{
+    if [ "x$1" = "x1" ]; then
+	echo "
+WARNING: veil.session_cache_entries (defined in postgresql.conf) is not
+set to at least 2, so the session cache tests will fail.  Set it and
+restart the server before running the regression tests."
+    fi
+}
+
 preload_library_message()
 {
     if [ "x$1" = "x1" -o "x$1" = "x2" ]; then
@@ -1185,10 +1838,13 @@ export STATUS=0
 if [ "x$1" = "x-h" ]; then
     usage; exit
 elif [ "x$1" = "x-c" ]; then
-    # Check and report on the preload library situation
+    # Check and report on the preload library and session cache
+    # situation
     check_preload_libraries; preload_status=$?
+    check_session_cache; cache_status=$?
     rm -f regress.log
     preload_library_message ${preload_status}
+    session_cache_message ${cache_status}
 elif [ "x$1" = "x-d" ]; then
     # Drop the database
     db_drop
@@ -1202,8 +1858,10 @@ elif [ "x$1" = "x-n" ]; then
     # Don't drop the database after running the tests
     rm -f regress.log
     check_preload_libraries; preload_status=$?
+    check_session_cache; cache_status=$?
     db_test ${owner} test 
     preload_library_message ${preload_status}
+    session_cache_message ${cache_status}
 elif [ "x$1" = "x-t" ]; then
     # Run specific tests.  No build or drop.
     (
@@ -1214,7 +1872,9 @@ elif [ "x$1" = "x-t" ]; then
         tests_done
     ) | psql_collate regress.log
     check_preload_libraries; preload_status=$?
+    check_session_cache; cache_status=$?
     preload_library_message ${preload_status}
+    session_cache_message ${cache_status}
 elif [ "x$1" = "x-T" ]; then
     # Run specific tests in raw form (no parser).  No build or drop.
     while [ "x$2" != "x" ]; do 
@@ -1231,8 +1891,10 @@ else
 but does not reference an up to date veil shared library." 1>&2
 	exit 5
     fi
+    check_session_cache; cache_status=$?
     db_test ${owner} test drop
     preload_library_message ${preload_status}
+    session_cache_message ${cache_status}
 fi
 
 exit ${STATUS}
@@ -0,0 +1,412 @@
+/**
+ * @file   veil_async.c
+ * \code
+ *     Author:       Marc Munro
+ *     Copyright (c) 2018 Marc Munro
+ *     License:      BSD
+ *
+ * \endcode
+ * @brief
+ * Functions for asynchronous session initialisation.
+ *
+ * Normally a session is initialised, by veil_init(), when it first
+ * calls a Veil function, and that call must wait until initialisation
+ * is complete.  A session that calls veil.init_async() instead has its
+ * session variables built by a background worker, while the session
+ * continues with other work.  The worker connects to the same database
+ * as the same user, calls veil_init(), and serialises the resulting
+ * session variables (see vl_serialise_session()) into a dynamic shared
+ * memory area belonging to the session.  When the session next needs
+ * its variables, it waits, on its latch, only if the worker has not yet
+ * finished, and then restores them.  If veil_init() creates session
+ * variables that cannot be serialised, such as bitmap refs, or the
+ * worker cannot be started or dies, the session is initialised
+ * directly instead.
+ */
+
+#include "postgres.h"
+#include "access/xact.h"
+#include "executor/spi.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "postmaster/bgworker.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/lwlock.h"
+#include "storage/proc.h"
+#include "storage/spin.h"
+#include "utils/builtins.h"
+#include "utils/dsa.h"
+#include "utils/memutils.h"
+#include "utils/resowner.h"
+#include "utils/snapmgr.h"
+#include "veil_version.h"
+#include "veil_funcs.h"
+#include "veil_datatypes.h"
+
+
+#ifndef DOXYGEN_SHOULD_SKIP_THIS
+
+#define ASYNC_TRANCHE     "veil_async_init"
+#define ASYNC_POLL_MS     1000
+
+#endif
+
+/**
+ * The state of an asynchronous initialisation.
+ */
+typedef enum {
+	ASYNC_PENDING = 0,		/**< The worker has not yet finished */
+	ASYNC_DONE,				/**< The session stream is ready */
+	ASYNC_FAILED			/**< The worker failed, or exited early */
+} AsyncStatus;
+
+/**
+ * Control structure for an asynchronous initialisation, allocated in
+ * the session's dynamic shared memory area and shared with the worker.
+ */
+typedef struct AsyncInit {
+	Oid               db_id;	 /**< Database to which the worker connects */
+	Oid               user_id;	 /**< User as whom the worker connects */
+	int               tranche_id; /**< LWLock tranche of the area */
+	PGPROC           *session;	 /**< The waiting session, whose latch is
+								  * set when status changes */
+	slock_t           mutex;	 /**< Protects status, stream and len */
+	AsyncStatus       status;	 /**< The state of the initialisation */
+	dsa_pointer       stream;	 /**< The serialised session variables */
+	int32             len;		 /**< The length of the stream */
+} AsyncInit;
+
+/**
+ * The dynamic shared memory area for this session's pending
+ * asynchronous initialisation, or NULL if there is none.
+ */
+static dsa_area *async_area = NULL;
+
+/**
+ * The ::AsyncInit control structure within async_area.
+ */
+static dsa_pointer async_control = InvalidDsaPointer;
+
+/**
+ * Handle for the background worker performing the initialisation.
+ */
+static BackgroundWorkerHandle *async_worker = NULL;
+
+/**
+ * The worker's ::AsyncInit control structure, for async_worker_exit().
+ */
+static AsyncInit *worker_control = NULL;
+
+/**
+ * Set the status of an asynchronous initialisation, and wake the
+ * session if it is waiting.
+ *
+ * @param control The control structure.
+ * @param status The new status.
+ */
+static void
+set_async_status(AsyncInit *control, AsyncStatus status)
+{
+	SpinLockAcquire(&control->mutex);
+	control->status = status;
+	SpinLockRelease(&control->mutex);
+	SetLatch(&control->session->procLatch);
+}
+
+/**
+ * Return the status of an asynchronous initialisation.
+ *
+ * @param control The control structure.
+ *
+ * @return The status.
+ */
+static AsyncStatus
+get_async_status(AsyncInit *control)
+{
+	AsyncStatus status;
+
+	SpinLockAcquire(&control->mutex);
+	status = control->status;
+	SpinLockRelease(&control->mutex);
+	return status;
+}
+
+/**
+ * Release the dynamic shared memory area, and forget the worker, once
+ * an asynchronous initialisation has been completed or abandoned.
+ */
+static void
+release_async_init()
+{
+	dsa_detach(async_area);
+	async_area = NULL;
+	async_control = InvalidDsaPointer;
+	if (async_worker) {
+		pfree(async_worker);
+		async_worker = NULL;
+	}
+}
+
+/**
+ * Start a background worker to initialise this session's variables.
+ *
+ * @return true if the worker was started, or if one is already
+ * running, in which case the caller must later call
+ * vl_finish_async_init().  false if no worker could be started.
+ */
+bool
+vl_start_async_init()
+{
+	static int        tranche_id = 0;
+	BackgroundWorker  worker;
+	AsyncInit        *control;
+	MemoryContext     oldcxt;
+
+	if (async_area) {
+		return true;
+	}
+
+	if (!tranche_id) {
+		tranche_id = LWLockNewTrancheId();
+		LWLockRegisterTranche(tranche_id, ASYNC_TRANCHE);
+	}
+
+	/* The area must outlive the current transaction, as it will be
+	 * read by some later one. */
+	oldcxt = MemoryContextSwitchTo(TopMemoryContext);
+	async_area = dsa_create(tranche_id);
+	dsa_pin_mapping(async_area);
+
+	async_control = dsa_allocate(async_area, sizeof(AsyncInit));
+	control = (AsyncInit *) dsa_get_address(async_area, async_control);
+	control->db_id = MyDatabaseId;
+	control->user_id = GetUserId();
+	control->tranche_id = tranche_id;
+	control->session = MyProc;
+	SpinLockInit(&control->mutex);
+	control->status = ASYNC_PENDING;
+	control->stream = InvalidDsaPointer;
+	control->len = 0;
+
+	memset(&worker, 0, sizeof(worker));
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS |
+		BGWORKER_BACKEND_DATABASE_CONNECTION;
+	worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+	worker.bgw_restart_time = BGW_NEVER_RESTART;
+	(void) snprintf(worker.bgw_library_name, BGW_MAXLEN, "veil");
+	(void) snprintf(worker.bgw_function_name, BGW_MAXLEN,
+					"vl_async_init_worker");
+	(void) snprintf(worker.bgw_name, BGW_MAXLEN,
+					"veil async init worker for pid %d", MyProcPid);
+	worker.bgw_main_arg = UInt32GetDatum(dsa_get_handle(async_area));
+	memcpy(worker.bgw_extra, &async_control, sizeof(dsa_pointer));
+	worker.bgw_notify_pid = MyProcPid;
+
+	if (!RegisterDynamicBackgroundWorker(&worker, &async_worker)) {
+		async_worker = NULL;
+		release_async_init();
+		MemoryContextSwitchTo(oldcxt);
+		return false;
+	}
+	MemoryContextSwitchTo(oldcxt);
+	return true;
+}
+
+/**
+ * Return whether an asynchronous initialisation has been started, and
+ * not yet finished by vl_finish_async_init().
+ */
+bool
+vl_async_init_pending()
+{
+	return async_area != NULL;
+}
+
+/**
+ * Complete an asynchronous initialisation started by
+ * vl_start_async_init(), waiting for the worker if it has not yet
+ * finished, and restoring the session variables that it built.  Our
+ * latch is set by the worker when it reports its status, and by the
+ * postmaster (through bgw_notify_pid) when the worker starts or stops,
+ * but the worker is also polled periodically, so that a worker that
+ * fails to start, or dies before it can report, cannot leave us
+ * waiting forever.
+ *
+ * @return true if the session variables were restored, false if the
+ * worker failed, in which case the caller should initialise the
+ * session itself.
+ */
+bool
+vl_finish_async_init()
+{
+	AsyncInit   *control;
+	AsyncStatus  status;
+	BgwHandleStatus worker_status;
+	char        *data = NULL;
+	int32        len = 0;
+	pid_t        pid;
+	int          rc;
+
+	if (!async_area) {
+		return false;
+	}
+	control = (AsyncInit *) dsa_get_address(async_area, async_control);
+
+	while ((status = get_async_status(control)) == ASYNC_PENDING) {
+		worker_status = GetBackgroundWorkerPid(async_worker, &pid);
+		if ((worker_status == BGWH_STOPPED) ||
+			(worker_status == BGWH_POSTMASTER_DIED)) {
+			/* The worker has gone without reporting a result: it may
+			 * have set its status just before exiting, so look once
+			 * more. */
+			status = get_async_status(control);
+			if (status == ASYNC_PENDING) {
+				status = ASYNC_FAILED;
+			}
+			break;
+		}
+		rc = WaitLatch(MyLatch, 
+					   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+					   ASYNC_POLL_MS, PG_WAIT_EXTENSION);
+		ResetLatch(MyLatch);
+		if (rc & WL_POSTMASTER_DEATH) {
+			proc_exit(1);
+		}
+		CHECK_FOR_INTERRUPTS();
+	}
+
+	if (status == ASYNC_DONE) {
+		len = control->len;
+		data = palloc(len);
+		memcpy(data, dsa_get_address(async_area, control->stream), len);
+	}
+	release_async_init();
+
+	if (!data) {
+		ereport(WARNING,
+				(errmsg("veil asynchronous session initialisation failed"),
+				 errdetail("The session will be initialised directly: "
+						   "check the server log for the cause.")));
+		return false;
+	}
+
+	(void) vl_deserialise_session(data, len, false);
+	pfree(data);
+	return true;
+}
+
+/**
+ * Exit callback for the asynchronous initialisation worker.  If the
+ * worker is exiting without having completed, this tells the waiting
+ * session that it has failed.
+ *
+ * @param code The exit code.
+ * @param arg Unused.
+ */
+static void
+async_worker_exit(int code, Datum arg)
+{
+	if (worker_control &&
+		(get_async_status(worker_control) == ASYNC_PENDING)) {
+		set_async_status(worker_control, ASYNC_FAILED);
+	}
+}
+
+/**
+ * Main function for background workers started by
+ * vl_start_async_init().  The worker connects to the database as the
+ * user of the session that started it, calls veil_init() to build the
+ * session variables, and returns them to that session as a serialised
+ * stream in its dynamic shared memory area.
+ *
+ * @param main_arg The handle of the session's dynamic shared memory
+ * area.  The location of the ::AsyncInit control structure within it
+ * is passed in bgw_extra.
+ */
+void
+vl_async_init_worker(Datum main_arg)
+{
+	dsa_area    *area;
+	dsa_pointer  control_ptr;
+	dsa_pointer  stream_ptr;
+	AsyncInit   *control;
+	bytea       *stream;
+	char        *name;
+	bool         success = false;
+	int32        len;
+	int          ok;
+
+	/* Register the exit callback before anything that can fail.  Until
+	 * worker_control is set it does nothing, and the session instead
+	 * notices that we have stopped. */
+	before_shmem_exit(async_worker_exit, (Datum) 0);
+	BackgroundWorkerUnblockSignals();
+
+	CurrentResourceOwner = ResourceOwnerCreate(NULL, "veil async init");
+	area = dsa_attach(DatumGetUInt32(main_arg));
+	dsa_pin_mapping(area);
+	memcpy(&control_ptr, MyBgworkerEntry->bgw_extra, sizeof(dsa_pointer));
+	control = (AsyncInit *) dsa_get_address(area, control_ptr);
+	LWLockRegisterTranche(control->tranche_id, ASYNC_TRANCHE);
+	worker_control = control;
+
+	BackgroundWorkerInitializeConnectionByOid(control->db_id,
+											  control->user_id);
+
+	SetCurrentStatementStartTimestamp();
+	StartTransactionCommand();
+	PushActiveSnapshot(GetTransactionSnapshot());
+
+	(void) vl_get_shared_hash();  /* Init all shared memory constructs */
+	vl_skip_session_init();
+
+	ok = SPI_connect();
+	if (ok != SPI_OK_CONNECT) {
+		ereport(ERROR,
+				(errcode(ERRCODE_INTERNAL_ERROR),
+				 errmsg("veil async init worker failed (1)"),
+				 errdetail("SPI_connect() failed, returning %d.", ok)));
+	}
+	(void) vl_bool_from_query("select veil.veil_init(FALSE)", &success);
+	if (!success) {
+		ereport(ERROR,
+				(errcode(ERRCODE_INTERNAL_ERROR),
+				 errmsg("veil async init worker failed (2)"),
+				 errdetail("veil_init() did not return true.")));
+	}
+	SPI_finish();
+
+	/* Bitmap refs, clones and mapped arrays refer to memory in this
+	 * process and cannot be returned.  Failing here makes the waiting
+	 * session initialise itself instead. */
+	name = vl_unserialisable_variable(cstring_to_text("%"),
+									  VAR_SCOPE_SESSION);
+	if (name) {
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("veil async init worker failed (3)"),
+				 errdetail("Session variable %s cannot be serialised.",
+						   name)));
+	}
+
+	/* Only session variables are returned: shared variables are
+	 * already visible to the waiting session. */
+	stream = vl_serialise_session(cstring_to_text("%"),
+								  VAR_SCOPE_SESSION, NULL);
+	len = VARSIZE(stream) - VARHDRSZ;
+	stream_ptr = dsa_allocate(area, Max(len, 1));
+	memcpy(dsa_get_address(area, stream_ptr), VARDATA(stream), len);
+
+	SpinLockAcquire(&control->mutex);
+	control->stream = stream_ptr;
+	control->len = len;
+	SpinLockRelease(&control->mutex);
+	set_async_status(control, ASYNC_DONE);
+
+	PopActiveSnapshot();
+	CommitTransactionCommand();
+	worker_control = NULL;
+	dsa_detach(area);
+	proc_exit(0);
+}
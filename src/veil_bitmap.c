@@ -7,12 +7,15 @@
  * 
  * \endcode
  * @brief  
- * Functions for manipulating Bitmaps, BitmapHashes and BitmapArrays
+ * Functions for manipulating Bitmaps, BitmapHashes and BitmapArrays,
+ * and for copy-on-write session clones (BitmapClones) of shared Bitmaps
+ * and BitmapArrays.
  * 
  */
 
 #include <stdio.h>
 #include "postgres.h"
+#include "utils/memutils.h"
 #include "veil_datatypes.h"
 #include "veil_funcs.h"
 
@@ -99,12 +102,11 @@ vl_NewBitmap(Bitmap **p_bitmap, bool shared,
 	int     elems = ARRAYELEMS(min, max);
 
 	if (bitmap) {
-		int cur_elems = ARRAYELEMS(bitmap->bitzero, bitmap->bitmax);
 		/* OK, there is an old bitmap in place.  If it is the same size
 		 * or larger than we need we will re-use it, otherwise we will
 		 * dispose of it and get a new one. */
 
-		if (elems <= cur_elems) {
+		if (elems <= bitmap->allocated) {
 			vl_ClearBitmap(bitmap);
 		}
 		else {
@@ -125,6 +127,7 @@ vl_NewBitmap(Bitmap **p_bitmap, bool shared,
 		else {
 			bitmap = vl_malloc(sizeof(Bitmap) + (sizeof(bm_int) * elems));
 		}
+		bitmap->allocated = elems;
 	}
 
 	DBG_SET_CANARY(*bitmap);
@@ -140,6 +143,81 @@ vl_NewBitmap(Bitmap **p_bitmap, bool shared,
 	*p_bitmap = bitmap;
 }
 
+/** 
+ * Extend a ::Bitmap so that its highest bit becomes newmax, preserving
+ * the existing bits.  If the bitmap has insufficient space allocated, a
+ * new bitmap is allocated with geometric headroom so that a series of
+ * small extensions does not require an allocation and copy each time.
+ * A bitmap is never shrunk by this function.  Shared memory cannot be
+ * freed, so the old copy of a moved shared bitmap is abandoned until
+ * the next reset of shared variables.  As the allocation at least
+ * doubles each time, the space abandoned by a series of extensions is
+ * less than the final size of the bitmap.
+ * 
+ * @param p_bitmap Pointer to the existing bitmap.  This will be updated
+ * if the bitmap has to be moved.
+ * @param shared Whether the bitmap is in shared memory
+ * @param newmax The new largest bit to be stored in the bitmap
+ */
+void
+vl_BitmapExtend(Bitmap **p_bitmap, bool shared,
+				int32 newmax)
+{
+	Bitmap *bitmap = *p_bitmap;
+	int     cur_elems = ARRAYELEMS(bitmap->bitzero, bitmap->bitmax);
+	int64   elems;
+	int64   max_elems = (MaxAllocSize - sizeof(Bitmap)) / sizeof(bm_int);
+	int     i;
+
+	DBG_TEST_CANARY(*bitmap);
+	DBG_TEST_TRAILER(*bitmap, bitset);
+	if (newmax <= bitmap->bitmax) {
+		return;
+	}
+
+	/* Computed in int64, as the range may exceed that of an int32. */
+	elems = (((int64) newmax - (int32) BITZERO(bitmap->bitzero)) /
+			 (int64) (sizeof(bm_int) * 8)) + 1;
+	if (elems > max_elems) {
+		ereport(ERROR,
+				(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+				 errmsg("bitmap cannot be extended to %d", newmax),
+				 errdetail("The bitmap would exceed the maximum "
+						   "allocation size.")));
+	}
+	if (elems > bitmap->allocated) {
+		Bitmap *old = bitmap;
+		int     alloc = (int) Min(Max(elems, (int64) old->allocated * 2),
+								  max_elems);
+
+		if (shared) {
+			bitmap = vl_shmalloc(sizeof(Bitmap) + (sizeof(bm_int) * alloc));
+		}
+		else {
+			bitmap = vl_malloc(sizeof(Bitmap) + (sizeof(bm_int) * alloc));
+		}
+		memcpy(bitmap, old, sizeof(Bitmap) + (sizeof(bm_int) * cur_elems));
+		bitmap->allocated = alloc;
+		if (shared) {
+			vl_free(old);
+		}
+		else {
+			pfree(old);
+		}
+	}
+
+	/* Zero the new words, which may contain stale data or, in debug
+	 * builds, the trailing canary. */
+	for (i = cur_elems; i < elems; i++) {
+		bitmap->bitset[i] = 0;
+	}
+	bitmap->bitmax = newmax;
+	DBG_SET_ELEMS(*bitmap, elems);
+	DBG_SET_TRAILER(*bitmap, bitset);
+
+	*p_bitmap = bitmap;
+}
+
 /** 
  * Set a bit within a ::Bitmap.  If the bit is outside of the acceptable
  * range, raise an error.
@@ -224,6 +302,10 @@ vl_BitmapTestbit(Bitmap *bitmap,
 
 /** 
  * Create the union of two bitmaps, updating the first with the result.
+ * The bitmaps must start at the same bit, and the target must be able
+ * to store every bit of the source, so a target that has been extended
+ * by vl_BitmapExtend() may be unioned with bitmaps of the original
+ * range.
  * 
  * @param target The ::Bitmap into which the result will be placed.
  * @param source The ::Bitmap to be unioned into target.
@@ -233,11 +315,10 @@ vl_BitmapUnion(Bitmap *target,
 			   Bitmap *source)
 {
 	int i;
-	int elems = ARRAYELEMS(target->bitzero, target->bitmax);
+	int elems = ARRAYELEMS(source->bitzero, source->bitmax);
 
-	/* TODO: Make this tolerant of range mismatches. */
 	if ((target->bitzero != source->bitzero) ||
-		(target->bitmax != source->bitmax))
+		(target->bitmax < source->bitmax))
 	{
 		ereport(ERROR,
 				(errcode(ERRCODE_INTERNAL_ERROR),
@@ -253,7 +334,8 @@ vl_BitmapUnion(Bitmap *target,
 
 /** 
  * Create the intersection of two bitmaps, updating the first with the
- * result.
+ * result.  The bitmaps must start at the same bit.  Any bits of target
+ * beyond the range of source are cleared.
  * 
  * @param target The ::Bitmap into which the result will be placed.
  * @param source The ::Bitmap to be intersected into target.
@@ -264,10 +346,9 @@ vl_BitmapIntersect(Bitmap *target,
 {
 	int i;
 	int elems = ARRAYELEMS(target->bitzero, target->bitmax);
+	int source_elems = ARRAYELEMS(source->bitzero, source->bitmax);
 
-	/* TODO: Make this tolerant of range mismatches. */
-	if ((target->bitzero != source->bitzero) ||
-		(target->bitmax != source->bitmax))
+	if (target->bitzero != source->bitzero)
 	{
 		ereport(ERROR,
 				(errcode(ERRCODE_INTERNAL_ERROR),
@@ -277,12 +358,46 @@ vl_BitmapIntersect(Bitmap *target,
 						   source->bitzero, source->bitmax)));
 	}
 	for (i = 0; i < elems; i++) {
-		target->bitset[i] &= source->bitset[i];
+		if (i < source_elems) {
+			target->bitset[i] &= source->bitset[i];
+		}
+		else {
+			target->bitset[i] = 0;
+		}
 	}
 }
 
 /** 
- * Return the next set bit in the ::Bitmap.
+ * Return the index of the lowest set bit in a non-zero bitset word.
+ * 
+ * @param word The bitset word, which must not be zero.
+ * 
+ * @return The index, within word, of its lowest set bit.
+ */
+static int
+lowest_bit(bm_int word)
+{
+#ifdef __GNUC__
+#ifdef USE_64_BIT
+	return __builtin_ctzll(word);
+#else
+	return __builtin_ctz(word);
+#endif
+#else
+	int bit = 0;
+
+	while (!(word & bitmasks[bit])) {
+		bit++;
+	}
+	return bit;
+#endif
+}
+
+/** 
+ * Return the next set bit in the ::Bitmap.  Rather than testing each
+ * bit in turn, this skips over empty words of the bitset, so that
+ * enumerating all of the bits in a bitmap is a single scan of its
+ * words.
  * 
  * @param bitmap The ::Bitmap being scanned.
  * @param bit The starting bit from which to scan the bitmap
@@ -296,19 +411,137 @@ vl_BitmapNextBit(Bitmap *bitmap,
 				 int32 bit,
 				 bool *found)
 {
-	while (bit <= bitmap->bitmax) {
-		if (vl_BitmapTestbit(bitmap, bit)) {
+	int32  zero = BITZERO(bitmap->bitzero);
+	int    elems = ARRAYELEMS(bitmap->bitzero, bitmap->bitmax);
+	int    relative_bit;
+	int    element;
+	bm_int word;
+
+	if (bit < bitmap->bitzero) {
+		bit = bitmap->bitzero;
+	}
+	if (bit > bitmap->bitmax) {
+		*found = false;
+		return 0;
+	}
+
+	/* Ignore any bits in the first word below the starting bit */
+	relative_bit = bit - zero;
+	element = BITSET_ELEM(relative_bit);
+	word = bitmap->bitset[element] & 
+		~(bitmasks[BITSET_BIT(relative_bit)] - 1);
+
+	for (;;) {
+		if (word) {
 			*found = true;
-			return bit;
+			return zero + (element * (int32) (sizeof(bm_int) * 8)) + 
+				lowest_bit(word);
 		}
-		bit++;
+		if (++element >= elems) {
+			break;
+		}
+		word = bitmap->bitset[element];
 	}
 	*found = false;
 	return 0;
 }
 
 /** 
- * Return a specified ::Bitmap from a ::BitmapArray.
+ * Allocate zeroed memory from either session or shared memory.
+ * 
+ * @param size The amount of memory required
+ * @param shared Whether the memory is to be allocated from shared memory
+ * 
+ * @return The allocated memory
+ */
+static void *
+alloc_zeroed(size_t size, bool shared)
+{
+	void *mem = shared? vl_shmalloc(size): vl_malloc(size);
+
+	memset(mem, 0, size);
+	return mem;
+}
+
+/** 
+ * Return the number of entries in the top level of the page directory
+ * of a sparse ::BitmapArray.
+ * 
+ * @param pages The number of pages spanned by the array
+ * 
+ * @return The number of ::BitmapDir pointers in the directory
+ */
+#define SPARSE_DIRS(pages) ((((pages) - 1) >> BITMAP_DIR_BITS) + 1)
+
+/** 
+ * Return the entry, within the page directory of a sparse
+ * ::BitmapArray, for the given page.  If the ::BitmapDir containing the
+ * entry has not yet been allocated, it will be allocated if create is
+ * true, otherwise NULL is returned.
+ * 
+ * @param bmarray The sparse ::BitmapArray
+ * @param pageno The number of the page within the array
+ * @param create Whether to allocate the ::BitmapDir if it does not yet
+ * exist
+ * 
+ * @return Pointer to the entry for the page, or NULL.
+ */
+static BitmapPage **
+sparse_page(BitmapArray *bmarray,
+			int32 pageno,
+			bool create)
+{
+	BitmapDir **p_dir = &(bmarray->pagedir[pageno >> BITMAP_DIR_BITS]);
+
+	if (!*p_dir) {
+		if (!create) {
+			return NULL;
+		}
+		*p_dir = alloc_zeroed(sizeof(BitmapDir), bmarray->shared);
+	}
+	return &((*p_dir)->page[pageno & (BITMAP_DIR_SIZE - 1)]);
+}
+
+/** 
+ * Return the slot, within the page directory of a sparse ::BitmapArray,
+ * that holds the ::Bitmap pointer for the given element.  If the page
+ * containing that slot has not yet been allocated, it will be allocated
+ * if create is true, otherwise NULL is returned.  The caller must have
+ * checked that elem is within the range of the array.
+ * 
+ * @param bmarray The sparse ::BitmapArray
+ * @param elem The index of the ::Bitmap within the array
+ * @param create Whether to allocate the page if it does not yet exist
+ * 
+ * @return Pointer to the slot for the ::Bitmap, or NULL.
+ */
+static Bitmap **
+sparse_slot(BitmapArray *bmarray,
+			int32 elem,
+			bool create)
+{
+	int64        offset = (int64) elem - bmarray->arrayzero;
+	BitmapPage **p_page = sparse_page(bmarray,
+									  (int32) (offset >> BITMAP_PAGE_BITS),
+									  create);
+
+	if (!p_page) {
+		return NULL;
+	}
+	if (!*p_page) {
+		if (!create) {
+			return NULL;
+		}
+		*p_page = alloc_zeroed(sizeof(BitmapPage), bmarray->shared);
+	}
+	return &((*p_page)->bitmap[offset & (BITMAP_PAGE_SIZE - 1)]);
+}
+
+/** 
+ * Return a specified ::Bitmap from a ::BitmapArray.  For a sparse
+ * array, a NULL result may also mean that no bits have ever been set
+ * in the requested ::Bitmap, in which case the caller should treat it
+ * as empty.
  * 
  * @param bmarray The ::BitmapArray from which the result is to be
  * returned.
@@ -326,12 +559,119 @@ vl_BitmapFromArray(BitmapArray *bmarray,
 	if ((elem < bmarray->arrayzero) || (elem > bmarray->arraymax)) {
 		return NULL;
 	}
+	else if (bmarray->pages) {
+		Bitmap **slot = sparse_slot(bmarray, elem, false);
+
+		return slot? *slot: NULL;
+	}
 	else {
 		DBG_CHECK_INDEX(*bmarray, elem - bmarray->arrayzero);
 		return bmarray->bitmap[elem - bmarray->arrayzero];
 	}
 }
 
+/** 
+ * Return a specified ::Bitmap from a ::BitmapArray, with the intention
+ * of modifying it.  For a sparse array, the ::Bitmap, and the page of
+ * the directory that references it, are allocated if they do not
+ * already exist.  Shared memory cannot be freed, so for a shared sparse
+ * array this is only allowed while init functions are running (see
+ * vl_in_init()): otherwise any number of sessions could go on
+ * allocating shared memory until the next reset.
+ * 
+ * @param bmarray The ::BitmapArray from which the result is to be
+ * returned.
+ * @param elem The index of the ::Bitmap within the array. 
+ * 
+ * @return The bitmap corresponding to the parameters, or NULL if elem
+ * is outside of the range of the array.
+ */
+Bitmap *
+vl_AddBitmapToArray(BitmapArray *bmarray,
+					int32 elem)
+{
+	Bitmap **slot;
+
+	if ((elem < bmarray->arrayzero) || (elem > bmarray->arraymax) ||
+		(!bmarray->pages)) 
+	{
+		return vl_BitmapFromArray(bmarray, elem);
+	}
+
+	if (bmarray->shared && !vl_in_init()) {
+		slot = sparse_slot(bmarray, elem, false);
+		if (slot && *slot) {
+			return *slot;
+		}
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("cannot add bitmap %d to shared sparse bitmap "
+						"array", elem),
+				 errdetail("Bitmaps may only be added to shared sparse "
+						   "arrays by init functions."),
+				 errhint("Set the bits from a function registered in "
+						 "veil.veil_init_fns.")));
+	}
+
+	slot = sparse_slot(bmarray, elem, true);
+	if (!*slot) {
+		vl_NewBitmap(slot, bmarray->shared, 
+					 bmarray->bitzero, bmarray->bitmax);
+	}
+	return *slot;
+}
+
+/** 
+ * Return the next allocated ::Bitmap from a ::BitmapArray, starting
+ * the search at element *p_elem.  For a normal array every element
+ * has a ::Bitmap, but for a sparse array this skips any elements, and
+ * whole directory pages, that have never been written.
+ * 
+ * @param bmarray The ::BitmapArray being scanned.
+ * @param p_elem Pointer to the index from which to start the search.
+ * This is updated to give the index of the returned ::Bitmap.
+ * 
+ * @return The next ::Bitmap, or NULL if there are no more.
+ */
+Bitmap *
+vl_NextBitmapFromArray(BitmapArray *bmarray,
+					   int32 *p_elem)
+{
+	int64   elem = *p_elem;
+	Bitmap *bitmap;
+
+	if (elem < bmarray->arrayzero) {
+		elem = bmarray->arrayzero;
+	}
+	while (elem <= bmarray->arraymax) {
+		if (bmarray->pages) {
+			int64        offset = elem - bmarray->arrayzero;
+			int64        dir_span = (int64) BITMAP_DIR_SIZE * 
+				BITMAP_PAGE_SIZE;
+			BitmapPage **p_page;
+
+			p_page = sparse_page(bmarray, 
+								 (int32) (offset >> BITMAP_PAGE_BITS), false);
+			if (!p_page) {
+				/* Skip to the start of the next directory */
+				elem += dir_span - (offset & (dir_span - 1));
+				continue;
+			}
+			if (!*p_page) {
+				/* Skip to the start of the next page */
+				elem += BITMAP_PAGE_SIZE - (offset & (BITMAP_PAGE_SIZE - 1));
+				continue;
+			}
+		}
+		if ((bitmap = vl_BitmapFromArray(bmarray, (int32) elem))) {
+			*p_elem = (int32) elem;
+			return bitmap;
+		}
+		elem++;
+	}
+	return NULL;
+}
+
 /** 
  * Clear all bitmaps in the given ::BitmapArray
  * 
@@ -345,12 +685,88 @@ vl_ClearBitmapArray(BitmapArray *bmarray)
 
 	DBG_TEST_CANARY(*bmarray);
 	DBG_TEST_TRAILER(*bmarray, bitmap);
+	if (bmarray->pages) {
+		Bitmap *bitmap;
+		int32   elem = bmarray->arrayzero;
+
+		while ((bitmap = vl_NextBitmapFromArray(bmarray, &elem))) {
+			vl_ClearBitmap(bitmap);
+			if (elem == bmarray->arraymax) {
+				break;
+			}
+			elem++;
+		}
+		return;
+	}
 	for (i = 0; i < bitmaps; i++) {
 		DBG_CHECK_INDEX(*bmarray, i);
 		vl_ClearBitmap(bmarray->bitmap[i]);
 	}
 }
 
+/** 
+ * Free a piece of memory allocated from either session or shared memory.
+ * 
+ * @param mem The memory to be freed
+ * @param shared Whether mem was allocated from shared memory
+ */
+static void
+free_mem(void *mem, bool shared)
+{
+	if (shared) {
+		vl_free(mem);
+	}
+	else {
+		pfree(mem);
+	}
+}
+
+/** 
+ * Free a ::BitmapArray, along with all of its Bitmaps and, for a
+ * sparse array, its directory pages.
+ * 
+ * @param bmarray The ::BitmapArray to be freed
+ */
+static void
+free_bitmap_array(BitmapArray *bmarray)
+{
+	int i;
+	int j;
+	int k;
+
+	if (bmarray->pages) {
+		for (i = 0; i < SPARSE_DIRS(bmarray->pages); i++) {
+			BitmapDir *dir = bmarray->pagedir[i];
+
+			if (!dir) {
+				continue;
+			}
+			for (j = 0; j < BITMAP_DIR_SIZE; j++) {
+				BitmapPage *page = dir->page[j];
+
+				if (page) {
+					for (k = 0; k < BITMAP_PAGE_SIZE; k++) {
+						if (page->bitmap[k]) {
+							free_mem(page->bitmap[k], bmarray->shared);
+						}
+					}
+					free_mem(page, bmarray->shared);
+				}
+			}
+			free_mem(dir, bmarray->shared);
+		}
+		free_mem(bmarray->pagedir, bmarray->shared);
+	}
+	else {
+		int bitmaps = bmarray->arraymax + 1 - bmarray->arrayzero;
+
+		for (i = 0; i < bitmaps; i++) {
+			free_mem(bmarray->bitmap[i], bmarray->shared);
+		}
+	}
+	free_mem(bmarray, bmarray->shared);
+}
+
 /** 
  * Return a newly initialised (empty) ::BitmapArray.  It may already
  * exist in which case it will be re-used if possible.  It may
@@ -381,22 +797,12 @@ vl_NewBitmapArray(BitmapArray **p_bmarray, bool shared,
 
 		DBG_TEST_CANARY(*bmarray);
 		DBG_TEST_TRAILER(*bmarray, bitmap);
-		if ((cur_elems >= bitsetelems) && (cur_maps >= bitmaps)) {
+		if ((!bmarray->pages) && 
+			(cur_elems >= bitsetelems) && (cur_maps >= bitmaps)) {
 			vl_ClearBitmapArray(bmarray);
 		}
 		else {
-			if (shared) {
-				for (i = 0; i < cur_maps; i++) {
-					vl_free(bmarray->bitmap[i]);
-				}
-				vl_free(bmarray);
-			}
-			else {
-				for (i = 0; i < cur_maps; i++) {
-					pfree(bmarray->bitmap[i]);
-				}
-				pfree(bmarray);
-			}
+			free_bitmap_array(bmarray);
 			bmarray = NULL;
 		}
 	}
@@ -418,6 +824,9 @@ vl_NewBitmapArray(BitmapArray **p_bmarray, bool shared,
 		}
 
 		bmarray->type = OBJ_BITMAP_ARRAY;
+		bmarray->shared = shared;
+		bmarray->pages = 0;
+		bmarray->pagedir = NULL;
 		DBG_SET_CANARY(*bmarray);
 		DBG_SET_ELEMS(*bmarray, bitmaps);
 		DBG_SET_TRAILERP(*bmarray, bitmap);
@@ -436,17 +845,94 @@ vl_NewBitmapArray(BitmapArray **p_bmarray, bool shared,
 	*p_bmarray = bmarray;
 }
 
+/** 
+ * Return a newly initialised (empty) sparse ::BitmapArray.  An existing
+ * sparse array with the same ranges is cleared and re-used, so that
+ * re-initialising a shared array does not abandon its pages; any other
+ * existing array is discarded.  Only the top level of the page
+ * directory is allocated here: the rest of the directory, and the
+ * Bitmaps, are allocated by vl_AddBitmapToArray() as bits are set.  It
+ * may be created in either session or shared memory depending on the
+ * value of shared.
+ * 
+ * @param p_bmarray Pointer to an existing bitmap if one exists.
+ * @param shared Whether to create the bitmap in shared memory
+ * @param arrayzero The lowest array index
+ * @param arraymax The highest array index
+ * @param bitzero The smallest bit to be stored in the bitmap
+ * @param bitmax The largest bit to be stored in the bitmap
+ */
+void
+vl_NewSparseBitmapArray(BitmapArray **p_bmarray, bool shared,
+						int32 arrayzero, int32 arraymax,
+						int32 bitzero, int32 bitmax)
+{
+	BitmapArray *bmarray = *p_bmarray;
+	int32  pages;
+
+	if (arraymax < arrayzero) {
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("Invalid BitmapArray range %d..%d", 
+						arrayzero, arraymax)));
+	}
+	pages = (int32) ((((int64) arraymax - arrayzero) >> BITMAP_PAGE_BITS) + 1);
+
+	if (bmarray) {
+		DBG_TEST_CANARY(*bmarray);
+		DBG_TEST_TRAILER(*bmarray, bitmap);
+		if (bmarray->pages && (bmarray->shared == shared) &&
+			(bmarray->arrayzero == arrayzero) && 
+			(bmarray->arraymax == arraymax) &&
+			(bmarray->bitzero == bitzero) && (bmarray->bitmax == bitmax)) {
+			vl_ClearBitmapArray(bmarray);
+			return;
+		}
+		free_bitmap_array(bmarray);
+	}
+
+	if (shared) {
+		bmarray = vl_shmalloc(sizeof(BitmapArray));
+	}
+	else {
+		bmarray = vl_malloc(sizeof(BitmapArray));
+	}
+	bmarray->pagedir = alloc_zeroed(sizeof(BitmapDir *) * SPARSE_DIRS(pages),
+									shared);
+
+	bmarray->type = OBJ_BITMAP_ARRAY;
+	bmarray->shared = shared;
+	bmarray->pages = pages;
+	DBG_SET_CANARY(*bmarray);
+	DBG_SET_ELEMS(*bmarray, 0);
+	DBG_SET_TRAILERP(*bmarray, bitmap);
+	bmarray->bitzero = bitzero;
+	bmarray->bitmax = bitmax;
+	bmarray->arrayzero = arrayzero;
+	bmarray->arraymax = arraymax;
+
+	*p_bmarray = bmarray;
+}
+
+/** 
+ * The number of entries for which the hash table of a ::BitmapHash is
+ * initially sized, unless a larger number is known to be needed.
+ */
+#define BITMAP_HASH_ELEMS 200
+
 /** 
  * Create a new hash table.  This is allocated from session memory as
  * BitmapHashes may not be declared as shared variables.
  * 
  * @param name The name of the hash to be created.  Note that we prefix
  * this with "vl_" to prevent name collisions from other subsystems.
+ * @param nelem The number of entries for which the hash should be
+ * sized.
  * 
  * @return Pointer to the newly created hash table.
  */
 static HTAB *
-new_hash(char *name)
+new_hash(char *name, long nelem)
 {
 	char     vl_name[HASH_KEYLEN];
 	HTAB    *hash;
@@ -457,32 +943,50 @@ new_hash(char *name)
 	hashctl.keysize = HASH_KEYLEN;
 	hashctl.entrysize = sizeof(VarEntry);
 
-	hash = hash_create(vl_name, 200, &hashctl, HASH_ELEM);
+	hash = hash_create(vl_name, nelem, &hashctl, HASH_ELEM);
     return hash;
 }
 
 /** 
- * Utility function for scanning the hash table of a BitmapHash.
+ * Begin a scan of the hash table of a BitmapHash.  The scan state is
+ * owned by the caller, so scans may be nested or interleaved.  A scan
+ * that is abandoned before vl_NextHashEntry() has returned NULL must
+ * be terminated using vl_EndHashScan().
  * 
- * @param hash The hash table being scanned
- * @param prev The entry from which to scan, starting with NULL.
+ * @param hash The hash table to be scanned
+ * @param status Caller-owned scan state to be initialised
+ */
+void
+vl_StartHashScan(HTAB *hash,
+				 HASH_SEQ_STATUS *status)
+{
+	hash_seq_init(status, hash);
+}
+
+/** 
+ * Return the next entry from a scan of the hash table of a BitmapHash.
+ * 
+ * @param status The scan state, as initialised by vl_StartHashScan().
  * 
  * @return The next element in the hash table (a VarEntry) or NULL when
  * the last element has already been scanned.
  */
 VarEntry *
-vl_NextHashEntry(HTAB *hash,
-				 VarEntry *prev)
+vl_NextHashEntry(HASH_SEQ_STATUS *status)
 {
-	VarEntry *next;
-	static HASH_SEQ_STATUS status;
-	if (!prev) {
-		/* Initialise the hash search */
-		
-		hash_seq_init(&status, hash);
-	}
-	next = (VarEntry *) hash_seq_search(&status);
-	return (next);
+	return (VarEntry *) hash_seq_search(status);
+}
+
+/** 
+ * Terminate a scan of a BitmapHash before it has reached the end of
+ * the hash table.
+ * 
+ * @param status The scan state, as initialised by vl_StartHashScan().
+ */
+void
+vl_EndHashScan(HASH_SEQ_STATUS *status)
+{
+	hash_seq_term(status);
 }
 
 /** 
@@ -498,15 +1002,37 @@ vl_NextHashEntry(HTAB *hash,
 void
 vl_NewBitmapHash(BitmapHash **p_bmhash, char *name,
 				 int32 bitzero, int32 bitmax)
+{
+	vl_NewSizedBitmapHash(p_bmhash, name, bitzero, bitmax, 0);
+}
+
+/** 
+ * Return a newly initialised (empty) ::BitmapHash, whose hash table is
+ * sized for a known number of entries.  This avoids the cost of
+ * repeatedly growing the hash table as the entries are added, eg when
+ * de-serialising a bitmap hash.
+ * 
+ * @param p_bmhash Pointer to an existing bitmap if one exists.
+ * @param name The name to be used for the hash table
+ * @param bitzero The smallest bit to be stored in the bitmap
+ * @param bitmax The largest bit to be stored in the bitmap
+ * @param entries The number of entries expected, or zero if this is
+ * not known.
+ */
+void
+vl_NewSizedBitmapHash(BitmapHash **p_bmhash, char *name,
+					  int32 bitzero, int32 bitmax, int32 entries)
 {
 	BitmapHash *bmhash = *p_bmhash;
 
 	if (bmhash) {
-		VarEntry *entry = NULL;
+		VarEntry *entry;
 		HTAB *hash = bmhash->hash;
+		HASH_SEQ_STATUS status;
 		bool found;
 
-		while ((entry = vl_NextHashEntry(hash, entry))) {
+		vl_StartHashScan(hash, &status);
+		while ((entry = vl_NextHashEntry(&status))) {
 			if (entry->obj) {
 				if (entry->obj->type != OBJ_BITMAP) {
 					ereport(ERROR,
@@ -521,11 +1047,16 @@ vl_NewBitmapHash(BitmapHash **p_bmhash, char *name,
 			/* Now remove the entry from the hash */
 			(void) hash_search(hash, entry->key, HASH_REMOVE, &found);
 		}
+		if (entries > BITMAP_HASH_ELEMS) {
+			/* Replace the now empty hash with a larger one */
+			hash_destroy(hash);
+			bmhash->hash = new_hash(name, entries);
+		}
 	}
 	else {
 		bmhash = vl_malloc(sizeof(BitmapHash));
 		bmhash->type = OBJ_BITMAP_HASH;
-		bmhash->hash = new_hash(name);
+		bmhash->hash = new_hash(name, Max(entries, BITMAP_HASH_ELEMS));
 	}
 	bmhash->bitzero = bitzero;
 	bmhash->bitmax = bitmax;
@@ -636,3 +1167,276 @@ vl_BitmapHashHasKey(BitmapHash *bmhash,
 }
 
 
+/** 
+ * Return a session copy of a ::Bitmap.
+ * 
+ * @param source The ::Bitmap to be copied.
+ * 
+ * @return Pointer to the newly allocated copy.
+ */
+static Bitmap *
+copy_bitmap(Bitmap *source)
+{
+	Bitmap *copy = NULL;
+
+	vl_NewBitmap(&copy, false, source->bitzero, source->bitmax);
+	memcpy(&(copy->bitset[0]), &(source->bitset[0]), 
+		   sizeof(bm_int) * ARRAYELEMS(source->bitzero, source->bitmax));
+	return copy;
+}
+
+/** 
+ * Return the shared variable from which a ::BitmapClone was cloned.
+ * The pointer recorded in the clone is only trusted for as long as the
+ * shared memory generation is unchanged: after a context switch the
+ * source is looked up again by name.
+ * 
+ * @param clone The ::BitmapClone.
+ * @param name The name of the clone, for error reporting.
+ * 
+ * @return Pointer to the source ::Bitmap or ::BitmapArray.
+ */
+static Object *
+clone_source(BitmapClone *clone, char *name)
+{
+	uint32    generation = vl_shared_generation();
+	VarEntry *var;
+
+	if (clone->source && (clone->generation == generation)) {
+		return clone->source;
+	}
+
+	var = vl_find_shared_variable(clone->source_name);
+	if (!var || !var->obj || (var->obj->type != clone->source_type)) {
+		ereport(ERROR,
+				(errcode(ERRCODE_INTERNAL_ERROR),
+				 errmsg("source of clone %s is not defined", name),
+				 errdetail("Shared %s %s, from which %s is cloned, does "
+						   "not exist.", vl_ObjTypeName(clone->source_type),
+						   clone->source_name, name),
+				 errhint("Clones may only be made of shared variables "
+						 "defined by veil_init().")));
+	}
+	if ((clone->source_type == OBJ_BITMAP_ARRAY) && 
+		((BitmapArray *) var->obj)->pages) 
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("sparse bitmap array %s cannot be cloned", 
+						clone->source_name)));
+	}
+
+	clone->source = var->obj;
+	clone->generation = generation;
+	return clone->source;
+}
+
+/** 
+ * Free the session copies that have been made for a ::BitmapClone.
+ * 
+ * @param clone The ::BitmapClone.
+ */
+static void
+free_clone_copies(BitmapClone *clone)
+{
+	BitmapArray *bmarray = clone->bmarray;
+	int32        elem;
+	bool         found;
+
+	if (clone->bitmap) {
+		pfree(clone->bitmap);
+		clone->bitmap = NULL;
+	}
+	if (bmarray) {
+		elem = vl_BitmapNextBit(clone->copied, bmarray->arrayzero, &found);
+		while (found) {
+			pfree(bmarray->bitmap[elem - bmarray->arrayzero]);
+			if (elem == bmarray->arraymax) {
+				break;
+			}
+			elem = vl_BitmapNextBit(clone->copied, elem + 1, &found);
+		}
+		pfree(bmarray);
+		pfree(clone->copied);
+		clone->bmarray = NULL;
+		clone->copied = NULL;
+	}
+}
+
+/** 
+ * Create or reset a ::BitmapClone of a shared ::Bitmap or
+ * ::BitmapArray.  No bitmaps are copied: for a cloned ::BitmapArray, a
+ * session view of the array is created whose elements are the shared
+ * bitmaps themselves.  Any copies made for an existing clone are
+ * discarded.
+ * 
+ * @param p_clone Pointer to an existing ::BitmapClone, which will be
+ * re-used, if one exists.
+ * @param name The name of the clone, for error reporting.
+ * @param type The type of the source variable, OBJ_BITMAP or
+ * OBJ_BITMAP_ARRAY.
+ * @param source The name of the shared variable to be cloned.
+ */
+void
+vl_NewBitmapClone(BitmapClone **p_clone, char *name, 
+				  ObjType type, char *source)
+{
+	BitmapClone *clone = *p_clone;
+	BitmapArray *srcarray;
+	BitmapArray *bmarray;
+	int32        rows;
+	int32        i;
+
+	if (clone) {
+		free_clone_copies(clone);
+	}
+	else {
+		clone = vl_malloc(sizeof(BitmapClone));
+		clone->bitmap = NULL;
+		clone->bmarray = NULL;
+		clone->copied = NULL;
+	}
+	clone->type = OBJ_BITMAP_CLONE;
+	clone->source_type = type;
+	clone->source = NULL;
+	strlcpy(clone->source_name, source, HASH_KEYLEN);
+	*p_clone = clone;
+
+	if (type == OBJ_BITMAP) {
+		(void) clone_source(clone, name);
+		return;
+	}
+
+	srcarray = (BitmapArray *) clone_source(clone, name);
+	rows = srcarray->arraymax + 1 - srcarray->arrayzero;
+	bmarray = vl_malloc(sizeof(BitmapArray) + (sizeof(Bitmap *) * rows));
+	bmarray->type = OBJ_BITMAP_ARRAY;
+	bmarray->bitzero = srcarray->bitzero;
+	bmarray->bitmax = srcarray->bitmax;
+	bmarray->arrayzero = srcarray->arrayzero;
+	bmarray->arraymax = srcarray->arraymax;
+	bmarray->shared = false;
+	bmarray->pages = 0;
+	bmarray->pagedir = NULL;
+	DBG_SET_CANARY(*bmarray);
+	DBG_SET_ELEMS(*bmarray, rows);
+	DBG_SET_TRAILERP(*bmarray, bitmap);
+	for (i = 0; i < rows; i++) {
+		bmarray->bitmap[i] = srcarray->bitmap[i];
+	}
+	vl_NewBitmap(&(clone->copied), false, 
+				 srcarray->arrayzero, srcarray->arraymax);
+	clone->bmarray = bmarray;
+	clone->view_generation = clone->generation;
+}
+
+/** 
+ * Return the ::Bitmap for a clone of a shared ::Bitmap.  Until the
+ * clone is first updated this is the shared ::Bitmap itself; when it
+ * is first updated, a session copy is made.
+ * 
+ * @param clone The ::BitmapClone.
+ * @param name The name of the clone, for error reporting.
+ * @param for_update Whether the caller may modify the returned
+ * ::Bitmap.
+ * 
+ * @return Pointer to the ::Bitmap.  If for_update is false this must
+ * not be modified.
+ */
+Bitmap *
+vl_ClonedBitmap(BitmapClone *clone, char *name, bool for_update)
+{
+	Bitmap *source;
+
+	if (clone->bitmap) {
+		return clone->bitmap;
+	}
+
+	source = (Bitmap *) clone_source(clone, name);
+	if (!for_update) {
+		return source;
+	}
+	clone->bitmap = copy_bitmap(source);
+	return clone->bitmap;
+}
+
+/** 
+ * Return the session view of a clone of a shared ::BitmapArray, for
+ * read-only use.  If the shared memory generation has changed since
+ * the view was built, the elements that have not been copied are
+ * re-pointed at the source's bitmaps, even if the source has been
+ * found at the same address: after a second reset a different array
+ * may occupy the memory of the first.
+ * 
+ * @param clone The ::BitmapClone.
+ * @param name The name of the clone, for error reporting.
+ * 
+ * @return Pointer to the ::BitmapArray.  This must not be modified.
+ */
+BitmapArray *
+vl_ClonedBitmapArray(BitmapClone *clone, char *name)
+{
+	BitmapArray *bmarray = clone->bmarray;
+	BitmapArray *source = (BitmapArray *) clone_source(clone, name);
+	int32        rows;
+	int32        i;
+
+	if (clone->view_generation == clone->generation) {
+		return bmarray;
+	}
+
+	if ((source->bitzero != bmarray->bitzero) ||
+		(source->bitmax != bmarray->bitmax) ||
+		(source->arrayzero != bmarray->arrayzero) ||
+		(source->arraymax != bmarray->arraymax))
+	{
+		clone->source = NULL;
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("source of clone %s has changed", name),
+				 errdetail("The ranges of shared BitmapArray %s no "
+						   "longer match those of its clone.",
+						   clone->source_name),
+				 errhint("Re-create the clone using "
+						 "veil.clone_bitmap_array().")));
+	}
+
+	rows = bmarray->arraymax + 1 - bmarray->arrayzero;
+	for (i = 0; i < rows; i++) {
+		if (!vl_BitmapTestbit(clone->copied, bmarray->arrayzero + i)) {
+			bmarray->bitmap[i] = source->bitmap[i];
+		}
+	}
+	clone->view_generation = clone->generation;
+	return bmarray;
+}
+
+/** 
+ * Return an element of a clone of a shared ::BitmapArray, for update.
+ * The element's ::Bitmap is copied into session memory when it is
+ * first updated: other elements continue to be read from the source.
+ * 
+ * @param clone The ::BitmapClone.
+ * @param name The name of the clone, for error reporting.
+ * @param elem The index of the required element.
+ * 
+ * @return Pointer to the session copy of the ::Bitmap, or NULL if elem
+ * is out of range.
+ */
+Bitmap *
+vl_ClonedArrayBitmap(BitmapClone *clone, char *name, int32 elem)
+{
+	BitmapArray *bmarray = vl_ClonedBitmapArray(clone, name);
+	int32        idx;
+
+	if ((elem < bmarray->arrayzero) || (elem > bmarray->arraymax)) {
+		return NULL;
+	}
+
+	idx = elem - bmarray->arrayzero;
+	if (!vl_BitmapTestbit(clone->copied, elem)) {
+		bmarray->bitmap[idx] = copy_bitmap(bmarray->bitmap[idx]);
+		vl_BitmapSetbit(clone->copied, elem);
+	}
+	return bmarray->bitmap[idx];
+}
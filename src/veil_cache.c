@@ -0,0 +1,314 @@
+/**
+ * @file   veil_cache.c
+ * \code
+ *     Author:       Marc Munro
+ *     Copyright (c) 2018 Marc Munro
+ *     License:      BSD
+ *
+ * \endcode
+ * @brief
+ * Functions providing a shared cache of serialised session state.
+ *
+ * Building the session variables for a user, in a function such as
+ * the demo's connect_person(), typically requires several queries and
+ * bitmap operations.  When backends are re-used by different users, as
+ * they are behind a connection pooler, this work is repeated each time
+ * a user is re-connected.  The session cache allows the result of that
+ * work to be saved, as a serialised session stream (see
+ * vl_serialise_session()), in shared memory, from where it may be
+ * restored by any backend connected to the same database.
+ *
+ * Entries are keyed by the database, an application-defined principal
+ * id, and the generation of Veil's shared memory (see
+ * vl_shared_generation()), so that entries built from shared variables
+ * that have since been reset are never restored.  The cache has a fixed
+ * number of fixed-size entries, set by veil.session_cache_entries and
+ * veil.session_cache_entry_size, and when full, the least recently used
+ * entry is replaced.
+ */
+
+#include "postgres.h"
+#include "miscadmin.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "veil_version.h"
+#include "veil_funcs.h"
+#include "veil_datatypes.h"
+
+
+#ifndef DOXYGEN_SHOULD_SKIP_THIS
+
+#define CACHE_NAME        "VEIL_SESSION_CACHE"
+#define CACHE_TRANCHE     "veil_session_cache"
+
+#endif
+
+/**
+ * An entry in the session cache.  The serialised session stream
+ * follows the entry header.
+ */
+typedef struct CacheEntry {
+	Oid     db_id;			/**< The database, or InvalidOid if unused */
+	int32   principal;		/**< The application's principal id */
+	uint32  generation;		/**< Shared memory generation at save time */
+	uint64  last_used;		/**< Value of the cache clock when last used */
+	int32   len;			/**< The length of the stream */
+	char    data[FLEXIBLE_ARRAY_MEMBER]; /**< The stream itself */
+} CacheEntry;
+
+/**
+ * The session cache, as held in shared memory.  The entries follow
+ * this header.
+ */
+typedef struct SessionCache {
+	LWLock *lock;			/**< Lock protecting all entries */
+	uint64  clock;			/**< Incremented by each use of an entry */
+	int32   entries;		/**< The number of entries */
+	Size    entry_size;		/**< The size of each entry, including its
+							 * header */
+} SessionCache;
+
+/**
+ * This session's pointer to the session cache.
+ */
+static SessionCache *session_cache = NULL;
+
+/**
+ * Return the size of each entry in the cache, including its header.
+ */
+static Size
+cache_entry_size()
+{
+	return MAXALIGN(offsetof(CacheEntry, data) +
+					veil_session_cache_entry_size());
+}
+
+/**
+ * Return the amount of shared memory required for the session cache.
+ */
+Size
+vl_session_cache_size()
+{
+	if (veil_session_cache_entries() == 0) {
+		return 0;
+	}
+	return add_size(MAXALIGN(sizeof(SessionCache)),
+					mul_size(veil_session_cache_entries(), 
+							 cache_entry_size()));
+}
+
+/**
+ * Request shared memory, and an LWLock, for the session cache.  This
+ * must be called from _PG_init().
+ */
+void
+vl_session_cache_request()
+{
+	if (veil_session_cache_entries() == 0) {
+		return;
+	}
+	RequestAddinShmemSpace(vl_session_cache_size());
+	RequestNamedLWLockTranche(CACHE_TRANCHE, 1);
+}
+
+/**
+ * Return the address of an entry in the session cache.
+ *
+ * @param cache The session cache.
+ * @param i The index of the entry.
+ */
+#define CACHE_ENTRY(cache, i) \
+	((CacheEntry *) ((char *) (cache) + MAXALIGN(sizeof(SessionCache)) + \
+					 ((i) * (cache)->entry_size)))
+
+/**
+ * Attach to, creating if necessary, the session cache.  Raise an
+ * ERROR if the cache is disabled.
+ *
+ * @return The session cache.
+ */
+static SessionCache *
+get_session_cache()
+{
+	SessionCache *cache;
+	bool          found;
+	int32         i;
+
+	if (session_cache) {
+		return session_cache;
+	}
+
+	if (veil_session_cache_entries() == 0) {
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("the veil session cache is disabled"),
+				 errhint("Set veil.session_cache_entries in "
+						 "postgresql.conf and restart the server.")));
+	}
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+	cache = ShmemInitStruct(CACHE_NAME, vl_session_cache_size(), &found);
+	if (!found) {
+		cache->lock = &(GetNamedLWLockTranche(CACHE_TRANCHE))->lock;
+		cache->clock = 0;
+		cache->entries = veil_session_cache_entries();
+		cache->entry_size = cache_entry_size();
+		for (i = 0; i < cache->entries; i++) {
+			CACHE_ENTRY(cache, i)->db_id = InvalidOid;
+		}
+	}
+	LWLockRelease(AddinShmemInitLock);
+
+	session_cache = cache;
+	return cache;
+}
+
+/**
+ * Find the entry for a principal in the current database.  The caller
+ * must hold the cache's lock.
+ *
+ * @param cache The session cache.
+ * @param principal The principal id.
+ *
+ * @return The entry, or NULL if there is none.
+ */
+static CacheEntry *
+find_entry(SessionCache *cache, int32 principal)
+{
+	CacheEntry *entry;
+	int32       i;
+
+	for (i = 0; i < cache->entries; i++) {
+		entry = CACHE_ENTRY(cache, i);
+		if ((entry->db_id == MyDatabaseId) &&
+			(entry->principal == principal)) {
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Save the session variables whose names match a LIKE pattern to the
+ * session cache, as the state for a principal.  Shared variables are
+ * never saved, as restoring them would overwrite changes made since by
+ * other sessions.  Any existing entry for the principal is replaced.
+ * If there is no existing entry, the least recently used entry is
+ * replaced.
+ *
+ * @param principal The application's id for the principal whose state
+ * is being saved.
+ * @param pattern The LIKE pattern that the names of the variables to
+ * be saved must match.
+ *
+ * @return The number of variables saved, or -1 if the serialised
+ * variables were too large for a cache entry, in which case nothing is
+ * saved.
+ */
+int32
+vl_cache_session(int32 principal, text *pattern)
+{
+	SessionCache *cache = get_session_cache();
+	uint32        generation = vl_shared_generation();
+	CacheEntry   *entry;
+	CacheEntry   *victim;
+	bytea        *stream;
+	int32         count;
+	int32         len;
+	int32         i;
+
+	stream = vl_serialise_session(pattern, VAR_SCOPE_SESSION, &count);
+	len = VARSIZE(stream) - VARHDRSZ;
+	if (len > veil_session_cache_entry_size()) {
+		pfree(stream);
+		return -1;
+	}
+
+	LWLockAcquire(cache->lock, LW_EXCLUSIVE);
+	if (!(entry = find_entry(cache, principal))) {
+		/* Use an unused entry, or else the least recently used one. */
+		for (i = 0; i < cache->entries; i++) {
+			victim = CACHE_ENTRY(cache, i);
+			if (!OidIsValid(victim->db_id)) {
+				entry = victim;
+				break;
+			}
+			if (!entry || (victim->last_used < entry->last_used)) {
+				entry = victim;
+			}
+		}
+	}
+	entry->db_id = MyDatabaseId;
+	entry->principal = principal;
+	entry->generation = generation;
+	entry->last_used = ++cache->clock;
+	entry->len = len;
+	memcpy(entry->data, VARDATA(stream), len);
+	LWLockRelease(cache->lock);
+
+	pfree(stream);
+	return count;
+}
+
+/**
+ * Restore the session variables saved for a principal by
+ * vl_cache_session().  An entry saved before the most recent reset of
+ * Veil's shared memory is discarded rather than restored.
+ *
+ * @param principal The application's id for the principal.
+ *
+ * @return The number of variables restored, or -1 if there is no
+ * current entry for the principal.
+ */
+int32
+vl_restore_cached_session(int32 principal)
+{
+	SessionCache *cache = get_session_cache();
+	uint32        generation = vl_shared_generation();
+	CacheEntry   *entry;
+	char         *data = NULL;
+	int32         len = 0;
+
+	LWLockAcquire(cache->lock, LW_EXCLUSIVE);
+	if ((entry = find_entry(cache, principal))) {
+		if (entry->generation == generation) {
+			entry->last_used = ++cache->clock;
+			len = entry->len;
+			data = palloc(len);
+			memcpy(data, entry->data, len);
+		}
+		else {
+			entry->db_id = InvalidOid;
+		}
+	}
+	LWLockRelease(cache->lock);
+
+	if (!data) {
+		return -1;
+	}
+	return vl_deserialise_session(data, len, false);
+}
+
+/**
+ * Remove any entry for a principal from the session cache.  This
+ * should be called when the data from which the principal's session
+ * state is derived changes.
+ *
+ * @param principal The application's id for the principal.
+ *
+ * @return true if an entry was removed.
+ */
+bool
+vl_uncache_session(int32 principal)
+{
+	SessionCache *cache = get_session_cache();
+	CacheEntry   *entry;
+
+	LWLockAcquire(cache->lock, LW_EXCLUSIVE);
+	if ((entry = find_entry(cache, principal))) {
+		entry->db_id = InvalidOid;
+	}
+	LWLockRelease(cache->lock);
+
+	return entry != NULL;
+}
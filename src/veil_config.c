@@ -41,6 +41,56 @@ static int dbs_in_cluster = 2;
  */
 static int shmem_context_size = 16384;
 
+/** 
+ * Whether the bitsets of bitmaps, bitmap arrays and bitmap hashes are
+ * packed (compressed) when serialised.  This defaults to false, so that
+ * serialised streams remain readable by older versions of Veil, and
+ * may be set using eg: "set veil.compress_bitmaps = on"
+ */
+static bool compress_bitmaps = false;
+
+/** 
+ * Whether the first backend to use Veil, after the cluster starts, will
+ * load shared variables from a snapshot saved by
+ * veil.save_shared_snapshot(), rather than waiting for them to be
+ * rebuilt by the init functions.  This defaults to false and may be
+ * defined in postgresql.conf using eg: "veil.snapshot_shared = on"
+ */
+static bool snapshot_shared = false;
+
+/** 
+ * The maximum number of background workers that veil_init() may use to
+ * run parallel init functions concurrently, when shared variables are
+ * being reset.  This defaults to 0, meaning that all init functions are
+ * run serially by the resetting backend, and may be defined in
+ * postgresql.conf using eg: "veil.init_workers = 4"
+ */
+static int init_workers = 0;
+
+/** 
+ * Whether session initialisation is deferred until variables are first
+ * used, so that only the initialisers of those variables, as
+ * registered in veil.veil_variable_init_fns, need be called.  This
+ * defaults to false and may be set using eg: "set veil.lazy_init = on"
+ */
+static bool lazy_init = false;
+
+/** 
+ * The number of entries in the shared cache of session state (see
+ * veil_cache.c).  This defaults to 0, which disables the cache, and may
+ * be defined in postgresql.conf using eg:
+ * "veil.session_cache_entries = 100"
+ */
+static int session_cache_entries = 0;
+
+/** 
+ * The maximum size, in bytes, of the serialised session state held in
+ * each entry of the session cache.  This defaults to 8192 and may be
+ * defined in postgresql.conf using eg:
+ * "veil.session_cache_entry_size = 16384"
+ */
+static int session_cache_entry_size = 8192;
+
 /** 
  * Return the number of databases, within the database cluster, that
  * will use Veil.  Each such database will be allocated 2 chunks of
@@ -85,6 +135,66 @@ veil_shmem_context_size()
 	return shmem_context_size;
 }
 
+/** 
+ * Return whether bitmaps should be packed when serialised.  Unlike the
+ * other configuration variables, this may be changed at any time
+ * during a session.
+ */
+bool
+veil_compress_bitmaps()
+{
+	return compress_bitmaps;
+}
+
+/** 
+ * Return whether shared variables should be loaded from a snapshot on
+ * startup.
+ */
+bool
+veil_snapshot_shared()
+{
+	return snapshot_shared;
+}
+
+/** 
+ * Return the maximum number of background workers to be used for
+ * running parallel init functions.
+ */
+int
+veil_init_workers()
+{
+	return init_workers;
+}
+
+/** 
+ * Return whether session initialisation should be deferred until
+ * variables are first used.
+ */
+bool
+veil_lazy_init()
+{
+	return lazy_init;
+}
+
+/** 
+ * Return the number of entries in the session cache.
+ */
+int
+veil_session_cache_entries()
+{
+	return session_cache_entries;
+}
+
+/** 
+ * Return the maximum size of the session state in each entry of the
+ * session cache.
+ */
+int
+veil_session_cache_entry_size()
+{
+	return session_cache_entry_size;
+}
+
 /** 
  * Initialise Veil's use of GUC variables.
  */
@@ -121,6 +231,68 @@ veil_config_init()
 							4096, 4096, 104857600,
 							PGC_USERSET,
 							0, NULL, NULL, NULL);
+	DefineCustomBoolVariable("veil.compress_bitmaps",
+							 "Whether bitmaps are compressed when "
+							 "serialised (off)",
+							 "Each serialised bitmap is written as raw "
+							 "words, runs of words or a list of set "
+							 "bits, whichever is smallest.",
+							 &compress_bitmaps,
+							 false,
+							 PGC_USERSET,
+							 0, NULL, NULL, NULL);
+	DefineCustomBoolVariable("veil.snapshot_shared",
+							 "Whether shared variables are loaded from a "
+							 "saved snapshot on startup (off)",
+							 "The snapshot is only loaded if its stamp "
+							 "matches that returned by "
+							 "veil.snapshot_stamp().",
+							 &snapshot_shared,
+							 false,
+							 PGC_SUSET,
+							 0, NULL, NULL, NULL);
+	DefineCustomIntVariable("veil.init_workers",
+							"The maximum number of background workers "
+							"used to run parallel init functions (0)",
+							"Init functions registered as parallel, "
+							"with the same priority, may be run "
+							"concurrently when shared variables are reset.",
+							&init_workers,
+							0, 0, 64,
+							PGC_SUSET,
+							0, NULL, NULL, NULL);
+	DefineCustomBoolVariable("veil.lazy_init",
+							 "Whether variables are initialised as they "
+							 "are first used (off)",
+							 "Each variable is initialised by the function "
+							 "registered for it in "
+							 "veil.veil_variable_init_fns.",
+							 &lazy_init,
+							 false,
+							 PGC_USERSET,
+							 0, NULL, NULL, NULL);
+	DefineCustomIntVariable("veil.session_cache_entries",
+							"The number of entries in the shared cache "
+							"of session state (0)",
+							"Each entry holds the saved session "
+							"variables for one principal.  This cannot "
+							"be changed without restarting the database "
+							"cluster.",
+							&session_cache_entries,
+							0, 0, 65536,
+							PGC_POSTMASTER,
+							0, NULL, NULL, NULL);
+	DefineCustomIntVariable("veil.session_cache_entry_size",
+							"The maximum size of each entry in the shared "
+							"cache of session state (8192)",
+							"Size in bytes of the serialised session "
+							"variables in each entry.  This cannot be "
+							"changed without restarting the database "
+							"cluster.",
+							&session_cache_entry_size,
+							8192, 256, 1048576,
+							PGC_POSTMASTER,
+							0, NULL, NULL, NULL);
 
 	first_time = false;
 }
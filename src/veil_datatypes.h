@@ -142,9 +142,21 @@ typedef enum {
 	OBJ_BITMAP_ARRAY,
 	OBJ_BITMAP_HASH,
 	OBJ_BITMAP_REF,
-	OBJ_INT4_ARRAY
+	OBJ_INT4_ARRAY,
+	OBJ_MAPPED_BITMAP_ARRAY,
+	OBJ_BITMAP_CLONE
 } ObjType;
 
+/**
+ * Identifies which variables, shared or session, an operation applies
+ * to.
+ */
+typedef enum {
+	VAR_SCOPE_ALL = 0,			/**< Both shared and session variables */
+	VAR_SCOPE_SHARED,			/**< Shared variables only */
+	VAR_SCOPE_SESSION			/**< Session variables only */
+} VarScope;
+
 /** 
  * General purpose object-type.  All veil variables are effectively
  * sub-types of this.
@@ -168,13 +180,25 @@ typedef struct ShmemCtl {
 								   * chunks in each context */ 
     bool      switching;          /**< Whether a context-switch is in
 								   * progress */
-	MemChunk *context[2];         /**< The first chunks of each context */
+	struct MemContext *context[2]; /**< Array (pair) of contexts (see
+								   * veil_shmem.h) */
 	TransactionId xid[2];         /**< The transaction id of the
 								   * transaction that initialised each
 								   * context: this is used to determine
 								   * whether there are transactions
 								   * still runnning that may be using an
 								   * earlier context. */
+    bool      snapshot_checked;   /**< Whether a backend has looked for
+								   * a snapshot of shared variables to
+								   * load since shared memory was
+								   * initialised */
+    uint32    generation;         /**< Incremented by each context
+								   * switch, so that sessions can tell
+								   * when pointers they hold into shared
+								   * memory may no longer be valid */
+    bool      init_workers_active; /**< Whether background workers may
+								   * be running init functions, during a
+								   * context switch */
 } ShmemCtl;
 
 /**
@@ -317,6 +341,10 @@ typedef struct Bitmap {
 						 * store */
     int32   bitmax;		/**< The index of the highest bit the bitmap can
 						 * store */
+	int32   allocated;  /**< The number of elements allocated for
+						 * bitset.  This may exceed the number needed
+						 * for bitzero..bitmax, allowing the bitmap to
+						 * be extended in place. */
 	bm_int  bitset[EMPTY]; /**< Element zero of the array of int4 values
 						 * comprising the bitmap. */
 } Bitmap;
@@ -334,11 +362,62 @@ typedef struct BitmapRef {
 	Bitmap        *bitmap;  /**< Pointer to the referenced bitmap */
 } BitmapRef;
 
+/**
+ * The number of bits of a BitmapArray index that select the entry
+ * within a single page of a sparse BitmapArray's page directory.
+ */
+#define BITMAP_PAGE_BITS      8
+
+/**
+ * The number of Bitmap pointers in each page of a sparse BitmapArray.
+ */
+#define BITMAP_PAGE_SIZE      (1 << BITMAP_PAGE_BITS)
+
+/**
+ * A page of Bitmap pointers for a sparse BitmapArray.  Pages are only
+ * allocated when a bit is first set in one of the Bitmaps that they
+ * cover, and each Bitmap is only allocated when a bit is first set in
+ * it.
+ */
+typedef struct BitmapPage {
+	struct Bitmap *bitmap[BITMAP_PAGE_SIZE]; /**< The Bitmaps for this
+						 * page, or NULL for those that are empty */
+} BitmapPage;
+
+/**
+ * The number of bits of a page number, within a sparse BitmapArray,
+ * that select the page within a single BitmapDir.
+ */
+#define BITMAP_DIR_BITS       12
+
+/**
+ * The number of BitmapPage pointers in each BitmapDir.
+ */
+#define BITMAP_DIR_SIZE       (1 << BITMAP_DIR_BITS)
+
+/**
+ * The second level of the page directory of a sparse BitmapArray.
+ * Like pages, these are only allocated when a bit is first set in one
+ * of the Bitmaps that they cover, so that the directory of an array
+ * spanning the whole int4 range needs only a few kilobytes until it is
+ * used.
+ */
+typedef struct BitmapDir {
+	BitmapPage *page[BITMAP_DIR_SIZE]; /**< The pages for this part of
+						 * the directory, or NULL for those that are
+						 * empty */
+} BitmapDir;
+
 /**
  * Subtype of Object for storing bitmap arrays.  A bitmap array is
  * simply an array of pointers to dynamically allocated Bitmaps.  Note
  * that the size of a Bitmap structure is determined dynamically at run
  * time as the size of the array is only known then.
+ *
+ * A sparse bitmap array has no entries in bitmap.  Instead, its Bitmaps
+ * are found through a two-level directory of BitmapPages, and are
+ * allocated only as they are first written.  This allows arrays with
+ * very wide but sparsely populated ranges to be stored cheaply.
  */
 typedef struct BitmapArray {	// subtype of Object
     ObjType type;		/**< This must have the value OBJ_BITMAP_ARRAY */
@@ -353,6 +432,14 @@ typedef struct BitmapArray {	// subtype of Object
 						 * array */
 	int32   arraymax;   /**< The index of the lowest numbered bitmap in
 						 * the array */
+	bool    shared;     /**< Whether the array is in shared memory */
+	int32   pages;      /**< The number of pages spanned by a sparse
+						 * array, or zero if this is not a sparse
+						 * array */
+	BitmapDir **pagedir; /**< For a sparse array, the top level of the
+						 * page directory, with an entry for each
+						 * BITMAP_DIR_SIZE pages, which is NULL if no
+						 * bits have yet been set in them */
 	Bitmap *bitmap[EMPTY];  /**< Element zero of the array of Bitmap pointers
 						 * comprising the array. */
 } BitmapArray;
@@ -383,9 +470,65 @@ typedef struct Int4Array {
 						 * array */
     int32   arraymax;   /**< The index of the lowest numbered bitmap in
 						 * the array */
+	int32   allocated;  /**< The number of elements allocated for
+						 * array.  This may exceed the number needed
+						 * for arrayzero..arraymax, allowing the array
+						 * to be extended in place. */
 	int32   array[0];   /**< Element zero of the array of integers */
 } Int4Array;
 
+/** 
+ * Subtype of Object for read-only bitmap arrays whose bitmaps are
+ * stored in an image file, as created by vl_SaveBitmapArrayImage().
+ * The variable holds only this description of the file: each backend
+ * maps the file into its own memory on first use, so that the bitmaps
+ * are read directly from the operating system's page cache.  The
+ * file's identity is recorded so that a backend can tell whether a
+ * mapping that it already holds is still current.
+ */
+typedef struct MappedBitmapArray {
+    ObjType type;		/**< This must have the value
+						 * OBJ_MAPPED_BITMAP_ARRAY */
+    int32   bitzero;	/**< The index of the lowest bit each bitmap can
+						 * store */
+    int32   bitmax;		/**< The index of the highest bit each bitmap can
+						 * store */
+	int32   arrayzero;  /**< The index of the lowest numbered bitmap */
+	int32   arraymax;   /**< The index of the highest numbered bitmap */
+	uint64  inode;      /**< Inode number of the image file */
+	int64   mtime;      /**< Modification time of the image file */
+	int64   size;       /**< Size in bytes of the image file */
+	char    path[MAXPGPATH]; /**< Path of the image file */
+} MappedBitmapArray;
+
+/**
+ * Subtype of Object for storing copy-on-write session clones of shared
+ * bitmaps and bitmap arrays.  Until it is written, a clone reads from
+ * the shared variable that is its source.  A cloned ::Bitmap is copied
+ * into session memory when it is first written, and each ::Bitmap of a
+ * cloned ::BitmapArray is copied only when it is itself first written.
+ * See veil_bitmap.c for more information.
+ */
+typedef struct BitmapClone {
+    ObjType      type;       /**< This must have the value
+							  * OBJ_BITMAP_CLONE */
+	ObjType      source_type; /**< OBJ_BITMAP or OBJ_BITMAP_ARRAY */
+	uint32       generation; /**< The shared memory generation in which
+							  * source was found */
+	Object      *source;     /**< The shared variable being cloned */
+	Bitmap      *bitmap;     /**< For a cloned Bitmap, the session copy,
+							  * once it has been written */
+	BitmapArray *bmarray;    /**< For a cloned BitmapArray, the session's
+							  * view of it: each element is the source's
+							  * Bitmap until it is first written */
+	uint32       view_generation; /**< The shared memory generation in
+							  * which the elements of bmarray that have
+							  * not been copied were taken from source */
+	Bitmap      *copied;     /**< For a cloned BitmapArray, the elements
+							  * of bmarray that have been copied */
+	char         source_name[HASH_KEYLEN]; /**< Name of the source */
+} BitmapClone;
+
 
 /**
  * A Veil variable.  These may be session or shared variables, and may
@@ -419,6 +562,40 @@ typedef struct veil_variable_t {
 						   opposed to a session variable) */
 } veil_variable_t;
 
+/**
+ * The state of a scan of all veil variables, as performed by
+ * vl_next_variable().  This is owned by the caller so that any number
+ * of scans may be in progress at once.
+ */
+typedef struct VarScan {
+    bool             doing_shared; /**< Whether the shared hash is being
+									  scanned (rather than the session
+									  hash) */
+    HASH_SEQ_STATUS  status;       /**< Scan state for the current hash */
+    veil_variable_t  result;       /**< The most recently returned
+									  variable */
+} VarScan;
+
+/**
+ * The state of a chunked serialisation of a veil variable, as performed
+ * by vl_next_chunk().  This is owned by the caller.
+ */
+typedef struct ChunkScan {
+    char            *name;        /**< The name of the variable */
+    Object          *obj;         /**< The contents of the variable */
+    int32            chunk_size;  /**< Target size in bytes of each chunk */
+    bool             packed;      /**< Whether bitsets are to be packed */
+    bool             first;       /**< Whether the first chunk has yet to
+									 be returned */
+    bool             done;        /**< Whether the last chunk has been
+									 returned */
+    int32            next_elem;   /**< The next element of a bitmap array
+									 to be serialised */
+    int32            hash_done;   /**< The number of bitmap hash entries
+									 serialised so far */
+    HASH_SEQ_STATUS  status;      /**< Scan state for a bitmap hash */
+} ChunkScan;
+
 
 #endif
 
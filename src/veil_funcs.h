@@ -12,6 +12,7 @@
 
 #include "veil_datatypes.h"
 #include "fmgr.h"
+#include "nodes/pg_list.h"
 
 /* veil_utils */
 extern void *vl_malloc(size_t size);
@@ -20,13 +21,18 @@ char *vl_ObjTypeName(ObjType obj);
 
 /* veil_variables */
 extern VarEntry *vl_lookup_shared_variable(char *name);
+extern VarEntry *vl_find_shared_variable(char *name);
+extern VarEntry *vl_find_variable(char *name);
 extern VarEntry *vl_lookup_variable(char *name);
-extern veil_variable_t *vl_next_variable(veil_variable_t *prev);
+extern void vl_start_variable_scan(VarScan *scan);
+extern veil_variable_t *vl_next_variable(VarScan *scan);
 extern void vl_ClearInt4Array(Int4Array *array);
 extern Int4Array *vl_NewInt4Array(Int4Array *current, bool shared,
 								  int32 min, int32 max);
 extern void vl_Int4ArraySet(Int4Array *array, int32 idx, int32 value);
 extern int32 vl_Int4ArrayGet(Int4Array *array, int32 idx);
+extern Int4Array *vl_Int4ArrayExtend(Int4Array *array, bool shared,
+									 int32 newmax);
 
 
 /* veil_datatypes */
@@ -36,6 +42,7 @@ extern Int4Var *vl_NewInt4(bool shared);
 /* veil_bitmap */
 extern void vl_ClearBitmap(Bitmap *bitmap);
 extern void vl_NewBitmap(Bitmap **p_bitmap, bool shared, int32 min, int32 max);
+extern void vl_BitmapExtend(Bitmap **p_bitmap, bool shared, int32 newmax);
 extern void vl_BitmapSetbit(Bitmap *bitmap, int32 bit);
 extern void vl_BitmapClearbit(Bitmap *bitmap, int32 bit);
 extern bool vl_BitmapTestbit(Bitmap *bitmap, int32 bit);
@@ -43,22 +50,49 @@ extern void vl_BitmapUnion(Bitmap *target,	Bitmap *source);
 extern void vl_BitmapIntersect(Bitmap *target,	Bitmap *source);
 extern int32 vl_BitmapNextBit(Bitmap *bitmap, int32 bit, bool *found);
 extern Bitmap *vl_BitmapFromArray(BitmapArray *bmarray, int32 elem);
+extern Bitmap *vl_AddBitmapToArray(BitmapArray *bmarray, int32 elem);
+extern Bitmap *vl_NextBitmapFromArray(BitmapArray *bmarray, int32 *p_elem);
 extern void vl_ClearBitmapArray(BitmapArray *bmarray);
 extern void vl_NewBitmapArray(BitmapArray **p_bmarray, bool shared,
 							  int32 arrayzero, int32 arraymax,
 							  int32 bitzero, int32 bitmax);
-extern VarEntry *vl_NextHashEntry(HTAB *hash, VarEntry *prev);
+extern void vl_NewSparseBitmapArray(BitmapArray **p_bmarray, bool shared,
+									int32 arrayzero, int32 arraymax,
+									int32 bitzero, int32 bitmax);
+extern void vl_StartHashScan(HTAB *hash, HASH_SEQ_STATUS *status);
+extern VarEntry *vl_NextHashEntry(HASH_SEQ_STATUS *status);
+extern void vl_EndHashScan(HASH_SEQ_STATUS *status);
 extern void vl_NewBitmapHash(BitmapHash **p_bmhash, char *name,
 							 int32 bitzero, int32 bitmax);
+extern void vl_NewSizedBitmapHash(BitmapHash **p_bmhash, char *name,
+								  int32 bitzero, int32 bitmax, 
+								  int32 entries);
 extern Bitmap *vl_BitmapFromHash(BitmapHash *bmhash, char *hashelem);
 extern Bitmap *vl_AddBitmapToHash(BitmapHash *bmhash, char *hashelem);
 extern bool vl_BitmapHashHasKey(BitmapHash *bmhash, char *hashelem);
+extern void vl_NewBitmapClone(BitmapClone **p_clone, char *name, 
+							  ObjType type, char *source);
+extern Bitmap *vl_ClonedBitmap(BitmapClone *clone, char *name, 
+							   bool for_update);
+extern BitmapArray *vl_ClonedBitmapArray(BitmapClone *clone, char *name);
+extern Bitmap *vl_ClonedArrayBitmap(BitmapClone *clone, char *name, 
+									int32 elem);
 
 /* veil_shmem */
 extern HTAB *vl_get_shared_hash(void);
 extern bool vl_prepare_context_switch(void);
 extern bool vl_complete_context_switch(void);
 extern void vl_force_context_switch(void);
+extern bool vl_claim_snapshot_load(void);
+extern void vl_clear_shared_hash(void);
+extern uint32 vl_shared_generation(void);
+extern bool vl_lock_generation(uint32 generation);
+extern void vl_unlock_generation(void);
+extern void vl_set_init_workers_active(bool active);
+extern void *vl_shared_hash_search(HTAB *hash, char *name, 
+								   HASHACTION action, bool *p_found);
+extern bool vl_switch_prepared(void);
+extern bool vl_join_context_switch(void);
 extern void *vl_shmalloc(size_t size);
 extern void vl_free(void *mem);
 extern void _PG_init(void);
@@ -67,8 +101,18 @@ extern void _PG_init(void);
 extern int vl_spi_connect(bool *p_pushed);
 extern int vl_spi_finish(bool pushed);
 extern bool vl_bool_from_query(const char *qry, bool *result);
+extern bool vl_str_from_query(const char *qry, char **result);
 extern bool vl_db_exists(Oid db_id);
+extern int32 vl_int32_from_datum(Datum value, Oid type, char *colname);
+extern int32 vl_load_bits(Object *target, Oid relid, char *row_col,
+						char *bit_col, char *filter);
+extern void vl_enter_init(void);
+extern void vl_leave_init(void);
+extern bool vl_in_init(void);
 extern int  vl_call_init_fns(bool param);
+extern bool vl_call_variable_init_fn(char *name);
+extern List *vl_derived_variables(void);
+extern PGDLLEXPORT void vl_init_fn_worker(Datum main_arg);
 
 /* veil_config */
 extern void veil_config_init(void);
@@ -76,9 +120,18 @@ extern void veil_load_config(void);
 extern int veil_shared_hash_elems(void);
 extern int veil_dbs_in_cluster(void);
 extern int veil_shmem_context_size(void);
+extern bool veil_compress_bitmaps(void);
+extern bool veil_snapshot_shared(void);
+extern int veil_init_workers(void);
+extern bool veil_lazy_init(void);
+extern int veil_session_cache_entries(void);
+extern int veil_session_cache_entry_size(void);
 
 
 /* veil_interface */
+extern void vl_skip_session_init(void);
+extern bool vl_init_variable(char *name);
+extern bool vl_rebuild_variable(char *name);
 extern void vl_type_mismatch(char *name,  ObjType expected, ObjType got);
 extern Datum veil_variables(PG_FUNCTION_ARGS);
 extern Datum veil_share(PG_FUNCTION_ARGS);
@@ -93,7 +146,10 @@ extern Datum veil_bitmap_union(PG_FUNCTION_ARGS);
 extern Datum veil_bitmap_intersect(PG_FUNCTION_ARGS);
 extern Datum veil_bitmap_bits(PG_FUNCTION_ARGS);
 extern Datum veil_bitmap_range(PG_FUNCTION_ARGS);
+extern Datum veil_bitmap_extend(PG_FUNCTION_ARGS);
+extern Datum veil_clone_bitmap(PG_FUNCTION_ARGS);
 extern Datum veil_init_bitmap_array(PG_FUNCTION_ARGS);
+extern Datum veil_init_sparse_bitmap_array(PG_FUNCTION_ARGS);
 extern Datum veil_clear_bitmap_array(PG_FUNCTION_ARGS);
 extern Datum veil_bitmap_from_array(PG_FUNCTION_ARGS);
 extern Datum veil_bitmap_array_testbit(PG_FUNCTION_ARGS);
@@ -104,6 +160,10 @@ extern Datum veil_intersect_from_bitmap_array(PG_FUNCTION_ARGS);
 extern Datum veil_bitmap_array_bits(PG_FUNCTION_ARGS);
 extern Datum veil_bitmap_array_arange(PG_FUNCTION_ARGS);
 extern Datum veil_bitmap_array_brange(PG_FUNCTION_ARGS);
+extern Datum veil_load_bitmap_array(PG_FUNCTION_ARGS);
+extern Datum veil_save_bitmap_array_image(PG_FUNCTION_ARGS);
+extern Datum veil_map_bitmap_array(PG_FUNCTION_ARGS);
+extern Datum veil_clone_bitmap_array(PG_FUNCTION_ARGS);
 extern Datum veil_init_bitmap_hash(PG_FUNCTION_ARGS);
 extern Datum veil_clear_bitmap_hash(PG_FUNCTION_ARGS);
 extern Datum veil_bitmap_hash_key_exists(PG_FUNCTION_ARGS);
@@ -124,15 +184,67 @@ extern Datum veil_init_int4array(PG_FUNCTION_ARGS);
 extern Datum veil_clear_int4array(PG_FUNCTION_ARGS);
 extern Datum veil_int4array_set(PG_FUNCTION_ARGS);
 extern Datum veil_int4array_get(PG_FUNCTION_ARGS);
+extern Datum veil_int4array_load(PG_FUNCTION_ARGS);
+extern Datum veil_int4array_get_array(PG_FUNCTION_ARGS);
+extern Datum veil_int4array_to_array(PG_FUNCTION_ARGS);
+extern Datum veil_int4array_extend(PG_FUNCTION_ARGS);
 extern Datum veil_init(PG_FUNCTION_ARGS);
 extern Datum veil_perform_reset(PG_FUNCTION_ARGS);
+extern Datum veil_init_async(PG_FUNCTION_ARGS);
 extern Datum veil_force_reset(PG_FUNCTION_ARGS);
 extern Datum veil_version(PG_FUNCTION_ARGS);
 extern Datum veil_serialise(PG_FUNCTION_ARGS);
 extern Datum veil_deserialise(PG_FUNCTION_ARGS);
+extern Datum veil_serialise_bin(PG_FUNCTION_ARGS);
+extern Datum veil_deserialise_bin(PG_FUNCTION_ARGS);
+extern Datum veil_serialise_chunks(PG_FUNCTION_ARGS);
+extern Datum veil_serialise_session(PG_FUNCTION_ARGS);
+extern Datum veil_deserialise_session(PG_FUNCTION_ARGS);
+extern Datum veil_cache_session(PG_FUNCTION_ARGS);
+extern Datum veil_restore_cached_session(PG_FUNCTION_ARGS);
+extern Datum veil_uncache_session(PG_FUNCTION_ARGS);
+extern Datum veil_save_shared_snapshot(PG_FUNCTION_ARGS);
+extern Datum veil_maintain_bitmap_array(PG_FUNCTION_ARGS);
+extern Datum veil_maintain_int4_array(PG_FUNCTION_ARGS);
 
 
 /* veil_serialise */
 extern char *vl_serialise_var(char *name);
-extern int32 vl_deserialise(char **p_stream);
+extern int32 vl_deserialise(char **p_stream, int32 len);
 extern VarEntry *vl_deserialise_next(char **p_stream);
+extern bytea *vl_serialise_var_bin(char *name);
+extern int32 vl_deserialise_bin(char *data, int32 len);
+extern bool vl_start_chunk_scan(ChunkScan *scan, char *name, 
+								int32 chunk_size);
+extern bytea *vl_next_chunk(ChunkScan *scan);
+extern bytea *vl_serialise_session(text *pattern, VarScope scope, 
+								   int32 *p_count);
+extern char *vl_unserialisable_variable(text *pattern, VarScope scope);
+extern int32 vl_deserialise_session(char *data, int32 len, bool shared);
+
+/* veil_cache */
+extern Size vl_session_cache_size(void);
+extern void vl_session_cache_request(void);
+extern int32 vl_cache_session(int32 principal, text *pattern);
+extern int32 vl_restore_cached_session(int32 principal);
+extern bool vl_uncache_session(int32 principal);
+
+/* veil_async */
+extern bool vl_start_async_init(void);
+extern bool vl_async_init_pending(void);
+extern bool vl_finish_async_init(void);
+extern PGDLLEXPORT void vl_async_init_worker(Datum main_arg);
+
+/* veil_maintain */
+struct TriggerData;
+extern void vl_maintain_request(void);
+extern void vl_queue_trigger_changes(struct TriggerData *trigdata,
+									 ObjType type, char *fn_name);
+
+/* veil_snapshot */
+extern int32 vl_save_shared_snapshot(void);
+extern bool vl_load_shared_snapshot(void);
+extern int32 vl_SaveBitmapArrayImage(BitmapArray *bmarray, char *filename);
+extern void vl_NewMappedBitmapArray(MappedBitmapArray **p_mapped, 
+									bool shared, char *filename);
+extern BitmapArray *vl_MappedBitmapArray(MappedBitmapArray *mapped);
@@ -13,10 +13,15 @@
 
 #include "postgres.h"
 #include "access/xact.h"
+#include "catalog/pg_type.h"
+#include "commands/trigger.h"
 #include "executor/spi.h"
 #include "funcapi.h"
+#include "miscadmin.h"
+#include "utils/array.h"
 #include "utils/hsearch.h"
 #include "utils/memutils.h"
+#include "utils/tuplestore.h"
 
 #include "veil_version.h"
 #include "veil_funcs.h"
@@ -133,25 +138,244 @@ strfrombool(bool val)
     return new;
 }
 
+/** 
+ * Prepare to return the result of a set returning function in
+ * materialize mode.  The result set is built in a single call into a
+ * tuplestore, rather than one row per call, which avoids the per-row
+ * overhead of the value-per-call protocol and means that no scan
+ * state needs to be kept between calls.
+ * 
+ * @param fcinfo The function call info of the set returning function.
+ * @param p_tupdesc Pointer to the tuple descriptor for the result rows.
+ * On return this will point to the copy of the descriptor that has been
+ * registered with the result set, which should be used when adding
+ * rows to the tuplestore.
+ * @return The empty tuplestore into which result rows should be put.
+ */
+static Tuplestorestate *
+materialise_result(FunctionCallInfo fcinfo, TupleDesc *p_tupdesc)
+{
+    ReturnSetInfo   *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+    MemoryContext    oldcontext;
+    Tuplestorestate *tupstore;
+
+    if (!rsinfo || !IsA(rsinfo, ReturnSetInfo)) {
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that "
+						"cannot accept a set")));
+    }
+    if (!(rsinfo->allowedModes & SFRM_Materialize)) {
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not "
+						"allowed in this context")));
+    }
+
+    oldcontext = MemoryContextSwitchTo(
+		rsinfo->econtext->ecxt_per_query_memory);
+    *p_tupdesc = CreateTupleDescCopy(*p_tupdesc);
+    tupstore = tuplestore_begin_heap(
+		(rsinfo->allowedModes & SFRM_Materialize_Random) != 0,
+		false, work_mem);
+    MemoryContextSwitchTo(oldcontext);
+
+    rsinfo->returnMode = SFRM_Materialize;
+    rsinfo->setResult = tupstore;
+    rsinfo->setDesc = *p_tupdesc;
+
+    return tupstore;
+}
+
+/** 
+ * Create a tuple descriptor for the single column result rows of a
+ * set returning function that returns a set of a scalar type.
+ * 
+ * @param type The type oid of the result column.
+ * @return The new tuple descriptor.
+ */
+static TupleDesc
+scalar_tupdesc(Oid type)
+{
+    TupleDesc tupdesc = CreateTemplateTupleDesc(1, false);
+
+    TupleDescInitEntry(tupdesc, (AttrNumber) 1, "result", type, -1, 0);
+    return tupdesc;
+}
+
+/** 
+ * Return the set of bits in a ::Bitmap, as a materialized result set.
+ * 
+ * @param fcinfo The function call info of the set returning function.
+ * @param bitmap The ::Bitmap whose bits are to be returned, or NULL if
+ * an empty set is to be returned.
+ * @return Dummy datum, as the result set is returned via fcinfo.
+ */
+static Datum
+materialise_bits(FunctionCallInfo fcinfo, Bitmap *bitmap)
+{
+    TupleDesc        tupdesc = scalar_tupdesc(INT4OID);
+    Tuplestorestate *tupstore = materialise_result(fcinfo, &tupdesc);
+    Datum  values[1];
+    bool   nulls[1] = {false};
+    bool   found;
+    int32  bit;
+
+    if (!bitmap) {
+        return (Datum) 0;
+    }
+
+    bit = bitmap->bitzero;
+    for (;;) {
+        bit = vl_BitmapNextBit(bitmap, bit, &found);
+        if (!found) {
+            break;
+        }
+        values[0] = Int32GetDatum(bit);
+        tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+        if (bit == bitmap->bitmax) {
+            break;
+        }
+        bit++;
+    }
+
+    return (Datum) 0;
+}
+
+/**
+ * Whether session initialisation has been performed, or is not
+ * required, for this session.
+ */
+static bool session_initialised = false;
+
+/** 
+ * Record that this session needs no initialisation.  This is used by
+ * background workers which run init functions on behalf of another
+ * backend: they must not run veil_init() for themselves.
+ */
+void
+vl_skip_session_init()
+{
+	session_initialised = true;
+}
+
+/**
+ * Whether the call of veil_init() for this session has been deferred,
+ * because veil.lazy_init is on, and has not yet been made.
+ */
+static bool init_deferred = false;
+
+/**
+ * The maximum depth to which the initialisers of variables, called by
+ * vl_init_variable(), may be nested.
+ */
+#define MAX_INIT_DEPTH 16
+
+/**
+ * The names of the variables whose initialisers are currently being
+ * executed by vl_init_variable().
+ */
+static char *initialising[MAX_INIT_DEPTH];
+
+/**
+ * The number of entries in use in initialising.
+ */
+static int init_depth = 0;
+
+/**
+ * The generation of shared memory (see vl_shared_generation()) from
+ * which this session's derived session variables were built.  This is
+ * only tracked once session initialisation has been performed.
+ */
+static uint32 session_generation = 0;
+
+/**
+ * Whether session_generation is being tracked.
+ */
+static bool tracking_generation = false;
+
+/**
+ * The names of derived session variables that have not been rebuilt
+ * since the shared variables from which they were derived were reset.
+ * See mark_derived_stale().
+ */
+static List *stale_vars = NIL;
+
+/** 
+ * Call veil_init(FALSE) to initialise the session.  The caller must
+ * have established an SPI connection.
+ */
+static void
+call_veil_init()
+{
+    bool  success = false;
+
+	(void) vl_bool_from_query("select veil.veil_init(FALSE)", &success);
+
+	if (!success) {
+		ereport(ERROR,
+				(errcode(ERRCODE_INTERNAL_ERROR),
+				 errmsg("failed to initialise session (2)"),
+				 errdetail("veil_init() did not return true.")));
+	}
+}
+
+/** 
+ * Record that the derived session variables, registered in
+ * veil.veil_derived_variables, have been made stale by a reset of the
+ * shared variables.  Each is rebuilt, by vl_rebuild_variable(), the
+ * next time that it is used.
+ */
+static void
+mark_derived_stale()
+{
+	bool pushed;
+	int  ok;
+
+	session_generation = vl_shared_generation();
+
+    ok = vl_spi_connect(&pushed);
+    if (ok != SPI_OK_CONNECT) {
+		ereport(ERROR,
+				(errcode(ERRCODE_INTERNAL_ERROR),
+				 errmsg("failed to check derived variables (1)"),
+				 errdetail("SPI_connect() failed, returning %d.", ok)));
+	}
+
+	list_free_deep(stale_vars);
+	stale_vars = NIL;
+	stale_vars = vl_derived_variables();
+
+	ok = vl_spi_finish(pushed);
+	if (ok != SPI_OK_FINISH) {
+		ereport(ERROR,
+				(errcode(ERRCODE_INTERNAL_ERROR),
+				 errmsg("failed to check derived variables (2)"),
+				 errdetail("SPI_finish() failed, returning %d.", ok)));
+	}
+}
+
 /** 
  * Perform session initialisation once for the session.  This calls the
  * user-defined function veil_init which should create and possibly
  * initialise all session and, maybe, shared variables.  This function
  * may be safely called any number of times - it will only perform the
- * initialisation on the first call.
+ * initialisation on the first call.  If veil.lazy_init is on, the call
+ * of veil_init is deferred, and variables are instead initialised as
+ * they are first used by vl_init_variable().  If veil_init_async() has
+ * been called, the session variables built by its background worker
+ * are restored instead.
  * 
  */
 static void
 ensure_init()
 {
-    bool  success = false;
 	TransactionId this_xid;
     int   ok;
 	bool pushed;
-    static bool done = false;
 	static TransactionId xid = 0;
 
-    if (!done) {
+    if (!session_initialised) {
 		this_xid =  GetCurrentTransactionId();
 		if (xid == this_xid) {
 			/* We must have been called recursively, so just return */
@@ -167,14 +391,21 @@ ensure_init()
         }
 
 		(void) vl_get_shared_hash();  /* Init all shared memory constructs */
-        (void) vl_bool_from_query("select veil.veil_init(FALSE)", &success);
-
-        if (!success) {
-			ereport(ERROR,
-					(errcode(ERRCODE_INTERNAL_ERROR),
-					 errmsg("failed to initialise session (2)"),
-					 errdetail("veil_init() did not return true.")));
-        }
+		(void) vl_load_shared_snapshot();
+		if (vl_async_init_pending()) {
+			/* A background worker has been building our session
+			 * variables: wait for it if necessary, and fall back to
+			 * doing the job ourselves if it failed. */
+			if (!vl_finish_async_init()) {
+				call_veil_init();
+			}
+		}
+		else if (veil_lazy_init()) {
+			init_deferred = true;
+		}
+		else {
+			call_veil_init();
+		}
         
         ok = vl_spi_finish(pushed);
         if (ok != SPI_OK_FINISH) {
@@ -183,8 +414,178 @@ ensure_init()
 					 errmsg("failed to initialise session (3)"),
 					 errdetail("SPI_finish() failed, returning %d.", ok)));
         }
-        done = true;	/* init is done, we don't need to do it again. */
+        session_initialised = true;	/* init is done, we don't need to 
+									 * do it again. */
+		session_generation = vl_shared_generation();
+		tracking_generation = true;
     }
+	else if (tracking_generation &&
+			 (vl_shared_generation() != session_generation)) {
+		/* Shared variables have been reset since our derived session
+		 * variables were built. */
+		mark_derived_stale();
+	}
+}
+
+/** 
+ * Initialise a variable that has not yet been defined in this session,
+ * when session initialisation has been deferred by veil.lazy_init.  If
+ * an initialiser for the variable is registered in
+ * veil.veil_variable_init_fns, only that function is called.
+ * Otherwise, unless we are already within an initialiser, the deferred
+ * call of veil_init() is made.  An initialiser may itself use other
+ * variables, whose initialisers will be called in turn, but references
+ * to a variable from within its own initialiser simply define it.
+ * 
+ * @param name The name of the undefined variable.
+ * 
+ * @return true if an initialiser, or veil_init(), has been called so
+ * that the caller should look for the variable again.
+ */
+bool
+vl_init_variable(char *name)
+{
+	bool  pushed;
+	bool  done;
+	int   depth = init_depth;
+	int   ok;
+	int   i;
+
+	if (!init_deferred) {
+		return false;
+	}
+
+	for (i = 0; i < init_depth; i++) {
+		if (strcmp(initialising[i], name) == 0) {
+			return false;
+		}
+	}
+
+	if (init_depth == MAX_INIT_DEPTH) {
+		ereport(ERROR,
+				(errcode(ERRCODE_INTERNAL_ERROR),
+				 errmsg("cannot initialise variable %s", name),
+				 errdetail("Variable initialisers are nested more than "
+						   "%d deep.", MAX_INIT_DEPTH)));
+	}
+
+	ok = vl_spi_connect(&pushed);
+	if (ok != SPI_OK_CONNECT) {
+		ereport(ERROR,
+				(errcode(ERRCODE_INTERNAL_ERROR),
+				 errmsg("failed to initialise variable %s (1)", name),
+				 errdetail("SPI_connect() failed, returning %d.", ok)));
+	}
+
+	initialising[init_depth++] = name;
+	PG_TRY();
+	{
+		done = vl_call_variable_init_fn(name);
+		if (!done && (depth == 0)) {
+			/* No initialiser is registered for this variable, so fall
+			 * back to initialising the whole session. */
+			init_deferred = false;
+			call_veil_init();
+			done = true;
+		}
+	}
+	PG_CATCH();
+	{
+		init_depth = depth;
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+	init_depth = depth;
+
+	ok = vl_spi_finish(pushed);
+	if (ok != SPI_OK_FINISH) {
+		ereport(ERROR,
+				(errcode(ERRCODE_INTERNAL_ERROR),
+				 errmsg("failed to initialise variable %s (2)", name),
+				 errdetail("SPI_finish() failed, returning %d.", ok)));
+	}
+	return done;
+}
+
+/** 
+ * Rebuild a derived session variable, if it has been made stale by a
+ * reset of shared variables since it was last built.  The variable is
+ * rebuilt by its initialiser, registered in
+ * veil.veil_variable_init_fns, or if there is none, by calling
+ * veil_init(), which rebuilds all session variables.  If the rebuild
+ * fails, the variable remains stale, so that it will be rebuilt again
+ * when it is next used.
+ * 
+ * @param name The name of the session variable.
+ * 
+ * @return true if the variable has been rebuilt.
+ */
+bool
+vl_rebuild_variable(char *name)
+{
+	ListCell     *cell;
+	char         *stale = NULL;
+	List *volatile rebuilt = NIL;  /* Modified within PG_TRY */
+	bool          pushed;
+	int           ok;
+	MemoryContext oldcxt;
+
+	if (!stale_vars) {
+		return false;
+	}
+
+	foreach (cell, stale_vars) {
+		if (strcmp((char *) lfirst(cell), name) == 0) {
+			stale = (char *) lfirst(cell);
+			break;
+		}
+	}
+	if (!stale) {
+		return false;
+	}
+
+	ok = vl_spi_connect(&pushed);
+	if (ok != SPI_OK_CONNECT) {
+		ereport(ERROR,
+				(errcode(ERRCODE_INTERNAL_ERROR),
+				 errmsg("failed to rebuild variable %s (1)", name),
+				 errdetail("SPI_connect() failed, returning %d.", ok)));
+	}
+
+	/* Remove the variable from the list first, so that its initialiser
+	 * may refer to it. */
+	stale_vars = list_delete_ptr(stale_vars, stale);
+	PG_TRY();
+	{
+		if (!vl_call_variable_init_fn(name)) {
+			/* veil_init() rebuilds every variable, so none is stale
+			 * any longer.  Clearing the list first stops each variable
+			 * that veil_init() uses from recursively calling it
+			 * again. */
+			rebuilt = stale_vars;
+			stale_vars = NIL;
+			call_veil_init();
+		}
+	}
+	PG_CATCH();
+	{
+		oldcxt = MemoryContextSwitchTo(TopMemoryContext);
+		stale_vars = lappend(list_concat(rebuilt, stale_vars), stale);
+		MemoryContextSwitchTo(oldcxt);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+	list_free_deep(rebuilt);
+	pfree(stale);
+
+	ok = vl_spi_finish(pushed);
+	if (ok != SPI_OK_FINISH) {
+		ereport(ERROR,
+				(errcode(ERRCODE_INTERNAL_ERROR),
+				 errmsg("failed to rebuild variable %s (2)", name),
+				 errdetail("SPI_finish() failed, returning %d.", ok)));
+	}
+	return true;
 }
 
 /** 
@@ -290,7 +691,8 @@ GetRange(char *name,
  * @param allow_empty Whether to raise an error if the variable has not
  * yet been initialised.
  * @param allow_ref Whether to (not) raise an error if the variable is a
- * bitmap_ref rather than a bitmap.
+ * bitmap_ref, or bitmap clone, rather than a bitmap.  A clone is copied
+ * into session memory, so that the caller may update it.
  * @return Pointer to the variable or null if the variable is undefined 
  * and allow_empty was true.
  */
@@ -318,6 +720,11 @@ GetBitmapFromVar(VarEntry *var,
 									 "veil_init().")));
 				}
 			}
+			else if (allow_ref && (bitmap->type == OBJ_BITMAP_CLONE) &&
+					 (((BitmapClone *) bitmap)->source_type == OBJ_BITMAP)) {
+				bitmap = vl_ClonedBitmap((BitmapClone *) bitmap, 
+										 var->key, true);
+			}
 			else {
 				vl_type_mismatch(var->key, OBJ_BITMAP, bitmap->type);
 			}
@@ -358,6 +765,27 @@ GetBitmap(char *name,
 	return bitmap;
 }
 
+/** 
+ * Return the Bitmap matching the name parameter, for read-only use.
+ * This is as GetBitmap(), allowing bitmap refs, except that a clone
+ * that has not yet been updated returns the Bitmap from which it was
+ * cloned, which must not be modified.
+ * 
+ * @param name The name of the variable.
+ * @return Pointer to the Bitmap.
+ */
+static Bitmap *
+GetReadableBitmap(char *name)
+{
+    VarEntry *var = vl_lookup_variable(name);
+
+	if (var->obj && (var->obj->type == OBJ_BITMAP_CLONE) &&
+		(((BitmapClone *) var->obj)->source_type == OBJ_BITMAP)) {
+		return vl_ClonedBitmap((BitmapClone *) var->obj, name, false);
+	}
+	return GetBitmapFromVar(var, false, true);
+}
+
 /** 
  * Return the BitmapRef from a bitmap ref variable.  This function exists
  * primarily to perform type checking, and to raise an error if the
@@ -449,27 +877,61 @@ GetBitmapArrayFromVar(VarEntry *var,
 }
 
 /** 
- * Return the BitmapArray matching the name parameter, possibly creating
- * the (VarEntry) variable.  Raise an error if the named variable
- * already exists and is of the wrong type.
+ * Return the BitmapArray matching the name parameter, for read-only
+ * use.  This is as GetBitmapArrayFromVar() except that the variable
+ * may also be a mapped bitmap array, or a clone of a bitmap array, in
+ * which case the BitmapArray returned is this session's view of the
+ * mapped image or clone, and must not be modified.
  * 
  * @param name The name of the variable.
- * @param allow_empty Whether to raise an error if the variable has not
- * been defined
- * @return Pointer to the variable or null if the variable does not
- * exist and create was false.
+ * @return Pointer to the BitmapArray.
  */
 static BitmapArray *
-GetBitmapArray(char *name,
-               bool allow_empty)
+GetReadableBitmapArray(char *name)
 {
-    VarEntry    *var;
-    BitmapArray *bmarray;
+    VarEntry *var = vl_lookup_variable(name);
 
-    var = vl_lookup_variable(name);
-    bmarray = GetBitmapArrayFromVar(var, allow_empty);
+	if (var->obj && (var->obj->type == OBJ_MAPPED_BITMAP_ARRAY)) {
+		return vl_MappedBitmapArray((MappedBitmapArray *) var->obj);
+	}
+	if (var->obj && (var->obj->type == OBJ_BITMAP_CLONE) &&
+		(((BitmapClone *) var->obj)->source_type == OBJ_BITMAP_ARRAY)) {
+		return vl_ClonedBitmapArray((BitmapClone *) var->obj, name);
+	}
+	return GetBitmapArrayFromVar(var, false);
+}
+
+/** 
+ * Return an element of the BitmapArray matching the name parameter,
+ * for update.  For a clone of a bitmap array, the element's Bitmap is
+ * copied into session memory if it has not been already.
+ * 
+ * @param name The name of the variable.
+ * @param elem The index of the element.
+ * @param create Whether to create the element's Bitmap, if the array
+ * is sparse and it does not yet exist.
+ * @param p_bmarray Pointer to receive the BitmapArray, for error
+ * reporting.
+ * @return Pointer to the element's Bitmap, or NULL if elem is out of
+ * range or does not exist.
+ */
+static Bitmap *
+GetBitmapFromArrayForUpdate(char *name, int32 elem, bool create,
+							BitmapArray **p_bmarray)
+{
+    VarEntry    *var = vl_lookup_variable(name);
+	BitmapClone *clone = (BitmapClone *) var->obj;
 
-	return bmarray;
+	if (clone && (clone->type == OBJ_BITMAP_CLONE) &&
+		(clone->source_type == OBJ_BITMAP_ARRAY)) {
+		*p_bmarray = vl_ClonedBitmapArray(clone, name);
+		return vl_ClonedArrayBitmap(clone, name, elem);
+	}
+	*p_bmarray = GetBitmapArrayFromVar(var, false);
+	if (create) {
+		return vl_AddBitmapToArray(*p_bmarray, elem);
+	}
+	return vl_BitmapFromArray(*p_bmarray, elem);
 }
 
 /** 
@@ -596,56 +1058,30 @@ PG_FUNCTION_INFO_V1(veil_variables);
 Datum
 veil_variables(PG_FUNCTION_ARGS)
 {
-    TupleDesc tupdesc;
-    TupleTableSlot *slot;
-    AttInMetadata *attinmeta;
-    FuncCallContext *funcctx;
-
+    TupleDesc        tupdesc;
+    Tuplestorestate *tupstore;
+    AttInMetadata   *attinmeta;
+    VarScan          scan;
     veil_variable_t *var;
-    char **values;
+    char  *values[3];
     HeapTuple tuple;
-    Datum datum;
 
-    if (SRF_IS_FIRSTCALL())
-    {
-        /* Only do this on first call for this result set */
-        MemoryContext   oldcontext;
-
-        ensure_init();
-        funcctx = SRF_FIRSTCALL_INIT();
-        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
-
-        tupdesc = RelationNameGetTupleDesc("veil.veil_variable_t");
-        slot = TupleDescGetSlot(tupdesc);
-        funcctx->slot = slot;
-        attinmeta = TupleDescGetAttInMetadata(tupdesc);
-        funcctx->attinmeta = attinmeta;
-
-        MemoryContextSwitchTo(oldcontext);
-		funcctx->user_fctx = NULL;
-    }
-    
-    funcctx = SRF_PERCALL_SETUP();
-    var = vl_next_variable(funcctx->user_fctx);
-    funcctx->user_fctx = var;
+    ensure_init();
+    tupdesc = RelationNameGetTupleDesc("veil.veil_variable_t");
+    tupstore = materialise_result(fcinfo, &tupdesc);
+    attinmeta = TupleDescGetAttInMetadata(tupdesc);
 
-    if (var) {
-        values = (char **) palloc(3 * sizeof(char *));
+    vl_start_variable_scan(&scan);
+    while ((var = vl_next_variable(&scan))) {
         values[0] = copystr(var->name);
         values[1] = copystr(var->type);
         values[2] = strfrombool(var->shared);
 
-        slot = funcctx->slot;
-        attinmeta = funcctx->attinmeta;
-        
         tuple = BuildTupleFromCStrings(attinmeta, values);
-        datum = TupleGetDatum(slot, tuple);
-        SRF_RETURN_NEXT(funcctx, datum);
-
-    }
-    else {
-        SRF_RETURN_DONE(funcctx);
+        tuplestore_puttuple(tupstore, tuple);
     }
+
+    return (Datum) 0;
 }
 
 PG_FUNCTION_INFO_V1(veil_share);
@@ -939,7 +1375,7 @@ veil_bitmap_testbit(PG_FUNCTION_ARGS)
 
     bit = PG_GETARG_INT32(1);
     name = strfromtext(PG_GETARG_TEXT_P(0));
-    bitmap = GetBitmap(name, false, true);
+    bitmap = GetReadableBitmap(name);
 
     result = vl_BitmapTestbit(bitmap, bit);
     PG_RETURN_BOOL(result);
@@ -972,7 +1408,7 @@ veil_bitmap_union(PG_FUNCTION_ARGS)
     bitmap1_name = strfromtext(PG_GETARG_TEXT_P(0));
     bitmap2_name = strfromtext(PG_GETARG_TEXT_P(1));
     target = GetBitmap(bitmap1_name, false, true);
-    source = GetBitmap(bitmap2_name, false, true);
+    source = GetReadableBitmap(bitmap2_name);
 
 	if (target && source) {
 		vl_BitmapUnion(target, source);
@@ -1008,7 +1444,7 @@ veil_bitmap_intersect(PG_FUNCTION_ARGS)
     bitmap1_name = strfromtext(PG_GETARG_TEXT_P(0));
     bitmap2_name = strfromtext(PG_GETARG_TEXT_P(1));
     target = GetBitmap(bitmap1_name, false, true);
-    source = GetBitmap(bitmap2_name, false, true);
+    source = GetReadableBitmap(bitmap2_name);
 
 	vl_BitmapIntersect(target, source);
     PG_RETURN_BOOL(true);
@@ -1027,55 +1463,24 @@ PG_FUNCTION_INFO_V1(veil_bitmap_bits);
 Datum
 veil_bitmap_bits(PG_FUNCTION_ARGS)
 {
-	struct bitmap_bits_state {
-		Bitmap *bitmap;
-		int32   bit;
-	} *state;
-    FuncCallContext *funcctx;
-	MemoryContext    oldcontext;
-    char  *name;
-    bool   found;
-    Datum  datum;
+    char   *name;
+    Bitmap *bitmap;
     
-    if (SRF_IS_FIRSTCALL())
-    {
-        /* Only do this on first call for this result set */
-        ensure_init();
-
-        funcctx = SRF_FIRSTCALL_INIT();
-		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
-		state = palloc(sizeof(struct bitmap_bits_state));
-        MemoryContextSwitchTo(oldcontext);
-
-        name = strfromtext(PG_GETARG_TEXT_P(0));
-        state->bitmap = GetBitmap(name, false, true);
+    ensure_init();
 
-        if (!state->bitmap) {
-			ereport(ERROR,
-					(errcode(ERRCODE_INTERNAL_ERROR),
-					 errmsg("Bitmap %s is not defined",
-							name),
-					 errhint("Perhaps the name is mis-spelled, or its "
-							 "definition is missing from veil_init().")));
-        }
+    name = strfromtext(PG_GETARG_TEXT_P(0));
+    bitmap = GetReadableBitmap(name);
 
-        state->bit = state->bitmap->bitzero;
-		funcctx->user_fctx = state;
-    }
-    
-    funcctx = SRF_PERCALL_SETUP();
-	state = funcctx->user_fctx;
-    
-    state->bit = vl_BitmapNextBit(state->bitmap, state->bit, &found);
-    
-    if (found) {
-        datum = Int32GetDatum(state->bit);
-        state->bit++;
-        SRF_RETURN_NEXT(funcctx, datum);
-    }
-    else {
-        SRF_RETURN_DONE(funcctx);
+    if (!bitmap) {
+		ereport(ERROR,
+				(errcode(ERRCODE_INTERNAL_ERROR),
+				 errmsg("Bitmap %s is not defined",
+						name),
+				 errhint("Perhaps the name is mis-spelled, or its "
+						 "definition is missing from veil_init().")));
     }
+
+    return materialise_bits(fcinfo, bitmap);
 }
 
 PG_FUNCTION_INFO_V1(veil_bitmap_range);
@@ -1097,7 +1502,7 @@ veil_bitmap_range(PG_FUNCTION_ARGS)
     ensure_init();
 
     name = strfromtext(PG_GETARG_TEXT_P(0));
-    bitmap = GetBitmap(name, false, true);
+    bitmap = GetReadableBitmap(name);
 
     if (!bitmap) {
 		ereport(ERROR,
@@ -1111,25 +1516,142 @@ veil_bitmap_range(PG_FUNCTION_ARGS)
 }
 
 
-PG_FUNCTION_INFO_V1(veil_init_bitmap_array);
 /** 
- * <code>veil_init_bitmap_array(text, text, text) returns bool</code>
- * Create or reset a BitmapArray.
- * An error will be raised if any parameter is not of the correct type.
+ * Raise an error if a shared variable is being extended other than by
+ * an init function.  Extending may allocate a new copy of the variable
+ * in shared memory, which cannot be freed, and must not be swapped
+ * into place while other sessions may be reading the old copy, or after
+ * pending maintenance has been resolved against it.
  *
- * @param fcinfo <code>bmarray text</code> The name of the bitmap array.
- * <br><code>array_range text</code> Name of the Range variable that
- * provides the range of the array part of the bitmap array.
- * <br><code>bitmap_range text</code> Name of the Range variable that
- * provides the range of each bitmap in the array.
+ * @param var The VarEntry of the variable being extended.
+ */
+static void
+check_extend_allowed(VarEntry *var)
+{
+	if (var->shared && !vl_in_init()) {
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("cannot extend shared variable %s", var->key),
+				 errdetail("Shared variables may only be extended by "
+						   "init functions."),
+				 errhint("Extend the variable from a function registered "
+						 "in veil.veil_init_fns.")));
+	}
+}
+
+PG_FUNCTION_INFO_V1(veil_bitmap_extend);
+/** 
+ * <code>veil_bitmap_extend(name text, newmax int4) returns bool</code>
+ * Extend a Bitmap so that it can store bits up to newmax, preserving
+ * its existing bits.  This allows new bits (eg for newly created
+ * privileges) to be added without re-initialising the Bitmap.  A
+ * Bitmap is never shrunk by this function.
+ *
+ * An error will be raised if the variable is not a Bitmap, or if it is
+ * a shared Bitmap and we are not running an init function.
+ *
+ * @param fcinfo <code>name text</code> The name of the bitmap.
+ * <br><code>newmax int4</code> The new largest bit for the bitmap.
  * @return <code>bool</code>  True
  */
 Datum
-veil_init_bitmap_array(PG_FUNCTION_ARGS)
+veil_bitmap_extend(PG_FUNCTION_ARGS)
 {
-    char        *bmarray_name;
-    char        *arrayrange_name;
-    char        *maprange_name;
+    char     *name;
+    VarEntry *var;
+    Bitmap   *bitmap;
+    int32     newmax;
+
+    ensure_init();
+
+    name = strfromtext(PG_GETARG_TEXT_P(0));
+    newmax = PG_GETARG_INT32(1);
+    var = vl_lookup_variable(name);
+    bitmap = GetBitmapFromVar(var, false, false);
+	check_extend_allowed(var);
+
+    vl_BitmapExtend(&bitmap, var->shared, newmax);
+    var->obj = (Object *) bitmap;
+
+    PG_RETURN_BOOL(true);
+}
+
+
+/** 
+ * Create or reset a session variable as a copy-on-write clone of a
+ * shared Bitmap or BitmapArray.  Raise an error if the variable is
+ * shared, or already exists as some other type.
+ *
+ * @param name The name of the clone.
+ * @param type The type of the variable to be cloned.
+ * @param source The name of the shared variable to be cloned.
+ */
+static void
+clone_variable(char *name, ObjType type, char *source)
+{
+    VarEntry    *var = vl_lookup_variable(name);
+	BitmapClone *clone = (BitmapClone *) var->obj;
+
+	if (var->shared) {
+		ereport(ERROR,
+				(errcode(ERRCODE_INTERNAL_ERROR),
+				 errmsg("illegal attempt to define shared clone %s", name),
+				 errhint("Clones may only be defined as session, "
+						 "not shared, variables.")));
+	}
+	if (clone && (clone->type != OBJ_BITMAP_CLONE)) {
+		vl_type_mismatch(name, OBJ_BITMAP_CLONE, clone->type);
+	}
+
+	vl_NewBitmapClone(&clone, name, type, source);
+	var->obj = (Object *) clone;
+}
+
+
+PG_FUNCTION_INFO_V1(veil_clone_bitmap);
+/** 
+ * <code>veil_clone_bitmap(name text, source text) returns bool</code>
+ * Create or reset a session Bitmap as a copy-on-write clone of a shared
+ * Bitmap.  The clone reads from the shared Bitmap until it is first
+ * updated, when a session copy is made.
+ *
+ * An error will be raised if the source is not a shared Bitmap.
+ *
+ * @param fcinfo <code>name text</code> The name of the clone.
+ * <br><code>source text</code> The name of the shared Bitmap.
+ * @return <code>bool</code> True
+ */
+Datum
+veil_clone_bitmap(PG_FUNCTION_ARGS)
+{
+    ensure_init();
+
+	clone_variable(strfromtext(PG_GETARG_TEXT_P(0)), OBJ_BITMAP,
+				   strfromtext(PG_GETARG_TEXT_P(1)));
+
+    PG_RETURN_BOOL(true);
+}
+
+
+PG_FUNCTION_INFO_V1(veil_init_bitmap_array);
+/** 
+ * <code>veil_init_bitmap_array(text, text, text) returns bool</code>
+ * Create or reset a BitmapArray.
+ * An error will be raised if any parameter is not of the correct type.
+ *
+ * @param fcinfo <code>bmarray text</code> The name of the bitmap array.
+ * <br><code>array_range text</code> Name of the Range variable that
+ * provides the range of the array part of the bitmap array.
+ * <br><code>bitmap_range text</code> Name of the Range variable that
+ * provides the range of each bitmap in the array.
+ * @return <code>bool</code>  True
+ */
+Datum
+veil_init_bitmap_array(PG_FUNCTION_ARGS)
+{
+    char        *bmarray_name;
+    char        *arrayrange_name;
+    char        *maprange_name;
     VarEntry    *bmarray_var;
     BitmapArray *bmarray;
     Range       *arrayrange;
@@ -1155,6 +1677,54 @@ veil_init_bitmap_array(PG_FUNCTION_ARGS)
     PG_RETURN_BOOL(true);
 }
 
+PG_FUNCTION_INFO_V1(veil_init_sparse_bitmap_array);
+/** 
+ * <code>veil_init_sparse_bitmap_array(text, text, text) returns bool</code>
+ * Create or reset a sparse BitmapArray.  This behaves exactly like a
+ * BitmapArray created by veil_init_bitmap_array() except that the
+ * Bitmaps within it are only allocated as bits are first set in them.
+ * This makes it suitable for arrays with very wide, but sparsely
+ * populated, index ranges.
+ * An error will be raised if any parameter is not of the correct type.
+ *
+ * @param fcinfo <code>bmarray text</code> The name of the bitmap array.
+ * <br><code>array_range text</code> Name of the Range variable that
+ * provides the range of the array part of the bitmap array.
+ * <br><code>bitmap_range text</code> Name of the Range variable that
+ * provides the range of each bitmap in the array.
+ * @return <code>bool</code>  True
+ */
+Datum
+veil_init_sparse_bitmap_array(PG_FUNCTION_ARGS)
+{
+    char        *bmarray_name;
+    char        *arrayrange_name;
+    char        *maprange_name;
+    VarEntry    *bmarray_var;
+    BitmapArray *bmarray;
+    Range       *arrayrange;
+    Range       *maprange;
+
+    ensure_init();
+
+    bmarray_name = strfromtext(PG_GETARG_TEXT_P(0));
+    bmarray_var = vl_lookup_variable(bmarray_name);
+    bmarray = GetBitmapArrayFromVar(bmarray_var, true);
+
+    arrayrange_name = strfromtext(PG_GETARG_TEXT_P(1));
+    arrayrange = GetRange(arrayrange_name, false);
+    maprange_name = strfromtext(PG_GETARG_TEXT_P(2));
+    maprange = GetRange(maprange_name, false);
+
+    vl_NewSparseBitmapArray(&bmarray, bmarray_var->shared, 
+							arrayrange->min, arrayrange->max,
+							maprange->min, maprange->max);
+
+    bmarray_var->obj = (Object *) bmarray;
+
+    PG_RETURN_BOOL(true);
+}
+
 PG_FUNCTION_INFO_V1(veil_clear_bitmap_array);
 /** 
  * <code>veil_clear_bitmap_array(bmarray text) returns bool</code>
@@ -1182,11 +1752,38 @@ veil_clear_bitmap_array(PG_FUNCTION_ARGS)
     PG_RETURN_BOOL(true);
 }
 
+/** 
+ * Return an empty Bitmap with the bit range of the given BitmapArray,
+ * for use as the referenced bitmap of an unpopulated element of a
+ * sparse BitmapArray.  The bitmap is allocated in
+ * TopTransactionContext as a BitmapRef is only valid for the current
+ * transaction.
+ * 
+ * @param bmarray The BitmapArray whose bit range is required.
+ * @return Pointer to the newly allocated empty Bitmap.
+ */
+static Bitmap *
+EmptyArrayBitmap(BitmapArray *bmarray)
+{
+	int     elems = ARRAYELEMS(bmarray->bitzero, bmarray->bitmax);
+	Bitmap *bitmap;
+
+	bitmap = MemoryContextAllocZero(TopTransactionContext,
+									sizeof(Bitmap) + (sizeof(bm_int) * elems));
+	bitmap->type = OBJ_BITMAP;
+	bitmap->allocated = elems;
+	bitmap->bitzero = bmarray->bitzero;
+	bitmap->bitmax = bmarray->bitmax;
+	return bitmap;
+}
+
 PG_FUNCTION_INFO_V1(veil_bitmap_from_array);
 /** 
  * <code>veil_bitmap_from_array(bmref text, bmarray text, index int4) returns text</code>
  * Place a reference to the specified Bitmap from a BitmapArray into
- * the specified BitmapRef
+ * the specified BitmapRef.  For an unpopulated element of a sparse
+ * BitmapArray, the reference is to an empty bitmap which is not part
+ * of the array: reading an element never allocates it.
  * An error will be raised if any parameter is not of the correct type.
  *
  * @param fcinfo <code>bmref text</code> The name of the BitmapRef into which
@@ -1212,16 +1809,21 @@ veil_bitmap_from_array(PG_FUNCTION_ARGS)
     bmref = GetBitmapRef(bmref_name);
 
     bmarray_name = strfromtext(PG_GETARG_TEXT_P(1));
-    bmarray = GetBitmapArray(bmarray_name, false);
-
 	arrayelem = PG_GETARG_INT32(2);
-    bitmap = vl_BitmapFromArray(bmarray, arrayelem);
+    bitmap = GetBitmapFromArrayForUpdate(bmarray_name, arrayelem, false,
+										 &bmarray);
 	if (!bitmap) {
-		ereport(ERROR,
-			(errcode(ERRCODE_INTERNAL_ERROR),
-			 errmsg("Range error for BitmapArray %s, %d not in %d - %d",
-					bmarray_name, arrayelem,
-					bmarray->arrayzero, bmarray->arraymax)));
+		if ((arrayelem < bmarray->arrayzero) ||
+			(arrayelem > bmarray->arraymax)) {
+			ereport(ERROR,
+				(errcode(ERRCODE_INTERNAL_ERROR),
+				 errmsg("Range error for BitmapArray %s, %d not in %d - %d",
+						bmarray_name, arrayelem,
+						bmarray->arrayzero, bmarray->arraymax)));
+		}
+		/* An unpopulated element of a sparse array.  Reading it must
+		 * not allocate it, so refer to an empty bitmap instead. */
+		bitmap = EmptyArrayBitmap(bmarray);
 	}
 
 	bmref->bitmap = bitmap;
@@ -1256,7 +1858,7 @@ veil_bitmap_array_testbit(PG_FUNCTION_ARGS)
     bit = PG_GETARG_INT32(2);
 
     name = strfromtext(PG_GETARG_TEXT_P(0));
-    bmarray = GetBitmapArray(name, false);
+    bmarray = GetReadableBitmapArray(name);
     
     bitmap = vl_BitmapFromArray(bmarray, arrayelem);
     if (bitmap) {
@@ -1294,9 +1896,7 @@ veil_bitmap_array_setbit(PG_FUNCTION_ARGS)
     arrayelem = PG_GETARG_INT32(1);
     bit = PG_GETARG_INT32(2);
     name = strfromtext(PG_GETARG_TEXT_P(0));
-    bmarray = GetBitmapArray(name, false);
-
-    bitmap = vl_BitmapFromArray(bmarray, arrayelem);
+    bitmap = GetBitmapFromArrayForUpdate(name, arrayelem, true, &bmarray);
     if (bitmap) {
 		vl_BitmapSetbit(bitmap, bit);
         PG_RETURN_BOOL(true);
@@ -1339,13 +1939,17 @@ veil_bitmap_array_clearbit(PG_FUNCTION_ARGS)
     arrayelem = PG_GETARG_INT32(1);
     bit = PG_GETARG_INT32(2);
     name = strfromtext(PG_GETARG_TEXT_P(0));
-    bmarray = GetBitmapArray(name, false);
-
-    bitmap = vl_BitmapFromArray(bmarray, arrayelem);
+    bitmap = GetBitmapFromArrayForUpdate(name, arrayelem, false, &bmarray);
     if (bitmap) {
 		vl_BitmapClearbit(bitmap, bit);
         PG_RETURN_BOOL(true);
     }
+    else if (bmarray->pages && (arrayelem >= bmarray->arrayzero) &&
+			 (arrayelem <= bmarray->arraymax)) {
+		/* An unallocated bitmap in a sparse array: the bit is already
+		 * clear. */
+        PG_RETURN_BOOL(true);
+    }
     else {
 		ereport(ERROR,
 				(errcode(ERRCODE_INTERNAL_ERROR),
@@ -1389,7 +1993,7 @@ veil_union_from_bitmap_array(PG_FUNCTION_ARGS)
     bitmap_name = strfromtext(PG_GETARG_TEXT_P(0));
     bmarray_name = strfromtext(PG_GETARG_TEXT_P(1));
     target = GetBitmap(bitmap_name, false, true);
-    bmarray = GetBitmapArray(bmarray_name, false);
+    bmarray = GetReadableBitmapArray(bmarray_name);
 
     bitmap = vl_BitmapFromArray(bmarray, arrayelem);
     if (bitmap) {
@@ -1430,12 +2034,17 @@ veil_intersect_from_bitmap_array(PG_FUNCTION_ARGS)
     bitmap_name = strfromtext(PG_GETARG_TEXT_P(0));
     bmarray_name = strfromtext(PG_GETARG_TEXT_P(1));
     target = GetBitmap(bitmap_name, false, true);
-    bmarray = GetBitmapArray(bmarray_name, false);
+    bmarray = GetReadableBitmapArray(bmarray_name);
 
     bitmap = vl_BitmapFromArray(bmarray, arrayelem);
     if (bitmap) {
         vl_BitmapIntersect(target, bitmap);
     }
+    else if (bmarray->pages && (arrayelem >= bmarray->arrayzero) &&
+			 (arrayelem <= bmarray->arraymax)) {
+		/* An unallocated bitmap in a sparse array is empty */
+		vl_ClearBitmap(target);
+    }
     PG_RETURN_BOOL(true);
 }
 
@@ -1454,69 +2063,44 @@ PG_FUNCTION_INFO_V1(veil_bitmap_array_bits);
 Datum
 veil_bitmap_array_bits(PG_FUNCTION_ARGS)
 {
-	struct bitmap_array_bits_state {
-		Bitmap *bitmap;
-		int32   bit;
-	} *state;
-    FuncCallContext *funcctx;
-	MemoryContext    oldcontext;
     char   *name;
-    bool    found;
     BitmapArray *bmarray;
+    Bitmap *bitmap;
     int     arrayelem;
-    Datum   datum;
     
-    if (SRF_IS_FIRSTCALL())
-    {
-        /* Only do this on first call for this result set */
-        ensure_init();
-        
-        funcctx = SRF_FIRSTCALL_INIT();
-		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
-		state = palloc(sizeof(struct bitmap_array_bits_state));
-        MemoryContextSwitchTo(oldcontext);
-
-        name = strfromtext(PG_GETARG_TEXT_P(0));
-        arrayelem = PG_GETARG_INT32(1);
-        bmarray = GetBitmapArray(name, false);
-
-        if (!bmarray) {
-			ereport(ERROR,
-					(errcode(ERRCODE_INTERNAL_ERROR),
-					 errmsg("BitmapArray %s is not defined",
-							name),
-					 errhint("Perhaps the name is mis-spelled, or its "
-							 "definition is missing from "
-							 "veil_init().")));
-        }
+    ensure_init();
 
-        state->bitmap = vl_BitmapFromArray(bmarray, arrayelem);
-        if (!state->bitmap) {
-			ereport(ERROR,
-					(errcode(ERRCODE_INTERNAL_ERROR),
-					 errmsg("Bitmap Array range error (%d not in %d..%d)", 
-							arrayelem, bmarray->arrayzero, bmarray->arraymax),
-					 errdetail("Attempt to reference BitmapArray element "
-							   "outside of the BitmapArray's defined range")));
-        }
+    name = strfromtext(PG_GETARG_TEXT_P(0));
+    arrayelem = PG_GETARG_INT32(1);
+    bmarray = GetReadableBitmapArray(name);
 
-        state->bit = state->bitmap->bitzero;
-		funcctx->user_fctx = state;
+    if (!bmarray) {
+		ereport(ERROR,
+				(errcode(ERRCODE_INTERNAL_ERROR),
+				 errmsg("BitmapArray %s is not defined",
+						name),
+				 errhint("Perhaps the name is mis-spelled, or its "
+						 "definition is missing from "
+						 "veil_init().")));
     }
-    
-    funcctx = SRF_PERCALL_SETUP();
-	state = funcctx->user_fctx;
 
-    state->bit = vl_BitmapNextBit(state->bitmap, state->bit, &found);
-    
-    if (found) {
-        datum = Int32GetDatum(state->bit);
-        state->bit++;
-        SRF_RETURN_NEXT(funcctx, datum);
+    bitmap = vl_BitmapFromArray(bmarray, arrayelem);
+    if ((!bitmap) && bmarray->pages &&
+		(arrayelem >= bmarray->arrayzero) &&
+		(arrayelem <= bmarray->arraymax)) {
+		/* An unallocated bitmap in a sparse array has no bits */
+		return materialise_bits(fcinfo, NULL);
     }
-    else {
-        SRF_RETURN_DONE(funcctx);
+    if (!bitmap) {
+		ereport(ERROR,
+				(errcode(ERRCODE_INTERNAL_ERROR),
+				 errmsg("Bitmap Array range error (%d not in %d..%d)", 
+						arrayelem, bmarray->arrayzero, bmarray->arraymax),
+				 errdetail("Attempt to reference BitmapArray element "
+						   "outside of the BitmapArray's defined range")));
     }
+
+    return materialise_bits(fcinfo, bitmap);
 }
 
 PG_FUNCTION_INFO_V1(veil_bitmap_array_arange);
@@ -1538,7 +2122,7 @@ veil_bitmap_array_arange(PG_FUNCTION_ARGS)
     ensure_init();
 
     name = strfromtext(PG_GETARG_TEXT_P(0));
-    bmarray = GetBitmapArray(name, false);
+    bmarray = GetReadableBitmapArray(name);
 
     if (!bmarray) {
 		ereport(ERROR,
@@ -1572,7 +2156,7 @@ veil_bitmap_array_brange(PG_FUNCTION_ARGS)
     ensure_init();
 
     name = strfromtext(PG_GETARG_TEXT_P(0));
-    bmarray = GetBitmapArray(name, false);
+    bmarray = GetReadableBitmapArray(name);
 
     if (!bmarray) {
 		ereport(ERROR,
@@ -1587,6 +2171,175 @@ veil_bitmap_array_brange(PG_FUNCTION_ARGS)
 }
 
 
+PG_FUNCTION_INFO_V1(veil_load_bitmap_array);
+/** 
+ * <code>veil_load_bitmap_array(bmarray text, relation regclass, 
+ * row_col name, bit_col name, filter text) returns int4</code>
+ * Set bits in a bitmap array, bitmap hash or bitmap from the rows of a
+ * relation.  For each row, the bit given by <code>bit_col</code> is set
+ * in the bitmap identified by <code>row_col</code>, which is ignored
+ * if the variable is a bitmap.  Rows containing nulls are skipped.  If
+ * <code>relation</code> or <code>bit_col</code> is null, nothing is
+ * loaded and null is returned.
+ *
+ * An error will be raised if the variable is undefined or of the
+ * wrong type, if the relation cannot be read by the current user, or
+ * if any bit or array element is out of range.
+ *
+ * @param fcinfo <code>bmarray text</code> The name of the bitmap array,
+ * bitmap hash or bitmap.
+ * <br><code>relation regclass</code> The relation to be loaded from.
+ * <br><code>row_col name</code> The column identifying the element or
+ * key of each bitmap.
+ * <br><code>bit_col name</code> The column giving the bit to be set.
+ * <br><code>filter text</code> An SQL condition that rows must match,
+ * or null to load from every row.
+ * @return <code>int4</code> The number of bits set.
+ */
+Datum
+veil_load_bitmap_array(PG_FUNCTION_ARGS)
+{
+    char     *name;
+    Oid       relid;
+    char     *row_col = NULL;
+    char     *bit_col;
+    char     *filter = NULL;
+    VarEntry *var;
+    Object   *target;
+
+    ensure_init();
+
+    if (PG_ARGISNULL(0) || PG_ARGISNULL(1) || PG_ARGISNULL(3)) {
+        PG_RETURN_NULL();
+	}
+
+    name = strfromtext(PG_GETARG_TEXT_P(0));
+    relid = PG_GETARG_OID(1);
+    if (!PG_ARGISNULL(2)) {
+        row_col = pstrdup(NameStr(*PG_GETARG_NAME(2)));
+    }
+    bit_col = pstrdup(NameStr(*PG_GETARG_NAME(3)));
+    if (!PG_ARGISNULL(4)) {
+        filter = strfromtext(PG_GETARG_TEXT_P(4));
+    }
+
+    var = vl_lookup_variable(name);
+	if (var->obj && (var->obj->type == OBJ_BITMAP_HASH)) {
+		target = (Object *) GetBitmapHashFromVar(var, false);
+	}
+	else if (var->obj && (var->obj->type != OBJ_BITMAP_ARRAY)) {
+		target = (Object *) GetBitmapFromVar(var, false, true);
+	}
+	else {
+		target = (Object *) GetBitmapArrayFromVar(var, false);
+	}
+
+	if ((target->type != OBJ_BITMAP) && !row_col) {
+		ereport(ERROR,
+				(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+				 errmsg("row_col must be given to load %s", name),
+				 errdetail("Only a bitmap can be loaded without a row "
+						   "column.")));
+	}
+
+    PG_RETURN_INT32(vl_load_bits(target, relid, row_col, bit_col, filter));
+}
+
+
+PG_FUNCTION_INFO_V1(veil_save_bitmap_array_image);
+/** 
+ * <code>veil_save_bitmap_array_image(bmarray text, filename text) returns int4</code>
+ * Save the bitmaps of a BitmapArray as an image file, in the pg_veil
+ * directory, which may later be mapped by veil_map_bitmap_array().
+ *
+ * @param fcinfo <code>bmarray text</code> The name of the bitmap array.
+ * <br><code>filename text</code> The name of the image file.
+ * @return <code>int4</code> The number of bitmaps saved.
+ */
+Datum
+veil_save_bitmap_array_image(PG_FUNCTION_ARGS)
+{
+    char        *name;
+    char        *filename;
+    BitmapArray *bmarray;
+
+    ensure_init();
+
+    name = strfromtext(PG_GETARG_TEXT_P(0));
+    filename = strfromtext(PG_GETARG_TEXT_P(1));
+    bmarray = GetReadableBitmapArray(name);
+
+    PG_RETURN_INT32(vl_SaveBitmapArrayImage(bmarray, filename));
+}
+
+
+PG_FUNCTION_INFO_V1(veil_map_bitmap_array);
+/** 
+ * <code>veil_map_bitmap_array(bmarray text, filename text) returns bool</code>
+ * Create or redefine a read-only bitmap array variable whose bitmaps
+ * are read directly from an image file created by
+ * veil_save_bitmap_array_image().  Each session maps the image into
+ * its own memory when it first reads from the variable.
+ *
+ * An error will be raised if the variable already exists as some other
+ * type, or if the image file is invalid.
+ *
+ * @param fcinfo <code>bmarray text</code> The name of the bitmap array.
+ * <br><code>filename text</code> The name of the image file.
+ * @return <code>bool</code> True
+ */
+Datum
+veil_map_bitmap_array(PG_FUNCTION_ARGS)
+{
+    char              *name;
+    char              *filename;
+    VarEntry          *var;
+    MappedBitmapArray *mapped;
+
+    ensure_init();
+
+    name = strfromtext(PG_GETARG_TEXT_P(0));
+    filename = strfromtext(PG_GETARG_TEXT_P(1));
+    var = vl_lookup_variable(name);
+    mapped = (MappedBitmapArray *) var->obj;
+	if (mapped && (mapped->type != OBJ_MAPPED_BITMAP_ARRAY)) {
+		vl_type_mismatch(name, OBJ_MAPPED_BITMAP_ARRAY, mapped->type);
+	}
+
+    vl_NewMappedBitmapArray(&mapped, var->shared, filename);
+    var->obj = (Object *) mapped;
+
+    PG_RETURN_BOOL(true);
+}
+
+
+PG_FUNCTION_INFO_V1(veil_clone_bitmap_array);
+/** 
+ * <code>veil_clone_bitmap_array(name text, source text) returns bool</code>
+ * Create or reset a session BitmapArray as a copy-on-write clone of a
+ * shared BitmapArray.  Each Bitmap of the clone is read from the shared
+ * BitmapArray until it is first updated, when a session copy of just
+ * that Bitmap is made.
+ *
+ * An error will be raised if the source is not a shared, non-sparse,
+ * BitmapArray.
+ *
+ * @param fcinfo <code>name text</code> The name of the clone.
+ * <br><code>source text</code> The name of the shared BitmapArray.
+ * @return <code>bool</code> True
+ */
+Datum
+veil_clone_bitmap_array(PG_FUNCTION_ARGS)
+{
+    ensure_init();
+
+	clone_variable(strfromtext(PG_GETARG_TEXT_P(0)), OBJ_BITMAP_ARRAY,
+				   strfromtext(PG_GETARG_TEXT_P(1)));
+
+    PG_RETURN_BOOL(true);
+}
+
+
 
 PG_FUNCTION_INFO_V1(veil_init_bitmap_hash);
 /** 
@@ -1873,7 +2626,7 @@ veil_union_into_bitmap_hash(PG_FUNCTION_ARGS)
     hashelem = strfromtext(PG_GETARG_TEXT_P(1));
 
     bitmap_name = strfromtext(PG_GETARG_TEXT_P(2));
-    bitmap = GetBitmap(bitmap_name, false, true);
+    bitmap = GetReadableBitmap(bitmap_name);
     bmhash = GetBitmapHash(bmhash_name, false);
 
     target = vl_AddBitmapToHash(bmhash, hashelem);
@@ -1982,60 +2735,24 @@ PG_FUNCTION_INFO_V1(veil_bitmap_hash_bits);
 Datum
 veil_bitmap_hash_bits(PG_FUNCTION_ARGS)
 {
-	struct bitmap_hash_bits_state {
-		Bitmap *bitmap;
-		int32   bit;
-	} *state;
-    FuncCallContext *funcctx;
-	MemoryContext    oldcontext;
     char   *name;
-    bool    found;
     BitmapHash *bmhash;
     char   *hashelem;
-    Datum   datum;
     
-    if (SRF_IS_FIRSTCALL())
-    {
-        /* Only do this on first call for this result set */
-        ensure_init();
-        
-        funcctx = SRF_FIRSTCALL_INIT();
-		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
-		state = palloc(sizeof(struct bitmap_hash_bits_state));
-        MemoryContextSwitchTo(oldcontext);
-
-        name = strfromtext(PG_GETARG_TEXT_P(0));
-        hashelem = strfromtext(PG_GETARG_TEXT_P(1));
-        bmhash = GetBitmapHash(name, false);
-
-        if (!bmhash) {
-			ereport(ERROR,
-					(errcode(ERRCODE_INTERNAL_ERROR),
-					 errmsg("Bitmap Hash %s not defined", name)));
-        }
+    ensure_init();
 
-        state->bitmap = vl_BitmapFromHash(bmhash, hashelem);
-        if (!state->bitmap) {
-			SRF_RETURN_DONE(funcctx);
-        }
+    name = strfromtext(PG_GETARG_TEXT_P(0));
+    hashelem = strfromtext(PG_GETARG_TEXT_P(1));
+    bmhash = GetBitmapHash(name, false);
 
-        state->bit = state->bitmap->bitzero;
-		funcctx->user_fctx = state;
+    if (!bmhash) {
+		ereport(ERROR,
+				(errcode(ERRCODE_INTERNAL_ERROR),
+				 errmsg("Bitmap Hash %s not defined", name)));
     }
-    
-    funcctx = SRF_PERCALL_SETUP();
-	state = funcctx->user_fctx;
 
-    state->bit = vl_BitmapNextBit(state->bitmap, state->bit, &found);
-    
-    if (found) {
-        datum = Int32GetDatum(state->bit);
-        state->bit++;
-        SRF_RETURN_NEXT(funcctx, datum);
-    }
-    else {
-        SRF_RETURN_DONE(funcctx);
-    }
+    /* A missing key gives an empty set */
+    return materialise_bits(fcinfo, vl_BitmapFromHash(bmhash, hashelem));
 }
 
 PG_FUNCTION_INFO_V1(veil_bitmap_hash_range);
@@ -2080,52 +2797,36 @@ PG_FUNCTION_INFO_V1(veil_bitmap_hash_entries);
 Datum
 veil_bitmap_hash_entries(PG_FUNCTION_ARGS)
 {
-	struct bitmap_hash_entries_state {
-		BitmapHash *bmhash;
-		VarEntry   *var;
-	} *state;
-    FuncCallContext *funcctx;
-	MemoryContext    oldcontext;
+    TupleDesc        tupdesc;
+    Tuplestorestate *tupstore;
+    BitmapHash *bmhash;
+    HASH_SEQ_STATUS status;
+    VarEntry   *var;
     char  *name;
-    Datum  datum;
-    text  *result;
+    Datum  values[1];
+    bool   nulls[1] = {false};
 
-    if (SRF_IS_FIRSTCALL())
-    {
-        /* Only do this on first call for this result set */
-        ensure_init();
-        
-        funcctx = SRF_FIRSTCALL_INIT();
-		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
-		state = palloc(sizeof(struct bitmap_hash_entries_state));
-        MemoryContextSwitchTo(oldcontext);
-
-        name = strfromtext(PG_GETARG_TEXT_P(0));
-        state->bmhash = GetBitmapHash(name, false);
+    ensure_init();
 
-        if (!state->bmhash) {
-			ereport(ERROR,
-					(errcode(ERRCODE_INTERNAL_ERROR),
-					 errmsg("Bitmap Hash %s not defined", name)));
-        }
+    name = strfromtext(PG_GETARG_TEXT_P(0));
+    bmhash = GetBitmapHash(name, false);
 
-        state->var = NULL;
-		funcctx->user_fctx = state;
+    if (!bmhash) {
+		ereport(ERROR,
+				(errcode(ERRCODE_INTERNAL_ERROR),
+				 errmsg("Bitmap Hash %s not defined", name)));
     }
 
-    funcctx = SRF_PERCALL_SETUP();
-	state = funcctx->user_fctx;
+    tupdesc = scalar_tupdesc(TEXTOID);
+    tupstore = materialise_result(fcinfo, &tupdesc);
 
-    state->var = vl_NextHashEntry(state->bmhash->hash, state->var);
-
-    if (state->var) {
-        result = textfromstrn(state->var->key, HASH_KEYLEN);
-        datum = PointerGetDatum(result);
-        SRF_RETURN_NEXT(funcctx, datum);
-    }
-    else {
-        SRF_RETURN_DONE(funcctx);
+    vl_StartHashScan(bmhash->hash, &status);
+    while ((var = vl_NextHashEntry(&status))) {
+        values[0] = PointerGetDatum(textfromstrn(var->key, HASH_KEYLEN));
+        tuplestore_putvalues(tupstore, tupdesc, values, nulls);
     }
+
+    return (Datum) 0;
 }
 
 
@@ -2313,6 +3014,214 @@ veil_int4array_get(PG_FUNCTION_ARGS)
 	PG_RETURN_INT32(value);
 }
 
+/** 
+ * Deconstruct a one-dimensional int4[] value into arrays of Datums and
+ * null flags.  An error is raised if the value is not a suitable
+ * array, or if it contains nulls when these are not allowed.
+ * 
+ * @param array The int4[] value
+ * @param allow_nulls Whether null elements are acceptable
+ * @param p_nulls Pointer to a null flag array that is returned
+ * @param p_count Pointer to the number of elements returned
+ * @return Dynamically allocated array of int4 Datums.
+ */
+static Datum *
+datums_from_int4_array(ArrayType *array, bool allow_nulls,
+					   bool **p_nulls, int *p_count)
+{
+	Datum *elems;
+	int    i;
+
+	if ((ARR_ELEMTYPE(array) != INT4OID) || (ARR_NDIM(array) > 1)) {
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("expected a one-dimensional int4 array")));
+	}
+	deconstruct_array(array, INT4OID, sizeof(int32), true, 'i',
+					  &elems, p_nulls, p_count);
+	if (!allow_nulls) {
+		for (i = 0; i < *p_count; i++) {
+			if ((*p_nulls)[i]) {
+				ereport(ERROR,
+						(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+						 errmsg("Int4Array elements cannot be null")));
+			}
+		}
+	}
+	return elems;
+}
+
+PG_FUNCTION_INFO_V1(veil_int4array_load);
+/** 
+ * <code>veil_int4array_load(array text, idx int4[], vals int4[]) returns int4</code>
+ * Set many Int4Array entries in a single call.  Each element of vals
+ * is placed in the array entry given by the corresponding element of
+ * idx.  
+ *
+ * @param fcinfo <code>array text</code> The name of the Int4Array variable.
+ * <br><code>idx int4[]</code> Indexes of the entries to be set
+ * <br><code>vals int4[]</code> Values to which the entries will be set
+ * @return <code>int4</code> The number of entries set
+ */
+Datum
+veil_int4array_load(PG_FUNCTION_ARGS)
+{
+    char      *array_name;
+    Int4Array *array;
+	Datum     *idx;
+	Datum     *vals;
+	bool      *idx_nulls;
+	bool      *val_nulls;
+	int        idx_count;
+	int        val_count;
+	int        i;
+
+    ensure_init();
+
+    array_name = strfromtext(PG_GETARG_TEXT_P(0));
+	array = GetInt4Array(array_name, false);
+	idx = datums_from_int4_array(PG_GETARG_ARRAYTYPE_P(1), false,
+								 &idx_nulls, &idx_count);
+	vals = datums_from_int4_array(PG_GETARG_ARRAYTYPE_P(2), false,
+								  &val_nulls, &val_count);
+	if (idx_count != val_count) {
+		ereport(ERROR,
+				(errcode(ERRCODE_ARRAY_SUBSCRIPT_ERROR),
+				 errmsg("index and value arrays differ in length"),
+				 errdetail("There are %d indexes and %d values.",
+						   idx_count, val_count)));
+	}
+
+	for (i = 0; i < idx_count; i++) {
+		vl_Int4ArraySet(array, DatumGetInt32(idx[i]), 
+						DatumGetInt32(vals[i]));
+	}
+
+	PG_RETURN_INT32(idx_count);
+}
+
+PG_FUNCTION_INFO_V1(veil_int4array_get_array);
+/** 
+ * <code>veil_int4array_get_array(array text, idx int4[]) returns int4[]</code>
+ * Get many Int4Array entries in a single call.  The result contains
+ * the entry for each element of idx, in the same order.  Null elements
+ * in idx give null results.
+ *
+ * @param fcinfo <code>array text</code> The name of the Int4Array variable.
+ * <br><code>idx int4[]</code> Indexes of the entries to be retrieved
+ * @return <code>int4[]</code> The values of the array entries
+ */
+Datum
+veil_int4array_get_array(PG_FUNCTION_ARGS)
+{
+    char      *array_name;
+    Int4Array *array;
+	ArrayType *idx_array;
+	Datum     *idx;
+	bool      *nulls;
+	int        count;
+	int        dims[1];
+	int        lbs[1];
+	int        i;
+
+    ensure_init();
+
+    array_name = strfromtext(PG_GETARG_TEXT_P(0));
+	array = GetInt4Array(array_name, false);
+	idx_array = PG_GETARG_ARRAYTYPE_P(1);
+	idx = datums_from_int4_array(idx_array, true, &nulls, &count);
+
+	for (i = 0; i < count; i++) {
+		if (!nulls[i]) {
+			idx[i] = Int32GetDatum(vl_Int4ArrayGet(array, 
+												   DatumGetInt32(idx[i])));
+		}
+	}
+
+	if (count == 0) {
+		PG_RETURN_ARRAYTYPE_P(construct_empty_array(INT4OID));
+	}
+	dims[0] = count;
+	lbs[0] = ARR_LBOUND(idx_array)[0];
+	PG_RETURN_ARRAYTYPE_P(construct_md_array(idx, nulls, 1, dims, lbs,
+											 INT4OID, sizeof(int32), 
+											 true, 'i'));
+}
+
+PG_FUNCTION_INFO_V1(veil_int4array_to_array);
+/** 
+ * <code>veil_int4array_to_array(array text) returns int4[]</code>
+ * Return the entire contents of an Int4Array as an SQL array.  The
+ * subscripts of the result match the indexes of the Int4Array.
+ *
+ * @param fcinfo <code>array text</code> The name of the Int4Array variable.
+ * @return <code>int4[]</code> The contents of the Int4Array
+ */
+Datum
+veil_int4array_to_array(PG_FUNCTION_ARGS)
+{
+    char      *array_name;
+    Int4Array *array;
+	Datum     *elems;
+	int        count;
+	int        dims[1];
+	int        lbs[1];
+	int        i;
+
+    ensure_init();
+
+    array_name = strfromtext(PG_GETARG_TEXT_P(0));
+	array = GetInt4Array(array_name, false);
+
+	count = 1 + array->arraymax - array->arrayzero;
+	elems = palloc(sizeof(Datum) * count);
+	for (i = 0; i < count; i++) {
+		elems[i] = Int32GetDatum(array->array[i]);
+	}
+
+	dims[0] = count;
+	lbs[0] = array->arrayzero;
+	PG_RETURN_ARRAYTYPE_P(construct_md_array(elems, NULL, 1, dims, lbs,
+											 INT4OID, sizeof(int32), 
+											 true, 'i'));
+}
+
+PG_FUNCTION_INFO_V1(veil_int4array_extend);
+/** 
+ * <code>veil_int4array_extend(array text, newmax int4) returns bool</code>
+ * Extend an Int4Array so that its highest index becomes newmax,
+ * preserving the values of existing entries.  New entries are zeroed.
+ * An Int4Array is never shrunk by this function.
+ *
+ * An error will be raised if the variable is a shared Int4Array and we
+ * are not running an init function.
+ *
+ * @param fcinfo <code>array text</code> The name of the Int4Array variable.
+ * <br><code>newmax int4</code> The new highest index for the array
+ * @return <code>bool</code>  True
+ */
+Datum
+veil_int4array_extend(PG_FUNCTION_ARGS)
+{
+    char      *array_name;
+    VarEntry  *array_var;
+    Int4Array *array;
+    int32      newmax;
+
+    ensure_init();
+
+    array_name = strfromtext(PG_GETARG_TEXT_P(0));
+    newmax = PG_GETARG_INT32(1);
+    array_var = vl_lookup_variable(array_name);
+	array = GetInt4ArrayFromVar(array_var, false);
+	check_extend_allowed(array_var);
+
+    array = vl_Int4ArrayExtend(array, array_var->shared, newmax);
+	array_var->obj = (Object *) array;
+
+	PG_RETURN_BOOL(true);
+}
+
 
 PG_FUNCTION_INFO_V1(veil_init);
 /** 
@@ -2346,6 +3255,30 @@ veil_init(PG_FUNCTION_ARGS)
     PG_RETURN_BOOL(true);
 }
 
+PG_FUNCTION_INFO_V1(veil_init_async);
+/** 
+ * <code>veil_init_async() returns bool</code>
+ * Start the initialisation of this session in a background worker, so
+ * that it may proceed while the session does other work.  The session
+ * waits for the worker, if it has not yet finished, when it next needs
+ * its session variables: ie on its next call of any other Veil
+ * function.
+ *
+ * @param fcinfo 
+ * @return <code>bool</code> True if a worker has been started.  False
+ * if the session has already been initialised, or no worker could be
+ * started, in which case the session will be initialised as usual.
+ */
+Datum
+veil_init_async(PG_FUNCTION_ARGS)
+{
+	/* Note that ensure_init() is deliberately not called here. */
+	if (session_initialised) {
+		PG_RETURN_BOOL(false);
+	}
+	PG_RETURN_BOOL(vl_start_async_init());
+}
+
 PG_FUNCTION_INFO_V1(veil_perform_reset);
 /** 
  * <code>veil_perform_reset() returns bool</code>
@@ -2402,6 +3335,79 @@ veil_perform_reset(PG_FUNCTION_ARGS)
     PG_RETURN_BOOL(success);
 }
 
+PG_FUNCTION_INFO_V1(veil_save_shared_snapshot);
+/** 
+ * <code>veil_save_shared_snapshot() returns int4</code>
+ * Save all shared variables for this database to a snapshot file, from
+ * which they may be loaded when the database cluster is next started.
+ *
+ * @param fcinfo 
+ * @return <code>int4</code> The number of shared variables saved.
+ */
+Datum
+veil_save_shared_snapshot(PG_FUNCTION_ARGS)
+{
+	ensure_init();
+	PG_RETURN_INT32(vl_save_shared_snapshot());
+}
+
+PG_FUNCTION_INFO_V1(veil_maintain_bitmap_array);
+/** 
+ * <code>veil_maintain_bitmap_array() returns trigger</code>
+ * Trigger function to maintain a shared BitmapArray from the rows of
+ * the table on which the trigger is defined.  The trigger must be
+ * defined as AFTER INSERT OR UPDATE OR DELETE, FOR EACH ROW, with
+ * three arguments: the name of the bitmap array, the name of the
+ * column giving the array element, and the name of the column giving
+ * the bit.  The bits for inserted rows are set, and those of deleted
+ * rows cleared, when the transaction commits.
+ *
+ * @param fcinfo The trigger call context.
+ * @return <code>trigger</code> Null, as for any AFTER trigger.
+ */
+Datum
+veil_maintain_bitmap_array(PG_FUNCTION_ARGS)
+{
+	if (!CALLED_AS_TRIGGER(fcinfo)) {
+		ereport(ERROR,
+				(errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
+				 errmsg("veil_maintain_bitmap_array() must be called "
+						"as a trigger")));
+	}
+	ensure_init();
+	vl_queue_trigger_changes((TriggerData *) fcinfo->context,
+							 OBJ_BITMAP_ARRAY, "veil_maintain_bitmap_array()");
+	return PointerGetDatum(NULL);
+}
+
+PG_FUNCTION_INFO_V1(veil_maintain_int4_array);
+/** 
+ * <code>veil_maintain_int4_array() returns trigger</code>
+ * Trigger function to maintain a shared Int4Array from the rows of the
+ * table on which the trigger is defined.  This is as
+ * veil_maintain_bitmap_array() except that the third argument names
+ * the column giving the value of the array entry.  The entries for
+ * inserted rows are set, and those of deleted rows reset to zero,
+ * when the transaction commits.
+ *
+ * @param fcinfo The trigger call context.
+ * @return <code>trigger</code> Null, as for any AFTER trigger.
+ */
+Datum
+veil_maintain_int4_array(PG_FUNCTION_ARGS)
+{
+	if (!CALLED_AS_TRIGGER(fcinfo)) {
+		ereport(ERROR,
+				(errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
+				 errmsg("veil_maintain_int4_array() must be called "
+						"as a trigger")));
+	}
+	ensure_init();
+	vl_queue_trigger_changes((TriggerData *) fcinfo->context,
+							 OBJ_INT4_ARRAY, "veil_maintain_int4_array()");
+	return PointerGetDatum(NULL);
+}
+
 PG_FUNCTION_INFO_V1(veil_force_reset);
 /** 
  * <code>veil_force_reset() returns bool</code>
@@ -2506,9 +3512,223 @@ veil_deserialise(PG_FUNCTION_ARGS)
 
 	txt = PG_GETARG_TEXT_P(0);
 	stream = strfromtext(txt);
-	result = vl_deserialise(&stream);
+	result = vl_deserialise(&stream, VARSIZE(txt) - VARHDRSZ);
 
 	PG_RETURN_INT32(result);
 }
 
 
+PG_FUNCTION_INFO_V1(veil_serialise_bin);
+/** 
+ * <code>veil_serialise_bin(varname text) returns bytea</code>
+ * Return a compact binary representation of the contents of our
+ * variable.
+ *
+ * @param fcinfo 
+ * <br><code>varname text</code> Name of the variable to be serialised.
+ * @return <code>bytea</code> The serialised variable.
+ */
+Datum
+veil_serialise_bin(PG_FUNCTION_ARGS)
+{
+    char  *name;
+	bytea *result;
+
+    ensure_init();
+
+    name = strfromtext(PG_GETARG_TEXT_P(0));
+	result = vl_serialise_var_bin(name);
+
+	if (result) {
+		PG_RETURN_BYTEA_P(result);
+	}
+	else {
+		PG_RETURN_NULL();
+	}
+}
+
+
+PG_FUNCTION_INFO_V1(veil_deserialise_bin);
+/** 
+ * <code>veil_deserialise_bin(stream bytea) returns int4</code>
+ * Create or reset variables based on the output of previous
+ * veil_serialise_bin calls.  The stream is read in place, without
+ * being copied.
+ *
+ * @param fcinfo 
+ * <br><code>stream bytea</code> Serialised variables
+ * @return <code>int4</code> Count of the items de-serialised from
+ * the stream.
+ */
+Datum
+veil_deserialise_bin(PG_FUNCTION_ARGS)
+{
+	bytea *stream;
+
+    ensure_init();
+
+	stream = PG_GETARG_BYTEA_PP(0);
+	PG_RETURN_INT32(vl_deserialise_bin(VARDATA_ANY(stream),
+									   VARSIZE_ANY_EXHDR(stream)));
+}
+
+
+PG_FUNCTION_INFO_V1(veil_serialise_chunks);
+/** 
+ * <code>veil_serialise_chunks(varname text, chunk_size int4) 
+ *     returns setof bytea</code>
+ * Return the binary representation of a variable as a set of chunks,
+ * each of roughly chunk_size bytes.  Only one chunk is held in memory
+ * at a time, so very large variables may be serialised without
+ * building a single large buffer.  The chunks may be de-serialised, in
+ * order, by separate calls to veil_deserialise_bin.
+ *
+ * @param fcinfo 
+ * <br><code>varname text</code> Name of the variable to be serialised.
+ * <br><code>chunk_size int4</code> Target size in bytes of each chunk.
+ * @return <code>setof bytea</code> The serialised chunks.
+ */
+Datum
+veil_serialise_chunks(PG_FUNCTION_ARGS)
+{
+    TupleDesc        tupdesc = scalar_tupdesc(BYTEAOID);
+    Tuplestorestate *tupstore;
+	ChunkScan        scan;
+    Datum            values[1];
+    bool             nulls[1] = {false};
+	bytea           *chunk;
+    char            *name;
+
+    ensure_init();
+
+	tupstore = materialise_result(fcinfo, &tupdesc);
+    name = strfromtext(PG_GETARG_TEXT_P(0));
+	if (vl_start_chunk_scan(&scan, name, PG_GETARG_INT32(1))) {
+		while ((chunk = vl_next_chunk(&scan))) {
+			values[0] = PointerGetDatum(chunk);
+			tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+			pfree(chunk);
+		}
+	}
+
+	return (Datum) 0;
+}
+
+
+PG_FUNCTION_INFO_V1(veil_serialise_session);
+/** 
+ * <code>veil_serialise_session(pattern text) returns bytea</code>
+ * Return a single checksummed stream containing every defined session
+ * and shared variable whose name matches the LIKE pattern.
+ *
+ * @param fcinfo 
+ * <br><code>pattern text</code> LIKE pattern for the variable names.
+ * @return <code>bytea</code> The serialised variables.
+ */
+Datum
+veil_serialise_session(PG_FUNCTION_ARGS)
+{
+    ensure_init();
+
+	PG_RETURN_BYTEA_P(vl_serialise_session(PG_GETARG_TEXT_PP(0), 
+										   VAR_SCOPE_ALL, NULL));
+}
+
+
+PG_FUNCTION_INFO_V1(veil_deserialise_session);
+/** 
+ * <code>veil_deserialise_session(stream bytea) returns int4</code>
+ * Create or reset the variables contained in the output of a previous
+ * veil_serialise_session call.  The stream's checksums are all verified
+ * before any variable is modified.
+ *
+ * @param fcinfo 
+ * <br><code>stream bytea</code> Serialised session variables
+ * @return <code>int4</code> Count of the variables de-serialised from
+ * the stream.
+ */
+Datum
+veil_deserialise_session(PG_FUNCTION_ARGS)
+{
+	bytea *stream;
+
+    ensure_init();
+
+	stream = PG_GETARG_BYTEA_PP(0);
+	PG_RETURN_INT32(vl_deserialise_session(VARDATA_ANY(stream),
+										   VARSIZE_ANY_EXHDR(stream), 
+										   false));
+}
+
+
+PG_FUNCTION_INFO_V1(veil_cache_session);
+/** 
+ * <code>veil_cache_session(principal int4, pattern text) returns int4</code>
+ * Save the variables whose names match a LIKE pattern in the shared
+ * session cache, as the session state for a principal.
+ *
+ * @param fcinfo <code>principal int4</code> The application's id for
+ * the principal.
+ * <br><code>pattern text</code> LIKE pattern for the names of the
+ * variables to be saved.
+ * @return <code>int4</code> Count of the variables saved, or null if
+ * they are too large for an entry in the cache.
+ */
+Datum
+veil_cache_session(PG_FUNCTION_ARGS)
+{
+	int32 result;
+
+    ensure_init();
+
+	result = vl_cache_session(PG_GETARG_INT32(0), PG_GETARG_TEXT_P(1));
+	if (result < 0) {
+		PG_RETURN_NULL();
+	}
+	PG_RETURN_INT32(result);
+}
+
+
+PG_FUNCTION_INFO_V1(veil_restore_cached_session);
+/** 
+ * <code>veil_restore_cached_session(principal int4) returns int4</code>
+ * Restore the session state saved for a principal by
+ * veil_cache_session.
+ *
+ * @param fcinfo <code>principal int4</code> The application's id for
+ * the principal.
+ * @return <code>int4</code> Count of the variables restored, or null if
+ * there is no current entry in the cache for the principal.
+ */
+Datum
+veil_restore_cached_session(PG_FUNCTION_ARGS)
+{
+	int32 result;
+
+    ensure_init();
+
+	result = vl_restore_cached_session(PG_GETARG_INT32(0));
+	if (result < 0) {
+		PG_RETURN_NULL();
+	}
+	PG_RETURN_INT32(result);
+}
+
+
+PG_FUNCTION_INFO_V1(veil_uncache_session);
+/** 
+ * <code>veil_uncache_session(principal int4) returns bool</code>
+ * Remove the session state saved for a principal from the session
+ * cache.
+ *
+ * @param fcinfo <code>principal int4</code> The application's id for
+ * the principal.
+ * @return <code>bool</code> True if an entry was removed.
+ */
+Datum
+veil_uncache_session(PG_FUNCTION_ARGS)
+{
+    ensure_init();
+
+	PG_RETURN_BOOL(vl_uncache_session(PG_GETARG_INT32(0)));
+}
@@ -569,6 +569,8 @@ The following functions comprise the Veil bitmaps API:
 - <code>\ref API-bitmap-intersect</code>
 - <code>\ref API-bitmap-bits</code>
 - <code>\ref API-bitmap-range</code>
+- <code>\ref API-bitmap-extend</code>
+- <code>\ref API-bitmap-clone</code>
 
 \section API-bitmap-init init_bitmap(bitmap_name text, range_name text)
 \verbatim
@@ -614,14 +616,18 @@ veil_bitmap_testbit().
 function veil.bitmap_union(result_name text, bm2_name text) returns bool
 \endverbatim
 Form the union of two bitmaps with the result going into the first.
-Implemented by C function veil_bitmap_union().
+The bitmaps must have the same lowest bit, and the first must be able
+to hold every bit of the second, so a bitmap that has been extended
+using \ref API-bitmap-extend may still be unioned with bitmaps of its
+original range.  Implemented by C function veil_bitmap_union().
 
 \section API-bitmap-intersect bitmap_intersect(result_name text, bm2_name text)
 \verbatim
 function veil.bitmap_intersect(result_name text, bm2_name text) returns bool
 \endverbatim
 Form the intersection of two bitmaps with the result going into the
-first.  Implemented by C function veil_bitmap_intersect().
+first.  The bitmaps must have the same lowest bit.  Implemented by C
+function veil_bitmap_intersect().
 
 \section API-bitmap-bits bitmap_bits(bitmap_name text)
 \verbatim
@@ -639,6 +645,39 @@ This returns the range, as a \ref veil_range_t, of a
 bitmap.  It is primarily intended for interactive use.  It is
 implemented by C function veil_bitmap_range().
 
+\section API-bitmap-extend bitmap_extend(bitmap_name text, newmax int4)
+\verbatim
+function veil.bitmap_extend(bitmap_name text, newmax int4) returns bool
+\endverbatim
+This extends a bitmap so that it can hold bits up to
+<code>newmax</code>, without losing any of the bits already set.  It
+allows bits for newly created privileges to be added without
+re-initialising and re-loading the bitmap.  Space is allocated with
+headroom so that a series of small extensions is cheap.  A bitmap is
+never shrunk.  A shared bitmap may only be extended by init
+functions.  As shared memory cannot be freed, extending a shared
+bitmap beyond its allocated space leaves the old copy unused until the
+next reset: because the space at least doubles each time, this waste
+is always less than the size of the bitmap.  It is implemented by C
+function veil_bitmap_extend().
+
+\section API-bitmap-clone clone_bitmap(bitmap_name text, source text)
+\verbatim
+function veil.clone_bitmap(bitmap_name text, source text) returns bool
+\endverbatim
+This creates, or resets, a session bitmap as a copy-on-write clone of
+the shared bitmap <code>source</code>.  Until the clone is first
+updated, it reads directly from <code>source</code> and costs almost
+nothing; when it is first updated, a session copy of
+<code>source</code> is made.  This is much cheaper than creating a
+session bitmap and unioning a shared bitmap into it, particularly for
+sessions that never update the clone.
+
+A clone that has not been updated reflects the current contents of its
+source, and follows it across a reset of shared variables.  Clones may
+only be session variables, and are not serialised.  It is implemented
+by C function veil_clone_bitmap().
+
 Next: \ref API-bitmap-arrays
 */
 /*! \page API-bitmap-arrays Bitmap Arrays
@@ -653,6 +692,7 @@ each element of the collection is indexed by something like a role_id.
 The following functions comprise the Veil bitmap arrays API:
 
 - <code>\ref API-bmarray-init</code>
+- <code>\ref API-bmarray-init-sparse</code>
 - <code>\ref API-bmarray-clear</code>
 - <code>\ref API-bmarray-bmap</code>
 - <code>\ref API-bmarray-testbit</code>
@@ -663,6 +703,10 @@ The following functions comprise the Veil bitmap arrays API:
 - <code>\ref API-bmarray-bits</code>
 - <code>\ref API-bmarray-arange</code>
 - <code>\ref API-bmarray-brange</code>
+- <code>\ref API-bmarray-load</code>
+- <code>\ref API-bmarray-save-image</code>
+- <code>\ref API-bmarray-map</code>
+- <code>\ref API-bmarray-clone</code>
 
 \section API-bmarray-init init_bitmap_array(bmarray text, array_range text, bitmap_range text)
 \verbatim
@@ -673,6 +717,21 @@ The last two parameters are the names of ranges used to bound the
 dimensions of the array, and the range of bits within the array's
 bitmaps.  Implemented by C function veil_init_bitmap_array().
 
+\section API-bmarray-init-sparse init_sparse_bitmap_array(bmarray text, array_range text, bitmap_range text)
+\verbatim
+function veil.init_sparse_bitmap_array(bmarray text, array_range text, bitmap_range text) returns bool
+\endverbatim
+Creates or resets the bitmap array named <code>bmarray</code> as a
+sparse bitmap array.  A sparse bitmap array behaves exactly like any
+other bitmap array, but its bitmaps are only allocated when a bit is
+first set in them: until then they read as empty.  Use this for arrays
+whose index range is very wide but of which only a small proportion of
+elements will ever be populated, such as an array indexed by a
+person_id.  As shared memory cannot be freed, bitmaps may only be added
+to a shared sparse bitmap array by init functions: elsewhere, bits may
+only be set in bitmaps that already exist.  Implemented by C function
+veil_init_sparse_bitmap_array().
+
 \section API-bmarray-clear clear_bitmap_array(bmarray text)
 \verbatim
 function veil.clear_bitmap_array(bmarray text) returns bool
@@ -685,8 +744,12 @@ Clear all bits in all bitmaps of the bitmap array named
 function veil.bitmap_from_array(bmref_name text, bmarray text, index int4) returns text
 \endverbatim
 Place a reference into <code>bmref_name</code> to the bitmap identified
-by <code>index</code> in bitmap array <code>bmarray</code>.  Implemented
-by C function veil_bitmap_from_array().
+by <code>index</code> in bitmap array <code>bmarray</code>.  For an
+element of a sparse bitmap array that has not yet been populated, the
+reference is to an empty bitmap that is not part of the array, so bits
+set through the reference are not recorded in the array: use
+<code>\ref API-bmarray-setbit</code> for that.  Implemented by C
+function veil_bitmap_from_array().
 
 \section API-bmarray-testbit bitmap_array_testbit(bmarray text, arr_idx int4, bitno int4)
 \verbatim
@@ -759,6 +822,70 @@ Show the range, as a \ref veil_range_t, of all bitmaps in the specified
 bitmap array.  Primarily for interactive use.  Implemented by
 C function veil_bitmap_array_range().
 
+\section API-bmarray-load load_bitmap_array(bmarray text, relation regclass, row_col name, bit_col name, filter text)
+\verbatim
+function veil.load_bitmap_array(bmarray text, relation regclass, row_col name, bit_col name, filter text) returns int4
+\endverbatim
+Set bits in <code>bmarray</code> from the rows of
+<code>relation</code>, returning the number of bits set.  For each row,
+the bit given by column <code>bit_col</code> is set in the element
+given by column <code>row_col</code>.  Rows containing nulls are
+skipped.  <code>bmarray</code> may also be a bitmap hash, in which case
+<code>row_col</code> gives the key, or a bitmap, in which case
+<code>row_col</code> is ignored.  If <code>filter</code> is not null,
+it is an SQL condition that rows must match.
+
+This is much faster than setting each bit from a query, particularly
+for large relations, as without a filter the relation is scanned
+directly with no per-row function calls.  A relation that is subject
+to row level security is always read through a query, so that its
+policies are applied.  Implemented by C function
+veil_load_bitmap_array().
+
+\section API-bmarray-save-image save_bitmap_array_image(bmarray text, filename text)
+\verbatim
+function veil.save_bitmap_array_image(bmarray text, filename text) returns int4
+\endverbatim
+Save the bitmaps of <code>bmarray</code> to an image file named
+<code>filename</code> in the pg_veil directory of the database cluster,
+returning the number of bitmaps saved.  The file is laid out exactly as
+the bitmaps are in memory, so that it can be mapped by \ref
+API-bmarray-map.  Sparse bitmap arrays cannot be saved.  Implemented by
+C function veil_save_bitmap_array_image().
+
+\section API-bmarray-map map_bitmap_array(bmarray text, filename text)
+\verbatim
+function veil.map_bitmap_array(bmarray text, filename text) returns bool
+\endverbatim
+Define <code>bmarray</code> as a read-only bitmap array whose bitmaps
+are read directly from the image file <code>filename</code>.  Each
+session maps the file into its own memory the first time it reads from
+<code>bmarray</code>, after which bitmap_array_testbit(), and the other
+functions that read bitmap arrays, use the operating system's page cache
+directly.  Shared variables defined in this way occupy almost no shared
+memory, which makes this suitable for very large privilege arrays that
+change rarely, and which can be rebuilt offline.
+
+A mapped bitmap array cannot be modified: to change it, save a new
+image and call map_bitmap_array() again.  If the image file is replaced
+without doing so, reading from the variable will raise an error.
+Implemented by C function veil_map_bitmap_array().
+
+\section API-bmarray-clone clone_bitmap_array(bmarray text, source text)
+\verbatim
+function veil.clone_bitmap_array(bmarray text, source text) returns bool
+\endverbatim
+Create, or reset, the session bitmap array <code>bmarray</code> as a
+copy-on-write clone of the shared bitmap array <code>source</code>.
+Each bitmap of the clone is read directly from <code>source</code> until
+it is first updated, when a session copy of just that bitmap is made,
+so a session pays only for the bitmaps that it changes.  As for \ref
+API-bitmap-clone, bitmaps that have not been updated follow their
+source across a reset of shared variables, though if the source's
+ranges change the clone must be re-created.  Sparse bitmap arrays
+cannot be cloned.  Implemented by C function
+veil_clone_bitmap_array().
+
 
 Next: \ref API-bitmap-hashes
 */
@@ -915,6 +1042,10 @@ The following functions comprise the Veil int arrays API:
 - <code>\ref API-intarray-clear</code>
 - <code>\ref API-intarray-set</code>
 - <code>\ref API-intarray-get</code>
+- <code>\ref API-intarray-load</code>
+- <code>\ref API-intarray-get-array</code>
+- <code>\ref API-intarray-to-array</code>
+- <code>\ref API-intarray-extend</code>
 
 \section API-intarray-init init_int4array(arrayname text, range text)
 \verbatim
@@ -944,6 +1075,52 @@ function int4array_get(arrayname text, idx int4) returns int4
 Get the value of an element from an int array.  Implemented by
 C function veil_int4array_get().
 
+\section API-intarray-load int4array_load(arrayname text, idx int4[], vals int4[])
+\verbatim
+function veil.int4array_load(arrayname text, idx int4[], vals int4[]) returns int4
+\endverbatim
+Set many elements of an int array in a single call.  Each element of
+<code>vals</code> is stored in the element given by the corresponding
+element of <code>idx</code>.  This is much faster than calling \ref
+API-intarray-set for each element, eg:
+\verbatim
+select veil.int4array_load('det_types_privs', 
+                           array_agg(detail_type_id),
+                           array_agg(required_privilege_id))
+from   hidden.detail_types;
+\endverbatim
+Returns the number of elements set.  Implemented by C function
+veil_int4array_load().
+
+\section API-intarray-get-array int4array_get(arrayname text, idx int4[])
+\verbatim
+function veil.int4array_get(arrayname text, idx int4[]) returns int4[]
+\endverbatim
+Get the values of many elements from an int array in a single call.
+The result contains the value for each element of <code>idx</code>, in
+the same order.  Implemented by C function veil_int4array_get_array().
+
+\section API-intarray-to-array int4array_to_array(arrayname text)
+\verbatim
+function veil.int4array_to_array(arrayname text) returns int4[]
+\endverbatim
+Return the entire contents of an int array as an SQL array whose
+subscripts match the indexes of the int array.  Implemented by C
+function veil_int4array_to_array().
+
+\section API-intarray-extend int4array_extend(arrayname text, newmax int4)
+\verbatim
+function int4array_extend(arrayname text, newmax int4) returns bool
+\endverbatim
+Extend an int array so that its highest index becomes
+<code>newmax</code>, preserving the values of existing elements.  New
+elements are zeroed.  This allows entries for new keys, such as new
+detail types, to be added without re-initialising the array.  As
+with \ref API-bitmap-extend, a shared array may only be extended by
+init functions, and extending it may leave unused shared memory, less
+than the size of the array, until the next reset.
+Implemented by C function veil_int4array_extend().
+
 Next: \ref API-serialisation
 */
 /*! \page API-serialisation Veil Serialisation Functions
@@ -957,12 +1134,34 @@ http://pgfoundry.org/projects/pgmemcache/
 
 Only session variables may be serialised.
 
+By default, the bitmaps within bitmap, bitmap array and bitmap hash
+variables are serialised in full.  If the configuration variable
+<code>veil.compress_bitmaps</code> is set, each bitmap is instead
+written as whichever is smallest of its raw contents, runs of empty and
+non-empty words, or a list of its set bits.  For sparsely populated
+bitmaps this reduces the size of the serialised stream enormously.
+Compressed streams are always accepted on de-serialisation, regardless
+of the setting.
+
 The following functions comprise the Veil serialisatation API:
 
 - <code>\ref API-serialise</code>
 - <code>\ref API-deserialise</code>
 - <code>\ref API-serialize</code>
 - <code>\ref API-deserialize</code>
+- <code>\ref API-serialise-bin</code>
+- <code>\ref API-deserialise-bin</code>
+- <code>\ref API-serialize-bin</code>
+- <code>\ref API-deserialize-bin</code>
+- <code>\ref API-serialise-chunks</code>
+- <code>\ref API-serialize-chunks</code>
+- <code>\ref API-serialise-session</code>
+- <code>\ref API-deserialise-session</code>
+- <code>\ref API-serialize-session</code>
+- <code>\ref API-deserialize-session</code>
+- <code>\ref API-cache-session</code>
+- <code>\ref API-restore-cached-session</code>
+- <code>\ref API-uncache-session</code>
 
 \section API-serialise serialise(varname text)
 \verbatim
@@ -995,6 +1194,141 @@ function veil.deserialize(stream text) returns text
 \endverbatim
 Synonym for veil_deserialise()
 
+\section API-serialise-bin serialise_bin(varname text)
+\verbatim
+function veil.serialise_bin(varname text) returns bytea
+\endverbatim
+This creates a serialised binary representation of the named session
+variable.  This is around 25% smaller than the textual representation
+created by veil_serialise(), and is much faster to create and to
+de-serialise.  Each result is a self-contained, versioned record, so
+results may be concatenated and then deserialised in a single call to
+veil_deserialise_bin().  Implemented by C function veil_serialise_bin().
+
+\section API-deserialise-bin deserialise_bin(stream bytea)
+\verbatim
+function veil.deserialise_bin(stream bytea) returns int
+\endverbatim
+This takes a serialised binary representation of one or more variables
+as created by concatenating the results of veil_serialise_bin(), and
+de-serialises them, creating new variables as needed and resetting their
+values to those they had when they were serialised.  Implemented by C
+function veil_deserialise_bin().
+
+\section API-serialize-bin serialize_bin(varname text)
+\verbatim
+function veil.serialize_bin(varname text) returns bytea
+\endverbatim
+Synonym for veil_serialise_bin()
+
+\section API-deserialize-bin deserialize_bin(stream bytea)
+\verbatim
+function veil.deserialize_bin(stream bytea) returns int
+\endverbatim
+Synonym for veil_deserialise_bin()
+
+\section API-serialise-chunks serialise_chunks(varname text, chunk_size int4)
+\verbatim
+function veil.serialise_chunks(varname text, chunk_size int4)
+    returns setof bytea
+\endverbatim
+This returns the same binary representation as veil_serialise_bin(), but
+split into a set of chunks of around chunk_size bytes.  Each chunk of a
+bitmap array or bitmap hash holds some of its elements, so even very
+large variables can be serialised and de-serialised without building the
+whole stream in memory.  Each chunk is a self-contained record that may
+be passed to veil_deserialise_bin(), separately or concatenated with
+others, provided that the chunks for a variable are de-serialised in
+the order in which they were returned.  Implemented by C function
+veil_serialise_chunks().
+
+\section API-serialize-chunks serialize_chunks(varname text, chunk_size int4)
+\verbatim
+function veil.serialize_chunks(varname text, chunk_size int4)
+    returns setof bytea
+\endverbatim
+Synonym for veil_serialise_chunks()
+
+\section API-serialise-session serialise_session(pattern text)
+\verbatim
+function veil.serialise_session(pattern text) returns bytea
+\endverbatim
+This serialises, into a single binary stream, every defined session and
+shared variable whose name matches the LIKE pattern.  The stream begins
+with a table of contents giving the location and checksum of each
+variable's record, so that it can be fully validated before anything is
+restored.  Implemented by C function veil_serialise_session().
+
+\section API-deserialise-session deserialise_session(stream bytea)
+\verbatim
+function veil.deserialise_session(stream bytea) returns int
+\endverbatim
+This restores all of the variables from a stream created by
+veil_serialise_session().  If any part of the stream is corrupt an error
+is raised and no variable is modified.  Implemented by C function
+veil_deserialise_session().
+
+\section API-serialize-session serialize_session(pattern text)
+\verbatim
+function veil.serialize_session(pattern text) returns bytea
+\endverbatim
+Synonym for veil_serialise_session()
+
+\section API-deserialize-session deserialize_session(stream bytea)
+\verbatim
+function veil.deserialize_session(stream bytea) returns int
+\endverbatim
+Synonym for veil_deserialise_session()
+
+\section API-cache-session cache_session(principal int4, pattern text)
+\verbatim
+function veil.cache_session(principal int4, pattern text) returns int4
+\endverbatim
+This saves the session variables whose names match the LIKE pattern,
+as for veil_serialise_session(), in a cache in shared memory.  The saved state
+is identified by <code>principal</code>, an application-defined id such
+as the id of the connected person, and may be restored by any session
+connected to the same database.  Shared variables are never saved, so
+that restoring the state cannot undo changes made to them since.  It
+returns the number of variables saved, or null if they
+are too large for an entry in the cache.
+
+The cache has <code>veil.session_cache_entries</code> entries, each of
+up to <code>veil.session_cache_entry_size</code> bytes.  When it is
+full, the least recently used entry is replaced.  Entries are
+discarded when Veil's shared memory is reset, as the session state may
+have been derived from shared variables that have since changed.  If
+<code>veil.session_cache_entries</code> is 0, as it is by default, the
+cache is disabled and this function raises an error.  Implemented by C
+function veil_cache_session().
+
+This allows a connect function, behind a connection pool, to rebuild a
+recently seen user's session state with a single call:
+\verbatim
+if veil.restore_cached_session(_person_id) is null then
+    -- build the session variables for _person_id, then
+    perform veil.cache_session(_person_id, 'session_%');
+end if;
+\endverbatim
+
+\section API-restore-cached-session restore_cached_session(principal int4)
+\verbatim
+function veil.restore_cached_session(principal int4) returns int4
+\endverbatim
+This restores the variables saved by veil_cache_session() for
+<code>principal</code>.  It returns the number of variables restored,
+or null if there is no current entry for <code>principal</code>.
+Implemented by C function veil_restore_cached_session().
+
+\section API-uncache-session uncache_session(principal int4)
+\verbatim
+function veil.uncache_session(principal int4) returns bool
+\endverbatim
+This removes any entry for <code>principal</code> from the session
+cache.  It should be called whenever the data from which the session
+state of <code>principal</code> is built changes.  It returns true if an
+entry was removed.  Implemented by C function veil_uncache_session().
+
 Next: \ref API-control
 */
 /*! \page API-control Veil Control Functions
@@ -1012,6 +1346,10 @@ The following functions comprise the Veil control functions API:
 - <code>\ref API-control-registered-init</code>
 - <code>\ref API-control-init</code>
 - <code>\ref API-control-reset</code>
+- <code>\ref API-control-init-async</code>
+- <code>\ref API-control-snapshot</code>
+- <code>\ref API-control-stamp</code>
+- <code>\ref API-control-maintain</code>
 - <code>\ref API-version</code>
 
 \section API-control-registered-init registered initialisation functions
@@ -1048,6 +1386,77 @@ values ('veil.init_roles', 1),
        ('veil.init_role_privs', 2);
 \endverbatim
 
+Each registered name is resolved, once per session, to the function of
+that name taking a single boolean argument, which is then called
+directly rather than through a query.  Names that cannot be resolved
+this way, for instance because the function relies on an implicit cast
+or a default parameter value, are called through a query as before.
+
+Sessions that use only a few variables, such as short-lived connections
+that check a single privilege, need not build every session variable.
+If the configuration variable <code>veil.lazy_init</code> is on, the
+call of veil_init() for a new session is deferred.  When an undefined
+variable is first used, only the init function registered for it in
+the configuration table <code>veil.veil_variable_init_fns</code> is
+called, with <code>doing_reset</code> false.  If no function is
+registered for the variable, veil_init() is called as usual.  Eg:
+
+\verbatim
+insert into veil.veil_variable_init_fns
+       (var_name, fn_name)
+values ('role_privs', 'veil.init_role_privs');
+\endverbatim
+
+Session variables that are derived from shared variables, such as a
+session bitmap built by intersecting bitmaps from a shared bitmap
+array, become stale when the shared variables are reset.  If such
+variables are listed in the configuration table
+<code>veil.veil_derived_variables</code>, each session checks, as it
+makes each call to Veil, whether shared variables have been reset
+since its derived variables were built.  This check is cheap: it
+simply compares a counter in shared memory.  If there has been a
+reset, each derived variable is rebuilt when it is next used, by
+calling the function registered for it in
+<code>veil.veil_variable_init_fns</code>, or by calling veil_init()
+if there is none.  Eg:
+
+\verbatim
+insert into veil.veil_derived_variables
+       (var_name)
+values ('global_context');
+\endverbatim
+
+Init functions that have no dependencies on each other may be given
+the same priority and registered as parallel, using the
+<code>parallel</code> column.  When shared variables are being reset,
+functions of the same priority that are registered as parallel are
+run concurrently by up to <code>veil.init_workers</code> background
+workers, while the resetting session runs the others.  Each priority
+level is completed before the next is started, so a reset takes only
+as long as the slowest function at each level.  Parallel functions run
+in their own transactions: they cannot see uncommitted changes made by
+the resetting session, and they should not define session variables as
+these will be lost when the worker exits.  If no workers are available,
+the functions are simply run in turn by the resetting session.
+
+A worker that needs a lock held by the resetting transaction would
+wait for it forever, as the resetting session is itself waiting for the
+worker, and this is not a deadlock that PostgreSQL can detect.  For
+this reason, if the resetting transaction holds any lock on a table
+stronger than ACCESS SHARE, for instance after LOCK TABLE, DDL, or any
+insert, update or delete, all init functions are run by the resetting
+session itself.  Waiting for workers may also be interrupted, for
+instance by statement_timeout, in which case the workers are stopped
+and the reset fails.
+
+\verbatim
+insert into veil.veil_init_fns
+       (fn_name, priority, parallel)
+values ('veil.init_roles', 1, true),
+       ('veil.init_privs', 1, true),
+       ('veil.init_role_privs', 2, false);
+\endverbatim
+
 \section API-control-init veil_init(doing_reset bool)
 \verbatim
 function veil.veil_init(doing_reset bool) returns bool
@@ -1075,6 +1484,89 @@ function veil.veil_perform_reset() returns bool
 This is used to reset Veil's shared variables.  It causes \ref
 API-control-init to be called.  Implemented by C function veil_perform_reset().
 
+\section API-control-init-async init_async()
+\verbatim
+function veil.init_async() returns bool
+\endverbatim
+This starts the initialisation of the current session in a background
+worker, so that it overlaps with whatever else the application does
+before it first needs Veil.  The worker connects to the same database
+as the same user, calls \ref API-control-init, and returns the session
+variables that it creates to the session through dynamic shared memory.
+The session's next call of any other Veil function restores those
+variables, first waiting for the worker only if it has not yet
+finished.  If the worker fails, cannot be started, or dies, a warning
+is given and the session is initialised as usual.
+
+Since the worker is a separate backend, its session variables must be
+serialisable (bitmap refs, for example, are not): if any is not, the
+worker fails and the session is initialised as usual.  veil_init() must
+also not depend on anything set earlier in the session.  init_async()
+returns false, and does nothing, if the session has already been
+initialised or no background worker could be started.  Implemented by
+C function veil_init_async().
+
+\section API-control-snapshot save_shared_snapshot()
+\verbatim
+function veil.save_shared_snapshot() returns int
+\endverbatim
+This saves all of the current database's shared variables to a snapshot
+file in the <code>pg_veil</code> directory of the cluster's data
+directory, returning the number of variables saved.  If the
+configuration option <code>veil.snapshot_shared</code> is on, the first
+session to use Veil after the cluster is restarted loads the shared
+variables from this snapshot before calling \ref API-control-init.
+Since the shared variables are then already defined, veil_share() will
+return true for each of them, and the init functions need not rebuild
+them.  A snapshot is only loaded if it was saved by the same cluster
+and its stamp (see \ref API-control-stamp) matches.  Otherwise, it is
+ignored, with a message to the server log.  Implemented by C function
+veil_save_shared_snapshot().
+
+\section API-control-stamp snapshot_stamp()
+\verbatim
+function veil.snapshot_stamp() returns text
+\endverbatim
+This returns the stamp that is recorded when a snapshot is saved, and
+compared with the recorded stamp when a snapshot is loaded.  The
+supplied version returns null, which matches any snapshot, so you
+should redefine it to return a value that changes whenever the data
+from which your shared variables are built changes: eg a version number
+maintained by triggers on the underlying tables.
+
+\section API-control-maintain maintain_bitmap_array() and maintain_int4_array()
+\verbatim
+function veil.maintain_bitmap_array() returns trigger
+function veil.maintain_int4_array() returns trigger
+\endverbatim
+These trigger functions keep shared bitmap arrays and int4 arrays up
+to date as the tables from which they are built change, so that a
+reset is not needed after each change.  Each is defined as an AFTER
+INSERT OR UPDATE OR DELETE trigger, FOR EACH ROW, with three
+arguments: the name of the shared variable; the column giving the
+array element; and the column giving the bit or, for an int4 array,
+the value.  Eg:
+
+\verbatim
+create trigger role_privileges__maintain
+after insert or update or delete on role_privileges
+for each row execute procedure
+  veil.maintain_bitmap_array('role_privs', 'role_id', 'privilege_id');
+\endverbatim
+
+The triggers only record the changes.  All the changes made by a
+transaction are applied together, as it commits, and are discarded if
+it, or the subtransaction that made them, aborts.  Deleting a row
+clears its bit, or resets its int4 array entry to zero, so each
+(element, bit) pair should be unique in the table.  A change that lies
+outside the ranges of the array is not applied, and a warning is given:
+the variable will be out of step with the table until the next reset.
+Transactions that make such changes cannot be prepared for two-phase
+commit.  If a reset runs while such a transaction is committing, and
+its init functions read the table before the commit, the changes will
+not be visible until the next reset.  Implemented by C functions veil_maintain_bitmap_array() and
+veil_maintain_int4_array().
+
 \section API-version version()
 \verbatim
 function veil.version() returns text
@@ -1980,9 +2472,15 @@ shared_preload_libraries = '<path to shared library>/veil.so'
 #veil.dbs_in_cluster = 1
 #veil.shared_hash_elems = 32
 #veil.shmem_context_size = 16384
+#veil.compress_bitmaps = off
+#veil.snapshot_shared = off
+#veil.init_workers = 0
+#veil.lazy_init = off
+#veil.session_cache_entries = 0
+#veil.session_cache_entry_size = 8192
 \endcode
 
-The three configuration options, commented out above, are:
+The configuration options, commented out above, are:
 - dbs_in_cluster
   The number of databases, within the database cluster, that
   will use Veil.  Each such database will be allocated 2 chunks of
@@ -2001,6 +2499,40 @@ The three configuration options, commented out above, are:
   Veil shared memory context (there will be two of these).  It defaults 
   to 16K.  Increase this if you have many shared memory structures.
 
+- compress_bitmaps
+  This determines whether the bitmaps in bitmap, bitmap array and
+  bitmap hash variables are compressed when serialised.  It defaults to
+  off, and may also be set within a session.  See \ref API-serialisation.
+
+- snapshot_shared
+  This determines whether shared variables are loaded, on startup, from
+  a snapshot created by veil_save_shared_snapshot().  It defaults to
+  off.  See \ref API-control-snapshot.
+
+- init_workers
+  This is the maximum number of background workers that may be used
+  to run parallel init functions when shared variables are reset.  It
+  defaults to 0, so that all init functions are run by the resetting
+  session.  Workers are taken from those allowed by
+  <code>max_worker_processes</code>.  See \ref
+  API-control-registered-init.
+
+- lazy_init
+  This determines whether session initialisation is deferred until
+  variables are first used, so that only the init functions of those
+  variables are called.  It defaults to off, and may also be set
+  within a session before Veil is first used.  See \ref
+  API-control-registered-init.
+
+- session_cache_entries
+  This is the number of entries in the shared cache of session state.
+  It defaults to 0, which disables the cache.  See \ref
+  API-cache-session.
+
+- session_cache_entry_size
+  This is the maximum size, in bytes, of the session state saved in
+  each entry of the session cache.  It defaults to 8192.
+
 \subsection Regression Regression Tests
 Veil comes with a built-in regression test suite.  Use <code>make
 regress</code> or <code>make check</code> (after installing and
@@ -2009,7 +2541,9 @@ Postgres in order to create the regression test database.  The
 regression test assumes you will have a postgres superuser account named
 the same as your OS account.  If pg_hba.conf disallows "trust"ed access
 locally, then you will need to provide a password for this account in
-your .pgpass file (see postgres documentation for details).
+your .pgpass file (see postgres documentation for details).  The
+session cache tests also need <code>veil.session_cache_entries</code>
+to be set to at least 2 in postgresql.conf.
 
 The regression tests are all contained within the regress directory and
 are run by the regress.sh shell script.  Use the -h option to get
@@ -0,0 +1,473 @@
+/**
+ * @file   veil_maintain.c
+ * \code
+ *     Author:       Marc Munro
+ *     Copyright (c) 2018 Marc Munro
+ *     License:      BSD
+ *
+ * \endcode
+ * @brief
+ * Functions for the incremental maintenance of shared variables from
+ * triggers.
+ *
+ * Shared bitmap arrays and int4 arrays are usually built, by the
+ * init functions, from the contents of tables such as role_privileges.
+ * Without incremental maintenance, any change to those tables requires
+ * a full reset of shared memory (see veil_perform_reset()) before it
+ * becomes visible.
+ *
+ * The trigger functions veil_maintain_bitmap_array() and
+ * veil_maintain_int4_array() record, for each row changed, the change
+ * to be made to a shared variable.  The changes are queued for the
+ * transaction, and applied to the shared variables, as a single batch,
+ * when the transaction commits.  Changes queued by an aborted
+ * transaction or subtransaction are discarded.
+ *
+ * Applying the changes happens in two steps.  Just before commit, while
+ * an error can still abort the transaction, each change is resolved to
+ * the ::Bitmap or ::Int4Array that it modifies.  Once the transaction
+ * has committed, the resolved changes are applied by a path that cannot
+ * fail.
+ *
+ * If a reset switches the shared memory context between these two
+ * steps, the resolved changes refer to variables that have been
+ * replaced, and are discarded.  The reset will usually have loaded the
+ * changed rows, but if its init functions read the table before this
+ * transaction committed it will not have seen them, and the variables
+ * will not reflect the changes until the next reset.  The window is
+ * small, as it is only the time taken to commit.
+ */
+
+#include "postgres.h"
+#include "access/xact.h"
+#include "commands/trigger.h"
+#include "executor/spi.h"
+#include "nodes/pg_list.h"
+#include "storage/lwlock.h"
+#include "utils/memutils.h"
+#include "veil_version.h"
+#include "veil_funcs.h"
+#include "veil_datatypes.h"
+
+
+#ifndef DOXYGEN_SHOULD_SKIP_THIS
+
+#define MAINTAIN_TRANCHE  "veil_maintain"
+
+#endif
+
+/**
+ * A change to be made to a shared variable when the current
+ * transaction commits.
+ */
+typedef struct VarChange {
+	char    name[HASH_KEYLEN];	/**< The name of the shared variable */
+	ObjType type;				/**< OBJ_BITMAP_ARRAY or OBJ_INT4_ARRAY */
+	int32   idx;				/**< The array element */
+	int32   value;				/**< The bit, or int4 value */
+	bool    add;				/**< Whether the bit is to be set, or
+								 * the value assigned, rather than
+								 * cleared */
+	int     nest_level;			/**< The transaction nesting level at
+								 * which the change was queued */
+	Object *target;				/**< The Bitmap, or Int4Array, to be
+								 * modified, set when the change is
+								 * resolved, or NULL if there is
+								 * nothing to modify */
+} VarChange;
+
+/**
+ * The list of ::VarChange entries queued by the current transaction,
+ * allocated in TopTransactionContext.
+ */
+static List *pending_changes = NIL;
+
+/**
+ * The generation of shared memory (see vl_shared_generation()) in which
+ * pending_changes were resolved.
+ */
+static uint32 resolved_generation = 0;
+
+/**
+ * Whether our transaction callbacks have been registered.
+ */
+static bool callbacks_registered = false;
+
+/**
+ * Request the LWLock that serialises the application of queued
+ * changes.  This must be called from _PG_init().
+ */
+void
+vl_maintain_request()
+{
+	RequestNamedLWLockTranche(MAINTAIN_TRANCHE, 1);
+}
+
+/**
+ * Return whether a change is within the ranges of the variable to
+ * which it applies.
+ *
+ * @param obj The BitmapArray or Int4Array.
+ * @param change The change.
+ *
+ * @return true if the change may be applied to obj.
+ */
+static bool
+change_in_range(Object *obj, VarChange *change)
+{
+	BitmapArray *bmarray;
+	Int4Array   *array;
+
+	if (obj->type == OBJ_BITMAP_ARRAY) {
+		bmarray = (BitmapArray *) obj;
+		return ((change->idx >= bmarray->arrayzero) &&
+				(change->idx <= bmarray->arraymax) &&
+				(change->value >= bmarray->bitzero) &&
+				(change->value <= bmarray->bitmax));
+	}
+	array = (Int4Array *) obj;
+	return ((change->idx >= array->arrayzero) &&
+			(change->idx <= array->arraymax));
+}
+
+/**
+ * Resolve a change to the ::Bitmap, or ::Int4Array, that it modifies.
+ * Bitmaps are not added to sparse bitmap arrays, as that is only
+ * allowed in init functions, so a change is resolved to an existing
+ * bitmap or none.  The target is left NULL if the change has nothing
+ * to modify.
+ *
+ * @param obj The BitmapArray or Int4Array, or NULL if the variable no
+ * longer exists.
+ * @param change The change.
+ */
+static void
+resolve_change(Object *obj, VarChange *change)
+{
+	change->target = NULL;
+	if (!obj || !change_in_range(obj, change)) {
+		return;
+	}
+	if (obj->type == OBJ_BITMAP_ARRAY) {
+		change->target = (Object *)
+			vl_BitmapFromArray((BitmapArray *) obj, change->idx);
+	}
+	else {
+		change->target = obj;
+	}
+}
+
+/**
+ * Resolve, just before the transaction commits, all changes queued by
+ * it.  The shared variables are looked up once for each run of changes
+ * to the same variable.  Changes to variables that no longer exist, or
+ * have been redefined by a reset, will not be applied.
+ */
+static void
+resolve_pending_changes()
+{
+	ListCell  *cell;
+	VarChange *change;
+	VarEntry  *var = NULL;
+	char      *last_name = NULL;
+	Object    *obj;
+
+	resolved_generation = vl_shared_generation();
+
+	foreach (cell, pending_changes) {
+		change = (VarChange *) lfirst(cell);
+		if (!last_name || (strcmp(last_name, change->name) != 0)) {
+			var = vl_find_shared_variable(change->name);
+			last_name = change->name;
+		}
+		obj = (var && var->obj && (var->obj->type == change->type))?
+			var->obj: NULL;
+		resolve_change(obj, change);
+	}
+}
+
+/**
+ * Apply, in the order in which they were queued, the changes resolved
+ * by resolve_pending_changes().  This is called after the transaction
+ * has committed, so must not fail: it allocates no memory and raises no
+ * errors.  If the shared memory context has been switched since the
+ * changes were resolved, they are discarded.  Holding VeilLWLock, via
+ * vl_lock_generation(), prevents a switch while they are applied.
+ */
+static void
+apply_pending_changes()
+{
+	ListCell  *cell;
+	VarChange *change;
+	LWLock    *lock = &(GetNamedLWLockTranche(MAINTAIN_TRANCHE))->lock;
+	Int4Array *array;
+
+	LWLockAcquire(lock, LW_EXCLUSIVE);
+	if (vl_lock_generation(resolved_generation)) {
+		foreach (cell, pending_changes) {
+			change = (VarChange *) lfirst(cell);
+			if (!change->target) {
+				continue;
+			}
+			/* The ranges were checked when the change was resolved,
+			 * so these cannot fail. */
+			if (change->type == OBJ_BITMAP_ARRAY) {
+				if (change->add) {
+					vl_BitmapSetbit((Bitmap *) change->target,
+									change->value);
+				}
+				else {
+					vl_BitmapClearbit((Bitmap *) change->target,
+									  change->value);
+				}
+			}
+			else {
+				/* Removing an entry resets it to zero. */
+				array = (Int4Array *) change->target;
+				array->array[change->idx - array->arrayzero] =
+					change->add? change->value: 0;
+			}
+		}
+		vl_unlock_generation();
+	}
+	LWLockRelease(lock);
+}
+
+/**
+ * Transaction callback.  Queued changes are resolved just before the
+ * transaction commits, so that any error will still abort it, applied
+ * once it has committed, and discarded if it aborts.  Transactions
+ * that have queued changes may not be prepared, as they may be
+ * committed by some other backend.
+ *
+ * @param event The transaction event.
+ * @param arg Unused.
+ */
+static void
+maintain_xact_callback(XactEvent event, void *arg)
+{
+	switch (event) {
+	case XACT_EVENT_PRE_COMMIT:
+		if (pending_changes) {
+			resolve_pending_changes();
+		}
+		break;
+	case XACT_EVENT_COMMIT:
+		if (pending_changes) {
+			apply_pending_changes();
+		}
+		/* The list itself is freed with TopTransactionContext. */
+		pending_changes = NIL;
+		break;
+	case XACT_EVENT_PRE_PREPARE:
+		if (pending_changes) {
+			ereport(ERROR,
+					(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+					 errmsg("cannot PREPARE a transaction that has "
+							"changed tables maintained by veil triggers")));
+		}
+		break;
+	default:
+		/* On abort, the queued changes are discarded. */
+		pending_changes = NIL;
+	}
+}
+
+/**
+ * Subtransaction callback.  Changes queued by an aborted
+ * subtransaction are discarded, and those of a committed
+ * subtransaction become changes of its parent.
+ *
+ * @param event The subtransaction event.
+ * @param mySubid Unused.
+ * @param parentSubid Unused.
+ * @param arg Unused.
+ */
+static void
+maintain_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+						  SubTransactionId parentSubid, void *arg)
+{
+	int           level = GetCurrentTransactionNestLevel();
+	List         *kept = NIL;
+	ListCell     *cell;
+	VarChange    *change;
+	MemoryContext oldcxt;
+
+	if ((event != SUBXACT_EVENT_ABORT_SUB) &&
+		(event != SUBXACT_EVENT_COMMIT_SUB)) {
+		return;
+	}
+
+	oldcxt = MemoryContextSwitchTo(TopTransactionContext);
+	foreach (cell, pending_changes) {
+		change = (VarChange *) lfirst(cell);
+		if (change->nest_level >= level) {
+			if (event == SUBXACT_EVENT_ABORT_SUB) {
+				pfree(change);
+				continue;
+			}
+			change->nest_level = level - 1;
+		}
+		kept = lappend(kept, change);
+	}
+	list_free(pending_changes);
+	pending_changes = kept;
+	MemoryContextSwitchTo(oldcxt);
+}
+
+/**
+ * Return the value of an integer column of a trigger tuple.
+ *
+ * @param tuple The tuple.
+ * @param tupdesc The tuple's descriptor.
+ * @param colname The name of the column.
+ * @param p_isnull Pointer to receive whether the value is null.
+ *
+ * @return The value of the column.
+ */
+static int32
+column_int32(HeapTuple tuple, TupleDesc tupdesc, char *colname,
+			 bool *p_isnull)
+{
+	int   fnumber = SPI_fnumber(tupdesc, colname);
+	Datum value;
+
+	if (fnumber <= 0) {
+		ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_COLUMN),
+				 errmsg("column %s does not exist", colname)));
+	}
+	value = SPI_getbinval(tuple, tupdesc, fnumber, p_isnull);
+	if (*p_isnull) {
+		return 0;
+	}
+	return vl_int32_from_datum(value, SPI_gettypeid(tupdesc, fnumber),
+							   colname);
+}
+
+/**
+ * Queue the change to a shared variable for a row added to, or
+ * removed from, the table on which a trigger fired.  Rows with null
+ * values are ignored.  A change that lies outside the ranges of the
+ * variable, or that would add a bitmap to a sparse bitmap array, cannot
+ * be recorded: a warning is given as the variable will be inconsistent
+ * with the table until the next reset.
+ *
+ * @param obj The shared variable.
+ * @param name The name of the shared variable.
+ * @param trigdata The trigger data.
+ * @param tuple The row.
+ * @param add Whether the row is being added.
+ */
+static void
+queue_change(Object *obj, char *name, TriggerData *trigdata,
+			 HeapTuple tuple, bool add)
+{
+	TupleDesc     tupdesc = trigdata->tg_relation->rd_att;
+	char        **args = trigdata->tg_trigger->tgargs;
+	VarChange    *change;
+	VarChange     row;
+	bool          idx_null;
+	bool          value_null;
+	MemoryContext oldcxt;
+
+	row.idx = column_int32(tuple, tupdesc, args[1], &idx_null);
+	row.value = column_int32(tuple, tupdesc, args[2], &value_null);
+	if (idx_null || value_null) {
+		return;
+	}
+	if (!change_in_range(obj, &row)) {
+		ereport(WARNING,
+				(errmsg("change to veil variable %s is out of range "
+						"(%d, %d)", name, row.idx, row.value),
+				 errhint("Use veil.perform_reset() to rebuild the "
+						 "variable.")));
+		return;
+	}
+	if (add && (obj->type == OBJ_BITMAP_ARRAY) &&
+		!vl_BitmapFromArray((BitmapArray *) obj, row.idx)) {
+		ereport(WARNING,
+				(errmsg("change to veil variable %s cannot be applied "
+						"(%d, %d)", name, row.idx, row.value),
+				 errdetail("Bitmaps can only be added to sparse bitmap "
+						   "arrays by init functions."),
+				 errhint("Use veil.perform_reset() to rebuild the "
+						 "variable.")));
+		return;
+	}
+
+	oldcxt = MemoryContextSwitchTo(TopTransactionContext);
+	change = palloc(sizeof(VarChange));
+	strlcpy(change->name, name, HASH_KEYLEN);
+	change->type = obj->type;
+	change->idx = row.idx;
+	change->value = row.value;
+	change->add = add;
+	change->nest_level = GetCurrentTransactionNestLevel();
+	change->target = NULL;
+	pending_changes = lappend(pending_changes, change);
+	MemoryContextSwitchTo(oldcxt);
+}
+
+/**
+ * Queue the changes to a shared BitmapArray or Int4Array required by
+ * the row change for which a maintenance trigger has fired.  The
+ * trigger must be an AFTER ROW trigger, whose arguments are the name
+ * of the shared variable and the names of the columns giving the array
+ * element and the bit, or value.  If the shared variable has not yet
+ * been created, there is nothing to maintain.
+ *
+ * @param trigdata The trigger data.
+ * @param type The type of variable to be maintained: OBJ_BITMAP_ARRAY
+ * or OBJ_INT4_ARRAY.
+ * @param fn_name The name of the trigger function, for error messages.
+ */
+void
+vl_queue_trigger_changes(TriggerData *trigdata, ObjType type,
+						 char *fn_name)
+{
+	TriggerEvent event = trigdata->tg_event;
+	char        *name;
+	VarEntry    *var;
+
+	if (!TRIGGER_FIRED_AFTER(event) || !TRIGGER_FIRED_FOR_ROW(event)) {
+		ereport(ERROR,
+				(errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
+				 errmsg("%s must be fired AFTER, FOR EACH ROW", fn_name)));
+	}
+	if (trigdata->tg_trigger->tgnargs != 3) {
+		ereport(ERROR,
+				(errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
+				 errmsg("%s requires 3 arguments", fn_name),
+				 errhint("The arguments are the variable name, and the "
+						 "names of the element and value columns.")));
+	}
+
+	name = trigdata->tg_trigger->tgargs[0];
+	var = vl_find_shared_variable(name);
+	if (!var || !var->obj) {
+		return;
+	}
+	if (var->obj->type != type) {
+		vl_type_mismatch(name, type, var->obj->type);
+	}
+
+	if (!callbacks_registered) {
+		RegisterXactCallback(maintain_xact_callback, NULL);
+		RegisterSubXactCallback(maintain_subxact_callback, NULL);
+		callbacks_registered = true;
+	}
+
+	if (TRIGGER_FIRED_BY_INSERT(event)) {
+		queue_change(var->obj, name, trigdata, trigdata->tg_trigtuple, true);
+	}
+	else if (TRIGGER_FIRED_BY_DELETE(event)) {
+		queue_change(var->obj, name, trigdata, trigdata->tg_trigtuple,
+					 false);
+	}
+	else if (TRIGGER_FIRED_BY_UPDATE(event)) {
+		queue_change(var->obj, name, trigdata, trigdata->tg_trigtuple,
+					 false);
+		queue_change(var->obj, name, trigdata, trigdata->tg_newtuple, true);
+	}
+}
@@ -15,8 +15,31 @@
 
 #include <stdio.h>
 #include "postgres.h"
+#include "access/heapam.h"
+#include "access/htup_details.h"
+#include "catalog/pg_class.h"
+#include "catalog/pg_inherits_fn.h"
 #include "catalog/pg_type.h"
 #include "executor/spi.h"
+#include "lib/stringinfo.h"
+#include "miscadmin.h"
+#include "parser/parse_func.h"
+#include "port/atomics.h"
+#include "postmaster/bgworker.h"
+#include "storage/dsm.h"
+#include "storage/lock.h"
+#include "utils/acl.h"
+#include "utils/builtins.h"
+#include "utils/hsearch.h"
+#include "utils/inval.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/rel.h"
+#include "utils/resowner.h"
+#include "utils/rls.h"
+#include "utils/snapmgr.h"
+#include "utils/syscache.h"
+#include "utils/varlena.h"
 #include "veil_version.h"
 #include "access/xact.h"
 #include "veil_funcs.h"
@@ -30,7 +53,8 @@ typedef bool (Fetch_fn)(HeapTuple, TupleDesc, void *);
 
 
 /**
- * The number of records to fetch in one go from the query executor.
+ * The number of records to fetch in one go from the query executor,
+ * through the cursor opened by ::query.
  */
 #define FETCH_SIZE    20
 
@@ -69,29 +93,25 @@ vl_spi_finish(bool pushed)
 }
 
 /** 
- * Prepare a query for query().  This creates and executes a plan.  The
- * caller must have established SPI_connect.  It is assumed that no
- * parameters to the query will be null.
+ * Prepare a query for query().  This creates, or retrieves a
+ * previously saved, plan.  The caller must have established
+ * SPI_connect.
  * \param qry The text of the SQL query to be performed.
  * \param nargs The number of input parameters ($1, $2, etc) to the query
  * \param argtypes Pointer to an array containing the OIDs of the data
- * \param args Actual parameters
  * types of the parameters 
- * \param read_only Whether the query should be read-only or not
  * \param saved_plan Adress of void pointer into which the query plan
  * will be saved.  Passing the same void pointer on a subsequent call
  * will cause the saved query plan to be re-used.
+ * \return The query plan.
  */
-static void
+static void *
 prepare_query(const char *qry,
 			  int nargs,
 			  Oid *argtypes,
-			  Datum *args,
-			  bool read_only,
 			  void **saved_plan)
 {
     void   *plan;
-    int     exec_result;
 	
     if (saved_plan && *saved_plan) {
 		/* A previously prepared plan is available, so use it */
@@ -112,24 +132,20 @@ prepare_query(const char *qry,
 			*saved_plan = SPI_saveplan(plan);
 		}
     }
-	
-	exec_result = SPI_execute_plan(plan, args, NULL, read_only, 0);
-	if (exec_result < 0) {
-		ereport(ERROR,
-				(errcode(ERRCODE_INTERNAL_ERROR),
-				 errmsg("prepare_query fails"),
-				 errdetail("SPI_execute_plan('%s') returns error %d",
-						   qry, exec_result)));
-    }
+	return plan;
 }
 
 /** 
  * Prepare and execute a query.  Query execution consists of a call to
  * process_row for each returned record.  Process_row can return a
  * single value to the caller of this function through the fn_param
- * parameter.  It is the caller's responsibility to establish an SPI
- * connection with SPI_connect.  It is assumed that no parameters to
- * the query, and no results will be null.
+ * parameter.  Rows are fetched through a cursor, ::FETCH_SIZE at a
+ * time, and each batch is freed once it has been processed, so that
+ * the memory used does not depend on the size of the result set.  This
+ * means that process_row must copy anything it needs to keep from the
+ * tuple it is given.  It is the caller's responsibility to establish
+ * an SPI connection with SPI_connect.  It is assumed that no
+ * parameters to the query, and no results will be null.
  * \param qry The text of the SQL query to be performed.
  * \param nargs The number of input parameters ($1, $2, etc) to the query
  * \param argtypes Pointer to an array containing the OIDs of the data
@@ -157,25 +173,47 @@ query(const char *qry,
       Fetch_fn process_row,
       void *fn_param)
 {
-    int  row;
-	int  fetched;
-	int  processed = 0;
-	bool cntinue;
+	void   *plan;
+	Portal  portal;
+    int     row;
+	int     fetched;
+	int     processed = 0;
+	bool    cntinue = true;
 	SPITupleTable *tuptab;
 
-    prepare_query(qry, nargs, argtypes, args, read_only, saved_plan);
-	fetched = SPI_processed;
-	tuptab = SPI_tuptable;
-	for(row = 0; row < fetched; row++) {
-		processed++;
-		/* Process a row using the processor function */
-		cntinue = process_row(tuptab->vals[row], 
-							  tuptab->tupdesc,
-							  fn_param);
-		if (!cntinue) {
+    plan = prepare_query(qry, nargs, argtypes, saved_plan);
+	portal = SPI_cursor_open(NULL, plan, args, NULL, read_only);
+	if (!portal) {
+		ereport(ERROR,
+				(errcode(ERRCODE_INTERNAL_ERROR),
+				 errmsg("query fails"),
+				 errdetail("SPI_cursor_open('%s') returns NULL "
+						   "(SPI_result = %d)", qry, SPI_result)));
+	}
+
+	while (cntinue) {
+		SPI_cursor_fetch(portal, true, FETCH_SIZE);
+		fetched = SPI_processed;
+		tuptab = SPI_tuptable;
+		for (row = 0; row < fetched; row++) {
+			processed++;
+			if (process_row) {
+				/* Process a row using the processor function */
+				cntinue = process_row(tuptab->vals[row], 
+									  tuptab->tupdesc,
+									  fn_param);
+				if (!cntinue) {
+					break;
+				}
+			}
+		}
+		SPI_freetuptable(tuptab);
+		if (fetched < FETCH_SIZE) {
 			break;
 		}
 	}
+
+	SPI_cursor_close(portal);
     return processed;
 }
 
@@ -241,31 +279,37 @@ vl_bool_from_query(const char *qry,
 }
 
 /** 
- * Executes a query by oid, that returns a single string value.
+ * Executes a query that returns a single string value.
  * 
  * @param qry The text of the query to be performed.
- * @param param The oid of the row to be fetched.
- * @param result Variable into which the result of the query will be placed.
+ * @param result Variable into which the result of the query will be
+ * placed.  This will be NULL if the query returns a null value.  The
+ * result is allocated in the current SPI memory context.
  * 
  * @return true if the query returned a record, false otherwise.
  */
-static bool
-str_from_oid_query(const char *qry,
-				   const Oid param,
-				   char *result)
+bool
+vl_str_from_query(const char *qry,
+				  char **result)
 {
 	int     rows;
-    Oid     argtypes[1] = {OIDOID};
-    Datum   args[1];
-	
-	args[0] = ObjectIdGetDatum(param);
-	rows = query(qry, 1, argtypes, args, false, NULL, 
-				 fetch_one_str, (void *)result);
+    Oid     argtypes[0];
+    Datum   args[0];
+
+	*result = NULL;
+	rows = query(qry, 0, argtypes, args, false, NULL, 
+				 fetch_one_str, (void *) result);
 	return (rows > 0);
 }
 
 /** 
  * Determine whether the given oid represents an existing database or not.
+ * This is called while probing Veil's shared memory contexts with
+ * InitialLWLock held, so rather than querying pg_database through SPI,
+ * it uses the syscache.  Syscache entries are invalidated through the
+ * shared invalidation queue when a database is dropped, so the result
+ * is always current, and costs at most a single index probe of
+ * pg_database per database per session.
  * 
  * @param db_id Oid of the database in which we are interested.
  * 
@@ -274,33 +318,529 @@ str_from_oid_query(const char *qry,
 extern bool
 vl_db_exists(Oid db_id)
 {
-	char dbname[NAMEDATALEN + 1];
+	if (!OidIsValid(db_id)) {
+		return false;
+	}
+	return SearchSysCacheExists1(DATABASEOID, ObjectIdGetDatum(db_id));
+}
+
+
+/**
+ * The state of a load of bits into a bitmap, bitmap array or bitmap
+ * hash, by vl_load_bits().
+ */
+typedef struct LoadState {
+	Object       *target;	/**< The Bitmap, BitmapArray or BitmapHash */
+	char         *row_col;	/**< Name of the column identifying the
+							 * bitmap to be updated, or NULL */
+	char         *bit_col;	/**< Name of the column giving the bit */
+	Oid           row_type;	/**< The type of row_col */
+	Oid           bit_type;	/**< The type of bit_col */
+	Oid           row_outfn; /**< Output function for row_col, for
+							  * keys of a BitmapHash */
+	MemoryContext tmpcxt;	/**< Per-row memory context */
+	int32         count;	/**< The number of bits set */
+} LoadState;
+
+/** 
+ * Convert an integer column value to an int32, raising an error if
+ * the column is not of an integer type or the value is out of range.
+ *
+ * @param value The column value.
+ * @param type The type of the column.
+ * @param colname The name of the column, for error messages.
+ *
+ * @return The value as an int32.
+ */
+int32
+vl_int32_from_datum(Datum value, Oid type, char *colname)
+{
+	int64 result;
 
-	return str_from_oid_query("select datname from pg_database where oid = $1",
-							  db_id, dbname);
+	switch (type) {
+	case INT2OID:
+		return (int32) DatumGetInt16(value);
+	case INT4OID:
+		return DatumGetInt32(value);
+	case INT8OID:
+		result = DatumGetInt64(value);
+		if ((result < PG_INT32_MIN) || (result > PG_INT32_MAX)) {
+			ereport(ERROR,
+					(errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
+					 errmsg("value " INT64_FORMAT " of column %s is out "
+							"of range", result, colname)));
+		}
+		return (int32) result;
+	default:
+		ereport(ERROR,
+				(errcode(ERRCODE_DATATYPE_MISMATCH),
+				 errmsg("column %s must be of an integer type", colname)));
+	}
+	return 0;
 }
 
+/** 
+ * Set the bit identified by a row of the relation being loaded.  Rows
+ * containing nulls are ignored.
+ *
+ * @param state The state of the load.
+ * @param row The value of the row column, if any.
+ * @param row_null Whether the row column is null.
+ * @param bit The value of the bit column.
+ * @param bit_null Whether the bit column is null.
+ */
+static void
+load_bit(LoadState *state, Datum row, bool row_null, Datum bit, bool bit_null)
+{
+	BitmapArray  *bmarray;
+	Bitmap       *bitmap;
+	MemoryContext oldcxt;
+	char         *key;
+	int32         elem;
+	int32         bitno;
+
+	if (bit_null || (state->row_col && row_null)) {
+		return;
+	}
+	bitno = vl_int32_from_datum(bit, state->bit_type, state->bit_col);
+
+	switch (state->target->type) {
+	case OBJ_BITMAP:
+		bitmap = (Bitmap *) state->target;
+		break;
+	case OBJ_BITMAP_ARRAY:
+		bmarray = (BitmapArray *) state->target;
+		elem = vl_int32_from_datum(row, state->row_type, state->row_col);
+		bitmap = vl_AddBitmapToArray(bmarray, elem);
+		if (!bitmap) {
+			ereport(ERROR,
+					(errcode(ERRCODE_INTERNAL_ERROR),
+					 errmsg("Bitmap Array range error (%d not in %d..%d)", 
+							elem, bmarray->arrayzero, bmarray->arraymax),
+					 errdetail("Attempt to reference BitmapArray element "
+							   "outside of the BitmapArray's defined "
+							   "range")));
+		}
+		break;
+	default:
+		/* OBJ_BITMAP_HASH: any type of key is accepted, through its
+		 * text representation. */
+		oldcxt = MemoryContextSwitchTo(state->tmpcxt);
+		switch (state->row_type) {
+		case TEXTOID:
+		case VARCHAROID:
+		case BPCHAROID:
+			key = TextDatumGetCString(row);
+			break;
+		case NAMEOID:
+			key = NameStr(*DatumGetName(row));
+			break;
+		default:
+			key = OidOutputFunctionCall(state->row_outfn, row);
+		}
+		MemoryContextSwitchTo(oldcxt);
+		bitmap = vl_AddBitmapToHash((BitmapHash *) state->target, key);
+		MemoryContextReset(state->tmpcxt);
+	}
+
+	vl_BitmapSetbit(bitmap, bitno);
+	state->count++;
+}
 
 /** 
- * ::Fetch_fn function for executing registered veil_init() functions for
- * ::query.
+ * ::Fetch_fn function for loading bits from the rows of a filtered
+ * query, for ::query.  The bit column is the first in the result, and
+ * the row column, if any, the second.
  * \param tuple The row to be processed
  * \param tupdesc Descriptor for the types of the fields in the tuple.
- * \param p_param Pointer to a boolean value which is the value of the
- * argument to the init function being called.
+ * \param p_state Pointer to the ::LoadState.
  * \return true.  This allows ::query to process further rows.
  */
 static bool
-exec_init_fn(HeapTuple tuple, TupleDesc tupdesc, void *p_param)
+fetch_bit(HeapTuple tuple, TupleDesc tupdesc, void *p_state)
 {
-    char *col = SPI_getvalue(tuple, tupdesc, 1);
-	char *qry = palloc(strlen(col) + 15);
+	LoadState *state = (LoadState *) p_state;
+	Datum      bit;
+	Datum      row = (Datum) 0;
+	bool       bit_null;
+	bool       row_null = true;
+
+	bit = SPI_getbinval(tuple, tupdesc, 1, &bit_null);
+	if (state->row_col) {
+		row = SPI_getbinval(tuple, tupdesc, 2, &row_null);
+	}
+	load_bit(state, row, row_null, bit, bit_null);
+	return true;
+}
+
+/** 
+ * Load bits, through a query, from the rows of a relation that match a
+ * filter condition.
+ *
+ * @param state The state of the load.
+ * @param relid The relation.
+ * @param filter The SQL condition that rows must match, or NULL.
+ */
+static void
+load_bits_from_query(LoadState *state, Oid relid, char *filter)
+{
+	StringInfoData qry;
+	Oid     argtypes[0];
+	Datum   args[0];
+	bool    pushed;
+	int     ok;
+
+	initStringInfo(&qry);
+	appendStringInfo(&qry, "select %s", quote_identifier(state->bit_col));
+	if (state->row_col) {
+		appendStringInfo(&qry, ", %s", quote_identifier(state->row_col));
+	}
+	appendStringInfo(&qry, " from %s", 
+					 quote_qualified_identifier(
+						 get_namespace_name(get_rel_namespace(relid)),
+						 get_rel_name(relid)));
+	if (filter) {
+		appendStringInfo(&qry, " where %s", filter);
+	}
+
+	ok = vl_spi_connect(&pushed);
+	if (ok != SPI_OK_CONNECT) {
+		ereport(ERROR,
+				(errcode(ERRCODE_INTERNAL_ERROR),
+				 errmsg("failed to execute vl_load_bits() (1)"),
+				 errdetail("SPI_connect() failed, returning %d.", ok)));
+	}
+
+	(void) query(qry.data, 0, argtypes, args, true, NULL, 
+				 fetch_bit, (void *) state);
+
+	ok = vl_spi_finish(pushed);
+	if (ok != SPI_OK_FINISH) {
+		ereport(ERROR,
+				(errcode(ERRCODE_INTERNAL_ERROR),
+				 errmsg("failed to execute vl_load_bits() (2)"),
+				 errdetail("SPI_finish() failed, returning %d.", ok)));
+	}
+	pfree(qry.data);
+}
+
+/** 
+ * Load bits from every row of a relation by scanning the relation
+ * directly, with no query or per-row function calls.
+ *
+ * @param state The state of the load.
+ * @param relid The relation.
+ * @param row_att The attribute number of the row column, if any.
+ * @param bit_att The attribute number of the bit column.
+ */
+static void
+load_bits_from_scan(LoadState *state, Oid relid, 
+					AttrNumber row_att, AttrNumber bit_att)
+{
+	Relation     rel = heap_open(relid, AccessShareLock);
+	TupleDesc    tupdesc = RelationGetDescr(rel);
+	HeapScanDesc scan;
+	HeapTuple    tuple;
+	Datum        bit;
+	Datum        row = (Datum) 0;
+	bool         bit_null;
+	bool         row_null = true;
+
+	scan = heap_beginscan(rel, GetActiveSnapshot(), 0, NULL);
+	while ((tuple = heap_getnext(scan, ForwardScanDirection)) != NULL) {
+		CHECK_FOR_INTERRUPTS();
+		bit = heap_getattr(tuple, bit_att, tupdesc, &bit_null);
+		if (state->row_col) {
+			row = heap_getattr(tuple, row_att, tupdesc, &row_null);
+		}
+		load_bit(state, row, row_null, bit, bit_null);
+	}
+	heap_endscan(scan);
+	heap_close(rel, AccessShareLock);
+}
+
+/** 
+ * Set bits in a Bitmap, BitmapArray or BitmapHash from the rows of a
+ * relation.  Each row gives the number of the bit to be set and, for
+ * a BitmapArray or BitmapHash, the element or key of the bitmap in
+ * which it is to be set.  If the relation is an ordinary table with no
+ * inheritance children, there is no filter, and the relation is not
+ * subject to row level security, the relation is scanned directly.
+ * Otherwise, as for views, partitioned tables and inheritance parents,
+ * the rows are fetched by a query.
+ *
+ * @param target The Bitmap, BitmapArray or BitmapHash.
+ * @param relid The relation from which the bits are to be loaded.
+ * @param row_col The name of the column identifying the bitmap in the
+ * array or hash.  This is ignored for a Bitmap.
+ * @param bit_col The name of the column giving the bit to be set.
+ * @param filter An SQL condition that rows must match, or NULL.
+ *
+ * @return The number of bits set.
+ */
+int32
+vl_load_bits(Object *target, Oid relid, 
+			 char *row_col, char *bit_col, char *filter)
+{
+	LoadState  state;
+	AttrNumber row_att = InvalidAttrNumber;
+	AttrNumber bit_att;
+	AclResult  aclresult;
+
+	aclresult = pg_class_aclcheck(relid, GetUserId(), ACL_SELECT);
+	if (aclresult != ACLCHECK_OK) {
+		aclcheck_error(aclresult, ACL_KIND_CLASS, get_rel_name(relid));
+	}
+
+	state.target = target;
+	state.row_col = (target->type == OBJ_BITMAP)? NULL: row_col;
+	state.bit_col = bit_col;
+	state.count = 0;
+
+	bit_att = get_attnum(relid, bit_col);
+	if (bit_att == InvalidAttrNumber) {
+		ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_COLUMN),
+				 errmsg("column %s of relation %s does not exist",
+						bit_col, get_rel_name(relid))));
+	}
+	state.bit_type = get_atttype(relid, bit_att);
+
+	if (state.row_col) {
+		row_att = get_attnum(relid, row_col);
+		if (row_att == InvalidAttrNumber) {
+			ereport(ERROR,
+					(errcode(ERRCODE_UNDEFINED_COLUMN),
+					 errmsg("column %s of relation %s does not exist",
+							row_col, get_rel_name(relid))));
+		}
+		state.row_type = get_atttype(relid, row_att);
+		if (target->type == OBJ_BITMAP_HASH) {
+			bool varlena;
+
+			getTypeOutputInfo(state.row_type, &state.row_outfn, &varlena);
+		}
+	}
+
+	state.tmpcxt = AllocSetContextCreate(CurrentMemoryContext,
+										 "veil load bits",
+										 ALLOCSET_DEFAULT_SIZES);
+	if (filter || (get_rel_relkind(relid) != RELKIND_RELATION) ||
+		has_subclass(relid) ||
+		(check_enable_rls(relid, InvalidOid, false) == RLS_ENABLED)) {
+		load_bits_from_query(&state, relid, filter);
+	}
+	else {
+		load_bits_from_scan(&state, relid, row_att, bit_att);
+	}
+	MemoryContextDelete(state.tmpcxt);
+
+	return state.count;
+}
+
+
+/**
+ * The maximum length of the name of an init function that may be run
+ * by a background worker.  Functions with longer names are always run
+ * by the calling backend.
+ */
+#define INIT_FN_NAMELEN    (2 * NAMEDATALEN + 8)
+
+/**
+ * Status of an init function task that is to be run by a background
+ * worker: not yet claimed.
+ */
+#define INIT_FN_PENDING    0
+
+/**
+ * Status of an init function task: claimed by a worker, or by the
+ * calling backend, and not yet successfully completed.  If this is
+ * still the status once all workers have exited, the function failed.
+ */
+#define INIT_FN_RUNNING    1
+
+/**
+ * Status of an init function task: successfully completed.
+ */
+#define INIT_FN_DONE       2
+
+/**
+ * A registered init function, as read from veil.veil_init_fns.
+ */
+typedef struct InitFn {
+	char   *fn_name;		/**< The (possibly qualified) function name */
+	int32   priority;		/**< The priority with which it is run */
+	bool    parallel;		/**< Whether it may be run concurrently with
+							 * others of the same priority */
+} InitFn;
+
+/**
+ * The list of registered init functions built by fetch_init_fn().
+ */
+typedef struct InitFnList {
+	int     count;			/**< The number of entries used in fns */
+	int     size;			/**< The number of entries allocated */
+	InitFn *fns;			/**< Array of init functions */
+} InitFnList;
+
+/**
+ * A single init function to be run in a background worker.
+ */
+typedef struct InitFnTask {
+	char   fn_name[INIT_FN_NAMELEN]; /**< The function name */
+	volatile int status;	/**< INIT_FN_PENDING, _RUNNING or _DONE */
+} InitFnTask;
+
+/**
+ * The dynamic shared memory segment through which a group of init
+ * functions, all of the same priority, is handed to background
+ * workers.  Each worker, and the calling backend, repeatedly claims the
+ * next unclaimed task until none remain.
+ */
+typedef struct InitFnGroup {
+	Oid    db_id;			/**< The database to connect to */
+	Oid    user_id;			/**< The user to connect as */
+	bool   param;			/**< The parameter for each init function */
+	bool   switching;		/**< Whether the caller has prepared a
+							 * context switch, which workers must join */
+	int    ntasks;			/**< The number of tasks */
+	pg_atomic_uint32 next;	/**< Index of the next unclaimed task */
+	InitFnTask task[FLEXIBLE_ARRAY_MEMBER]; /**< The tasks themselves */
+} InitFnGroup;
+
+/**
+ * An entry in the session cache of resolved init functions.  Entries
+ * are keyed by the function name as registered in veil.veil_init_fns.
+ */
+typedef struct InitFnCacheEntry {
+	char     fn_name[INIT_FN_NAMELEN]; /**< The hash key */
+	bool     valid;			/**< False once invalidated by a change to
+							 * pg_proc */
+	Oid      fn_oid;		/**< The resolved function */
+	uint32   hashvalue;		/**< PROCOID syscache hash value for fn_oid */
+	FmgrInfo flinfo;		/**< Lookup info for calling the function */
+} InitFnCacheEntry;
+
+/**
+ * Session cache of resolved init functions, created on first use by
+ * lookup_init_fn().
+ */
+static HTAB *init_fn_cache = NULL;
+
+/**
+ * Syscache callback for pg_proc.  Invalidates any cached init
+ * function that may have been altered or dropped.
+ *
+ * @param arg Unused.
+ * @param cacheid Unused (always PROCOID).
+ * @param hashvalue The hash value of the changed pg_proc entry, or 0
+ * if all entries should be invalidated.
+ */
+static void
+init_fn_cache_callback(Datum arg, int cacheid, uint32 hashvalue)
+{
+	HASH_SEQ_STATUS   status;
+	InitFnCacheEntry *entry;
+
+	hash_seq_init(&status, init_fn_cache);
+	while ((entry = hash_seq_search(&status))) {
+		if ((hashvalue == 0) || (entry->hashvalue == hashvalue)) {
+			entry->valid = false;
+		}
+	}
+}
+
+/** 
+ * Resolve the name of an init function to the function taking a single
+ * boolean argument, and cache its fmgr lookup information for the
+ * session.
+ *
+ * @param fn_name The name of the init function.
+ *
+ * @return Pointer to the function's fmgr lookup information, or NULL if
+ * the name cannot be resolved directly, in which case the caller
+ * should fall back to calling the function through SQL.  This includes
+ * names that are not simple, possibly qualified, function names.
+ */
+static FmgrInfo *
+lookup_init_fn(char *fn_name)
+{
+	InitFnCacheEntry *entry;
+	HASHCTL hashctl;
+	Oid     argtypes[1] = {BOOLOID};
+	Oid     fn_oid;
+	bool    found;
+	MemoryContext oldcontext = CurrentMemoryContext;
+	List   *volatile names = NIL;
+
+	if (strlen(fn_name) >= INIT_FN_NAMELEN) {
+		return NULL;
+	}
+
+	if (!init_fn_cache) {
+		MemSet(&hashctl, 0, sizeof(hashctl));
+		hashctl.keysize = INIT_FN_NAMELEN;
+		hashctl.entrysize = sizeof(InitFnCacheEntry);
+		init_fn_cache = hash_create("VEIL_INIT_FNS", 16, &hashctl, HASH_ELEM);
+		CacheRegisterSyscacheCallback(PROCOID, init_fn_cache_callback,
+									  (Datum) 0);
+	}
+
+	entry = (InitFnCacheEntry *) hash_search(init_fn_cache, fn_name,
+											 HASH_ENTER, &found);
+	if (found && entry->valid) {
+		return &entry->flinfo;
+	}
+
+	entry->valid = false;
+	PG_TRY();
+	{
+		names = stringToQualifiedNameList(fn_name);
+	}
+	PG_CATCH();
+	{
+		/* The name cannot be parsed as a function name, so leave it to
+		 * exec_init_fn_query() to make sense of it. */
+		MemoryContextSwitchTo(oldcontext);
+		FlushErrorState();
+		names = NIL;
+	}
+	PG_END_TRY();
+	if (names == NIL) {
+		return NULL;
+	}
+
+	fn_oid = LookupFuncName((List *) names, 1, argtypes, true);
+	if (!OidIsValid(fn_oid)) {
+		return NULL;
+	}
+
+	fmgr_info_cxt(fn_oid, &entry->flinfo, TopMemoryContext);
+	entry->fn_oid = fn_oid;
+	entry->hashvalue = GetSysCacheHashValue1(PROCOID,
+											 ObjectIdGetDatum(fn_oid));
+	entry->valid = true;
+	return &entry->flinfo;
+}
+
+/** 
+ * Execute a single init function through SQL.  This is used for init
+ * functions that cannot be resolved by lookup_init_fn(), for instance
+ * because they rely on a default parameter value or an implicit cast.
+ * The caller must have established an SPI connection.
+ *
+ * @param fn_name The name of the init function.
+ * @param param The boolean argument to be passed to the init function.
+ */
+static void
+exec_init_fn_query(char *fn_name, bool param)
+{
+	char *qry = palloc(strlen(fn_name) + 15);
 	bool pushed;
 	bool result;
 	int ok;
 
-	(void) sprintf(qry, "select %s(%s)", col, 
-				   *((bool *) p_param)? "true": "false");
+	(void) sprintf(qry, "select %s(%s)", fn_name, param? "true": "false");
 
 	ok = vl_spi_connect(&pushed);
 	if (ok != SPI_OK_CONNECT) {
@@ -320,13 +860,427 @@ exec_init_fn(HeapTuple tuple, TupleDesc tupdesc, void *p_param)
 				 errmsg("failed to execute exec_init_fn() (2)"),
 				 errdetail("SPI_finish() failed, returning %d.", ok)));
 	}
+	pfree(qry);
+}
+
+/**
+ * The depth to which init functions, or the loading of a snapshot of
+ * shared variables, are running in this backend.  See vl_in_init().
+ */
+static int init_depth = 0;
+
+/** 
+ * Record that this backend has started running an init function, or
+ * loading a snapshot.  Each call must be matched by a call to
+ * vl_leave_init(), including when an error is raised.
+ */
+void
+vl_enter_init()
+{
+	init_depth++;
+}
+
+/** 
+ * Record that this backend has finished running an init function, or
+ * loading a snapshot, started by vl_enter_init().
+ */
+void
+vl_leave_init()
+{
+	init_depth--;
+}
+
+/** 
+ * Report whether this backend is running an init function, or loading
+ * a snapshot.  Some operations that allocate shared memory which can
+ * never be freed, such as adding bitmaps to a shared sparse bitmap
+ * array, are only allowed then, so that their cost is bounded by the
+ * init functions and recovered by the next reset.
+ *
+ * @return true if an init function is running.
+ */
+bool
+vl_in_init()
+{
+	return init_depth > 0;
+}
+
+/** 
+ * Execute a single init function.  Where possible, the function is
+ * called directly through the fmgr, using lookup information cached
+ * for the session, which avoids parsing and planning a query for each
+ * call.  As with a call through SQL, the user must have execute
+ * privilege on the function, and the function's result, which may be
+ * NULL, is ignored.  The caller must have established an SPI
+ * connection.
+ *
+ * @param fn_name The name of the init function.
+ * @param param The boolean argument to be passed to the init function.
+ */
+static void
+exec_init_fn(char *fn_name, bool param)
+{
+	FmgrInfo      *flinfo = lookup_init_fn(fn_name);
+	AclResult      aclresult;
+	FunctionCallInfoData fcinfo;
+
+	vl_enter_init();
+	PG_TRY();
+	{
+		if (!flinfo) {
+			exec_init_fn_query(fn_name, param);
+		}
+		else {
+			aclresult = pg_proc_aclcheck(flinfo->fn_oid, GetUserId(), 
+										 ACL_EXECUTE);
+			if (aclresult != ACLCHECK_OK) {
+				aclcheck_error(aclresult, ACL_KIND_PROC, fn_name);
+			}
+
+			/* Unlike FunctionCall1(), this allows a NULL result */
+			InitFunctionCallInfoData(fcinfo, flinfo, 1, InvalidOid, 
+									 NULL, NULL);
+			fcinfo.arg[0] = BoolGetDatum(param);
+			fcinfo.argnull[0] = false;
+			(void) FunctionCallInvoke(&fcinfo);
+			CommandCounterIncrement();
+		}
+	}
+	PG_CATCH();
+	{
+		vl_leave_init();
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+	vl_leave_init();
+}
+
+/** 
+ * Call the initialiser registered for a variable in
+ * veil.veil_variable_init_fns, passing it false as for session
+ * initialisation.  The caller must have established an SPI connection.
+ *
+ * @param name The name of the variable.
+ *
+ * @return true if an initialiser was registered and has been called.
+ */
+bool
+vl_call_variable_init_fn(char *name)
+{
+	static void *saved_plan = NULL;
+    Oid     argtypes[1] = {TEXTOID};
+    Datum   args[1];
+	char   *fn_name = NULL;
+
+	args[0] = CStringGetTextDatum(name);
+	(void) query("select fn_name from veil.veil_variable_init_fns "
+				 "where var_name = $1", 
+				 1, argtypes, args, false, &saved_plan, 
+				 fetch_one_str, (void *) &fn_name);
+	if (!fn_name) {
+		return false;
+	}
+
+	exec_init_fn(fn_name, false);
+	return true;
+}
 
+/** 
+ * ::Fetch_fn function for building a list of variable names, for
+ * ::query.  The names are allocated in TopMemoryContext.
+ * \param tuple The row to be processed
+ * \param tupdesc Descriptor for the types of the fields in the tuple.
+ * \param p_list Pointer to the List to which the name is to be added.
+ * \return true.  This allows ::query to process further rows.
+ */
+static bool
+fetch_var_name(HeapTuple tuple, TupleDesc tupdesc, void *p_list)
+{
+	List        **list = (List **) p_list;
+	MemoryContext oldcxt = MemoryContextSwitchTo(TopMemoryContext);
+
+	*list = lappend(*list, pstrdup(SPI_getvalue(tuple, tupdesc, 1)));
+	MemoryContextSwitchTo(oldcxt);
     return true;
 }
 
+/** 
+ * Return the names of the session variables registered in
+ * veil.veil_derived_variables, as being derived from shared
+ * variables.  The caller must have established an SPI connection.
+ *
+ * @return A List, allocated in TopMemoryContext, of the variable
+ * names.
+ */
+List *
+vl_derived_variables()
+{
+	static void *saved_plan = NULL;
+    Oid     argtypes[0];
+    Datum   args[0];
+	List   *names = NIL;
+
+	(void) query("select var_name from veil.veil_derived_variables", 
+				 0, argtypes, args, true, &saved_plan, 
+				 fetch_var_name, (void *) &names);
+	return names;
+}
+
+/** 
+ * ::Fetch_fn function for recording registered veil_init() functions
+ * for ::query.
+ * \param tuple The row to be processed
+ * \param tupdesc Descriptor for the types of the fields in the tuple.
+ * \param p_list Pointer to the ::InitFnList to which the function is
+ * to be added.
+ * \return true.  This allows ::query to process further rows.
+ */
+static bool
+fetch_init_fn(HeapTuple tuple, TupleDesc tupdesc, void *p_list)
+{
+	InitFnList *list = (InitFnList *) p_list;
+	InitFn     *fn;
+	bool        isnull;
+
+	if (list->count == list->size) {
+		list->size = list->size? list->size * 2: 8;
+		list->fns = list->fns? 
+			repalloc(list->fns, sizeof(InitFn) * list->size):
+			palloc(sizeof(InitFn) * list->size);
+	}
+
+	fn = &list->fns[list->count++];
+	fn->fn_name = SPI_getvalue(tuple, tupdesc, 1);
+	fn->priority = DatumGetInt32(SPI_getbinval(tuple, tupdesc, 2, &isnull));
+	fn->parallel = DatumGetBool(SPI_getbinval(tuple, tupdesc, 3, &isnull));
+
+    return true;
+}
 
 /** 
- * Identify any registered init_functions and execute them.
+ * Claim and execute tasks from group until none remain.  Each task is
+ * marked as running before it is executed, so that if it fails, the
+ * backend that started the group will be able to tell.
+ *
+ * @param group The group of init functions.
+ */
+static void
+run_init_tasks(InitFnGroup *group)
+{
+	uint32      idx;
+	InitFnTask *task;
+
+	while ((idx = pg_atomic_fetch_add_u32(&group->next, 1)) < (uint32)
+		   group->ntasks) {
+		task = &group->task[idx];
+		task->status = INIT_FN_RUNNING;
+		exec_init_fn(task->fn_name, group->param);
+		task->status = INIT_FN_DONE;
+	}
+}
+
+/** 
+ * Start a background worker to run tasks from a group of init
+ * functions.
+ *
+ * @param seg The dynamic shared memory segment containing the group.
+ *
+ * @return Handle for the worker, or NULL if no worker could be
+ * registered.
+ */
+static BackgroundWorkerHandle *
+start_init_worker(dsm_segment *seg)
+{
+	BackgroundWorker        worker;
+	BackgroundWorkerHandle *handle;
+
+	memset(&worker, 0, sizeof(worker));
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS | 
+		BGWORKER_BACKEND_DATABASE_CONNECTION;
+	worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+	worker.bgw_restart_time = BGW_NEVER_RESTART;
+	(void) snprintf(worker.bgw_library_name, BGW_MAXLEN, "veil");
+	(void) snprintf(worker.bgw_function_name, BGW_MAXLEN, 
+					"vl_init_fn_worker");
+	(void) snprintf(worker.bgw_name, BGW_MAXLEN, 
+					"veil init worker for pid %d", MyProcPid);
+	worker.bgw_main_arg = UInt32GetDatum(dsm_segment_handle(seg));
+	worker.bgw_notify_pid = MyProcPid;
+
+	if (!RegisterDynamicBackgroundWorker(&worker, &handle)) {
+		return NULL;
+	}
+	return handle;
+}
+
+/** 
+ * Report whether this backend holds any lock on a relation stronger
+ * than AccessShareLock.  Init functions run by background workers
+ * may need to read such a relation, and would then wait for our
+ * transaction to end while we wait for them, in a deadlock that the
+ * lock manager cannot see.
+ *
+ * @return true if such a lock is held.
+ */
+static bool
+holds_relation_write_locks()
+{
+	LockData *data = GetLockStatusData();
+	LockInstanceData *lock;
+	int       i;
+
+	for (i = 0; i < data->nelements; i++) {
+		lock = &data->locks[i];
+		if ((lock->pid == MyProcPid) && 
+			(lock->locktag.locktag_type == LOCKTAG_RELATION) &&
+			(lock->holdMask & ~LOCKBIT_ON(AccessShareLock))) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/** 
+ * Wait for background workers started by run_init_group() to exit.
+ * The wait may be interrupted, by a query cancel or statement_timeout,
+ * in which case an ERROR is raised.
+ *
+ * @param handles The handles of the workers, or NULL for any that
+ * could not be started.
+ * @param nworkers The number of handles.
+ */
+static void
+wait_for_init_workers(BackgroundWorkerHandle **handles, int nworkers)
+{
+	int i;
+
+	for (i = 0; i < nworkers; i++) {
+		if (handles[i]) {
+			/* This checks for interrupts as it waits */
+			(void) WaitForBackgroundWorkerShutdown(handles[i]);
+		}
+	}
+}
+
+/** 
+ * Run a group of init functions, all of the same priority.  Those
+ * registered as parallel are handed to background workers, while this
+ * backend runs the rest.  Once it has done so, this backend helps the
+ * workers with any parallel functions that remain, so if no workers
+ * can be started, all functions are simply run serially.  They are
+ * also run serially if this transaction holds locks that the workers
+ * might need: see holds_relation_write_locks().
+ *
+ * @param fns The init functions in the group.
+ * @param count The number of init functions in the group.
+ * @param param The boolean argument to be passed to each function.
+ */
+static void
+run_init_group(InitFn *fns, int count, bool param)
+{
+	int          ntasks = 0;
+	int          nworkers;
+	int          i;
+	Size         size;
+	dsm_segment *seg;
+	InitFnGroup *group;
+	BackgroundWorkerHandle **handles;
+
+	/* Parallel execution is only useful when resetting shared
+	 * variables: any session variables that a worker created would
+	 * be lost when it exits. */
+	if (param && (veil_init_workers() > 0) && 
+		!holds_relation_write_locks()) {
+		for (i = 0; i < count; i++) {
+			if (fns[i].parallel && (strlen(fns[i].fn_name) < INIT_FN_NAMELEN)) {
+				ntasks++;
+			}
+		}
+	}
+
+	if (ntasks < 2) {
+		for (i = 0; i < count; i++) {
+			exec_init_fn(fns[i].fn_name, param);
+		}
+		return;
+	}
+
+	size = offsetof(InitFnGroup, task) + sizeof(InitFnTask) * ntasks;
+	seg = dsm_create(size, 0);
+	group = (InitFnGroup *) dsm_segment_address(seg);
+	group->db_id = MyDatabaseId;
+	group->user_id = GetUserId();
+	group->param = param;
+	group->switching = vl_switch_prepared();
+	group->ntasks = 0;
+	pg_atomic_init_u32(&group->next, 0);
+
+	for (i = 0; i < count; i++) {
+		if (fns[i].parallel && (strlen(fns[i].fn_name) < INIT_FN_NAMELEN)) {
+			strcpy(group->task[group->ntasks].fn_name, fns[i].fn_name);
+			group->task[group->ntasks].status = INIT_FN_PENDING;
+			group->ntasks++;
+		}
+	}
+
+	nworkers = Min(ntasks, veil_init_workers());
+	handles = palloc0(sizeof(BackgroundWorkerHandle *) * nworkers);
+	vl_set_init_workers_active(true);
+
+	PG_TRY();
+	{
+		for (i = 0; i < nworkers; i++) {
+			handles[i] = start_init_worker(seg);
+		}
+
+		for (i = 0; i < count; i++) {
+			if (!(fns[i].parallel && 
+				  (strlen(fns[i].fn_name) < INIT_FN_NAMELEN))) {
+				exec_init_fn(fns[i].fn_name, param);
+			}
+		}
+		run_init_tasks(group);
+		wait_for_init_workers(handles, nworkers);
+	}
+	PG_CATCH();
+	{
+		/* The workers must not go on creating variables in a context
+		 * whose switch is about to be abandoned. */
+		for (i = 0; i < nworkers; i++) {
+			if (handles[i]) {
+				TerminateBackgroundWorker(handles[i]);
+				(void) WaitForBackgroundWorkerShutdown(handles[i]);
+			}
+		}
+		vl_set_init_workers_active(false);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+	vl_set_init_workers_active(false);
+
+	for (i = 0; i < group->ntasks; i++) {
+		if (group->task[i].status != INIT_FN_DONE) {
+			ereport(ERROR,
+					(errcode(ERRCODE_INTERNAL_ERROR),
+					 errmsg("init function %s failed", 
+							group->task[i].fn_name),
+					 errdetail("The function was run by a background "
+							   "worker: check the server log for the "
+							   "cause.")));
+		}
+	}
+
+	dsm_detach(seg);
+	pfree(handles);
+}
+
+/** 
+ * Identify any registered init_functions and execute them.  Functions
+ * are run in priority order.  When shared variables are being reset,
+ * functions of the same priority that are registered as parallel may
+ * be run concurrently in background workers (see veil.init_workers),
+ * so that a group of functions takes only as long as the slowest of
+ * them.  The query of veil.veil_init_fns is planned once per session.
  * 
  * @param param The boolean parameter to be passed to each init_function.
  * 
@@ -337,9 +1291,13 @@ vl_call_init_fns(bool param)
 {
     Oid     argtypes[0];
     Datum   args[0];
-	char   *qry = "select fn_name from veil.veil_init_fns order by priority";
+	char   *qry = "select fn_name, priority, parallel "
+		"from veil.veil_init_fns order by priority";
+	InitFnList list = {0, 0, NULL};
+	static void *saved_plan = NULL;
 	bool    pushed;
-	int     rows;
+	int     first;
+	int     last;
 	int     ok;
 
 	ok = vl_spi_connect(&pushed);
@@ -350,8 +1308,17 @@ vl_call_init_fns(bool param)
 				 errdetail("SPI_connect() failed, returning %d.", ok)));
 	}
 
-	rows = query(qry, 0, argtypes, args, false, NULL, 
-				 exec_init_fn, (void *) &param);
+	(void) query(qry, 0, argtypes, args, false, &saved_plan, 
+				 fetch_init_fn, (void *) &list);
+
+	for (first = 0; first < list.count; first = last) {
+		for (last = first + 1; last < list.count; last++) {
+			if (list.fns[last].priority != list.fns[first].priority) {
+				break;
+			}
+		}
+		run_init_group(&list.fns[first], last - first, param);
+	}
 
 	ok = vl_spi_finish(pushed);
 	if (ok != SPI_OK_FINISH) {
@@ -360,5 +1327,56 @@ vl_call_init_fns(bool param)
 				 errmsg("failed to execute vl_call_init_fns() (2)"),
 				 errdetail("SPI_finish() failed, returning %d.", ok)));
 	}
-    return rows;
+    return list.count;
+}
+
+/** 
+ * Main function for background workers started by run_init_group().
+ * The worker connects to the database as the user of the backend that
+ * started it, joins any context switch that backend has prepared, and
+ * then runs init functions from the group until none remain.
+ *
+ * @param main_arg The handle of the dynamic shared memory segment
+ * containing the ::InitFnGroup.
+ */
+void
+vl_init_fn_worker(Datum main_arg)
+{
+	dsm_segment *seg;
+	InitFnGroup *group;
+
+	BackgroundWorkerUnblockSignals();
+
+	CurrentResourceOwner = ResourceOwnerCreate(NULL, "veil init worker");
+	seg = dsm_attach(DatumGetUInt32(main_arg));
+	if (!seg) {
+		ereport(ERROR,
+				(errcode(ERRCODE_INTERNAL_ERROR),
+				 errmsg("veil init worker unable to map dynamic "
+						"shared memory segment")));
+	}
+	group = (InitFnGroup *) dsm_segment_address(seg);
+
+	BackgroundWorkerInitializeConnectionByOid(group->db_id, group->user_id);
+
+	SetCurrentStatementStartTimestamp();
+	StartTransactionCommand();
+	PushActiveSnapshot(GetTransactionSnapshot());
+
+	(void) vl_get_shared_hash();  /* Init all shared memory constructs */
+	vl_skip_session_init();
+	if (group->switching && !vl_join_context_switch()) {
+		ereport(ERROR,
+				(errcode(ERRCODE_INTERNAL_ERROR),
+				 errmsg("veil init worker cannot join context switch"),
+				 errdetail("The context switch is no longer in "
+						   "progress.")));
+	}
+
+	run_init_tasks(group);
+
+	PopActiveSnapshot();
+	CommitTransactionCommand();
+	dsm_detach(seg);
+	proc_exit(0);
 }
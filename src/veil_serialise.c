@@ -21,6 +21,10 @@
  */
 
 #include "postgres.h"
+#include "catalog/pg_collation.h"
+#include "port/pg_crc32c.h"
+#include "utils/builtins.h"
+#include "utils/memutils.h"
 #include "veil_version.h"
 #include "veil_funcs.h"
 #include "veil_datatypes.h"
@@ -36,11 +40,35 @@
 #define BITMAP_HDR        'M'
 #endif
 #define BITMAP_ARRAY_HDR  'A'
+#define SPARSE_ARRAY_HDR  'S'
 #define BITMAP_HASH_HDR   'H'
 #define INT4_ARRAY_HDR    'I'
 #define BITMAP_HASH_MORE  '>'
 #define BITMAP_HASH_DONE  '.'
 
+/* Headers for bitmap types whose bitsets are packed */
+#ifdef USE_64_BIT
+#define PACKED_BITMAP_HDR 'b'
+#else
+#define PACKED_BITMAP_HDR 'm'
+#endif
+#define PACKED_ARRAY_HDR  'a'
+#define PACKED_SPARSE_HDR 's'
+#define PACKED_HASH_HDR   'h'
+
+/* Encodings for packed bitsets */
+#define BITSET_RAW        'W'
+#define BITSET_RUNS       'R'
+#define BITSET_LIST       'L'
+
+/* The smallest packed bitset: a BITSET_LIST tag and an empty list */
+#define MIN_PACKED_BITSET  2
+
+/* What precedes each bitset checked by bin_check_bitsets() */
+#define BITSET_NO_PREFIX    '-'
+#define BITSET_INDEX_PREFIX 'i'
+#define BITSET_KEY_PREFIX   'k'
+
 
 #define HDRLEN                 8   /* HDR field plus int32 for length of
 									* item */
@@ -67,54 +95,7 @@ static const int8 b64lookup[128] = {
 };
 
 static unsigned
-b64_encode(const char *src, unsigned len, char *dst)
-{
-	char	   *p,
-			   *lend = dst + 76;
-	const char *s,
-			   *end = src + len;
-	int			pos = 2;
-	uint32		buf = 0;
-
-	s = src;
-	p = dst;
-
-	while (s < end)
-	{
-		buf |= (unsigned char) *s << (pos << 3);
-		pos--;
-		s++;
-
-		/* write it out */
-		if (pos < 0)
-		{
-			*p++ = _base64[(buf >> 18) & 0x3f];
-			*p++ = _base64[(buf >> 12) & 0x3f];
-			*p++ = _base64[(buf >> 6) & 0x3f];
-			*p++ = _base64[buf & 0x3f];
-
-			pos = 2;
-			buf = 0;
-		}
-		if (p >= lend)
-		{
-			*p++ = '\n';
-			lend = p + 76;
-		}
-	}
-	if (pos != 2)
-	{
-		*p++ = _base64[(buf >> 18) & 0x3f];
-		*p++ = _base64[(buf >> 12) & 0x3f];
-		*p++ = (pos == 0) ? _base64[(buf >> 6) & 0x3f] : '=';
-		*p++ = '=';
-	}
-
-	return p - dst;
-}
-
-static unsigned
-b64_decode(const char *src, unsigned len, char *dst)
+b64_decode_slow(const char *src, unsigned len, char *dst)
 {
 	const char *srcend = src + len,
 			   *s = src;
@@ -183,20 +164,190 @@ b64_decode(const char *src, unsigned len, char *dst)
 
 /* END SECTION OF CODE COPIED FROM pgcrypto.c */
 
+#define B64_QUADS_PER_LINE 19          /* 76 characters per line */
+#define B64_BAD            0x01000000  /* Invalid character flag */
+
 #endif
 
+/**
+ * Lookup table for base64 encoding, giving the pair of base64
+ * characters for each 12-bit value.
+ */
+static char b64_pairs[4096][2];
+
+/**
+ * Lookup tables for base64 decoding, giving, for each character, its
+ * 6-bit value shifted into place for each of the 4 positions within a
+ * quad, or B64_BAD for characters that are not part of the base64
+ * alphabet.
+ */
+static uint32 b64_quad[4][256];
+
+/**
+ * Whether the base64 lookup tables have been built.
+ */
+static bool b64_tables_built = false;
+
+/** 
+ * Build the lookup tables used by b64_encode() and b64_decode(), if
+ * this has not already been done.
+ */
+static void
+b64_build_tables()
+{
+	int i;
+
+	if (b64_tables_built) {
+		return;
+	}
+	for (i = 0; i < 4096; i++) {
+		b64_pairs[i][0] = _base64[i >> 6];
+		b64_pairs[i][1] = _base64[i & 0x3f];
+	}
+	for (i = 0; i < 256; i++) {
+		int b = (i < 128)? b64lookup[i]: -1;
+
+		if (b < 0) {
+			b64_quad[0][i] = b64_quad[1][i] = B64_BAD;
+			b64_quad[2][i] = b64_quad[3][i] = B64_BAD;
+		}
+		else {
+			b64_quad[0][i] = b << 18;
+			b64_quad[1][i] = b << 12;
+			b64_quad[2][i] = b << 6;
+			b64_quad[3][i] = b;
+		}
+	}
+	b64_tables_built = true;
+}
+
+/** 
+ * Base64 encode a binary stream.  Each group of 3 input bytes is
+ * encoded using 2 lookups into a table of character pairs.  The output
+ * is identical to that of the original pgcrypto implementation: a
+ * newline follows every 76 characters (19 quads) of output.
+ * 
+ * @param src The binary stream to be encoded.
+ * @param len The length of src in bytes.
+ * @param dst Buffer to receive the encoded stream.  This must be at
+ * least streamlen(len) bytes long.
+ * @return The number of characters written to dst.
+ */
+static unsigned
+b64_encode(const char *src, unsigned len, char *dst)
+{
+	const unsigned char *s = (const unsigned char *) src;
+	const unsigned char *end = s + (len - (len % 3));
+	char   *p = dst;
+	int     quads = 0;
+	uint32  buf;
+
+	b64_build_tables();
+	while (s < end) {
+		buf = (s[0] << 16) | (s[1] << 8) | s[2];
+		p[0] = b64_pairs[buf >> 12][0];
+		p[1] = b64_pairs[buf >> 12][1];
+		p[2] = b64_pairs[buf & 0xfff][0];
+		p[3] = b64_pairs[buf & 0xfff][1];
+		p += 4;
+		s += 3;
+		if (++quads == B64_QUADS_PER_LINE) {
+			*p++ = '\n';
+			quads = 0;
+		}
+	}
+
+	if (len % 3) {
+		buf = s[0] << 16;
+		if (len % 3 == 2) {
+			buf |= s[1] << 8;
+		}
+		p[0] = _base64[(buf >> 18) & 0x3f];
+		p[1] = _base64[(buf >> 12) & 0x3f];
+		p[2] = (len % 3 == 2)? _base64[(buf >> 6) & 0x3f]: '=';
+		p[3] = '=';
+		p += 4;
+	}
+
+	return p - dst;
+}
+
+/** 
+ * Base64 decode a character stream.  Whole quads of base64 characters
+ * are decoded using one table lookup per character, and the line breaks
+ * written by b64_encode() are skipped.  Anything else, ie padding,
+ * other whitespace or invalid characters, is handed over to
+ * b64_decode_slow(), which deals with it, or reports the error, exactly
+ * as before.
+ * 
+ * @param src The base64 stream to be decoded.
+ * @param len The length of src in characters.
+ * @param dst Buffer to receive the decoded binary stream.
+ * @return The number of bytes written to dst.
+ */
+static unsigned
+b64_decode(const char *src, unsigned len, char *dst)
+{
+	const unsigned char *s = (const unsigned char *) src;
+	const unsigned char *srcend = s + len;
+	char   *p = dst;
+	uint32  buf;
+
+	b64_build_tables();
+	while ((srcend - s) >= 4) {
+		buf = b64_quad[0][s[0]] | b64_quad[1][s[1]] | 
+			b64_quad[2][s[2]] | b64_quad[3][s[3]];
+		if (buf & B64_BAD) {
+			if (s[0] == '\n') {
+				s++;
+				continue;
+			}
+			break;
+		}
+		p[0] = (buf >> 16) & 255;
+		p[1] = (buf >> 8) & 255;
+		p[2] = buf & 255;
+		p += 3;
+		s += 4;
+	}
+
+	return (p - dst) + b64_decode_slow((const char *) s, srcend - s, p);
+}
+
 /** 
  * Return the length of a base64 encoded stream for a binary stream of
- * ::bytes length.
+ * ::bytes length.  This includes the newline that b64_encode() writes
+ * after each complete line of output.  This is computed in int64 so
+ * that a corrupt length read from a stream cannot overflow.
  * 
  * @param bytes The length of the input binary stream in bytes
  * @return The length of the base64 character stream required to
  * represent the input stream.
  */
-static int
-streamlen(int bytes)
+static int64
+streamlen(int64 bytes)
+{
+	return (4 * ((bytes + 2) / 3)) + ((bytes / 3) / B64_QUADS_PER_LINE);
+}
+
+/** 
+ * Return the smallest possible size, in bytes, of the raw bitset of a
+ * bitmap with the given range.  This is used to check a range read
+ * from a stream against the length of the stream before any memory is
+ * allocated for it.
+ * 
+ * @param bitzero The lowest bit of the range.
+ * @param bitmax The highest bit of the range, which must not be less
+ * than bitzero.
+ * @return The minimum size of the bitset.
+ */
+static int64
+min_bitset_bytes(int32 bitzero, int32 bitmax)
 {
-	return (4 * ((bytes + 2) / 3));
+	int64 bits_per_word = 8 * sizeof(bm_int);
+
+	return ((((int64) bitmax - bitzero) / bits_per_word) + 1) * 
+		(int64) sizeof(bm_int);
 }
 
 /** 
@@ -215,790 +366,3151 @@ hdrlen(char *name)
 }
 
 
+/**
+ * A binary stream being written or read.  When writing, a NULL buf
+ * means that we are only calculating the size of the stream.
+ */
+typedef struct BinStream {
+	char  *buf;     /**< The start of the stream */
+	char  *end;     /**< The end of the stream, when reading */
+	int32  pos;     /**< Offset of the next byte to be written or read */
+	bool   packed;  /**< Whether bitsets are written in, or read from,
+					   their packed (compressed) form */
+} BinStream;
+
 /** 
- * Serialise an int4 value as a base64 stream (truncated to save a
- * byte) into *p_stream.
+ * Write bytes to a binary stream, or, if the stream has no buffer,
+ * simply account for their size.
  *
- * @param p_stream Pointer into stream currently being written.  This
- * must be large enought to take the contents to be written.  This
- * pointer is updated to point to the next free slot in the stream after
- * writing the int4 value, and is null terminated at that position.
- * @param value The value to be written to the stream.
+ * @param stream The stream being written.
+ * @param data The data to be written.
+ * @param bytes The number of bytes to be written.
  */
 static void
-serialise_int4(char **p_stream, int32 value)
+bin_put(BinStream *stream, const void *data, int32 bytes)
 {
-	int len = b64_encode((char *) &value, sizeof(int32), *p_stream);
-	(*p_stream) += (len - 1);  /* X: dumb optimisation saves a byte */
-	(**p_stream) = '\0';
+	if (stream->buf) {
+		memcpy(stream->buf + stream->pos, data, bytes);
+	}
+	stream->pos += bytes;
 }
 
-
 /** 
- * De-serialise an int4 value from a base64 character stream.
+ * Write an int4 value to a binary stream.
  *
- * @param p_stream Pointer into the stream currently being read.
- * must be large enought to take the contents to be written.  This
- * pointer is updated to point to the next free slot in the stream after
- * reading the int4 value.
- * @return the int4 value read from the stream
+ * @param stream The stream being written.
+ * @param value The value to be written.
  */
-static int32
-deserialise_int4(char **p_stream)
+static void
+bin_put_int4(BinStream *stream, int32 value)
 {
-	int32 value;
-	char *endpos = (*p_stream) + INT32SIZE_B64;
-	char endchar = *endpos;
-	*endpos = '=';	/* deal with dumb optimisation (X) above */
-	b64_decode(*p_stream, INT32SIZE_B64 + 1, (char *) &value);
-	*endpos = endchar;
-	(*p_stream) += INT32SIZE_B64;
-	return value;
+	bin_put(stream, &value, sizeof(int32));
 }
 
-#ifdef UNUSED_BUT_WORKS
 /** 
- * Serialise an int8 value as a base64 stream into *p_stream.
+ * Write a single byte to a binary stream.
  *
- * @param p_stream Pointer into stream currently being written.  This
- * must be large enought to take the contents to be written.  This
- * pointer is updated to point to the next free slot in the stream after
- * writing the int8 value, and is null terminated at that position.
- * @param value The value to be written to the stream.
+ * @param stream The stream being written.
+ * @param value The value to be written.
  */
 static void
-serialise_int8(char **p_stream, int64 value)
+bin_put_char(BinStream *stream, char value)
 {
-	int len = b64_encode((char *) &value, sizeof(int64), *p_stream);
-	(*p_stream) += len; 
-	(**p_stream) = '\0';
+	bin_put(stream, &value, 1);
 }
 
-
 /** 
- * De-serialise an int8 value from a base64 character stream.
+ * Write a length-prefixed string to a binary stream.
  *
- * @param p_stream Pointer into the stream currently being read.
- * must be large enought to take the contents to be written.  This
- * pointer is updated to point to the next free slot in the stream after
- * reading the int8 value.
- * @return the int8 value read from the stream
+ * @param stream The stream being written.
+ * @param name The string to be written.  NULL is treated as an empty
+ * string.
  */
-static int64
-deserialise_int8(char **p_stream)
+static void
+bin_put_name(BinStream *stream, char *name)
 {
-	int64 value;
-	fprintf(stderr, "Deserialise %s\n", *p_stream);
-	b64_decode(*p_stream, INT64SIZE_B64, (char *) &value);
-	(*p_stream) += INT64SIZE_B64;
-	return value;
+	int32 len = name? strlen(name): 0;
+
+	bin_put_int4(stream, len);
+	bin_put(stream, name, len);
 }
-#endif
 
 /** 
- * Serialise a binary stream as a base64 stream into *p_stream.
+ * Return a pointer to the next bytes of a binary stream being read,
+ * advancing past them.  An error is raised if the stream does not
+ * contain enough bytes.
  *
- * @param p_stream Pointer into stream currently being written.  This
- * pointer is updated to point to the next free slot in the stream after
- * writing the contents of instream and is null terminated at that
- * position.
- * @param bytes The number of bytes to be written.
- * @param instream The binary stream to be written.
+ * @param stream The stream being read.
+ * @param bytes The number of bytes to be read.
+ * @return Pointer to the bytes within the stream.
  */
-static void
-serialise_stream(char **p_stream, int32 bytes, char *instream)
+static char *
+bin_get(BinStream *stream, int32 bytes)
 {
-	int len = b64_encode(instream, bytes, *p_stream);
-	(*p_stream)[len] = '\0';
-	(*p_stream) += len;
+	char *result = stream->buf + stream->pos;
+
+	if ((bytes < 0) || (bytes > (stream->end - result))) {
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("serialised stream is truncated or corrupt"),
+				 errdetail("Attempt to read %d bytes at offset %d of "
+						   "%d byte stream.", bytes, stream->pos,
+						   (int32) (stream->end - stream->buf))));
+	}
+	stream->pos += bytes;
+	return result;
 }
 
 /** 
- * De-serialise a binary stream.
+ * Check, without reading them, that a binary stream contains at least
+ * the given number of bytes beyond the current position.  This is used
+ * to check counts read from the stream before any memory is allocated
+ * based on them.
  *
- * @param p_stream Pointer into the stream currently being read.
- * pointer is updated to point to the next free slot in the stream after
- * reading the stream.
- * @param bytes The number of bytes to be read
- * @param outstream Pointer into the pre-allocated memory are into which
- * the binary from p_stream is to be written.
+ * @param stream The stream being read.
+ * @param bytes The minimum number of bytes that must remain.
  */
 static void
-deserialise_stream(char **p_stream, int32 bytes, char *outstream)
+bin_need(BinStream *stream, int64 bytes)
 {
-	int32 len = streamlen(bytes);
-	b64_decode(*p_stream, len, outstream);
-	(*p_stream) += len;
+	if ((bytes < 0) || 
+		(bytes > (stream->end - (stream->buf + stream->pos)))) {
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("serialised stream is truncated or corrupt"),
+				 errdetail("Need " INT64_FORMAT " bytes at offset %d of "
+						   "%d byte stream.", bytes, stream->pos,
+						   (int32) (stream->end - stream->buf))));
+	}
 }
 
+/** 
+ * Read an int4 value from a binary stream.  The value need not be
+ * aligned.
+ *
+ * @param stream The stream being read.
+ * @return The value read.
+ */
+static int32
+bin_get_int4(BinStream *stream)
+{
+	int32 value;
+
+	memcpy(&value, bin_get(stream, sizeof(int32)), sizeof(int32));
+	return value;
+}
 
 /** 
- * Serialise a boolean value into *p_stream.
+ * Read a single byte from a binary stream.
  *
- * @param p_stream Pointer into stream currently being written.  This
- * pointer is updated to point to the next free slot in the stream after
- * writing the contents of value and is null terminated at that
- * position.  A true value is written as 'T', and false as 'F'.
- * @param value The boolean value to be written.
+ * @param stream The stream being read.
+ * @return The value read.
  */
-static void
-serialise_bool(char **p_stream, bool value)
+static char
+bin_get_char(BinStream *stream)
 {
-	(**p_stream) = value? 'T': 'F';
-	(*p_stream)++;
-	(**p_stream) = '\0';
+	return *bin_get(stream, 1);
 }
 
 /** 
- * De-serialise a boolean value.
+ * Read a length-prefixed string from a binary stream, returning a
+ * dynamically allocated null-terminated copy of it.
  *
- * @param p_stream Pointer into the stream currently being read.
- * pointer is updated to point to the next free slot in the stream after
- * reading the stream.
- * @return True or false depending on the contents of p_stream.
+ * @param stream The stream being read.
+ * @return The string read.
  */
-static bool
-deserialise_bool(char **p_stream)
+static char *
+bin_get_name(BinStream *stream)
 {
-	bool result = (**p_stream) == 'T';
-	(*p_stream)++;
+	int32 len = bin_get_int4(stream);
+	char *name = bin_get(stream, len);
 
-	return result;
+	if (len >= HASH_KEYLEN) {
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("serialised stream is corrupt"),
+				 errdetail("Name of length %d exceeds the maximum of %d.",
+						   len, HASH_KEYLEN - 1)));
+	}
+	return pnstrdup(name, len);
 }
 
 /** 
- * Serialise a character value into *p_stream.
+ * Write an unsigned integer to a binary stream using a variable length
+ * encoding: 7 bits per byte, least significant first, with the top bit
+ * of each byte set if more bytes follow.
  *
- * @param p_stream Pointer into stream currently being written.  This
- * pointer is updated to point to the next free slot in the stream after
- * writing the contents of value and is null terminated at that
- * position.  The character is written as a single byte character.
- * @param value The character value to be written.
+ * @param stream The stream being written.
+ * @param value The value to be written.
  */
 static void
-serialise_char(char **p_stream, char value)
+bin_put_varint(BinStream *stream, uint32 value)
 {
-	(**p_stream) = value;
-	(*p_stream)++;
-	(**p_stream) = '\0';
+	char byte;
+
+	do {
+		byte = value & 0x7f;
+		value >>= 7;
+		if (value) {
+			byte |= 0x80;
+		}
+		bin_put_char(stream, byte);
+	} while (value);
 }
 
 /** 
- * De-serialise a character value.
+ * Read an unsigned integer written by bin_put_varint().
  *
- * @param p_stream Pointer into the stream currently being read.
- * pointer is updated to point to the next free slot in the stream after
- * reading the stream.
- * @return The value of the character read from p_stream.
+ * @param stream The stream being read.
+ * @return The value read.
  */
-static char
-deserialise_char (char **p_stream)
+static uint32
+bin_get_varint(BinStream *stream)
 {
-	char result = **p_stream;
-	(*p_stream)++;
-
-	return result;
+	uint32 value = 0;
+	int    shift = 0;
+	unsigned char byte;
+
+	do {
+		if (shift > 28) {
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("serialised stream is corrupt"),
+					 errdetail("Invalid integer at offset %d.", 
+							   stream->pos)));
+		}
+		byte = (unsigned char) bin_get_char(stream);
+		value |= ((uint32) (byte & 0x7f)) << shift;
+		shift += 7;
+	} while (byte & 0x80);
+	return value;
 }
 
 /** 
- * Serialise a string (containing a name) into *p_stream.
+ * Write a bitset as alternating runs of empty and non-empty words.
+ * Each run of empty words is written as a count, and each run of
+ * non-empty words as a count followed by the words themselves.
  *
- * @param p_stream Pointer into stream currently being written.  This
- * pointer is updated to point to the next free slot in the stream after
- * writing the contents of value and is null terminated at that
- * position.  The character is written as a single byte character.
- * @param name The string to be written.
+ * @param stream The stream being written.
+ * @param bitmap The bitmap whose bitset is to be written.
  */
 static void
-serialise_name(char **p_stream, char *name)
+put_bitset_runs(BinStream *stream, Bitmap *bitmap)
 {
-	static char *blank_name = "";
-	char *safe_name;
-	if (name) {
-		safe_name = name;
-	}
-	else {
-		safe_name = blank_name;
+	int elems = ARRAYELEMS(bitmap->bitzero, bitmap->bitmax);
+	int i = 0;
+	int start;
+
+	while (i < elems) {
+		start = i;
+		while ((i < elems) && (bitmap->bitset[i] == 0)) {
+			i++;
+		}
+		bin_put_varint(stream, i - start);
+		start = i;
+		while ((i < elems) && (bitmap->bitset[i] != 0)) {
+			i++;
+		}
+		bin_put_varint(stream, i - start);
+		bin_put(stream, &(bitmap->bitset[start]), 
+				(i - start) * sizeof(bm_int));
 	}
-		
-	serialise_int4(p_stream, strlen(safe_name));
-	strcpy((*p_stream), safe_name);
-	(*p_stream) += strlen(safe_name);
-	(**p_stream) = '\0';
 }
 
 /** 
- * De-serialise a string returning a dynamically allocated string.
+ * Read a bitset written by put_bitset_runs().
  *
- * @param p_stream Pointer into the stream currently being read.
- * pointer is updated to point to the next free slot in the stream after
- * reading the stream.
- * @return Dynamically allocated copy of string read from *p_stream
+ * @param stream The stream being read.
+ * @param bitmap The bitmap to be read into, or NULL if the bitset is
+ * only to be checked and skipped.
+ * @param elems The number of words in the bitset.
  */
-static char *
-deserialise_name(char **p_stream)
+static void
+get_bitset_runs(BinStream *stream, Bitmap *bitmap, int32 elems)
 {
-	int32 name_len = deserialise_int4(p_stream);
-	char *result = palloc((name_len + 1) * sizeof(char));
-	strncpy(result, *p_stream, name_len);
-	result[name_len] = '\0';
-	(*p_stream) += name_len;
-	return result;
+	int    i = 0;
+	char  *words_data;
+	uint32 empty;
+	uint32 words;
+
+	while (i < elems) {
+		empty = bin_get_varint(stream);
+		words = bin_get_varint(stream);
+		if (((empty == 0) && (words == 0)) || 
+			(empty > elems - i) || (words > elems - i - empty)) {
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("serialised stream is corrupt"),
+					 errdetail("Invalid run of %u+%u words at word %d "
+							   "of %d.", empty, words, i, elems)));
+		}
+		words_data = bin_get(stream, words * sizeof(bm_int));
+		if (bitmap) {
+			memset(&(bitmap->bitset[i]), 0, empty * sizeof(bm_int));
+			memcpy(&(bitmap->bitset[i + empty]), words_data, 
+				   words * sizeof(bm_int));
+		}
+		i += empty + words;
+	}
 }
 
 /** 
- * Serialise a veil integer variable into a dynamically allocated string.
+ * Write a bitset as a count of its set bits followed by the difference
+ * between each set bit and the previous one (or, for the first, the
+ * bitmap's bitzero).
  *
- * @param var Pointer to the variable to be serialised
- * @param name The name of the variable
- * @return Dynamically allocated string containing the serialised
- * variable
+ * @param stream The stream being written.
+ * @param bitmap The bitmap whose bitset is to be written.
  */
-static char *
-serialise_int4var(Int4Var *var, char *name)
+static void
+put_bitset_list(BinStream *stream, Bitmap *bitmap)
 {
-    int stream_len = hdrlen(name) + BOOLSIZE + INT32SIZE_B64 + 1;
-	char *stream = palloc(stream_len * sizeof(char));
-	char *streamstart = stream;
-	
-	serialise_char(&stream, INT4VAR_HDR);
-	serialise_name(&stream, name);
-	serialise_bool(&stream, var->isnull);
-	serialise_int4(&stream, var->value);
-	return streamstart;
+	int32  bit;
+	int32  prev;
+	int32  count = 0;
+	bool   found;
+
+	bit = bitmap->bitzero;
+	for (;;) {
+		bit = vl_BitmapNextBit(bitmap, bit, &found);
+		if (!found) {
+			break;
+		}
+		count++;
+		if (bit == bitmap->bitmax) {
+			break;
+		}
+		bit++;
+	}
+	bin_put_varint(stream, count);
+
+	prev = bit = bitmap->bitzero;
+	for (;;) {
+		bit = vl_BitmapNextBit(bitmap, bit, &found);
+		if (!found) {
+			break;
+		}
+		bin_put_varint(stream, (uint32) (bit - prev));
+		prev = bit;
+		if (bit == bitmap->bitmax) {
+			break;
+		}
+		bit++;
+	}
 }
 
 /** 
- * De-serialise a veil integer variable.
+ * Read a bitset written by put_bitset_list().
  *
- * @param **p_stream Pointer into the stream currently being read.
- * pointer is updated to point to the next free slot in the stream after
- * reading the stream
- * @return Pointer to the variable created or updated from the stream.
+ * @param stream The stream being read.
+ * @param bitmap The bitmap to be read into, or NULL if the bitset is
+ * only to be checked and skipped.
+ * @param bitzero The lowest bit of the bitset.
+ * @param bitmax The highest bit of the bitset.
  */
-static VarEntry *
-deserialise_int4var(char **p_stream)
+static void
+get_bitset_list(BinStream *stream, Bitmap *bitmap, 
+				int32 bitzero, int32 bitmax)
 {
-	char *name = deserialise_name(p_stream);
-	VarEntry *var = vl_lookup_variable(name);
-    Int4Var *i4v = (Int4Var *) var->obj;
+	uint32 count = bin_get_varint(stream);
+	int64  bit = bitzero;
 
-    if (i4v) {
-        if (i4v->type != OBJ_INT4) {
-            vl_type_mismatch(name, OBJ_INT4, i4v->type);
-        }
-    }
-	else {
-        var->obj = (Object *) vl_NewInt4(var->shared);
-        i4v = (Int4Var *) var->obj;
- 	}
-	i4v->isnull = deserialise_bool(p_stream);
-	i4v->value = deserialise_int4(p_stream);
-	return var;
+	if (bitmap) {
+		vl_ClearBitmap(bitmap);
+	}
+	while (count-- > 0) {
+		bit += bin_get_varint(stream);
+		if (bit > bitmax) {
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("serialised stream is corrupt"),
+					 errdetail("Bit " INT64_FORMAT " is outside of the "
+							   "range %d..%d.", bit, bitzero, bitmax)));
+		}
+		if (bitmap) {
+			vl_BitmapSetbit(bitmap, (int32) bit);
+		}
+	}
 }
 
 /** 
- * Serialise a veil integer array variable into a dynamically allocated
- * string.
+ * Write the bitset words of a bitmap to a binary stream.  If the stream
+ * is packed, the smallest of the raw words, the runs of words and the
+ * list of set bits is written, preceded by a tag identifying which.
  *
- * @param array Pointer to the variable to be serialised
- * @param name The name of the variable
- * @return Dynamically allocated string containing the serialised
- * variable
+ * @param stream The stream being written.
+ * @param bitmap The bitmap to be written.
  */
-static char *
-serialise_int4array(Int4Array *array, char *name)
+static void
+bin_put_bitset(BinStream *stream, Bitmap *bitmap)
 {
-    int elems = 1 + array->arraymax - array->arrayzero;
-    int stream_len = hdrlen(name) + (2 * INT32SIZE_B64) +
-		streamlen(elems * sizeof(int32)) + 1;
-	char *stream = palloc(stream_len * sizeof(char));
-	char *streamstart = stream;
-
-	serialise_char(&stream, INT4_ARRAY_HDR);
-	serialise_name(&stream, name);
-	serialise_int4(&stream, array->arrayzero);
-	serialise_int4(&stream, array->arraymax);
-	serialise_stream(&stream, elems * sizeof(int32), 
-					 (char *) &(array->array[0]));
-
-	return streamstart;
+	int32     raw = ARRAYELEMS(bitmap->bitzero, bitmap->bitmax) * 
+		sizeof(bm_int);
+	int32     runs;
+	int32     list;
+	BinStream sizer = {NULL, NULL, 0, true};
+
+	if (stream->packed) {
+		put_bitset_runs(&sizer, bitmap);
+		runs = sizer.pos;
+		sizer.pos = 0;
+		put_bitset_list(&sizer, bitmap);
+		list = sizer.pos;
+
+		if ((list < runs) && (list < raw)) {
+			bin_put_char(stream, BITSET_LIST);
+			put_bitset_list(stream, bitmap);
+			return;
+		}
+		if (runs < raw) {
+			bin_put_char(stream, BITSET_RUNS);
+			put_bitset_runs(stream, bitmap);
+			return;
+		}
+		bin_put_char(stream, BITSET_RAW);
+	}
+	bin_put(stream, &(bitmap->bitset[0]), raw);
 }
 
 /** 
- * De-serialise a veil integer array variable.
+ * Read the bitset words for a bitmap with the given range from a binary
+ * stream, either directly into the bitmap or, if no bitmap is given,
+ * simply checking that they are valid and skipping over them.
  *
- * @param **p_stream Pointer into the stream currently being read.
- * pointer is updated to point to the next free slot in the stream after
- * reading the stream
- * @return Pointer to the variable created or updated from the stream.
+ * @param stream The stream being read.
+ * @param bitmap The bitmap to be read into, or NULL.  If given, its
+ * range must have already been set to bitzero..bitmax.
+ * @param bitzero The lowest bit of the bitset.
+ * @param bitmax The highest bit of the bitset.
  */
-static VarEntry *
-deserialise_int4array(char **p_stream)
+static void
+bin_read_bitset(BinStream *stream, Bitmap *bitmap, 
+				int32 bitzero, int32 bitmax)
 {
-	char *name = deserialise_name(p_stream);
-    int32 arrayzero;
-	int32 arraymax;
-	int32 elems;
-	VarEntry *var = vl_lookup_variable(name);
-	Int4Array *array = (Int4Array *) var->obj;
-
-	arrayzero = deserialise_int4(p_stream);
-	arraymax = deserialise_int4(p_stream);
-	elems = 1 + arraymax - arrayzero;
-
-    if (array) {
-        if (array->type != OBJ_INT4_ARRAY) {
-            vl_type_mismatch(name, OBJ_INT4_ARRAY, array->type);
-        }
-    }
-	array = vl_NewInt4Array(array, var->shared, arrayzero, arraymax);
-	var->obj = (Object *) array;
-
-	deserialise_stream(p_stream, elems * sizeof(int32), 
-					   (char *) &(array->array[0]));
-	return var;
+	int32 elems = ARRAYELEMS(bitzero, bitmax);
+	int32 bytes = elems * sizeof(bm_int);
+	char *data;
+	char  tag;
+
+	if (stream->packed) {
+		tag = bin_get_char(stream);
+		switch (tag) {
+		case BITSET_RAW:
+			break;
+		case BITSET_RUNS:
+			get_bitset_runs(stream, bitmap, elems);
+			return;
+		case BITSET_LIST:
+			get_bitset_list(stream, bitmap, bitzero, bitmax);
+			return;
+		default:
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("serialised stream is corrupt"),
+					 errdetail("Unknown bitset encoding %c.", tag)));
+		}
+	}
+	data = bin_get(stream, bytes);
+	if (bitmap) {
+		memcpy(&(bitmap->bitset[0]), data, bytes);
+	}
 }
 
 /** 
- * Serialise a veil range variable into a dynamically allocated
- * string.
+ * Read the bitset words for a bitmap from a binary stream directly into
+ * the bitmap.
  *
- * @param range Pointer to the variable to be serialised
- * @param name The name of the variable
- * @return Dynamically allocated string containing the serialised
- * variable
+ * @param stream The stream being read.
+ * @param bitmap The bitmap to be read into.  Its range must have
+ * already been set.
  */
-static char *
-serialise_range(Range *range, char *name)
+static void
+bin_get_bitset(BinStream *stream, Bitmap *bitmap)
 {
-    int stream_len = hdrlen(name) + (INT32SIZE_B64 * 2) + 1;
-	char *stream = palloc(stream_len * sizeof(char));
-	char *streamstart = stream;
-
-	serialise_char(&stream, RANGE_HDR);
-	serialise_name(&stream, name);
-	serialise_int4(&stream, range->min);
-	serialise_int4(&stream, range->max);
-	return streamstart;
+	bin_read_bitset(stream, bitmap, bitmap->bitzero, bitmap->bitmax);
 }
 
 /** 
- * De-serialise a veil range variable.
+ * Check that the next count bitsets in a packed binary stream, each
+ * optionally preceded by an array index or hash key, are valid for a
+ * bitmap of the given range, without reading them.  A packed bitset
+ * can be far smaller than the bitmap it describes, so this is done
+ * before any memory is allocated for the bitmaps: a corrupt or
+ * truncated stream then raises an error rather than an attempt to
+ * allocate memory for a range that it only claims.  For an unpacked
+ * stream, bin_need() on the bitsets' exact size is sufficient.
  *
- * @param **p_stream Pointer into the stream currently being read.
- * pointer is updated to point to the next free slot in the stream after
- * reading the stream
- * @return Pointer to the variable created or updated from the stream.
+ * @param stream The stream being read.
+ * @param bitzero The lowest bit of the bitsets.
+ * @param bitmax The highest bit of the bitsets.
+ * @param count The number of bitsets.
+ * @param prefix What precedes each bitset: BITSET_NO_PREFIX,
+ * BITSET_INDEX_PREFIX or BITSET_KEY_PREFIX.
  */
-static VarEntry *
-deserialise_range(char **p_stream)
+static void
+bin_check_bitsets(BinStream *stream, int32 bitzero, int32 bitmax,
+				  int32 count, char prefix)
 {
-	char *name = deserialise_name(p_stream);
-	VarEntry *var = vl_lookup_variable(name);
-    Range *range = (Range *) var->obj;
-
-    if (range) {
-        if (range->type != OBJ_RANGE) {
-            vl_type_mismatch(name, OBJ_RANGE, range->type);
-        }
-    }
-	else {
-        var->obj = (Object *) vl_NewRange(var->shared);
-        range = (Range *) var->obj;
- 	}
+	int32 pos = stream->pos;
 
-	range->min = deserialise_int4(p_stream);
-	range->max = deserialise_int4(p_stream);
-	return var;
+	if (!stream->packed) {
+		return;
+	}
+	while (count-- > 0) {
+		if (prefix == BITSET_INDEX_PREFIX) {
+			(void) bin_get_int4(stream);
+		}
+		else if (prefix == BITSET_KEY_PREFIX) {
+			pfree(bin_get_name(stream));
+		}
+		bin_read_bitset(stream, NULL, bitzero, bitmax);
+	}
+	stream->pos = pos;
 }
 
 /** 
- * Serialise a single bitmap from a veil bitmap array or bitmap hash.
+ * Return the smallest number of bytes that the bitset of a bitmap with
+ * the given range can occupy in a binary stream.  A raw bitset is the
+ * whole of the bitset.  The smallest packed bitset, whatever the range,
+ * is an empty list: its encoding tag and a 1 byte count of zero.  As
+ * this does not depend on the range, packed bitsets must also be
+ * checked by bin_check_bitsets() before memory is allocated for them.
  *
- * @param p_stream Pointer into the stream currently being read.
- * pointer is updated to point to the next free slot in the stream after
- * writing the stream.
- * @param bitmap The bitmap to be serialised.
+ * @param stream The stream being read.
+ * @param bitzero The lowest bit of the bitmap.
+ * @param bitmax The highest bit of the bitmap.
+ * @return The minimum number of bytes for the bitset.
  */
-static void
-serialise_one_bitmap(char **p_stream, Bitmap *bitmap)
+static int64
+bin_min_bitset_len(BinStream *stream, int32 bitzero, int32 bitmax)
 {
-    int elems = ARRAYELEMS(bitmap->bitzero, bitmap->bitmax);
-	serialise_int4(p_stream, bitmap->bitzero);
-	serialise_int4(p_stream, bitmap->bitmax);
-	serialise_stream(p_stream, elems * sizeof(bm_int), 
-					 (char *) &(bitmap->bitset));
+	return stream->packed? MIN_PACKED_BITSET: 
+		min_bitset_bytes(bitzero, bitmax);
 }
 
+/**
+ * The bounds of the text stream currently being de-serialised, as set
+ * by vl_deserialise().  Every read from the stream is checked against
+ * these, so that a truncated or corrupt stream raises an error rather
+ * than causing us to read beyond the end of it.
+ */
+static char *text_start = NULL;
+static char *text_end = NULL;   /**< See text_start */
+
 /** 
- * Serialise a veil bitmap variable into a dynamically allocated
- * string.
+ * Return the offset of the current position within the text stream
+ * being de-serialised, for error reporting.
  *
- * @param bitmap Pointer to the variable to be serialised
- * @param name The name of the variable
- * @return Dynamically allocated string containing the serialised
- * variable
+ * @param p_stream Pointer into the stream currently being read.
+ * @return The offset of *p_stream from the start of the stream.
  */
-static char *
-serialise_bitmap(Bitmap *bitmap, char *name)
+static int32
+text_offset(char **p_stream)
 {
-    int elems = ARRAYELEMS(bitmap->bitzero, bitmap->bitmax);
-    int stream_len = hdrlen(name) + (INT32SIZE_B64 * 2) + 
-		             streamlen(sizeof(bm_int) * elems) + 1;
-	char *stream = palloc(stream_len * sizeof(char));
-	char *streamstart = stream;
-
-	serialise_char(&stream, BITMAP_HDR);
-	serialise_name(&stream, name);
-	serialise_one_bitmap(&stream, bitmap);
-	return streamstart;
+	return (int32) ((*p_stream) - text_start);
 }
 
 /** 
- * De-serialise a single bitmap into a veil bitmap array or bitmap hash.
+ * Check that the text stream being de-serialised contains at least the
+ * given number of characters beyond the current position, raising an
+ * error if it does not.
  *
- * @param p_bitmap Pointer to bitmap pointer.  This may be updated to
- * contain a dynamically allocated bitmap if none is already present.
- * @param name  The name of the variable, for error reporting purposes.
- * @param shared Whether the bitmap is part of a shared rather than
- * session variable.
  * @param p_stream Pointer into the stream currently being read.
- * pointer is updated to point to the next free slot in the stream after
- * reading the stream.
+ * @param chars The number of characters that are about to be read.
  */
 static void
-deserialise_one_bitmap(Bitmap **p_bitmap, char *name, 
-					   bool shared, char **p_stream)
+text_need(char **p_stream, int64 chars)
 {
-	Bitmap *bitmap = *p_bitmap;
-    int32 bitzero;
-	int32 bitmax;
-	int32 elems;
-
-	bitzero = deserialise_int4(p_stream);
-	bitmax = deserialise_int4(p_stream);
-	elems = ARRAYELEMS(bitzero, bitmax);
-
-    if (bitmap) {
-        if (bitmap->type != OBJ_BITMAP) {
-            vl_type_mismatch(name, OBJ_BITMAP, bitmap->type);
-        }
-    }
-	/* Check size and re-allocate memory if needed */
-	vl_NewBitmap(p_bitmap, shared, bitzero, bitmax);
-	bitmap = *p_bitmap;
-
-	deserialise_stream(p_stream, elems * sizeof(bitmap->bitset[0]), 
-					   (char *) &(bitmap->bitset[0]));
-
+	if ((chars < 0) || (chars > (text_end - (*p_stream)))) {
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("serialised stream is truncated or corrupt"),
+				 errdetail("Attempt to read " INT64_FORMAT " characters at "
+						   "offset %d of %d character stream.", chars,
+						   text_offset(p_stream), 
+						   (int32) (text_end - text_start))));
+	}
 }
 
 /** 
- * De-serialise a veil bitmap variable.
+ * Check that a range read from a text stream is valid, before any
+ * memory is allocated based on it.
  *
- * @param **p_stream Pointer into the stream currently being read.
- * pointer is updated to point to the next free slot in the stream after
- * reading the stream
- * @return Pointer to the variable created or updated from the stream.
+ * @param p_stream Pointer into the stream currently being read.
+ * @param min The lower bound of the range.
+ * @param max The upper bound of the range.
+ * @param name The variable name, for error reporting.
  */
-static VarEntry *
-deserialise_bitmap(char **p_stream)
+static void
+text_check_range(char **p_stream, int32 min, int32 max, char *name)
 {
-	char *name = deserialise_name(p_stream);
-	VarEntry *var = vl_lookup_variable(name);
-	Bitmap *bitmap = (Bitmap *) var->obj;
-
-	deserialise_one_bitmap(&bitmap, name, var->shared, p_stream);
-	var->obj = (Object *) bitmap;
-	return var;
+	if (min > max) {
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("serialised stream is corrupt"),
+				 errdetail("Invalid range %d..%d for %s at offset %d.", 
+						   min, max, name, text_offset(p_stream))));
+	}
 }
 
 /** 
- * Serialise a veil bitmap array variable into a dynamically allocated
- * string.
+ * Return the smallest number of characters that the bitset of a bitmap
+ * with the given range can occupy in a text stream.  A packed bitset
+ * is its length followed by at least the smallest packed bitset, which
+ * does not depend on the range, so packed bitsets must also be checked
+ * by text_check_bitsets() before memory is allocated for them.  A raw
+ * bitset is the whole of the bitset.
  *
- * @param bmarray Pointer to the variable to be serialised
- * @param name The name of the variable
- * @return Dynamically allocated string containing the serialised
- * variable
+ * @param bitzero The lowest bit of the bitmap.
+ * @param bitmax The highest bit of the bitmap.
+ * @param packed Whether the bitset is packed.
+ * @return The minimum number of characters for the bitset.
  */
-static char *
-serialise_bitmap_array(BitmapArray *bmarray, char *name)
+static int64
+text_min_bitset_len(int32 bitzero, int32 bitmax, bool packed)
 {
-    int bitset_elems = ARRAYELEMS(bmarray->bitzero, bmarray->bitmax);
-    int array_elems = 1 + bmarray->arraymax - bmarray->arrayzero;
-	int bitmap_len = (INT32SIZE_B64 * 2) + 
-		             streamlen(sizeof(bm_int) * bitset_elems);
-    int stream_len = hdrlen(name) + (INT32SIZE_B64 * 4) + 
-		             (bitmap_len * array_elems) + 1;
-	int idx;
+	if (packed) {
+		return INT32SIZE_B64 + streamlen(MIN_PACKED_BITSET);
+	}
+	return streamlen(min_bitset_bytes(bitzero, bitmax));
+}
+
+/** 
+ * Serialise an int4 value as a base64 stream (truncated to save a
+ * byte) into *p_stream.
+ *
+ * @param p_stream Pointer into stream currently being written.  This
+ * must be large enought to take the contents to be written.  This
+ * pointer is updated to point to the next free slot in the stream after
+ * writing the int4 value, and is null terminated at that position.
+ * @param value The value to be written to the stream.
+ */
+static void
+serialise_int4(char **p_stream, int32 value)
+{
+	int len = b64_encode((char *) &value, sizeof(int32), *p_stream);
+	(*p_stream) += (len - 1);  /* X: dumb optimisation saves a byte */
+	(**p_stream) = '\0';
+}
+
+
+/** 
+ * De-serialise an int4 value from a base64 character stream.
+ *
+ * @param p_stream Pointer into the stream currently being read.
+ * must be large enought to take the contents to be written.  This
+ * pointer is updated to point to the next free slot in the stream after
+ * reading the int4 value.
+ * @return the int4 value read from the stream
+ */
+static int32
+deserialise_int4(char **p_stream)
+{
+	int32 value;
+	char  buf[INT32SIZE_B64];
+	char *endpos;
+	char  endchar;
+	int   len;
+
+	text_need(p_stream, INT32SIZE_B64);
+	endpos = (*p_stream) + INT32SIZE_B64;
+	endchar = *endpos;
+	*endpos = '=';	/* deal with dumb optimisation (X) above */
+	len = b64_decode(*p_stream, INT32SIZE_B64 + 1, buf);
+	*endpos = endchar;
+	if (len != sizeof(int32)) {
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("serialised stream is corrupt"),
+				 errdetail("Invalid int4 value at offset %d.", 
+						   text_offset(p_stream))));
+	}
+	memcpy(&value, buf, sizeof(int32));
+	(*p_stream) += INT32SIZE_B64;
+	return value;
+}
+
+#ifdef UNUSED_BUT_WORKS
+/** 
+ * Serialise an int8 value as a base64 stream into *p_stream.
+ *
+ * @param p_stream Pointer into stream currently being written.  This
+ * must be large enought to take the contents to be written.  This
+ * pointer is updated to point to the next free slot in the stream after
+ * writing the int8 value, and is null terminated at that position.
+ * @param value The value to be written to the stream.
+ */
+static void
+serialise_int8(char **p_stream, int64 value)
+{
+	int len = b64_encode((char *) &value, sizeof(int64), *p_stream);
+	(*p_stream) += len; 
+	(**p_stream) = '\0';
+}
+
+
+/** 
+ * De-serialise an int8 value from a base64 character stream.
+ *
+ * @param p_stream Pointer into the stream currently being read.
+ * must be large enought to take the contents to be written.  This
+ * pointer is updated to point to the next free slot in the stream after
+ * reading the int8 value.
+ * @return the int8 value read from the stream
+ */
+static int64
+deserialise_int8(char **p_stream)
+{
+	int64 value;
+	fprintf(stderr, "Deserialise %s\n", *p_stream);
+	b64_decode(*p_stream, INT64SIZE_B64, (char *) &value);
+	(*p_stream) += INT64SIZE_B64;
+	return value;
+}
+#endif
+
+/** 
+ * Serialise a binary stream as a base64 stream into *p_stream.
+ *
+ * @param p_stream Pointer into stream currently being written.  This
+ * pointer is updated to point to the next free slot in the stream after
+ * writing the contents of instream and is null terminated at that
+ * position.
+ * @param bytes The number of bytes to be written.
+ * @param instream The binary stream to be written.
+ */
+static void
+serialise_stream(char **p_stream, int32 bytes, char *instream)
+{
+	int len = b64_encode(instream, bytes, *p_stream);
+	(*p_stream)[len] = '\0';
+	(*p_stream) += len;
+}
+
+/** 
+ * De-serialise a binary stream.  The stream is decoded into a scratch
+ * buffer so that a corrupt stream, which may decode to more bytes than
+ * expected, cannot overrun outstream.
+ *
+ * @param p_stream Pointer into the stream currently being read.
+ * pointer is updated to point to the next free slot in the stream after
+ * reading the stream.
+ * @param bytes The number of bytes to be read
+ * @param outstream Pointer into the pre-allocated memory are into which
+ * the binary from p_stream is to be written.
+ */
+static void
+deserialise_stream(char **p_stream, int32 bytes, char *outstream)
+{
+	int64 need = streamlen(bytes);
+	int32 len;
+	int32 decoded;
+	char *buf;
+
+	text_need(p_stream, need);
+	len = (int32) need;
+	buf = palloc(((len / 4) + 1) * 3);
+	decoded = b64_decode(*p_stream, len, buf);
+	if (decoded != bytes) {
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("serialised stream is corrupt"),
+				 errdetail("Expected %d bytes but decoded %d at offset %d.", 
+						   bytes, decoded, text_offset(p_stream))));
+	}
+	memcpy(outstream, buf, bytes);
+	pfree(buf);
+	(*p_stream) += len;
+}
+
+
+/** 
+ * Serialise a boolean value into *p_stream.
+ *
+ * @param p_stream Pointer into stream currently being written.  This
+ * pointer is updated to point to the next free slot in the stream after
+ * writing the contents of value and is null terminated at that
+ * position.  A true value is written as 'T', and false as 'F'.
+ * @param value The boolean value to be written.
+ */
+static void
+serialise_bool(char **p_stream, bool value)
+{
+	(**p_stream) = value? 'T': 'F';
+	(*p_stream)++;
+	(**p_stream) = '\0';
+}
+
+/** 
+ * De-serialise a boolean value.
+ *
+ * @param p_stream Pointer into the stream currently being read.
+ * pointer is updated to point to the next free slot in the stream after
+ * reading the stream.
+ * @return True or false depending on the contents of p_stream.
+ */
+static bool
+deserialise_bool(char **p_stream)
+{
+	bool result;
+
+	text_need(p_stream, BOOLSIZE);
+	if (((**p_stream) != 'T') && ((**p_stream) != 'F')) {
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("serialised stream is corrupt"),
+				 errdetail("Invalid boolean value at offset %d.", 
+						   text_offset(p_stream))));
+	}
+	result = (**p_stream) == 'T';
+	(*p_stream)++;
+
+	return result;
+}
+
+/** 
+ * Serialise a character value into *p_stream.
+ *
+ * @param p_stream Pointer into stream currently being written.  This
+ * pointer is updated to point to the next free slot in the stream after
+ * writing the contents of value and is null terminated at that
+ * position.  The character is written as a single byte character.
+ * @param value The character value to be written.
+ */
+static void
+serialise_char(char **p_stream, char value)
+{
+	(**p_stream) = value;
+	(*p_stream)++;
+	(**p_stream) = '\0';
+}
+
+/** 
+ * De-serialise a character value.
+ *
+ * @param p_stream Pointer into the stream currently being read.
+ * pointer is updated to point to the next free slot in the stream after
+ * reading the stream.
+ * @return The value of the character read from p_stream.
+ */
+static char
+deserialise_char (char **p_stream)
+{
+	char result;
+
+	text_need(p_stream, 1);
+	result = **p_stream;
+	(*p_stream)++;
+
+	return result;
+}
+
+/** 
+ * Serialise a string (containing a name) into *p_stream.
+ *
+ * @param p_stream Pointer into stream currently being written.  This
+ * pointer is updated to point to the next free slot in the stream after
+ * writing the contents of value and is null terminated at that
+ * position.  The character is written as a single byte character.
+ * @param name The string to be written.
+ */
+static void
+serialise_name(char **p_stream, char *name)
+{
+	static char *blank_name = "";
+	char *safe_name;
+	if (name) {
+		safe_name = name;
+	}
+	else {
+		safe_name = blank_name;
+	}
+		
+	serialise_int4(p_stream, strlen(safe_name));
+	strcpy((*p_stream), safe_name);
+	(*p_stream) += strlen(safe_name);
+	(**p_stream) = '\0';
+}
+
+/** 
+ * De-serialise a string returning a dynamically allocated string.
+ *
+ * @param p_stream Pointer into the stream currently being read.
+ * pointer is updated to point to the next free slot in the stream after
+ * reading the stream.
+ * @return Dynamically allocated copy of string read from *p_stream
+ */
+static char *
+deserialise_name(char **p_stream)
+{
+	int32 name_len = deserialise_int4(p_stream);
+	char *result;
+
+	if ((name_len < 0) || (name_len >= HASH_KEYLEN)) {
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("serialised stream is corrupt"),
+				 errdetail("Invalid name length %d at offset %d.",
+						   name_len, text_offset(p_stream))));
+	}
+	text_need(p_stream, name_len);
+	result = pnstrdup(*p_stream, name_len);
+	(*p_stream) += name_len;
+	return result;
+}
+
+/** 
+ * Serialise a veil integer variable into a dynamically allocated string.
+ *
+ * @param var Pointer to the variable to be serialised
+ * @param name The name of the variable
+ * @return Dynamically allocated string containing the serialised
+ * variable
+ */
+static char *
+serialise_int4var(Int4Var *var, char *name)
+{
+    int stream_len = hdrlen(name) + BOOLSIZE + INT32SIZE_B64 + 1;
 	char *stream = palloc(stream_len * sizeof(char));
 	char *streamstart = stream;
-
-	serialise_char(&stream, BITMAP_ARRAY_HDR);
+	
+	serialise_char(&stream, INT4VAR_HDR);
+	serialise_name(&stream, name);
+	serialise_bool(&stream, var->isnull);
+	serialise_int4(&stream, var->value);
+	return streamstart;
+}
+
+/** 
+ * De-serialise a veil integer variable.
+ *
+ * @param **p_stream Pointer into the stream currently being read.
+ * pointer is updated to point to the next free slot in the stream after
+ * reading the stream
+ * @return Pointer to the variable created or updated from the stream.
+ */
+static VarEntry *
+deserialise_int4var(char **p_stream)
+{
+	char *name = deserialise_name(p_stream);
+	VarEntry *var = vl_lookup_variable(name);
+    Int4Var *i4v = (Int4Var *) var->obj;
+
+    if (i4v) {
+        if (i4v->type != OBJ_INT4) {
+            vl_type_mismatch(name, OBJ_INT4, i4v->type);
+        }
+    }
+	else {
+        var->obj = (Object *) vl_NewInt4(var->shared);
+        i4v = (Int4Var *) var->obj;
+ 	}
+	i4v->isnull = deserialise_bool(p_stream);
+	i4v->value = deserialise_int4(p_stream);
+	return var;
+}
+
+/** 
+ * Serialise a veil integer array variable into a dynamically allocated
+ * string.
+ *
+ * @param array Pointer to the variable to be serialised
+ * @param name The name of the variable
+ * @return Dynamically allocated string containing the serialised
+ * variable
+ */
+static char *
+serialise_int4array(Int4Array *array, char *name)
+{
+    int elems = 1 + array->arraymax - array->arrayzero;
+    int stream_len = hdrlen(name) + (2 * INT32SIZE_B64) +
+		streamlen(elems * sizeof(int32)) + 1;
+	char *stream = palloc(stream_len * sizeof(char));
+	char *streamstart = stream;
+
+	serialise_char(&stream, INT4_ARRAY_HDR);
+	serialise_name(&stream, name);
+	serialise_int4(&stream, array->arrayzero);
+	serialise_int4(&stream, array->arraymax);
+	serialise_stream(&stream, elems * sizeof(int32), 
+					 (char *) &(array->array[0]));
+
+	return streamstart;
+}
+
+/** 
+ * De-serialise a veil integer array variable.
+ *
+ * @param **p_stream Pointer into the stream currently being read.
+ * pointer is updated to point to the next free slot in the stream after
+ * reading the stream
+ * @return Pointer to the variable created or updated from the stream.
+ */
+static VarEntry *
+deserialise_int4array(char **p_stream)
+{
+	char *name = deserialise_name(p_stream);
+    int32 arrayzero;
+	int32 arraymax;
+	int32 elems;
+	VarEntry *var = vl_lookup_variable(name);
+	Int4Array *array = (Int4Array *) var->obj;
+
+	arrayzero = deserialise_int4(p_stream);
+	arraymax = deserialise_int4(p_stream);
+	text_check_range(p_stream, arrayzero, arraymax, name);
+	/* Reject a truncated or corrupt stream before we try to allocate
+	 * for it. */
+	text_need(p_stream, streamlen(((int64) arraymax + 1 - arrayzero) * 
+								  (int64) sizeof(int32)));
+	elems = 1 + arraymax - arrayzero;
+
+    if (array) {
+        if (array->type != OBJ_INT4_ARRAY) {
+            vl_type_mismatch(name, OBJ_INT4_ARRAY, array->type);
+        }
+    }
+	array = vl_NewInt4Array(array, var->shared, arrayzero, arraymax);
+	var->obj = (Object *) array;
+
+	deserialise_stream(p_stream, elems * sizeof(int32), 
+					   (char *) &(array->array[0]));
+	return var;
+}
+
+/** 
+ * Serialise a veil range variable into a dynamically allocated
+ * string.
+ *
+ * @param range Pointer to the variable to be serialised
+ * @param name The name of the variable
+ * @return Dynamically allocated string containing the serialised
+ * variable
+ */
+static char *
+serialise_range(Range *range, char *name)
+{
+    int stream_len = hdrlen(name) + (INT32SIZE_B64 * 2) + 1;
+	char *stream = palloc(stream_len * sizeof(char));
+	char *streamstart = stream;
+
+	serialise_char(&stream, RANGE_HDR);
+	serialise_name(&stream, name);
+	serialise_int4(&stream, range->min);
+	serialise_int4(&stream, range->max);
+	return streamstart;
+}
+
+/** 
+ * De-serialise a veil range variable.
+ *
+ * @param **p_stream Pointer into the stream currently being read.
+ * pointer is updated to point to the next free slot in the stream after
+ * reading the stream
+ * @return Pointer to the variable created or updated from the stream.
+ */
+static VarEntry *
+deserialise_range(char **p_stream)
+{
+	char *name = deserialise_name(p_stream);
+	VarEntry *var = vl_lookup_variable(name);
+    Range *range = (Range *) var->obj;
+
+    if (range) {
+        if (range->type != OBJ_RANGE) {
+            vl_type_mismatch(name, OBJ_RANGE, range->type);
+        }
+    }
+	else {
+        var->obj = (Object *) vl_NewRange(var->shared);
+        range = (Range *) var->obj;
+ 	}
+
+	range->min = deserialise_int4(p_stream);
+	range->max = deserialise_int4(p_stream);
+	return var;
+}
+
+/** 
+ * Return the maximum length of the base64 stream for a single
+ * serialised bitmap, packed or otherwise, with the given range.
+ *
+ * @param bitzero The lowest bit in the bitmap's range.
+ * @param bitmax The highest bit in the bitmap's range.
+ * @return The maximum length of the serialised bitmap.
+ */
+static int
+one_bitmap_len(int32 bitzero, int32 bitmax)
+{
+	/* A packed bitset is never more than 1 byte larger than the raw
+	 * bitset, and is preceded by its length. */
+	return (INT32SIZE_B64 * 3) + 
+		streamlen(1 + (sizeof(bm_int) * ARRAYELEMS(bitzero, bitmax)));
+}
+
+/** 
+ * Serialise a single bitmap from a veil bitmap array or bitmap hash.
+ *
+ * @param p_stream Pointer into the stream currently being read.
+ * pointer is updated to point to the next free slot in the stream after
+ * writing the stream.
+ * @param bitmap The bitmap to be serialised.
+ * @param packed Whether the bitset should be packed, in which case it
+ * is preceded by the length of the packed bitset.
+ */
+static void
+serialise_one_bitmap(char **p_stream, Bitmap *bitmap, bool packed)
+{
+    int elems = ARRAYELEMS(bitmap->bitzero, bitmap->bitmax);
+	BinStream bitset = {NULL, NULL, 0, true};
+
+	serialise_int4(p_stream, bitmap->bitzero);
+	serialise_int4(p_stream, bitmap->bitmax);
+	if (!packed) {
+		serialise_stream(p_stream, elems * sizeof(bm_int), 
+						 (char *) &(bitmap->bitset));
+		return;
+	}
+
+	bin_put_bitset(&bitset, bitmap);
+	bitset.buf = palloc(bitset.pos);
+	bitset.pos = 0;
+	bin_put_bitset(&bitset, bitmap);
+	serialise_int4(p_stream, bitset.pos);
+	serialise_stream(p_stream, bitset.pos, bitset.buf);
+	pfree(bitset.buf);
+}
+
+/** 
+ * Serialise a veil bitmap variable into a dynamically allocated
+ * string.
+ *
+ * @param bitmap Pointer to the variable to be serialised
+ * @param name The name of the variable
+ * @param packed Whether the bitset is to be packed
+ * @return Dynamically allocated string containing the serialised
+ * variable
+ */
+static char *
+serialise_bitmap(Bitmap *bitmap, char *name, bool packed)
+{
+    int stream_len = hdrlen(name) + 
+		one_bitmap_len(bitmap->bitzero, bitmap->bitmax) + 1;
+	char *stream = palloc(stream_len * sizeof(char));
+	char *streamstart = stream;
+
+	serialise_char(&stream, packed? PACKED_BITMAP_HDR: BITMAP_HDR);
+	serialise_name(&stream, name);
+	serialise_one_bitmap(&stream, bitmap, packed);
+	return streamstart;
+}
+
+/** 
+ * De-serialise a packed bitset for a bitmap with the given range into
+ * a dynamically allocated binary stream, checking that it is valid.
+ * The bitset may then be read from the binary stream, with
+ * bin_get_bitset(), without further checks.
+ *
+ * @param p_stream Pointer into the stream currently being read.
+ * pointer is updated to point to the next free slot in the stream after
+ * reading the stream.
+ * @param bitset The binary stream to receive the bitset.  Its buffer
+ * should be freed by the caller.
+ * @param bitzero The lowest bit of the bitset.
+ * @param bitmax The highest bit of the bitset.
+ * @param name  The name of the variable, for error reporting purposes.
+ */
+static void
+deserialise_packed_bitset(char **p_stream, BinStream *bitset, 
+						  int32 bitzero, int32 bitmax, char *name)
+{
+	int32 elems = ARRAYELEMS(bitzero, bitmax);
+	int32 len;
+
+	len = deserialise_int4(p_stream);
+	if ((len < MIN_PACKED_BITSET) || 
+		((int64) len > 1 + ((int64) elems * (int64) sizeof(bm_int)))) {
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("serialised stream is corrupt"),
+				 errdetail("Invalid packed bitset length %d for %s.", 
+						   len, name)));
+	}
+	text_need(p_stream, streamlen(len));
+	bitset->buf = palloc(len);
+	bitset->end = bitset->buf + len;
+	bitset->pos = 0;
+	bitset->packed = true;
+	deserialise_stream(p_stream, len, bitset->buf);
+	bin_read_bitset(bitset, NULL, bitzero, bitmax);
+	if (bitset->pos != len) {
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("serialised stream is corrupt"),
+				 errdetail("Packed bitset for %s has length %d but %d "
+						   "bytes were read.", name, len, bitset->pos)));
+	}
+	bitset->pos = 0;
+}
+
+/** 
+ * De-serialise the bitset of a single bitmap directly into an existing
+ * bitmap, whose range must already have been set.
+ *
+ * @param bitmap The bitmap into which the bitset is read.
+ * @param name  The name of the variable, for error reporting purposes.
+ * @param p_stream Pointer into the stream currently being read.
+ * pointer is updated to point to the next free slot in the stream after
+ * reading the stream.
+ * @param packed Whether the bitset is packed.
+ */
+static void
+deserialise_bitset(Bitmap *bitmap, char *name, 
+				   char **p_stream, bool packed)
+{
+	int32 elems = ARRAYELEMS(bitmap->bitzero, bitmap->bitmax);
+	BinStream bitset;
+
+	if (!packed) {
+		deserialise_stream(p_stream, elems * sizeof(bitmap->bitset[0]), 
+						   (char *) &(bitmap->bitset[0]));
+		return;
+	}
+
+	deserialise_packed_bitset(p_stream, &bitset, bitmap->bitzero, 
+							  bitmap->bitmax, name);
+	bin_get_bitset(&bitset, bitmap);
+	pfree(bitset.buf);
+}
+
+/** 
+ * De-serialise the range of a bitmap within a bitmap array or bitmap
+ * hash, raising an error if it does not match that of its container.
+ * The bitset can then be read directly into the container's bitmap.
+ *
+ * @param p_stream Pointer into the stream currently being read.
+ * pointer is updated to point to the next free slot in the stream after
+ * reading the stream.
+ * @param bitzero The lowest bit of the container's bitmaps.
+ * @param bitmax The highest bit of the container's bitmaps.
+ * @param name  The name of the variable, for error reporting purposes.
+ */
+static void
+deserialise_member_range(char **p_stream, int32 bitzero, int32 bitmax,
+						 char *name)
+{
+	if ((deserialise_int4(p_stream) != bitzero) ||
+		(deserialise_int4(p_stream) != bitmax)) {
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("serialised stream is corrupt"),
+				 errdetail("Bitmap range does not match that of %s at "
+						   "offset %d.", name, text_offset(p_stream))));
+	}
+}
+
+/** 
+ * Check that the next count packed bitsets in a text stream, each
+ * optionally preceded by its range, are valid for a bitmap of the
+ * given range, without reading them.  This is the text stream
+ * equivalent of bin_check_bitsets().
+ *
+ * @param p_stream Pointer into the stream currently being read.  This
+ * is not updated.
+ * @param bitzero The lowest bit of the bitsets.
+ * @param bitmax The highest bit of the bitsets.
+ * @param count The number of bitsets.
+ * @param ranges Whether each bitset is preceded by its range.
+ * @param name  The name of the variable, for error reporting purposes.
+ * @param packed Whether the bitsets are packed.
+ */
+static void
+text_check_bitsets(char **p_stream, int32 bitzero, int32 bitmax, 
+				   int32 count, bool ranges, char *name, bool packed)
+{
+	char     *stream = *p_stream;
+	BinStream bitset;
+
+	if (!packed) {
+		return;
+	}
+	while (count-- > 0) {
+		if (ranges) {
+			deserialise_member_range(&stream, bitzero, bitmax, name);
+		}
+		deserialise_packed_bitset(&stream, &bitset, bitzero, bitmax, name);
+		pfree(bitset.buf);
+	}
+}
+
+/** 
+ * Check the end of list marker for the bitmaps of a sparse bitmap
+ * array or bitmap hash.
+ *
+ * @param p_stream Pointer into the stream currently being read.
+ * pointer is updated to point to the next free slot in the stream after
+ * reading the stream.
+ * @param name  The name of the variable, for error reporting purposes.
+ * @return True if another bitmap follows, false at the end of the list.
+ */
+static bool
+deserialise_more(char **p_stream, char *name)
+{
+	char flag = deserialise_char(p_stream);
+
+	if (flag == BITMAP_HASH_MORE) {
+		return true;
+	}
+	if (flag != BITMAP_HASH_DONE) {
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("serialised stream is corrupt"),
+				 errdetail("Invalid list marker for %s at offset %d.", 
+						   name, text_offset(p_stream) - 1)));
+	}
+	return false;
+}
+
+/** 
+ * De-serialise a single bitmap, re-allocating it if its range has
+ * changed.
+ *
+ * @param p_bitmap Pointer to bitmap pointer.  This may be updated to
+ * contain a dynamically allocated bitmap if none is already present.
+ * @param name  The name of the variable, for error reporting purposes.
+ * @param shared Whether the bitmap is part of a shared rather than
+ * session variable.
+ * @param p_stream Pointer into the stream currently being read.
+ * pointer is updated to point to the next free slot in the stream after
+ * reading the stream.
+ * @param packed Whether the bitset is packed.
+ */
+static void
+deserialise_one_bitmap(Bitmap **p_bitmap, char *name, 
+					   bool shared, char **p_stream, bool packed)
+{
+	Bitmap *bitmap = *p_bitmap;
+    int32 bitzero;
+	int32 bitmax;
+
+	bitzero = deserialise_int4(p_stream);
+	bitmax = deserialise_int4(p_stream);
+	text_check_range(p_stream, bitzero, bitmax, name);
+	text_need(p_stream, text_min_bitset_len(bitzero, bitmax, packed));
+	text_check_bitsets(p_stream, bitzero, bitmax, 1, false, name, packed);
+
+    if (bitmap) {
+        if (bitmap->type != OBJ_BITMAP) {
+            vl_type_mismatch(name, OBJ_BITMAP, bitmap->type);
+        }
+    }
+	/* Check size and re-allocate memory if needed */
+	vl_NewBitmap(p_bitmap, shared, bitzero, bitmax);
+	deserialise_bitset(*p_bitmap, name, p_stream, packed);
+}
+
+/** 
+ * De-serialise a veil bitmap variable.
+ *
+ * @param **p_stream Pointer into the stream currently being read.
+ * pointer is updated to point to the next free slot in the stream after
+ * reading the stream
+ * @param packed Whether the bitset is packed
+ * @return Pointer to the variable created or updated from the stream.
+ */
+static VarEntry *
+deserialise_bitmap(char **p_stream, bool packed)
+{
+	char *name = deserialise_name(p_stream);
+	VarEntry *var = vl_lookup_variable(name);
+	Bitmap *bitmap = (Bitmap *) var->obj;
+
+	deserialise_one_bitmap(&bitmap, name, var->shared, p_stream, packed);
+	var->obj = (Object *) bitmap;
+	return var;
+}
+
+/** 
+ * Serialise a veil bitmap array variable into a dynamically allocated
+ * string.
+ *
+ * @param bmarray Pointer to the variable to be serialised
+ * @param name The name of the variable
+ * @param packed Whether the bitsets are to be packed
+ * @return Dynamically allocated string containing the serialised
+ * variable
+ */
+static char *
+serialise_bitmap_array(BitmapArray *bmarray, char *name, bool packed)
+{
+    int array_elems = 1 + bmarray->arraymax - bmarray->arrayzero;
+	int bitmap_len = one_bitmap_len(bmarray->bitzero, bmarray->bitmax);
+    int stream_len = hdrlen(name) + (INT32SIZE_B64 * 4) + 
+		             (bitmap_len * array_elems) + 1;
+	int idx;
+	char *stream = palloc(stream_len * sizeof(char));
+	char *streamstart = stream;
+
+	serialise_char(&stream, packed? PACKED_ARRAY_HDR: BITMAP_ARRAY_HDR);
+	serialise_name(&stream, name);
+	serialise_int4(&stream, bmarray->bitzero);
+	serialise_int4(&stream, bmarray->bitmax);
+	serialise_int4(&stream, bmarray->arrayzero);
+	serialise_int4(&stream, bmarray->arraymax);
+	for (idx = 0; idx < array_elems; idx++) {
+		serialise_one_bitmap(&stream, bmarray->bitmap[idx], packed);
+	}
+	return streamstart;
+}
+
+/** 
+ * De-serialise a veil bitmap array variable.
+ *
+ * @param **p_stream Pointer into the stream currently being read.
+ * pointer is updated to point to the next free slot in the stream after
+ * reading the stream
+ * @param packed Whether the bitsets are packed
+ * @return Pointer to the variable created or updated from the stream.
+ */
+static VarEntry *
+deserialise_bitmap_array(char **p_stream, bool packed)
+{
+	char *name = deserialise_name(p_stream);
+    int32 bitzero;
+	int32 bitmax;
+    int32 arrayzero;
+	int32 arraymax;
+    int32 array_elems;
+    int32 idx;
+	VarEntry *var = vl_lookup_variable(name);
+	BitmapArray *bmarray = (BitmapArray *) var->obj;
+
+	bitzero = deserialise_int4(p_stream);
+	bitmax = deserialise_int4(p_stream);
+	arrayzero = deserialise_int4(p_stream);
+	arraymax = deserialise_int4(p_stream);
+	text_check_range(p_stream, bitzero, bitmax, name);
+	text_check_range(p_stream, arrayzero, arraymax, name);
+	/* Every bitmap takes at least its range and bitset, so this
+	 * rejects a truncated stream before we try to allocate for it. */
+	text_need(p_stream, 
+			  ((int64) arraymax + 1 - arrayzero) * 
+			  ((2 * INT32SIZE_B64) + 
+			   text_min_bitset_len(bitzero, bitmax, packed)));
+	text_check_bitsets(p_stream, bitzero, bitmax, 
+					   1 + arraymax - arrayzero, true, name, packed);
+
+    if (bmarray) {
+        if (bmarray->type != OBJ_BITMAP_ARRAY) {
+            vl_type_mismatch(name, OBJ_BITMAP_ARRAY, bmarray->type);
+        }
+    }
+	/* Check size and re-allocate memory if needed */
+	vl_NewBitmapArray(&bmarray, var->shared, arrayzero, 
+					  arraymax, bitzero, bitmax);
+	var->obj = (Object *) bmarray;
+
+    array_elems = 1 + arraymax - arrayzero;
+	for (idx = 0; idx < array_elems; idx++) {
+		deserialise_member_range(p_stream, bitzero, bitmax, name);
+		deserialise_bitset(bmarray->bitmap[idx], name, p_stream, packed);
+	}
+	return var;
+}
+
+/** 
+ * Serialise a sparse veil bitmap array variable into a dynamically
+ * allocated string.  Only those bitmaps that have been allocated are
+ * written, each preceded by its index within the array.
+ *
+ * @param bmarray Pointer to the variable to be serialised
+ * @param name The name of the variable
+ * @param packed Whether the bitsets are to be packed
+ * @return Dynamically allocated string containing the serialised
+ * variable
+ */
+static char *
+serialise_sparse_bitmap_array(BitmapArray *bmarray, char *name, 
+							  bool packed)
+{
+	int bitmap_len = 1 + INT32SIZE_B64 + 
+		one_bitmap_len(bmarray->bitzero, bmarray->bitmax);
+	int bitmaps = 0;
+	int stream_len;
+	int32 idx = bmarray->arrayzero;
+	Bitmap *bitmap;
+	char *stream;
+	char *streamstart;
+
+	while ((bitmap = vl_NextBitmapFromArray(bmarray, &idx))) {
+		bitmaps++;
+		if (idx == bmarray->arraymax) {
+			break;
+		}
+		idx++;
+	}
+
+    stream_len = hdrlen(name) + (INT32SIZE_B64 * 4) + 
+		(bitmap_len * bitmaps) + 2;
+	stream = palloc(stream_len * sizeof(char));
+	streamstart = stream;
+
+	serialise_char(&stream, packed? PACKED_SPARSE_HDR: SPARSE_ARRAY_HDR);
 	serialise_name(&stream, name);
 	serialise_int4(&stream, bmarray->bitzero);
 	serialise_int4(&stream, bmarray->bitmax);
 	serialise_int4(&stream, bmarray->arrayzero);
 	serialise_int4(&stream, bmarray->arraymax);
-	for (idx = 0; idx < array_elems; idx++) {
-		serialise_one_bitmap(&stream, bmarray->bitmap[idx]);
+	idx = bmarray->arrayzero;
+	while ((bitmap = vl_NextBitmapFromArray(bmarray, &idx))) {
+		serialise_char(&stream, BITMAP_HASH_MORE);
+		serialise_int4(&stream, idx);
+		serialise_one_bitmap(&stream, bitmap, packed);
+		if (idx == bmarray->arraymax) {
+			break;
+		}
+		idx++;
+	}
+	serialise_char(&stream, BITMAP_HASH_DONE);
+	return streamstart;
+}
+
+/** 
+ * De-serialise a sparse veil bitmap array variable.
+ *
+ * @param **p_stream Pointer into the stream currently being read.
+ * pointer is updated to point to the next free slot in the stream after
+ * reading the stream
+ * @param packed Whether the bitsets are packed
+ * @return Pointer to the variable created or updated from the stream.
+ */
+static VarEntry *
+deserialise_sparse_bitmap_array(char **p_stream, bool packed)
+{
+	char *name = deserialise_name(p_stream);
+    int32 bitzero;
+	int32 bitmax;
+    int32 arrayzero;
+	int32 arraymax;
+    int32 idx;
+	VarEntry *var = vl_lookup_variable(name);
+	BitmapArray *bmarray = (BitmapArray *) var->obj;
+	Bitmap *bitmap;
+
+	bitzero = deserialise_int4(p_stream);
+	bitmax = deserialise_int4(p_stream);
+	arrayzero = deserialise_int4(p_stream);
+	arraymax = deserialise_int4(p_stream);
+	text_check_range(p_stream, bitzero, bitmax, name);
+	text_check_range(p_stream, arrayzero, arraymax, name);
+
+    if (bmarray) {
+        if (bmarray->type != OBJ_BITMAP_ARRAY) {
+            vl_type_mismatch(name, OBJ_BITMAP_ARRAY, bmarray->type);
+        }
+    }
+	vl_NewSparseBitmapArray(&bmarray, var->shared, arrayzero, 
+							arraymax, bitzero, bitmax);
+	var->obj = (Object *) bmarray;
+
+	while (deserialise_more(p_stream, name)) {
+		idx = deserialise_int4(p_stream);
+		/* Check that the bitmap is present before allocating it */
+		text_need(p_stream, (2 * INT32SIZE_B64) + 
+				  text_min_bitset_len(bitzero, bitmax, packed));
+		text_check_bitsets(p_stream, bitzero, bitmax, 1, true, name, packed);
+		bitmap = vl_AddBitmapToArray(bmarray, idx);
+		if (!bitmap) {
+			ereport(ERROR,
+					(errcode(ERRCODE_INTERNAL_ERROR),
+					 errmsg("Bitmap Array range error (%d not in %d..%d)", 
+							idx, arrayzero, arraymax),
+					 errdetail("Serialised stream for %s is corrupt.",
+							   name)));
+		}
+		deserialise_member_range(p_stream, bitzero, bitmax, name);
+		deserialise_bitset(bitmap, name, p_stream, packed);
+	}
+	return var;
+}
+
+
+/** 
+ * Calculate the size needed for a base64 stream to contain all of the
+ * bitmaps in a bitmap hash including their keys.
+ *
+ * @param bmhash Pointer to the variable to be serialised
+ * @param bitset_size The size, in bytes, of each bitset in the bitmap
+ * hash.
+ * @return Number of bytes required to contain all of the bitmaps and
+ * keys in the bitmap_hash
+ */
+static int
+sizeof_bitmaps_in_hash(BitmapHash *bmhash, int bitset_size)
+{
+	HASH_SEQ_STATUS status;
+	VarEntry *var;
+	int size = 1;  /* Allow for final end of stream indicator */
+
+	vl_StartHashScan(bmhash->hash, &status);
+	while ((var = vl_NextHashEntry(&status))) {
+		/* 1 byte below for record/end flag to precede each bitmap in
+		 * the hash */
+		size += 1 + bitset_size + hdrlen(var->key); 
+	}
+	return size;
+}
+
+
+/** 
+ * Serialise a veil bitmap hash variable into a dynamically allocated
+ * string.
+ *
+ * @param bmhash Pointer to the variable to be serialised
+ * @param name The name of the variable
+ * @param packed Whether the bitsets are to be packed
+ * @return Dynamically allocated string containing the serialised
+ * variable
+ */
+static char *
+serialise_bitmap_hash(BitmapHash *bmhash, char *name, bool packed)
+{
+    int bitset_size = one_bitmap_len(bmhash->bitzero, bmhash->bitmax);
+	int all_bitmaps_size = sizeof_bitmaps_in_hash(bmhash, bitset_size);
+    int stream_len = hdrlen(name) + (INT32SIZE_B64 * 3) + 
+		             all_bitmaps_size + 1;
+	char *stream = palloc(stream_len * sizeof(char));
+	char *streamstart = stream;
+	HASH_SEQ_STATUS status;
+	VarEntry *var;
+
+	serialise_char(&stream, packed? PACKED_HASH_HDR: BITMAP_HASH_HDR);
+	serialise_name(&stream, name);
+	serialise_int4(&stream, bmhash->bitzero);
+	serialise_int4(&stream, bmhash->bitmax);
+	if (packed) {
+		/* Allow the hash to be pre-sized on de-serialisation */
+		serialise_int4(&stream, (int32) hash_get_num_entries(bmhash->hash));
+	}
+	vl_StartHashScan(bmhash->hash, &status);
+	while ((var = vl_NextHashEntry(&status))) {
+		serialise_char(&stream, BITMAP_HASH_MORE);
+		serialise_name(&stream, var->key);
+		serialise_one_bitmap(&stream, (Bitmap *) var->obj, packed);
+	}
+	serialise_char(&stream, BITMAP_HASH_DONE);
+
+	return streamstart;
+}
+
+/** 
+ * De-serialise a veil bitmap hash variable.
+ *
+ * @param **p_stream Pointer into the stream currently being read.
+ * pointer is updated to point to the next free slot in the stream after
+ * reading the stream
+ * @param packed Whether the bitsets are packed
+ * @return Pointer to the variable created or updated from the stream.
+ */
+static VarEntry *
+deserialise_bitmap_hash(char **p_stream, bool packed)
+{
+	char *name = deserialise_name(p_stream);
+	char *hashkey;
+    int32 bitzero;
+	int32 bitmax;
+	int32 entries = 0;
+	VarEntry *var = vl_lookup_variable(name);
+	BitmapHash *bmhash = (BitmapHash *) var->obj;
+	Bitmap *bitmap;
+
+	bitzero = deserialise_int4(p_stream);
+	bitmax = deserialise_int4(p_stream);
+	text_check_range(p_stream, bitzero, bitmax, name);
+	if (packed) {
+		entries = deserialise_int4(p_stream);
+		/* Each entry takes at least its key, range and bitset, so this
+		 * rejects a corrupt count before the hash is sized from it. */
+		if (entries < 0) {
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("serialised stream is corrupt"),
+					 errdetail("Invalid entry count %d for %s at offset %d.",
+							   entries, name, text_offset(p_stream))));
+		}
+		text_need(p_stream, (int64) entries * 
+				  ((3 * INT32SIZE_B64) + 
+				   text_min_bitset_len(bitzero, bitmax, packed)));
+	}
+
+    if (bmhash) {
+        if (bmhash->type != OBJ_BITMAP_HASH) {
+            vl_type_mismatch(name, OBJ_BITMAP_HASH, bmhash->type);
+        }
+    }
+	/* Check size and re-allocate memory if needed */
+	vl_NewSizedBitmapHash(&bmhash, name, bitzero, bitmax, entries);
+	var->obj = (Object *) bmhash;
+
+	while (deserialise_more(p_stream, name)) {
+		hashkey = deserialise_name(p_stream);
+		/* Check that the bitmap is present before allocating it */
+		text_need(p_stream, (2 * INT32SIZE_B64) + 
+				  text_min_bitset_len(bitzero, bitmax, packed));
+		text_check_bitsets(p_stream, bitzero, bitmax, 1, true, name, packed);
+		bitmap = vl_AddBitmapToHash(bmhash, hashkey);
+		pfree(hashkey);
+
+		/* Every bitmap in the hash has the same range as the hash, so
+		 * the bitset can be read directly into the new entry. */
+		deserialise_member_range(p_stream, bitzero, bitmax, name);
+		deserialise_bitset(bitmap, name, p_stream, packed);
+	}
+	return var;
+}
+
+/** 
+ * Serialise a veil variable
+ *
+ * @param name  The name of the variable to be serialised.
+ * @return Dynamically allocated string containing the serialised value.
+ */
+extern char *
+vl_serialise_var(char *name)
+{
+	VarEntry *var;
+	char *result = NULL;
+	bool packed = veil_compress_bitmaps();
+
+	var = vl_lookup_variable(name);
+	if (var && var->obj) {
+		switch (var->obj->type)	{
+			case OBJ_INT4:
+				result = serialise_int4var((Int4Var *)var->obj, name);
+				break;
+			case OBJ_INT4_ARRAY:
+				result = serialise_int4array((Int4Array *)var->obj, name);
+				break;
+			case OBJ_RANGE:
+				result = serialise_range((Range *)var->obj, name);
+				break;
+			case OBJ_BITMAP:
+				result = serialise_bitmap((Bitmap *)var->obj, name, packed);
+				break;
+			case OBJ_BITMAP_ARRAY:
+				if (((BitmapArray *) var->obj)->pages) {
+					result = serialise_sparse_bitmap_array(
+						(BitmapArray *)var->obj, name, packed);
+				}
+				else {
+					result = serialise_bitmap_array(
+						(BitmapArray *)var->obj, name, packed);
+				}
+				break;
+			case OBJ_BITMAP_HASH:
+				result = serialise_bitmap_hash((BitmapHash *)var->obj, name,
+											   packed);
+				break;
+			default:
+				ereport(ERROR,
+						(errcode(ERRCODE_INTERNAL_ERROR),
+						 errmsg("Unsupported type for variable serialisation"),
+						 errdetail("Cannot serialise objects of type %d.", 
+								   (int32) var->obj->type)));
+				
+		}
+	}
+	return result;
+}
+
+/** 
+ * De-serialise the next veil variable from *p_stream, which must be
+ * within the stream whose bounds were set by vl_deserialise().
+ *
+ * @param **p_stream Pointer into the stream currently being read.
+ * pointer is updated to point to the next free slot in the stream after
+ * reading the stream
+ * @return The deserialised variable, or NULL at the end of the stream.
+ */
+extern VarEntry *
+vl_deserialise_next(char **p_stream)
+{
+	VarEntry *var = NULL;
+	if ((*p_stream) < text_end) {
+		char type = deserialise_char(p_stream);
+		switch (type){
+			case INT4VAR_HDR: var = deserialise_int4var(p_stream);
+				break;
+			case INT4_ARRAY_HDR: var = deserialise_int4array(p_stream);
+				break;
+			case RANGE_HDR: var = deserialise_range(p_stream);
+				break;
+			case BITMAP_HDR: var = deserialise_bitmap(p_stream, false);
+				break;
+			case BITMAP_ARRAY_HDR: 
+				var = deserialise_bitmap_array(p_stream, false);
+				break;
+			case SPARSE_ARRAY_HDR: 
+				var = deserialise_sparse_bitmap_array(p_stream, false);
+				break;
+			case BITMAP_HASH_HDR: 
+				var = deserialise_bitmap_hash(p_stream, false);
+				break;
+			case PACKED_BITMAP_HDR: var = deserialise_bitmap(p_stream, true);
+				break;
+			case PACKED_ARRAY_HDR: 
+				var = deserialise_bitmap_array(p_stream, true);
+				break;
+			case PACKED_SPARSE_HDR: 
+				var = deserialise_sparse_bitmap_array(p_stream, true);
+				break;
+			case PACKED_HASH_HDR: 
+				var = deserialise_bitmap_hash(p_stream, true);
+				break;
+			default:
+				ereport(ERROR,
+					(errcode(ERRCODE_INTERNAL_ERROR),
+					 errmsg("Unsupported type for variable deserialisation"),
+					 errdetail("Cannot deserialise objects of type %c "
+							   "at offset %d.", type, 
+							   text_offset(p_stream) - 1)));
+				
+		}
+	}
+	return var;
+}
+
+/** 
+ * De-serialise a base64 string containing, possibly many, derialised
+ * veil variables.  Every read is checked against the length of the
+ * stream, and each length, type header and range is validated as it is
+ * read, so a truncated or corrupt stream raises an error describing
+ * where the problem was found, rather than reading beyond its end.
+ * Variables that precede the problem will already have been
+ * de-serialised.
+ *
+ * @param **p_stream Pointer into the stream currently being read.  The
+ * stream must be writable and null-terminated.
+ * @param len The length of the stream, in characters.
+ * @return A count of the number of variables that have been de-serialised.
+ */
+extern int32
+vl_deserialise(char **p_stream, int32 len)
+{
+	int count = 0;
+
+	text_start = *p_stream;
+	text_end = text_start + len;
+	while ((*p_stream) < text_end) {
+		(void) vl_deserialise_next(p_stream);
+		count++;
+	}
+	return count;
+}
+
+
+/*
+ * Binary serialisation.
+ *
+ * The binary format is a sequence of self-contained records, so that
+ * the results of separate calls to vl_serialise_var_bin() may simply
+ * be concatenated.  Each record has the following layout:
+ *
+ *   byte   BIN_RECORD_MAGIC
+ *   byte   format version: 1 for raw bitsets, or 2 (BIN_FORMAT_VERSION)
+ *          for packed bitsets
+ *   byte   size of a bitset word (sizeof(bm_int))
+ *   byte   variable type, using the same type headers as the text
+ *          format
+ *   int32  length of the remainder of the record
+ *   int32  length of the variable name
+ *   bytes  the variable name (not null-terminated)
+ *   bytes  the type-specific payload
+ *
+ * All integers and bitset words are written in native byte order, just
+ * as they are (before base64 encoding) in the text format.
+ *
+ * A large bitmap array or bitmap hash may instead be written as a
+ * sequence of chunk records (ARRAY_CHUNK_HDR or HASH_CHUNK_HDR), each
+ * holding some of its elements, by vl_next_chunk().  The payload of a
+ * chunk begins with a flags byte, the first chunk for a variable being
+ * flagged with CHUNK_FIRST.  That chunk re-creates the variable, and
+ * each subsequent chunk adds elements to it, so chunks must be
+ * de-serialised in order but need not be de-serialised together.
+ */
+
+#ifndef DOXYGEN_SHOULD_SKIP_THIS
+
+#define BIN_RECORD_MAGIC   '#'
+#define BIN_FORMAT_VERSION 2
+#define BIN_RECORD_HDRLEN  (4 + sizeof(int32))
+
+#define ARRAY_CHUNK_HDR    'C'
+#define HASH_CHUNK_HDR     'K'
+#define CHUNK_FIRST        0x01
+#define CHUNK_SPARSE       0x02
+#define CHUNK_HDRLEN       (1 + (5 * sizeof(int32)))
+
+#endif
+
+/** 
+ * Write the binary payload for a variable, ie everything that follows
+ * the variable name in its record.
+ *
+ * @param stream The stream being written.
+ * @param obj The variable's contents.
+ * @return The type header for the record.
+ */
+static char
+bin_put_payload(BinStream *stream, Object *obj)
+{
+	switch (obj->type) {
+	case OBJ_INT4:
+	{
+		Int4Var *i4v = (Int4Var *) obj;
+
+		bin_put_char(stream, i4v->isnull? 1: 0);
+		bin_put_int4(stream, i4v->value);
+		return INT4VAR_HDR;
+	}
+	case OBJ_INT4_ARRAY:
+	{
+		Int4Array *array = (Int4Array *) obj;
+
+		bin_put_int4(stream, array->arrayzero);
+		bin_put_int4(stream, array->arraymax);
+		bin_put(stream, &(array->array[0]), 
+				(1 + array->arraymax - array->arrayzero) * sizeof(int32));
+		return INT4_ARRAY_HDR;
+	}
+	case OBJ_RANGE:
+		bin_put_int4(stream, ((Range *) obj)->min);
+		bin_put_int4(stream, ((Range *) obj)->max);
+		return RANGE_HDR;
+	case OBJ_BITMAP:
+		bin_put_int4(stream, ((Bitmap *) obj)->bitzero);
+		bin_put_int4(stream, ((Bitmap *) obj)->bitmax);
+		bin_put_bitset(stream, (Bitmap *) obj);
+		return BITMAP_HDR;
+	case OBJ_BITMAP_ARRAY:
+	{
+		BitmapArray *bmarray = (BitmapArray *) obj;
+		Bitmap *bitmap;
+		int32   idx;
+		int32   count = 0;
+
+		bin_put_int4(stream, bmarray->bitzero);
+		bin_put_int4(stream, bmarray->bitmax);
+		bin_put_int4(stream, bmarray->arrayzero);
+		bin_put_int4(stream, bmarray->arraymax);
+		if (!bmarray->pages) {
+			for (idx = 0; idx <= bmarray->arraymax - bmarray->arrayzero;
+				 idx++) {
+				bin_put_bitset(stream, bmarray->bitmap[idx]);
+			}
+			return BITMAP_ARRAY_HDR;
+		}
+
+		/* For a sparse array, write a count of the allocated bitmaps,
+		 * and then each, preceded by its index. */
+		idx = bmarray->arrayzero;
+		while ((bitmap = vl_NextBitmapFromArray(bmarray, &idx))) {
+			count++;
+			if (idx == bmarray->arraymax) {
+				break;
+			}
+			idx++;
+		}
+		bin_put_int4(stream, count);
+		idx = bmarray->arrayzero;
+		while ((bitmap = vl_NextBitmapFromArray(bmarray, &idx))) {
+			bin_put_int4(stream, idx);
+			bin_put_bitset(stream, bitmap);
+			if (idx == bmarray->arraymax) {
+				break;
+			}
+			idx++;
+		}
+		return SPARSE_ARRAY_HDR;
+	}
+	case OBJ_BITMAP_HASH:
+	{
+		BitmapHash *bmhash = (BitmapHash *) obj;
+		HASH_SEQ_STATUS status;
+		VarEntry *var;
+
+		bin_put_int4(stream, bmhash->bitzero);
+		bin_put_int4(stream, bmhash->bitmax);
+		bin_put_int4(stream, (int32) hash_get_num_entries(bmhash->hash));
+		vl_StartHashScan(bmhash->hash, &status);
+		while ((var = vl_NextHashEntry(&status))) {
+			bin_put_name(stream, var->key);
+			bin_put_bitset(stream, (Bitmap *) var->obj);
+		}
+		return BITMAP_HASH_HDR;
+	}
+	default:
+		ereport(ERROR,
+				(errcode(ERRCODE_INTERNAL_ERROR),
+				 errmsg("Unsupported type for variable serialisation"),
+				 errdetail("Cannot serialise objects of type %d.", 
+						   (int32) obj->type)));
+	}
+	return '\0';   /* Keep the compiler quiet */
+}
+
+/** 
+ * Write the header of a binary record, up to and including the variable
+ * name.  The type and length fields are completed by
+ * bin_finish_record().
+ *
+ * @param stream The stream being written.
+ * @param name The name of the variable.
+ * @return The position of the record within the stream.
+ */
+static int32
+bin_start_record(BinStream *stream, char *name)
+{
+	int32 start = stream->pos;
+
+	bin_put_char(stream, BIN_RECORD_MAGIC);
+	bin_put_char(stream, stream->packed? BIN_FORMAT_VERSION: 1);
+	bin_put_char(stream, sizeof(bm_int));
+	bin_put_char(stream, '\0');   /* Type, filled in below */
+	bin_put_int4(stream, 0);      /* Length, filled in below */
+	bin_put_name(stream, name);
+	return start;
+}
+
+/** 
+ * Complete a binary record, once its payload has been written, by
+ * filling in its type and length.
+ *
+ * @param stream The stream being written.
+ * @param start The position of the record, from bin_start_record().
+ * @param type The type header for the record.
+ */
+static void
+bin_finish_record(BinStream *stream, int32 start, char type)
+{
+	int32 len;
+
+	if (stream->buf) {
+		len = stream->pos - (start + BIN_RECORD_HDRLEN);
+		stream->buf[start + 3] = type;
+		memcpy(stream->buf + start + 4, &len, sizeof(int32));
+	}
+}
+
+/** 
+ * Write a complete binary record for a variable.
+ *
+ * @param stream The stream being written.
+ * @param name The name of the variable.
+ * @param obj The variable's contents.
+ */
+static void
+bin_put_record(BinStream *stream, char *name, Object *obj)
+{
+	int32 start = bin_start_record(stream, name);
+
+	bin_finish_record(stream, start, bin_put_payload(stream, obj));
+}
+
+/** 
+ * Return a bytea containing a complete binary record for a variable.
+ *
+ * @param name The name of the variable.
+ * @param obj The variable's contents.
+ * @param packed Whether bitsets are to be packed.
+ * @return Dynamically allocated bytea containing the record.
+ */
+static bytea *
+bin_record_bytea(char *name, Object *obj, bool packed)
+{
+	BinStream  stream = {NULL, NULL, 0, packed};
+	bytea     *result;
+
+	/* The first pass calculates the size of the stream, the second
+	 * writes it. */
+	bin_put_record(&stream, name, obj);
+
+	result = palloc(VARHDRSZ + stream.pos);
+	SET_VARSIZE(result, VARHDRSZ + stream.pos);
+	stream.buf = VARDATA(result);
+	stream.pos = 0;
+	bin_put_record(&stream, name, obj);
+
+	return result;
+}
+
+/** 
+ * Serialise a veil variable into the binary format.
+ *
+ * @param name  The name of the variable to be serialised.
+ * @return Dynamically allocated bytea containing the serialised value,
+ * or NULL if the variable is not defined.
+ */
+extern bytea *
+vl_serialise_var_bin(char *name)
+{
+	VarEntry  *var;
+
+	var = vl_lookup_variable(name);
+	if (!(var && var->obj)) {
+		return NULL;
+	}
+	return bin_record_bytea(name, var->obj, veil_compress_bitmaps());
+}
+
+/** 
+ * Start a chunked serialisation of a veil variable.  Chunks are then
+ * returned by successive calls to vl_next_chunk().
+ *
+ * @param scan The caller-owned scan state to be initialised.
+ * @param name The name of the variable to be serialised.
+ * @param chunk_size The target size of each chunk in bytes.  Chunks
+ * may exceed this by up to the size of a single element.
+ * @return false if the variable is not defined.
+ */
+extern bool
+vl_start_chunk_scan(ChunkScan *scan, char *name, int32 chunk_size)
+{
+	VarEntry *var = vl_lookup_variable(name);
+
+	if (!(var && var->obj)) {
+		return false;
+	}
+	if (chunk_size <= 0) {
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("chunk size must be positive")));
+	}
+	scan->name = name;
+	scan->obj = var->obj;
+	scan->chunk_size = chunk_size;
+	scan->packed = veil_compress_bitmaps();
+	scan->first = true;
+	scan->done = false;
+	scan->hash_done = 0;
+	if (var->obj->type == OBJ_BITMAP_ARRAY) {
+		scan->next_elem = ((BitmapArray *) var->obj)->arrayzero;
+	}
+	return true;
+}
+
+/** 
+ * Write the payload of the next chunk of a bitmap array.
+ *
+ * @param stream The stream being written.
+ * @param scan The scan state.
+ * @return The type header for the record.
+ */
+static char
+bin_put_array_chunk(BinStream *stream, ChunkScan *scan)
+{
+	BitmapArray *bmarray = (BitmapArray *) scan->obj;
+	Bitmap      *bitmap;
+	int32        count_pos;
+	int32        count = 0;
+	char         flags = scan->first? CHUNK_FIRST: 0;
+
+	if (bmarray->pages) {
+		flags |= CHUNK_SPARSE;
+	}
+	bin_put_char(stream, flags);
+	bin_put_int4(stream, bmarray->bitzero);
+	bin_put_int4(stream, bmarray->bitmax);
+	bin_put_int4(stream, bmarray->arrayzero);
+	bin_put_int4(stream, bmarray->arraymax);
+	count_pos = stream->pos;
+	bin_put_int4(stream, 0);      /* Count, filled in below */
+
+	while ((stream->pos - count_pos) < scan->chunk_size) {
+		bitmap = vl_NextBitmapFromArray(bmarray, &scan->next_elem);
+		if (!bitmap) {
+			scan->done = true;
+			break;
+		}
+		bin_put_int4(stream, scan->next_elem);
+		bin_put_bitset(stream, bitmap);
+		count++;
+		if (scan->next_elem == bmarray->arraymax) {
+			scan->done = true;
+			break;
+		}
+		scan->next_elem++;
+	}
+	memcpy(stream->buf + count_pos, &count, sizeof(int32));
+	return ARRAY_CHUNK_HDR;
+}
+
+/** 
+ * Write the payload of the next chunk of a bitmap hash.
+ *
+ * @param stream The stream being written.
+ * @param scan The scan state.
+ * @return The type header for the record.
+ */
+static char
+bin_put_hash_chunk(BinStream *stream, ChunkScan *scan)
+{
+	BitmapHash *bmhash = (BitmapHash *) scan->obj;
+	VarEntry   *var;
+	int32       count_pos;
+	int32       count = 0;
+
+	bin_put_char(stream, scan->first? CHUNK_FIRST: 0);
+	bin_put_int4(stream, bmhash->bitzero);
+	bin_put_int4(stream, bmhash->bitmax);
+	bin_put_int4(stream, (int32) hash_get_num_entries(bmhash->hash));
+	count_pos = stream->pos;
+	bin_put_int4(stream, 0);      /* Count, filled in below */
+
+	if (scan->first) {
+		vl_StartHashScan(bmhash->hash, &scan->status);
+	}
+	while ((stream->pos - count_pos) < scan->chunk_size) {
+		/* The scan terminates itself when it returns NULL */
+		if (!(var = vl_NextHashEntry(&scan->status))) {
+			scan->done = true;
+			break;
+		}
+		bin_put_name(stream, var->key);
+		bin_put_bitset(stream, (Bitmap *) var->obj);
+		count++;
+	}
+	scan->hash_done += count;
+	memcpy(stream->buf + count_pos, &count, sizeof(int32));
+	return HASH_CHUNK_HDR;
+}
+
+/** 
+ * Return the next chunk of a chunked serialisation.  Each chunk is a
+ * self-contained binary record that may be passed, in order, to
+ * vl_deserialise_bin(), so a large bitmap array or bitmap hash need
+ * never be serialised into, or de-serialised from, a single buffer.
+ * Variables of other types are returned as a single ordinary record.
+ *
+ * @param scan The scan state, as initialised by vl_start_chunk_scan().
+ * @return Dynamically allocated bytea containing the chunk, or NULL if
+ * there are no more chunks.
+ */
+extern bytea *
+vl_next_chunk(ChunkScan *scan)
+{
+	BinStream stream = {NULL, NULL, 0, scan->packed};
+	bytea    *result;
+	int32     bitzero;
+	int32     bitmax;
+	int64     elems;
+	int64     elem_max;
+	int64     payload;
+	int64     bound;
+	int32     start;
+	char      type;
+
+	if (scan->done) {
+		return NULL;
+	}
+	if ((scan->obj->type != OBJ_BITMAP_ARRAY) && 
+		(scan->obj->type != OBJ_BITMAP_HASH)) 
+	{
+		scan->done = true;
+		return bin_record_bytea(scan->name, scan->obj, scan->packed);
+	}
+
+	if (scan->obj->type == OBJ_BITMAP_ARRAY) {
+		bitzero = ((BitmapArray *) scan->obj)->bitzero;
+		bitmax = ((BitmapArray *) scan->obj)->bitmax;
+		elems = 1 + (int64) ((BitmapArray *) scan->obj)->arraymax - 
+			scan->next_elem;
+	}
+	else {
+		bitzero = ((BitmapHash *) scan->obj)->bitzero;
+		bitmax = ((BitmapHash *) scan->obj)->bitmax;
+		elems = (int64) hash_get_num_entries(
+			((BitmapHash *) scan->obj)->hash) - scan->hash_done;
+	}
+
+	/* Elements are written until the chunk size is reached, so the
+	 * chunk may overrun it by the size of the largest possible
+	 * element: an index or key, a tag and a raw bitset.  It can never
+	 * be larger than all of the remaining elements, though, which for
+	 * the last chunk of a variable may be much less. */
+	elem_max = sizeof(int32) + HASH_KEYLEN + 1 +
+		((int64) ARRAYELEMS(bitzero, bitmax) * (int64) sizeof(bm_int));
+	payload = Min((int64) scan->chunk_size + elem_max, 
+				  Max(elems, 0) * elem_max);
+	bound = BIN_RECORD_HDRLEN + sizeof(int32) + strlen(scan->name) + 
+		CHUNK_HDRLEN + payload;
+	if (bound > MaxAllocSize - VARHDRSZ) {
+		ereport(ERROR,
+				(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+				 errmsg("chunk of variable %s is too large", scan->name),
+				 errhint("Use a smaller chunk size.")));
+	}
+	result = palloc(VARHDRSZ + bound);
+	stream.buf = VARDATA(result);
+	stream.end = stream.buf + bound;
+
+	start = bin_start_record(&stream, scan->name);
+	if (scan->obj->type == OBJ_BITMAP_ARRAY) {
+		type = bin_put_array_chunk(&stream, scan);
+	}
+	else {
+		type = bin_put_hash_chunk(&stream, scan);
+	}
+	bin_finish_record(&stream, start, type);
+	Assert(stream.pos <= bound);
+
+	SET_VARSIZE(result, VARHDRSZ + stream.pos);
+	scan->first = false;
+	return result;
+}
+
+/** 
+ * Check that a variable being de-serialised is either undefined or of
+ * the expected type.
+ *
+ * @param var The variable.
+ * @param name The variable name, for error reporting.
+ * @param type The expected type.
+ */
+static void
+bin_check_type(VarEntry *var, char *name, ObjType type)
+{
+	if (var->obj && (var->obj->type != type)) {
+		vl_type_mismatch(name, type, var->obj->type);
+	}
+}
+
+/** 
+ * Check that a range read from a binary stream is valid, before any
+ * memory is allocated based on it.
+ *
+ * @param min The lower bound of the range.
+ * @param max The upper bound of the range.
+ * @param name The variable name, for error reporting.
+ */
+static void
+bin_check_range(int32 min, int32 max, char *name)
+{
+	if (min > max) {
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("serialised stream is corrupt"),
+				 errdetail("Invalid range %d..%d for %s.", 
+						   min, max, name)));
+	}
+}
+
+/** 
+ * Check that an element count read from a binary stream is valid, and
+ * that the stream is long enough to hold that many elements, before
+ * any memory is allocated based on it.
+ *
+ * @param stream The stream being read.
+ * @param count The number of elements.
+ * @param elem_len The minimum length of each element in the stream.
+ * @param name The variable name, for error reporting.
+ */
+static void
+bin_check_count(BinStream *stream, int32 count, int64 elem_len, char *name)
+{
+	if (count < 0) {
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("serialised stream is corrupt"),
+				 errdetail("Invalid element count %d for %s.", 
+						   count, name)));
+	}
+	bin_need(stream, (int64) count * elem_len);
+}
+
+/** 
+ * Raise an error for a chunk record that does not follow on from the
+ * chunks previously de-serialised into its variable.
+ *
+ * @param name The variable name, for error reporting.
+ */
+static void
+bin_chunk_mismatch(char *name)
+{
+	ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("serialised chunk does not match variable %s", name),
+			 errhint("The first chunk of a variable must be "
+					 "de-serialised before any of its other chunks.")));
+}
+
+/** 
+ * Read the payload of a binary record into the named variable.
+ *
+ * @param stream The stream being read.
+ * @param type The type header from the record.
+ * @param name The name of the variable.
+ * @return The de-serialised variable.
+ */
+static VarEntry *
+bin_get_payload(BinStream *stream, char type, char *name)
+{
+	VarEntry *var = vl_lookup_variable(name);
+	int32 bitzero;
+	int32 bitmax;
+	int32 arrayzero;
+	int32 arraymax;
+
+	switch (type) {
+	case INT4VAR_HDR:
+		bin_check_type(var, name, OBJ_INT4);
+		if (!var->obj) {
+			var->obj = (Object *) vl_NewInt4(var->shared);
+		}
+		((Int4Var *) var->obj)->isnull = bin_get_char(stream) != 0;
+		((Int4Var *) var->obj)->value = bin_get_int4(stream);
+		break;
+	case INT4_ARRAY_HDR:
+	{
+		Int4Array *array;
+		int64      bytes;
+
+		bin_check_type(var, name, OBJ_INT4_ARRAY);
+		arrayzero = bin_get_int4(stream);
+		arraymax = bin_get_int4(stream);
+		bin_check_range(arrayzero, arraymax, name);
+		bytes = (1 + (int64) arraymax - arrayzero) * (int64) sizeof(int32);
+		bin_need(stream, bytes);
+		array = vl_NewInt4Array((Int4Array *) var->obj, var->shared, 
+								arrayzero, arraymax);
+		var->obj = (Object *) array;
+		memcpy(&(array->array[0]), bin_get(stream, (int32) bytes), 
+			   (int32) bytes);
+		break;
+	}
+	case RANGE_HDR:
+		bin_check_type(var, name, OBJ_RANGE);
+		if (!var->obj) {
+			var->obj = (Object *) vl_NewRange(var->shared);
+		}
+		((Range *) var->obj)->min = bin_get_int4(stream);
+		((Range *) var->obj)->max = bin_get_int4(stream);
+		break;
+	case BITMAP_HDR:
+	{
+		Bitmap *bitmap = (Bitmap *) var->obj;
+
+		bin_check_type(var, name, OBJ_BITMAP);
+		bitzero = bin_get_int4(stream);
+		bitmax = bin_get_int4(stream);
+		bin_check_range(bitzero, bitmax, name);
+		bin_need(stream, bin_min_bitset_len(stream, bitzero, bitmax));
+		bin_check_bitsets(stream, bitzero, bitmax, 1, BITSET_NO_PREFIX);
+		vl_NewBitmap(&bitmap, var->shared, bitzero, bitmax);
+		var->obj = (Object *) bitmap;
+		bin_get_bitset(stream, bitmap);
+		break;
+	}
+	case BITMAP_ARRAY_HDR:
+	case SPARSE_ARRAY_HDR:
+	{
+		BitmapArray *bmarray = (BitmapArray *) var->obj;
+		Bitmap *bitmap;
+		int32   count;
+		int32   idx;
+
+		bin_check_type(var, name, OBJ_BITMAP_ARRAY);
+		bitzero = bin_get_int4(stream);
+		bitmax = bin_get_int4(stream);
+		arrayzero = bin_get_int4(stream);
+		arraymax = bin_get_int4(stream);
+		bin_check_range(bitzero, bitmax, name);
+		bin_check_range(arrayzero, arraymax, name);
+		if (type == BITMAP_ARRAY_HDR) {
+			bin_need(stream, (1 + (int64) arraymax - arrayzero) * 
+					 bin_min_bitset_len(stream, bitzero, bitmax));
+			bin_check_bitsets(stream, bitzero, bitmax, 
+							  1 + arraymax - arrayzero, BITSET_NO_PREFIX);
+			vl_NewBitmapArray(&bmarray, var->shared, arrayzero, 
+							  arraymax, bitzero, bitmax);
+			var->obj = (Object *) bmarray;
+			for (idx = 0; idx <= arraymax - arrayzero; idx++) {
+				bin_get_bitset(stream, bmarray->bitmap[idx]);
+			}
+			break;
+		}
+
+		count = bin_get_int4(stream);
+		bin_check_count(stream, count, sizeof(int32) + 
+						bin_min_bitset_len(stream, bitzero, bitmax), name);
+		bin_check_bitsets(stream, bitzero, bitmax, count, 
+						  BITSET_INDEX_PREFIX);
+		vl_NewSparseBitmapArray(&bmarray, var->shared, arrayzero, 
+								arraymax, bitzero, bitmax);
+		var->obj = (Object *) bmarray;
+		while (count-- > 0) {
+			idx = bin_get_int4(stream);
+			bitmap = vl_AddBitmapToArray(bmarray, idx);
+			if (!bitmap) {
+				ereport(ERROR,
+						(errcode(ERRCODE_INTERNAL_ERROR),
+						 errmsg("Bitmap Array range error (%d not in "
+								"%d..%d)", idx, arrayzero, arraymax),
+						 errdetail("Serialised stream for %s is corrupt.",
+								   name)));
+			}
+			bin_get_bitset(stream, bitmap);
+		}
+		break;
+	}
+	case ARRAY_CHUNK_HDR:
+	{
+		BitmapArray *bmarray = (BitmapArray *) var->obj;
+		Bitmap *bitmap;
+		char    flags = bin_get_char(stream);
+		int32   count;
+		int32   idx;
+
+		bin_check_type(var, name, OBJ_BITMAP_ARRAY);
+		bitzero = bin_get_int4(stream);
+		bitmax = bin_get_int4(stream);
+		arrayzero = bin_get_int4(stream);
+		arraymax = bin_get_int4(stream);
+		bin_check_range(bitzero, bitmax, name);
+		bin_check_range(arrayzero, arraymax, name);
+		count = bin_get_int4(stream);
+		bin_check_count(stream, count, sizeof(int32) + 
+						bin_min_bitset_len(stream, bitzero, bitmax), name);
+		bin_check_bitsets(stream, bitzero, bitmax, count, 
+						  BITSET_INDEX_PREFIX);
+		if (flags & CHUNK_FIRST) {
+			if (flags & CHUNK_SPARSE) {
+				vl_NewSparseBitmapArray(&bmarray, var->shared, arrayzero, 
+										arraymax, bitzero, bitmax);
+			}
+			else {
+				vl_NewBitmapArray(&bmarray, var->shared, arrayzero, 
+								  arraymax, bitzero, bitmax);
+			}
+			var->obj = (Object *) bmarray;
+		}
+		else if (!(bmarray && (bmarray->bitzero == bitzero) && 
+				   (bmarray->bitmax == bitmax) &&
+				   (bmarray->arrayzero == arrayzero) &&
+				   (bmarray->arraymax == arraymax))) 
+		{
+			bin_chunk_mismatch(name);
+		}
+
+		while (count-- > 0) {
+			idx = bin_get_int4(stream);
+			bitmap = vl_AddBitmapToArray(bmarray, idx);
+			if (!bitmap) {
+				ereport(ERROR,
+						(errcode(ERRCODE_INTERNAL_ERROR),
+						 errmsg("Bitmap Array range error (%d not in "
+								"%d..%d)", idx, arrayzero, arraymax),
+						 errdetail("Serialised stream for %s is corrupt.",
+								   name)));
+			}
+			bin_get_bitset(stream, bitmap);
+		}
+		break;
+	}
+	case HASH_CHUNK_HDR:
+	{
+		BitmapHash *bmhash = (BitmapHash *) var->obj;
+		char   flags = bin_get_char(stream);
+		int32  entries;
+		int32  count;
+
+		bin_check_type(var, name, OBJ_BITMAP_HASH);
+		bitzero = bin_get_int4(stream);
+		bitmax = bin_get_int4(stream);
+		entries = bin_get_int4(stream);
+		bin_check_range(bitzero, bitmax, name);
+		count = bin_get_int4(stream);
+		bin_check_count(stream, count, sizeof(int32) + 
+						bin_min_bitset_len(stream, bitzero, bitmax), name);
+		bin_check_bitsets(stream, bitzero, bitmax, count, 
+						  BITSET_KEY_PREFIX);
+		if (entries < count) {
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("serialised stream is corrupt"),
+					 errdetail("Chunk of %d entries exceeds the %d entries "
+							   "of %s.", count, entries, name)));
+		}
+		if (flags & CHUNK_FIRST) {
+			/* The total number of entries, which may be spread across
+			 * many chunks, cannot be checked against this chunk so
+			 * only the entries in this chunk are used to size the
+			 * hash. */
+			vl_NewSizedBitmapHash(&bmhash, name, bitzero, bitmax, count);
+			var->obj = (Object *) bmhash;
+		}
+		else if (!(bmhash && (bmhash->bitzero == bitzero) &&
+				   (bmhash->bitmax == bitmax))) 
+		{
+			bin_chunk_mismatch(name);
+		}
+
+		while (count-- > 0) {
+			char *key = bin_get_name(stream);
+
+			bin_get_bitset(stream, vl_AddBitmapToHash(bmhash, key));
+			pfree(key);
+		}
+		break;
 	}
-	return streamstart;
+	case BITMAP_HASH_HDR:
+	{
+		BitmapHash *bmhash = (BitmapHash *) var->obj;
+		int32 count;
+
+		bin_check_type(var, name, OBJ_BITMAP_HASH);
+		bitzero = bin_get_int4(stream);
+		bitmax = bin_get_int4(stream);
+		bin_check_range(bitzero, bitmax, name);
+		count = bin_get_int4(stream);
+		bin_check_count(stream, count, sizeof(int32) + 
+						bin_min_bitset_len(stream, bitzero, bitmax), name);
+		bin_check_bitsets(stream, bitzero, bitmax, count, 
+						  BITSET_KEY_PREFIX);
+		vl_NewSizedBitmapHash(&bmhash, name, bitzero, bitmax, count);
+		var->obj = (Object *) bmhash;
+		while (count-- > 0) {
+			char *key = bin_get_name(stream);
+
+			/* Read each bitset straight into its hash entry */
+			bin_get_bitset(stream, vl_AddBitmapToHash(bmhash, key));
+			pfree(key);
+		}
+		break;
+	}
+	default:
+		ereport(ERROR,
+				(errcode(ERRCODE_INTERNAL_ERROR),
+				 errmsg("Unsupported type for variable deserialisation"),
+				 errdetail("Cannot deserialise objects of type %c.", 
+						   type)));
+	}
+	return var;
 }
 
 /** 
- * De-serialise a veil bitmap array variable.
+ * Read and check the header of the next record in a binary stream.
  *
- * @param **p_stream Pointer into the stream currently being read.
- * pointer is updated to point to the next free slot in the stream after
- * reading the stream
- * @return Pointer to the variable created or updated from the stream.
+ * @param stream The stream being read.
+ * @param p_type Result parameter giving the type header from the
+ * record.
+ * @return The length of the record following its header.
  */
-static VarEntry *
-deserialise_bitmap_array(char **p_stream)
+static int32
+bin_get_record_header(BinStream *stream, char *p_type)
 {
-	char *name = deserialise_name(p_stream);
-    int32 bitzero;
-	int32 bitmax;
-    int32 arrayzero;
-	int32 arraymax;
-    int32 array_elems;
-    int32 idx;
-	VarEntry *var = vl_lookup_variable(name);
-	BitmapArray *bmarray = (BitmapArray *) var->obj;
-
-	bitzero = deserialise_int4(p_stream);
-	bitmax = deserialise_int4(p_stream);
-	arrayzero = deserialise_int4(p_stream);
-	arraymax = deserialise_int4(p_stream);
+	char      version;
+	char      wordsize;
+	int32     len;
 
-    if (bmarray) {
-        if (bmarray->type != OBJ_BITMAP_ARRAY) {
-            vl_type_mismatch(name, OBJ_BITMAP_ARRAY, bmarray->type);
-        }
-    }
-	/* Check size and re-allocate memory if needed */
-	vl_NewBitmapArray(&bmarray, var->shared, arrayzero, 
-					  arraymax, bitzero, bitmax);
-	var->obj = (Object *) bmarray;
+	if (bin_get_char(stream) != BIN_RECORD_MAGIC) {
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("serialised stream is corrupt"),
+				 errdetail("No record header found at offset %d.", 
+						   stream->pos - 1)));
+	}
+	version = bin_get_char(stream);
+	wordsize = bin_get_char(stream);
+	*p_type = bin_get_char(stream);
+	len = bin_get_int4(stream);
 
-    array_elems = 1 + arraymax - arrayzero;
-	for (idx = 0; idx < array_elems; idx++) {
-		deserialise_one_bitmap(&(bmarray->bitmap[idx]), "", 
-							   var->shared, p_stream);
-		
+	if ((version < 1) || (version > BIN_FORMAT_VERSION)) {
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("unsupported serialisation format version %d", 
+						(int) version),
+				 errdetail("This version of veil supports versions up "
+						   "to %d.", BIN_FORMAT_VERSION)));
+	}
+	if (wordsize != sizeof(bm_int)) {
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("serialised stream uses %d-bit bitmaps",
+						wordsize * 8),
+				 errdetail("This version of veil uses %d-bit bitmaps.",
+						   (int) sizeof(bm_int) * 8)));
 	}
-	return var;
-}
 
+	stream->packed = (version >= 2);
+	return len;
+}
 
 /** 
- * Calculate the size needed for a base64 stream to contain all of the
- * bitmaps in a bitmap hash including their keys.
+ * Return the object type that a binary record of the given type will
+ * be de-serialised into.
  *
- * @param bmhash Pointer to the variable to be serialised
- * @param bitset_size The size, in bytes, of each bitset in the bitmap
- * hash.
- * @return Number of bytes required to contain all of the bitmaps and
- * keys in the bitmap_hash
+ * @param type The type header from the record.
+ * @return The corresponding object type.
  */
-static int
-sizeof_bitmaps_in_hash(BitmapHash *bmhash, int bitset_size)
+static ObjType
+bin_record_objtype(char type)
 {
-	VarEntry *var = NULL;
-	int size = 1;  /* Allow for final end of stream indicator */
-	while ((var = vl_NextHashEntry(bmhash->hash, var))) {
-		/* 1 byte below for record/end flag to precede each bitmap in
-		 * the hash */
-		size += 1 + bitset_size + hdrlen(var->key); 
+	switch (type) {
+	case INT4VAR_HDR:      return OBJ_INT4;
+	case INT4_ARRAY_HDR:   return OBJ_INT4_ARRAY;
+	case RANGE_HDR:        return OBJ_RANGE;
+	case BITMAP_HDR:       return OBJ_BITMAP;
+	case BITMAP_ARRAY_HDR: 
+	case SPARSE_ARRAY_HDR: 
+	case ARRAY_CHUNK_HDR:  return OBJ_BITMAP_ARRAY;
+	case BITMAP_HASH_HDR: 
+	case HASH_CHUNK_HDR:   return OBJ_BITMAP_HASH;
 	}
-	return size;
+	ereport(ERROR,
+			(errcode(ERRCODE_INTERNAL_ERROR),
+			 errmsg("Unsupported type for variable deserialisation"),
+			 errdetail("Cannot deserialise objects of type %c.", 
+					   type)));
+	return OBJ_UNDEFINED;   /* Keep the compiler quiet */
 }
 
-
 /** 
- * Serialise a veil bitmap hash variable into a dynamically allocated
- * string.
+ * Check, without modifying any variable, that the next record from a
+ * binary stream can be de-serialised into the variable it names.  The
+ * record's header and name are checked, as is the type of any existing
+ * variable of that name.  The payload itself is not read.
  *
- * @param bmhash Pointer to the variable to be serialised
- * @param name The name of the variable
- * @return Dynamically allocated string containing the serialised
- * variable
+ * @param stream The stream being read.
+ * @param shared Whether the variable is to be restored as a shared
+ * variable.
  */
-static char *
-serialise_bitmap_hash(BitmapHash *bmhash, char *name)
+static void
+bin_check_record(BinStream *stream, bool shared)
 {
-    int bitset_elems = ARRAYELEMS(bmhash->bitzero, bmhash->bitmax);
-    int bitset_size = (INT32SIZE_B64 * 2) + 
-		              streamlen(sizeof(int32) * bitset_elems);
-	int all_bitmaps_size = sizeof_bitmaps_in_hash(bmhash, bitset_size);
-    int stream_len = hdrlen(name) + (INT32SIZE_B64 * 2) + 
-		             all_bitmaps_size + 1;
-	char *stream = palloc(stream_len * sizeof(char));
-	char *streamstart = stream;
-	VarEntry *var = NULL;
+	char      type;
+	ObjType   objtype;
+	char     *name;
+	VarEntry *var;
 
-	serialise_char(&stream, BITMAP_HASH_HDR);
-	serialise_name(&stream, name);
-	serialise_int4(&stream, bmhash->bitzero);
-	serialise_int4(&stream, bmhash->bitmax);
-	while ((var = vl_NextHashEntry(bmhash->hash, var))) {
-		serialise_char(&stream, BITMAP_HASH_MORE);
-		serialise_name(&stream, var->key);
-		serialise_one_bitmap(&stream, (Bitmap *) var->obj);
+	(void) bin_get_record_header(stream, &type);
+	objtype = bin_record_objtype(type);
+	name = bin_get_name(stream);
+	var = vl_find_variable(name);
+	if (var) {
+		if (shared && !var->shared) {
+			ereport(ERROR,
+					(errcode(ERRCODE_INTERNAL_ERROR),
+					 errmsg("attempt to redefine session variable %s", 
+							name),
+					 errdetail("You are trying to create shared variable "
+							   "%s but it already exists as a session "
+							   "variable.", name)));
+		}
+		bin_check_type(var, name, objtype);
 	}
-	serialise_char(&stream, BITMAP_HASH_DONE);
-
-	return streamstart;
 }
 
 /** 
- * De-serialise a veil bitmap hash variable.
+ * De-serialise the next record from a binary stream.
  *
- * @param **p_stream Pointer into the stream currently being read.
- * pointer is updated to point to the next free slot in the stream after
- * reading the stream
- * @return Pointer to the variable created or updated from the stream.
+ * @param stream The stream being read.
+ * @return The de-serialised variable.
  */
 static VarEntry *
-deserialise_bitmap_hash(char **p_stream)
+bin_get_record(BinStream *stream)
 {
-	char *name = deserialise_name(p_stream);
-	char *hashkey;
-    int32 bitzero;
-	int32 bitmax;
-	VarEntry *var = vl_lookup_variable(name);
-	BitmapHash *bmhash = (BitmapHash *) var->obj;
-	Bitmap *tmp_bitmap = NULL;
-	Bitmap *bitmap;
+	char      type;
+	int32     len;
+	int32     end;
+	char     *name;
+	VarEntry *var;
 
-	bitzero = deserialise_int4(p_stream);
-	bitmax = deserialise_int4(p_stream);
+	len = bin_get_record_header(stream, &type);
 
-    if (bmhash) {
-        if (bmhash->type != OBJ_BITMAP_HASH) {
-            vl_type_mismatch(name, OBJ_BITMAP_HASH, bmhash->type);
-        }
-    }
-	/* Check size and re-allocate memory if needed */
-	vl_NewBitmapHash(&bmhash, name, bitzero, bitmax);
-	var->obj = (Object *) bmhash;
+	/* Ensure the record lies within the stream, and that we read
+	 * exactly the whole of it. */
+	(void) bin_get(stream, len);
+	end = stream->pos;
+	stream->pos -= len;
 
-	while (deserialise_char(p_stream) == BITMAP_HASH_MORE) {
-		hashkey = deserialise_name(p_stream);
-		deserialise_one_bitmap(&tmp_bitmap, "", var->shared, p_stream);
-		/* tmp_bitmap now contains a (dynamically allocated) bitmap
-		 * Now we want to copy that into the bmhash.  We don't worry
-		 * about memory leaks here since this is allocated only once
-		 * per call of this function, and the memory context will
-		 * eventually be freed anyway.
-		 */
-		bitmap = vl_AddBitmapToHash(bmhash, hashkey);
-		vl_BitmapUnion(bitmap, tmp_bitmap);
+	name = bin_get_name(stream);
+	var = bin_get_payload(stream, type, name);
+	if (stream->pos != end) {
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("serialised stream is corrupt"),
+				 errdetail("Record for %s has length %d but %d bytes "
+						   "were read.", name, len, 
+						   len + stream->pos - end)));
 	}
 	return var;
 }
 
 /** 
- * Serialise a veil variable
+ * De-serialise a binary stream containing, possibly many, serialised
+ * veil variables.  The stream is read in place.
  *
- * @param name  The name of the variable to be serialised.
- * @return Dynamically allocated string containing the serialised value.
+ * @param data The start of the binary stream.
+ * @param len The length of the binary stream in bytes.
+ * @return A count of the number of variables that have been de-serialised.
  */
-extern char *
-vl_serialise_var(char *name)
+extern int32
+vl_deserialise_bin(char *data, int32 len)
 {
-	VarEntry *var;
-	char *result = NULL;
+	BinStream stream;
+	int32     count = 0;
+
+	stream.buf = data;
+	stream.end = data + len;
+	stream.pos = 0;
+	stream.packed = false;
+	while (stream.pos < len) {
+		(void) bin_get_record(&stream);
+		count++;
+	}
+	return count;
+}
 
-	var = vl_lookup_variable(name);
-	if (var && var->obj) {
-		switch (var->obj->type)	{
-			case OBJ_INT4:
-				result = serialise_int4var((Int4Var *)var->obj, name);
-				break;
-			case OBJ_INT4_ARRAY:
-				result = serialise_int4array((Int4Array *)var->obj, name);
-				break;
-			case OBJ_RANGE:
-				result = serialise_range((Range *)var->obj, name);
-				break;
-			case OBJ_BITMAP:
-				result = serialise_bitmap((Bitmap *)var->obj, name);
-				break;
-			case OBJ_BITMAP_ARRAY:
-				result = serialise_bitmap_array((BitmapArray *)var->obj, name);
-				break;
-			case OBJ_BITMAP_HASH:
-				result = serialise_bitmap_hash((BitmapHash *)var->obj, name);
-				break;
-			default:
-				ereport(ERROR,
-						(errcode(ERRCODE_INTERNAL_ERROR),
-						 errmsg("Unsupported type for variable serialisation"),
-						 errdetail("Cannot serialise objects of type %d.", 
-								   (int32) var->obj->type)));
-				
+
+/*
+ * Session serialisation.
+ *
+ * A session stream contains the binary records of many variables,
+ * preceded by a table of contents giving the location and checksum of
+ * each record, so that the whole stream can be validated before any
+ * variable is modified.  Its layout is:
+ *
+ *   bytes  SESSION_MAGIC
+ *   byte   SESSION_VERSION
+ *   int32  the number of variables
+ *   for each variable:
+ *     int32  offset of its record from the start of the data area
+ *     int32  length of its record
+ *     uint32 CRC-32C checksum of its record
+ *   uint32 CRC-32C checksum of everything above
+ *   the data area, containing the binary record of each variable
+ */
+
+#ifndef DOXYGEN_SHOULD_SKIP_THIS
+
+#define SESSION_MAGIC      "VLSS"
+#define SESSION_MAGIC_LEN  4
+#define SESSION_VERSION    1
+#define SESSION_TOC_ENTRY  (3 * sizeof(int32))
+
+#endif
+
+/** 
+ * Return the CRC-32C checksum of a block of memory.
+ *
+ * @param data The memory to be checksummed.
+ * @param len The length of data in bytes.
+ * @return The checksum.
+ */
+static pg_crc32c
+checksum(const char *data, int32 len)
+{
+	pg_crc32c crc;
+
+	INIT_CRC32C(crc);
+	COMP_CRC32C(crc, data, len);
+	FIN_CRC32C(crc);
+	return crc;
+}
+
+/** 
+ * Return the names of all defined variables, shared and session, whose
+ * names match a LIKE pattern.
+ *
+ * @param pattern The LIKE pattern to be matched.
+ * @param scope Whether shared variables, session variables, or both,
+ * are to be returned.
+ * @param p_count Pointer to variable to receive the number of names.
+ * @return Dynamically allocated array of the matching names.
+ */
+static char **
+matching_variables(text *pattern, VarScope scope, int32 *p_count)
+{
+	VarScan  scan;
+	veil_variable_t *var;
+	int32    count = 0;
+	int32    size = 16;
+	char   **names = palloc(size * sizeof(char *));
+	bool     match;
+
+	/* The names are collected before any of the variables are looked
+	 * up, as lookups may add entries to the hash being scanned. */
+	vl_start_variable_scan(&scan);
+	while ((var = vl_next_variable(&scan))) {
+		if (((scope == VAR_SCOPE_SHARED) && !var->shared) ||
+			((scope == VAR_SCOPE_SESSION) && var->shared)) {
+			continue;
+		}
+		match = DatumGetBool(
+			DirectFunctionCall2Coll(textlike, DEFAULT_COLLATION_OID,
+									PointerGetDatum(
+										cstring_to_text(var->name)),
+									PointerGetDatum(pattern)));
+		if (match) {
+			if (count == size) {
+				size *= 2;
+				names = repalloc(names, size * sizeof(char *));
+			}
+			names[count++] = pstrdup(var->name);
 		}
 	}
-	return result;
+	*p_count = count;
+	return names;
 }
 
 /** 
- * De-serialise the next veil variable from *p_stream
+ * Determine whether a variable's contents may be serialised.  Bitmap
+ * refs, bitmap clones, mapped bitmap arrays, and Veil's own control
+ * structure, may not.
  *
- * @param **p_stream Pointer into the stream currently being read.
- * pointer is updated to point to the next free slot in the stream after
- * reading the stream
- * @return The deserialised variable.
+ * @param obj The variable's contents.
+ * @return true if obj may be serialised.
  */
-extern VarEntry *
-vl_deserialise_next(char **p_stream)
+static bool
+serialisable(Object *obj)
 {
-	VarEntry *var = NULL;
-	if ((**p_stream) != '\0') {
-		char type = deserialise_char(p_stream);
-		switch (type){
-			case INT4VAR_HDR: var = deserialise_int4var(p_stream);
-				break;
-			case INT4_ARRAY_HDR: var = deserialise_int4array(p_stream);
-				break;
-			case RANGE_HDR: var = deserialise_range(p_stream);
-				break;
-			case BITMAP_HDR: var = deserialise_bitmap(p_stream);
-				break;
-			case BITMAP_ARRAY_HDR: var = deserialise_bitmap_array(p_stream);
-				break;
-			case BITMAP_HASH_HDR: var = deserialise_bitmap_hash(p_stream);
-				break;
-			default:
-				ereport(ERROR,
-					(errcode(ERRCODE_INTERNAL_ERROR),
-					 errmsg("Unsupported type for variable deserialisation"),
-					 errdetail("Cannot deserialise objects of type %c.", 
-							   type)));
-				
+	return (obj->type != OBJ_SHMEMCTL) && (obj->type != OBJ_BITMAP_REF) &&
+		(obj->type != OBJ_MAPPED_BITMAP_ARRAY) &&
+		(obj->type != OBJ_BITMAP_CLONE);
+}
+
+/** 
+ * Find a defined variable, whose name matches a LIKE pattern, that
+ * vl_serialise_session() would skip because it cannot be serialised.
+ *
+ * @param pattern The LIKE pattern that variable names must match.
+ * @param scope Whether shared variables, session variables, or both,
+ * are to be checked.
+ * @return The name of the first such variable found, or NULL if there
+ * is none.
+ */
+extern char *
+vl_unserialisable_variable(text *pattern, VarScope scope)
+{
+	int32      count;
+	char     **names = matching_variables(pattern, scope, &count);
+	int32      i;
+	VarEntry  *var;
+
+	for (i = 0; i < count; i++) {
+		var = vl_lookup_variable(names[i]);
+		if (var->obj && !serialisable(var->obj) &&
+			(var->obj->type != OBJ_SHMEMCTL)) {
+			return names[i];
 		}
 	}
-	return var;
+	return NULL;
 }
 
 /** 
- * De-serialise a base64 string containing, possibly many, derialised
- * veil variables.
+ * Serialise all defined variables whose names match a LIKE pattern into
+ * a single session stream.  Variables that have been declared but not
+ * yet given a value, and those that cannot be serialised, are skipped.
  *
- * @param **p_stream Pointer into the stream currently being read.
- * @return A count of the number of variables that have been de-serialised.
+ * @param pattern The LIKE pattern that variable names must match.
+ * @param scope Whether shared variables, session variables, or both,
+ * are to be serialised.
+ * @param p_count Pointer to variable to receive the number of
+ * variables serialised.  This may be NULL.
+ * @return Dynamically allocated bytea containing the session stream.
+ */
+extern bytea *
+vl_serialise_session(text *pattern, VarScope scope, int32 *p_count)
+{
+	int32      count;
+	char     **names = matching_variables(pattern, scope, &count);
+	Object   **objs = palloc(Max(count, 1) * sizeof(Object *));
+	int32     *lens = palloc(Max(count, 1) * sizeof(int32));
+	bool       packed = veil_compress_bitmaps();
+	int32      vars = 0;
+	int32      hdr_len;
+	int32      data_len = 0;
+	int32      i;
+	VarEntry  *var;
+	BinStream  stream = {NULL, NULL, 0, packed};
+	BinStream  toc;
+	bytea     *result;
+	char      *data;
+	char       version = SESSION_VERSION;
+
+	/* Find, and size the record for, each variable */
+	for (i = 0; i < count; i++) {
+		var = vl_lookup_variable(names[i]);
+		if (!(var->obj && serialisable(var->obj))) {
+			continue;
+		}
+		names[vars] = names[i];
+		objs[vars] = var->obj;
+		stream.pos = 0;
+		bin_put_record(&stream, names[vars], objs[vars]);
+		lens[vars] = stream.pos;
+		data_len += stream.pos;
+		vars++;
+	}
+
+	hdr_len = SESSION_MAGIC_LEN + 1 + sizeof(int32) + 
+		(vars * SESSION_TOC_ENTRY) + sizeof(pg_crc32c);
+	result = palloc(VARHDRSZ + hdr_len + data_len);
+	SET_VARSIZE(result, VARHDRSZ + hdr_len + data_len);
+	data = VARDATA(result) + hdr_len;
+
+	toc.buf = VARDATA(result);
+	toc.end = data;
+	toc.pos = 0;
+	toc.packed = false;
+	bin_put(&toc, SESSION_MAGIC, SESSION_MAGIC_LEN);
+	bin_put(&toc, &version, 1);
+	bin_put_int4(&toc, vars);
+
+	/* Write each record, and its table of contents entry */
+	stream.buf = data;
+	stream.pos = 0;
+	for (i = 0; i < vars; i++) {
+		int32     start = stream.pos;
+		pg_crc32c crc;
+
+		bin_put_record(&stream, names[i], objs[i]);
+		crc = checksum(data + start, lens[i]);
+		bin_put_int4(&toc, start);
+		bin_put_int4(&toc, lens[i]);
+		bin_put(&toc, &crc, sizeof(pg_crc32c));
+	}
+	Assert(stream.pos == data_len);
+
+	{
+		pg_crc32c crc = checksum(toc.buf, toc.pos);
+
+		bin_put(&toc, &crc, sizeof(pg_crc32c));
+	}
+	Assert(toc.pos == hdr_len);
+
+	pfree(objs);
+	pfree(lens);
+	if (p_count) {
+		*p_count = vars;
+	}
+	return result;
+}
+
+/** 
+ * Raise an error for a session stream that fails validation.
+ *
+ * @param detail Description of the problem.
+ * @param entry The table of contents entry at fault, or -1.
+ */
+static void
+corrupt_session(const char *detail, int32 entry)
+{
+	ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("serialised session stream is corrupt"),
+			 (entry >= 0)?
+			 errdetail("%s (variable %d).", detail, entry + 1):
+			 errdetail("%s.", detail)));
+}
+
+/** 
+ * De-serialise a session stream, as created by vl_serialise_session().
+ * Before any variable is restored, the table of contents and every
+ * record's bounds, checksum, header and name are validated, and each
+ * record is checked against the type of any existing variable of the
+ * same name.  A stream that fails these checks raises an ERROR without
+ * modifying any variable.  Record payloads are only parsed as they are
+ * restored, so a payload that is malformed despite a valid checksum, or
+ * a variable whose deferred initialiser (see veil.lazy_init) creates it
+ * with a different type, raises an ERROR part way through, leaving the
+ * variables from earlier records restored.  Variables are restored in
+ * place, re-using their existing memory where possible.
+ *
+ * @param data The start of the session stream.
+ * @param len The length of the session stream in bytes.
+ * @param shared Whether variables that do not yet exist should be
+ * created as shared, rather than session, variables.
+ * @return A count of the number of variables that have been
+ * de-serialised.
  */
 extern int32
-vl_deserialise(char **p_stream)
+vl_deserialise_session(char *data, int32 len, bool shared)
 {
-	int count = 0;
-	while ((**p_stream) != '\0') {
-		(void) vl_deserialise_next(p_stream);
-		count++;
+	BinStream  stream = {data, data + len, 0, false};
+	BinStream  record;
+	char      *toc;
+	char      *area;
+	int32      area_len;
+	int32      vars;
+	int32      i;
+	int32      offset;
+	int32      rec_len;
+	pg_crc32c  crc;
+
+	if (memcmp(bin_get(&stream, SESSION_MAGIC_LEN), SESSION_MAGIC, 
+			   SESSION_MAGIC_LEN) != 0) {
+		corrupt_session("Not a serialised session stream", -1);
 	}
-	return count;
+	if (bin_get_char(&stream) != SESSION_VERSION) {
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("unsupported session stream version %d", 
+						(int) data[SESSION_MAGIC_LEN])));
+	}
+	vars = bin_get_int4(&stream);
+	if ((vars < 0) || (vars > (len / SESSION_TOC_ENTRY))) {
+		corrupt_session("Invalid number of variables", -1);
+	}
+	toc = bin_get(&stream, vars * SESSION_TOC_ENTRY);
+	memcpy(&crc, bin_get(&stream, sizeof(pg_crc32c)), sizeof(pg_crc32c));
+	if (!EQ_CRC32C(crc, checksum(data, stream.pos - sizeof(pg_crc32c)))) {
+		corrupt_session("Table of contents checksum failure", -1);
+	}
+	area = data + stream.pos;
+	area_len = len - stream.pos;
+
+	/* Validate every record before restoring any of them */
+	for (i = 0; i < vars; i++) {
+		memcpy(&offset, toc + (i * SESSION_TOC_ENTRY), sizeof(int32));
+		memcpy(&rec_len, toc + (i * SESSION_TOC_ENTRY) + sizeof(int32),
+			   sizeof(int32));
+		memcpy(&crc, toc + (i * SESSION_TOC_ENTRY) + (2 * sizeof(int32)),
+			   sizeof(pg_crc32c));
+		if ((offset < 0) || (rec_len <= 0) || 
+			(offset > area_len) || (rec_len > area_len - offset)) {
+			corrupt_session("Record lies outside of the stream", i);
+		}
+		if (!EQ_CRC32C(crc, checksum(area + offset, rec_len))) {
+			corrupt_session("Record checksum failure", i);
+		}
+		record.buf = area + offset;
+		record.end = record.buf + rec_len;
+		record.pos = 0;
+		record.packed = false;
+		bin_check_record(&record, shared);
+	}
+
+	for (i = 0; i < vars; i++) {
+		memcpy(&offset, toc + (i * SESSION_TOC_ENTRY), sizeof(int32));
+		memcpy(&rec_len, toc + (i * SESSION_TOC_ENTRY) + sizeof(int32),
+			   sizeof(int32));
+		record.buf = area + offset;
+		record.end = record.buf + rec_len;
+		record.pos = 0;
+		record.packed = false;
+		if (shared) {
+			/* Peek at the variable name, so that it can be declared
+			 * before the record is read. */
+			record.pos = BIN_RECORD_HDRLEN;
+			(void) vl_lookup_shared_variable(bin_get_name(&record));
+			record.pos = 0;
+		}
+		(void) bin_get_record(&record);
+		if (record.pos != rec_len) {
+			corrupt_session("Record length mismatch", i);
+		}
+	}
+	return vars;
 }
@@ -155,6 +155,12 @@ _PG_init()
 
 	/* Request LWLocks for later use by all backends */
 	RequestNamedLWLockTranche(TRANCHE_NAME, veil_dbs);
+
+	/* Request shared memory for the session cache, if enabled */
+	vl_session_cache_request();
+
+	/* Request the lock used by trigger-based maintenance */
+	vl_maintain_request();
 }
 
 /** 
@@ -522,6 +528,9 @@ shmalloc_init(void)
 			shared_meminfo->context[1] = context1;
 			shared_meminfo->xid[0] = GetCurrentTransactionId();
 			shared_meminfo->xid[1] = shared_meminfo->xid[0];
+			shared_meminfo->snapshot_checked = false;
+			shared_meminfo->generation = 0;
+			shared_meminfo->init_workers_active = false;
 			shared_meminfo->initialised = true;
 
 			/* Set up both shared hashes */
@@ -572,6 +581,171 @@ vl_get_shared_hash()
 	return hash;
 }
 
+/** 
+ * Claim the right to load a snapshot of shared variables.  Only the
+ * first backend to call this, after Veil's shared memory has been
+ * initialised, is given the right, so that a snapshot is loaded at
+ * most once.
+ * 
+ * @return true if the caller should load the snapshot.
+ */
+bool
+vl_claim_snapshot_load()
+{
+	bool claimed;
+
+	(void) vl_get_shared_hash();  /* Ensure shared memory is set up. */
+
+	LWLockAcquire(VeilLWLock, LW_EXCLUSIVE);
+	claimed = !shared_meminfo->snapshot_checked;
+	shared_meminfo->snapshot_checked = true;
+	LWLockRelease(VeilLWLock);
+
+	return claimed;
+}
+
+/** 
+ * Return the generation of shared memory, which is incremented by
+ * each context switch.  A session that holds a pointer into shared
+ * memory across transactions must look it up again if the generation
+ * has changed, as the memory may since have been re-used.  The value
+ * is read without taking VeilLWLock: a stale value can only cause an
+ * unnecessary look up.
+ * 
+ * @return The current generation.
+ */
+uint32
+vl_shared_generation()
+{
+	(void) vl_get_shared_hash();  /* Ensure shared memory is set up. */
+
+	return shared_meminfo->generation;
+}
+
+/** 
+ * Take VeilLWLock, in shared mode, provided that the generation of
+ * shared memory is still that given.  While the lock is held no context
+ * switch can complete, so pointers into shared memory obtained in that
+ * generation remain valid until vl_unlock_generation() is called.
+ * 
+ * @param generation The generation, from vl_shared_generation(), in
+ * which the caller's pointers were obtained.
+ * 
+ * @return true if the lock has been taken, false if the generation has
+ * changed, in which case the lock is not held.
+ */
+bool
+vl_lock_generation(uint32 generation)
+{
+	LWLockAcquire(VeilLWLock, LW_SHARED);
+	if (shared_meminfo->generation == generation) {
+		return true;
+	}
+	LWLockRelease(VeilLWLock);
+	return false;
+}
+
+/** 
+ * Release the lock taken by vl_lock_generation().
+ */
+void
+vl_unlock_generation()
+{
+	LWLockRelease(VeilLWLock);
+}
+
+/**
+ * Record whether background workers may be running init functions
+ * (see vl_call_init_fns()) for the context switch that this backend has
+ * prepared.  While they may be, vl_shared_hash_search() serialises
+ * access to the shared hashes.
+ *
+ * @param active true before the workers are started, false once they
+ * have all exited.
+ */
+void
+vl_set_init_workers_active(bool active)
+{
+	LWLockAcquire(VeilLWLock, LW_EXCLUSIVE);
+	shared_meminfo->init_workers_active = active;
+	LWLockRelease(VeilLWLock);
+}
+
+/**
+ * Search for, or add, an entry in one of the shared hashes.  While a
+ * context switch is being prepared, init functions running in
+ * background workers (see vl_call_init_fns()) may be adding entries
+ * to the new context's hash concurrently, so while such workers are
+ * active, access to the shared hashes by name is serialised through
+ * VeilLWLock.  The flag is read without the lock: it is set before the
+ * workers start and cleared after they exit, so the backend performing
+ * the switch and its workers always see it set, and no other backend
+ * uses the new context's hash until the switch completes.
+ *
+ * @param hash The shared hash to be searched.
+ * @param name The key of the entry.
+ * @param action HASH_FIND or HASH_ENTER.
+ * @param p_found Pointer to boolean into which we record whether the
+ * entry already existed.
+ *
+ * @return Pointer to the hash entry, or NULL if it was not found (or
+ * could not be created).
+ */
+void *
+vl_shared_hash_search(HTAB *hash,
+					  char *name,
+					  HASHACTION action,
+					  bool *p_found)
+{
+	void *entry;
+
+	if (!shared_meminfo->init_workers_active) {
+		return hash_search(hash, (void *) name, action, p_found);
+	}
+
+	LWLockAcquire(VeilLWLock,
+				  action == HASH_FIND? LW_SHARED: LW_EXCLUSIVE);
+	entry = hash_search(hash, (void *) name, action, p_found);
+	LWLockRelease(VeilLWLock);
+
+	return entry;
+}
+
+/**
+ * Report whether this backend has prepared a context switch, that it
+ * has not yet completed.
+ *
+ * @return true if vl_prepare_context_switch() has succeeded for this
+ * backend and the switch is not yet complete.
+ */
+bool
+vl_switch_prepared()
+{
+	return prepared_for_switch;
+}
+
+/**
+ * Join a context switch that has been prepared by another backend.
+ * This is used by background workers that execute init functions on
+ * behalf of the backend performing a reset, so that the shared
+ * variables they create are placed in the new context.  The worker
+ * must not attempt to complete the switch.
+ *
+ * @return true if a context switch was in progress, and has been
+ * joined.
+ */
+bool
+vl_join_context_switch()
+{
+	(void) get_cur_context();  /* Ensure shared memory is set up */
+
+	LWLockAcquire(VeilLWLock, LW_SHARED);
+	prepared_for_switch = shared_meminfo->switching;
+	LWLockRelease(VeilLWLock);
+
+	return prepared_for_switch;
+}
+
 /** 
  * Reset one of the shared hashes.  This is one of the final steps in a
  * context switch.
@@ -581,7 +755,7 @@ vl_get_shared_hash()
 static void
 clear_hash(HTAB *hash)
 {
-	static HASH_SEQ_STATUS status;
+	HASH_SEQ_STATUS status;
 	VarEntry *var;
 
 	hash_seq_init(&status, hash);
@@ -592,6 +766,23 @@ clear_hash(HTAB *hash)
 	}
 }
 
+/** 
+ * Remove all variables from the current context's shared hash, so that
+ * they will be re-created by the init functions.  This is used when
+ * loading a snapshot of shared variables fails part way through.  The
+ * shared memory already used by the removed variables is not recovered
+ * until the next reset.
+ */
+void
+vl_clear_shared_hash()
+{
+	HTAB *hash = vl_get_shared_hash();
+
+	LWLockAcquire(VeilLWLock, LW_EXCLUSIVE);
+	clear_hash(hash);
+	LWLockRelease(VeilLWLock);
+}
+
 /** 
  * Prepare for a switch to the alternate context.  Switching will
  * only be allowed if there are no transactions that may still be using
@@ -706,6 +897,7 @@ vl_complete_context_switch()
 	shared_meminfo->switching = false;
 	shared_meminfo->current_context = context_newidx;
 	shared_meminfo->xid[context_newidx] = GetCurrentTransactionId();
+	shared_meminfo->generation++;
 	LWLockRelease(VeilLWLock);
 	prepared_for_switch = false;
 	return true;
@@ -750,6 +942,7 @@ vl_force_context_switch()
 	shared_meminfo->current_context = context_newidx;
 	shared_meminfo->xid[context_newidx] = GetCurrentTransactionId();
 	shared_meminfo->xid[0] = GetCurrentTransactionId();
+	shared_meminfo->generation++;
 	LWLockRelease(VeilLWLock);
 	prepared_for_switch = false;
 }
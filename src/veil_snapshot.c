@@ -0,0 +1,746 @@
+/**
+ * @file   veil_snapshot.c
+ * \code
+ *     Author:       Marc Munro
+ *     Copyright (c) 2018 Marc Munro
+ *     License:      BSD
+ *
+ * \endcode
+ * @brief
+ * Functions for saving Veil's shared variables to, and loading them
+ * from, a snapshot file.
+ *
+ * After a restart of the database cluster, Veil's shared variables must
+ * normally be rebuilt by the registered init functions before the first
+ * session can use them.  If the shared variables are saved, using
+ * veil.save_shared_snapshot(), and veil.snapshot_shared is on, the
+ * first backend to use Veil after a restart instead loads them from
+ * the snapshot.  The init functions will then find the shared variables
+ * already defined (veil.share() returns true) and need not rebuild
+ * them.
+ *
+ * Each database has its own snapshot file, in the pg_veil directory of
+ * the cluster's data directory.  A snapshot is only loaded if it was
+ * created by the same cluster, with the same catalog version, and if
+ * the stamp recorded when it was saved matches the current result of
+ * veil.snapshot_stamp().  This allows an application to invalidate
+ * snapshots when the data from which its shared variables are built
+ * changes.
+ *
+ * This file also provides images of bitmap arrays.  An image is a file
+ * containing the bitmaps of a bitmap array, laid out exactly as they
+ * are in memory, which each backend maps read-only into its own memory.
+ * A mapped bitmap array variable (::MappedBitmapArray) records only the
+ * location of the image, so a large, static, bitmap array can be made
+ * available to all backends without being built in shared memory.
+ */
+
+#include "postgres.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "access/xact.h"
+#include "access/xlog.h"
+#include "catalog/catversion.h"
+#include "executor/spi.h"
+#include "miscadmin.h"
+#include "port/pg_crc32c.h"
+#include "storage/fd.h"
+#include "utils/builtins.h"
+#include "utils/resowner.h"
+#include "veil_version.h"
+#include "veil_funcs.h"
+#include "veil_datatypes.h"
+
+
+#ifndef DOXYGEN_SHOULD_SKIP_THIS
+
+#define SNAPSHOT_DIR      "pg_veil"
+#define SNAPSHOT_MAGIC    "VEILSNAP"
+#define SNAPSHOT_VERSION  1
+#define MAXSNAPSHOTPATH   (sizeof(SNAPSHOT_DIR) + 32)
+
+#endif
+
+/**
+ * The header of a snapshot file.  This is followed by the stamp, and
+ * then by a session stream, as created by vl_serialise_session(),
+ * containing the shared variables.
+ */
+typedef struct SnapshotHeader {
+    char      magic[8];         /**< SNAPSHOT_MAGIC */
+    uint32    version;          /**< SNAPSHOT_VERSION */
+    uint32    catalog_version;  /**< CATALOG_VERSION_NO of the cluster */
+    uint64    system_id;        /**< System identifier of the cluster */
+    Oid       db_id;            /**< Oid of the database */
+    uint32    stamp_len;        /**< Length of the stamp */
+    uint32    data_len;         /**< Length of the session stream */
+    pg_crc32c crc;              /**< Checksum of the stamp and stream */
+} SnapshotHeader;
+
+
+/**
+ * Build the path of the snapshot file, or of its temporary file, for
+ * the current database.
+ *
+ * @param path Buffer, of at least MAXSNAPSHOTPATH bytes, to receive
+ * the path.
+ * @param temp Whether the temporary file path is required.
+ */
+static void
+snapshot_path(char *path, bool temp)
+{
+	snprintf(path, MAXSNAPSHOTPATH, "%s/%u.%s", SNAPSHOT_DIR,
+			 MyDatabaseId, temp? "tmp": "snap");
+}
+
+/**
+ * Return the current stamp for snapshots, as returned by the
+ * user-redefinable function veil.snapshot_stamp().
+ *
+ * @return Dynamically allocated string containing the stamp.  A null
+ * result from veil.snapshot_stamp() is returned as an empty string.
+ */
+static char *
+snapshot_stamp()
+{
+	char *stamp;
+	char *result;
+	bool  pushed;
+	int   ok;
+
+	ok = vl_spi_connect(&pushed);
+	if (ok != SPI_OK_CONNECT) {
+		ereport(ERROR,
+				(errcode(ERRCODE_INTERNAL_ERROR),
+				 errmsg("failed to fetch snapshot stamp"),
+				 errdetail("SPI_connect() failed, returning %d.", ok)));
+	}
+	if (!vl_str_from_query("select veil.snapshot_stamp()", &stamp) ||
+		!stamp)
+	{
+		stamp = "";
+	}
+
+	/* Copy the stamp out of the SPI memory context */
+	result = SPI_palloc(strlen(stamp) + 1);
+	strcpy(result, stamp);
+
+	ok = vl_spi_finish(pushed);
+	if (ok != SPI_OK_FINISH) {
+		ereport(ERROR,
+				(errcode(ERRCODE_INTERNAL_ERROR),
+				 errmsg("failed to fetch snapshot stamp"),
+				 errdetail("SPI_finish() failed, returning %d.", ok)));
+	}
+	return result;
+}
+
+/**
+ * Write a buffer to a snapshot or image file, raising an error if it
+ * cannot all be written.
+ *
+ * @param fd The file descriptor.
+ * @param path The file path, for error reporting.
+ * @param buf The data to be written.
+ * @param len The length of the data in bytes.
+ */
+static void
+write_file(int fd, char *path, void *buf, uint32 len)
+{
+	errno = 0;
+	if (write(fd, buf, len) != (ssize_t) len) {
+		int save_errno = errno;
+
+		CloseTransientFile(fd);
+		/* If write didn't set errno, assume the problem is no disk
+		 * space */
+		errno = save_errno? save_errno: ENOSPC;
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not write to file \"%s\": %m", path)));
+	}
+}
+
+/**
+ * Save all of the current database's shared variables to its snapshot
+ * file.  The snapshot is written to a temporary file which then
+ * replaces any existing snapshot, so a failure will never leave a
+ * partially written snapshot in place.
+ *
+ * @return The number of shared variables saved.
+ */
+extern int32
+vl_save_shared_snapshot()
+{
+	char           path[MAXSNAPSHOTPATH];
+	char           temppath[MAXSNAPSHOTPATH];
+	SnapshotHeader hdr;
+	char          *stamp = snapshot_stamp();
+	bytea         *stream;
+	char          *data;
+	int32          vars;
+	int            fd;
+
+	stream = vl_serialise_session(cstring_to_text("%"), VAR_SCOPE_SHARED,
+								  &vars);
+	data = VARDATA(stream);
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic));
+	hdr.version = SNAPSHOT_VERSION;
+	hdr.catalog_version = CATALOG_VERSION_NO;
+	hdr.system_id = GetSystemIdentifier();
+	hdr.db_id = MyDatabaseId;
+	hdr.stamp_len = strlen(stamp);
+	hdr.data_len = VARSIZE(stream) - VARHDRSZ;
+	INIT_CRC32C(hdr.crc);
+	COMP_CRC32C(hdr.crc, stamp, hdr.stamp_len);
+	COMP_CRC32C(hdr.crc, data, hdr.data_len);
+	FIN_CRC32C(hdr.crc);
+
+	if ((mkdir(SNAPSHOT_DIR, S_IRWXU) < 0) && (errno != EEXIST)) {
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not create directory \"%s\": %m",
+						SNAPSHOT_DIR)));
+	}
+
+	snapshot_path(path, false);
+	snapshot_path(temppath, true);
+	fd = OpenTransientFile(temppath, O_WRONLY | O_CREAT | O_TRUNC | PG_BINARY,
+						   S_IRUSR | S_IWUSR);
+	if (fd < 0) {
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not create file \"%s\": %m", temppath)));
+	}
+	write_file(fd, temppath, &hdr, sizeof(hdr));
+	write_file(fd, temppath, stamp, hdr.stamp_len);
+	write_file(fd, temppath, data, hdr.data_len);
+
+	if (pg_fsync(fd) != 0) {
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not fsync file \"%s\": %m", temppath)));
+	}
+	if (CloseTransientFile(fd)) {
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not close file \"%s\": %m", temppath)));
+	}
+	(void) durable_rename(temppath, path, ERROR);
+
+	return vars;
+}
+
+/**
+ * Report, to the server log, that a snapshot is being ignored.
+ *
+ * @param path The path of the snapshot file.
+ * @param reason Why the snapshot is being ignored.
+ * @return false.
+ */
+static bool
+ignore_snapshot(char *path, char *reason)
+{
+	ereport(LOG,
+			(errmsg("veil: ignoring shared variable snapshot \"%s\"", path),
+			 errdetail("%s", reason)));
+	return false;
+}
+
+/**
+ * Load the current database's shared variables from its snapshot file,
+ * if veil.snapshot_shared is on and this is the first backend to use
+ * Veil since shared memory was initialised.  Any problem with the
+ * snapshot file causes it to be ignored, with a message to the server
+ * log, so that the shared variables will instead be built by the init
+ * functions in the usual way.  The variables are restored within a
+ * subtransaction, so that an error raised while restoring them also
+ * causes the snapshot to be ignored, after removing any shared
+ * variables that were restored before the error.  This must be called
+ * before the init functions.
+ *
+ * @return true if the shared variables were loaded.
+ */
+extern bool
+vl_load_shared_snapshot()
+{
+	char           path[MAXSNAPSHOTPATH];
+	SnapshotHeader hdr;
+	struct stat    st;
+	char          *stamp;
+	char          *data;
+	pg_crc32c      crc;
+	int            fd;
+	int32          vars = 0;
+	bool           ok;
+	MemoryContext  oldcontext = CurrentMemoryContext;
+	ResourceOwner  oldowner = CurrentResourceOwner;
+	ErrorData     *edata = NULL;
+
+	if (!(veil_snapshot_shared() && vl_claim_snapshot_load())) {
+		return false;
+	}
+
+	snapshot_path(path, false);
+	fd = OpenTransientFile(path, O_RDONLY | PG_BINARY, 0);
+	if (fd < 0) {
+		if (errno != ENOENT) {
+			ereport(LOG,
+					(errcode_for_file_access(),
+					 errmsg("could not open file \"%s\": %m", path)));
+		}
+		return false;
+	}
+
+	ok = (fstat(fd, &st) == 0) && (st.st_size >= (off_t) sizeof(hdr)) &&
+		(read(fd, &hdr, sizeof(hdr)) == (ssize_t) sizeof(hdr)) &&
+		(st.st_size == (off_t) (sizeof(hdr) + hdr.stamp_len + 
+								hdr.data_len));
+	if (!ok) {
+		CloseTransientFile(fd);
+		return ignore_snapshot(path, "The file is truncated or corrupt.");
+	}
+
+	data = palloc(hdr.stamp_len + hdr.data_len + 1);
+	ok = read(fd, data, hdr.stamp_len + hdr.data_len) ==
+		(ssize_t) (hdr.stamp_len + hdr.data_len);
+	CloseTransientFile(fd);
+	if (!ok) {
+		return ignore_snapshot(path, "The file could not be read.");
+	}
+
+	if ((memcmp(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic)) != 0) ||
+		(hdr.version != SNAPSHOT_VERSION))
+	{
+		return ignore_snapshot(path, "The file is not a Veil snapshot.");
+	}
+	INIT_CRC32C(crc);
+	COMP_CRC32C(crc, data, hdr.stamp_len + hdr.data_len);
+	FIN_CRC32C(crc);
+	if (!EQ_CRC32C(crc, hdr.crc)) {
+		return ignore_snapshot(path, "Checksum failure.");
+	}
+	if ((hdr.system_id != GetSystemIdentifier()) ||
+		(hdr.catalog_version != CATALOG_VERSION_NO) ||
+		(hdr.db_id != MyDatabaseId))
+	{
+		return ignore_snapshot(path, "The snapshot was created by a "
+							   "different database or cluster.");
+	}
+
+	/* The stamp is last checked, as it may require a query */
+	stamp = snapshot_stamp();
+	if ((strlen(stamp) != hdr.stamp_len) ||
+		(memcmp(stamp, data, hdr.stamp_len) != 0))
+	{
+		return ignore_snapshot(path, "The snapshot stamp does not match "
+							   "veil.snapshot_stamp().");
+	}
+
+	vl_enter_init();
+	BeginInternalSubTransaction(NULL);
+	MemoryContextSwitchTo(oldcontext);
+	PG_TRY();
+	{
+		vars = vl_deserialise_session(data + hdr.stamp_len, hdr.data_len, 
+									  true);
+		ReleaseCurrentSubTransaction();
+		MemoryContextSwitchTo(oldcontext);
+		CurrentResourceOwner = oldowner;
+	}
+	PG_CATCH();
+	{
+		MemoryContextSwitchTo(oldcontext);
+		edata = CopyErrorData();
+		FlushErrorState();
+		RollbackAndReleaseCurrentSubTransaction();
+		MemoryContextSwitchTo(oldcontext);
+		CurrentResourceOwner = oldowner;
+		SPI_restore_connection();
+	}
+	PG_END_TRY();
+	vl_leave_init();
+	pfree(data);
+
+	if (edata) {
+		/* Shared memory is not rolled back with the subtransaction, so
+		 * remove whatever was restored before the error. */
+		vl_clear_shared_hash();
+		ok = ignore_snapshot(path, edata->message);
+		FreeErrorData(edata);
+		return ok;
+	}
+	ereport(LOG,
+			(errmsg("veil: loaded %d shared variables from snapshot \"%s\"",
+					vars, path)));
+	return true;
+}
+
+
+#ifndef DOXYGEN_SHOULD_SKIP_THIS
+
+#define IMAGE_MAGIC       "VEILIMG"
+#define IMAGE_VERSION     1
+#define IMAGE_HDRLEN      MAXALIGN(sizeof(ImageHeader))
+
+#endif
+
+/**
+ * The header of a bitmap array image file.  This is followed, at offset
+ * IMAGE_HDRLEN, by each bitmap of the array, in order, each occupying
+ * row_size bytes.
+ */
+typedef struct ImageHeader {
+    char      magic[8];         /**< IMAGE_MAGIC */
+    uint32    version;          /**< IMAGE_VERSION */
+    uint32    word_size;        /**< sizeof(bm_int) */
+    uint32    row_size;         /**< The size of each bitmap */
+    int32     bitzero;          /**< As for ::BitmapArray */
+    int32     bitmax;           /**< As for ::BitmapArray */
+    int32     arrayzero;        /**< As for ::BitmapArray */
+    int32     arraymax;         /**< As for ::BitmapArray */
+} ImageHeader;
+
+/**
+ * A session's mapping of a bitmap array image.
+ */
+typedef struct ImageMapping {
+    struct ImageMapping *next;  /**< The next mapping for this session */
+    MappedBitmapArray *mapped;  /**< The variable this mapping is for */
+    uint64       inode;         /**< Identity of the mapped file */
+    int64        mtime;         /**< Identity of the mapped file */
+    int64        size;          /**< Size of the mapping */
+    char        *map;           /**< Address of the mapping */
+    BitmapArray *bmarray;       /**< Session BitmapArray whose bitmaps
+								   are in the mapping */
+} ImageMapping;
+
+/**
+ * All of the image mappings for this session.
+ */
+static ImageMapping *mappings = NULL;
+
+
+/**
+ * Return the size of each bitmap in an image.
+ *
+ * @param bitzero The lowest bit in each bitmap.
+ * @param bitmax The highest bit in each bitmap.
+ * @return The size in bytes of each bitmap in the image.
+ */
+static uint32
+image_row_size(int32 bitzero, int32 bitmax)
+{
+	return MAXALIGN(sizeof(Bitmap) + 
+					(sizeof(bm_int) * ARRAYELEMS(bitzero, bitmax)));
+}
+
+/**
+ * Build the path of an image file, which must be a simple file name
+ * within the pg_veil directory.
+ *
+ * @param path Buffer, of MAXPGPATH bytes, to receive the path.
+ * @param filename The name of the image file.
+ */
+static void
+image_path(char *path, char *filename)
+{
+	if ((filename[0] == '\0') || (filename[0] == '.') || 
+		strchr(filename, '/') || 
+		(strlen(filename) + sizeof(SNAPSHOT_DIR) + 5 > MAXPGPATH))
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("invalid image file name \"%s\"", filename),
+				 errdetail("Image files are stored in the %s directory, "
+						   "and must be named by a simple file name.",
+						   SNAPSHOT_DIR)));
+	}
+	snprintf(path, MAXPGPATH, "%s/%s", SNAPSHOT_DIR, filename);
+}
+
+/**
+ * Save the bitmaps of a ::BitmapArray as an image file, which may then
+ * be mapped, using vl_NewMappedBitmapArray(), as a read-only bitmap
+ * array.  As with snapshots, the image is written to a temporary file
+ * that then replaces any existing image.  Sparse bitmap arrays may not
+ * be saved as images.
+ *
+ * @param bmarray The ::BitmapArray to be saved.
+ * @param filename The name of the image file.
+ * @return The number of bitmaps saved.
+ */
+extern int32
+vl_SaveBitmapArrayImage(BitmapArray *bmarray, char *filename)
+{
+	char        path[MAXPGPATH];
+	char        temppath[MAXPGPATH + 4];
+	char        hdrbuf[IMAGE_HDRLEN];
+	ImageHeader hdr;
+	int32       elems = ARRAYELEMS(bmarray->bitzero, bmarray->bitmax);
+	int32       rows = bmarray->arraymax + 1 - bmarray->arrayzero;
+	uint32      row_size = image_row_size(bmarray->bitzero, 
+										  bmarray->bitmax);
+	char       *row;
+	int32       i;
+	int         fd;
+
+	if (bmarray->pages) {
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("sparse bitmap arrays cannot be saved as images")));
+	}
+
+	image_path(path, filename);
+	snprintf(temppath, sizeof(temppath), "%s.tmp", path);
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, IMAGE_MAGIC, sizeof(hdr.magic));
+	hdr.version = IMAGE_VERSION;
+	hdr.word_size = sizeof(bm_int);
+	hdr.row_size = row_size;
+	hdr.bitzero = bmarray->bitzero;
+	hdr.bitmax = bmarray->bitmax;
+	hdr.arrayzero = bmarray->arrayzero;
+	hdr.arraymax = bmarray->arraymax;
+	memset(hdrbuf, 0, IMAGE_HDRLEN);
+	memcpy(hdrbuf, &hdr, sizeof(hdr));
+
+	if ((mkdir(SNAPSHOT_DIR, S_IRWXU) < 0) && (errno != EEXIST)) {
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not create directory \"%s\": %m",
+						SNAPSHOT_DIR)));
+	}
+	fd = OpenTransientFile(temppath, O_WRONLY | O_CREAT | O_TRUNC | PG_BINARY,
+						   S_IRUSR | S_IWUSR);
+	if (fd < 0) {
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not create file \"%s\": %m", temppath)));
+	}
+	write_file(fd, temppath, hdrbuf, IMAGE_HDRLEN);
+
+	/* Each bitmap is written as it would be allocated by
+	 * vl_NewBitmap(), with no spare capacity */
+	row = palloc0(row_size);
+	for (i = 0; i < rows; i++) {
+		Bitmap *bitmap = bmarray->bitmap[i];
+
+		memcpy(row, bitmap, sizeof(Bitmap));
+		((Bitmap *) row)->allocated = elems;
+		memcpy(row + sizeof(Bitmap), &(bitmap->bitset[0]), 
+			   sizeof(bm_int) * elems);
+		write_file(fd, temppath, row, row_size);
+	}
+	pfree(row);
+
+	if (pg_fsync(fd) != 0) {
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not fsync file \"%s\": %m", temppath)));
+	}
+	if (CloseTransientFile(fd)) {
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not close file \"%s\": %m", temppath)));
+	}
+	(void) durable_rename(temppath, path, ERROR);
+
+	return rows;
+}
+
+/**
+ * Raise an error for an image file that cannot be used.
+ *
+ * @param path The path of the image file.
+ * @param reason Why the file cannot be used.
+ */
+static void
+bad_image(char *path, char *reason)
+{
+	ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("invalid bitmap array image \"%s\"", path),
+			 errdetail("%s", reason)));
+}
+
+/**
+ * Create, or redefine, a ::MappedBitmapArray describing an image file
+ * created by vl_SaveBitmapArrayImage().  The image is validated here,
+ * but is not mapped until it is first used by each backend.
+ *
+ * @param p_mapped Pointer to an existing ::MappedBitmapArray, which
+ * will be re-used, if one exists.
+ * @param shared Whether to create the ::MappedBitmapArray in shared
+ * memory.
+ * @param filename The name of the image file.
+ */
+extern void
+vl_NewMappedBitmapArray(MappedBitmapArray **p_mapped, bool shared,
+						char *filename)
+{
+	char               path[MAXPGPATH];
+	MappedBitmapArray *mapped = *p_mapped;
+	ImageHeader        hdr;
+	struct stat        st;
+	int64              rows;
+	int                fd;
+	bool               ok;
+
+	image_path(path, filename);
+	fd = OpenTransientFile(path, O_RDONLY | PG_BINARY, 0);
+	if (fd < 0) {
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not open file \"%s\": %m", path)));
+	}
+	ok = (fstat(fd, &st) == 0) && (st.st_size >= (off_t) IMAGE_HDRLEN) &&
+		(read(fd, &hdr, sizeof(hdr)) == (ssize_t) sizeof(hdr));
+	CloseTransientFile(fd);
+
+	if (!ok || (memcmp(hdr.magic, IMAGE_MAGIC, sizeof(hdr.magic)) != 0) ||
+		(hdr.version != IMAGE_VERSION))
+	{
+		bad_image(path, "The file is not a Veil bitmap array image.");
+	}
+	if ((hdr.word_size != sizeof(bm_int)) ||
+		(hdr.row_size != image_row_size(hdr.bitzero, hdr.bitmax)))
+	{
+		bad_image(path, "The image was created by an incompatible build "
+				  "of Veil.");
+	}
+	if ((hdr.bitzero > hdr.bitmax) || (hdr.arrayzero > hdr.arraymax)) {
+		bad_image(path, "The image's ranges are invalid.");
+	}
+	rows = (int64) hdr.arraymax + 1 - hdr.arrayzero;
+	if (st.st_size != (off_t) (IMAGE_HDRLEN + (rows * hdr.row_size))) {
+		bad_image(path, "The file is truncated or corrupt.");
+	}
+
+	if (!mapped) {
+		if (shared) {
+			mapped = vl_shmalloc(sizeof(MappedBitmapArray));
+		}
+		else {
+			mapped = vl_malloc(sizeof(MappedBitmapArray));
+		}
+	}
+	mapped->type = OBJ_MAPPED_BITMAP_ARRAY;
+	mapped->bitzero = hdr.bitzero;
+	mapped->bitmax = hdr.bitmax;
+	mapped->arrayzero = hdr.arrayzero;
+	mapped->arraymax = hdr.arraymax;
+	mapped->inode = (uint64) st.st_ino;
+	mapped->mtime = (int64) st.st_mtime;
+	mapped->size = (int64) st.st_size;
+	strlcpy(mapped->path, path, MAXPGPATH);
+
+	*p_mapped = mapped;
+}
+
+/**
+ * Return this session's read-only view of a ::MappedBitmapArray, as a
+ * ::BitmapArray whose bitmaps are in the mapped image file.  The image
+ * is mapped on first use, and the mapping retained for the rest of the
+ * session unless the variable is redefined to describe a different
+ * file.
+ *
+ * @param mapped The ::MappedBitmapArray.
+ * @return The ::BitmapArray.  This must not be modified.
+ */
+extern BitmapArray *
+vl_MappedBitmapArray(MappedBitmapArray *mapped)
+{
+	ImageMapping *mapping;
+	BitmapArray  *bmarray;
+	struct stat   st;
+	int32         rows = mapped->arraymax + 1 - mapped->arrayzero;
+	uint32        row_size = image_row_size(mapped->bitzero, 
+											mapped->bitmax);
+	int32         i;
+	int           fd;
+	void         *map;
+
+	for (mapping = mappings; mapping; mapping = mapping->next) {
+		if (mapping->mapped == mapped) {
+			if (mapping->map &&
+				(mapping->inode == mapped->inode) && 
+				(mapping->mtime == mapped->mtime) &&
+				(mapping->size == mapped->size))
+			{
+				return mapping->bmarray;
+			}
+			if (mapping->map) {
+				/* The variable now describes a different file */
+				munmap(mapping->map, mapping->size);
+				pfree(mapping->bmarray);
+				mapping->map = NULL;
+				mapping->bmarray = NULL;
+			}
+			break;
+		}
+	}
+
+	fd = OpenTransientFile(mapped->path, O_RDONLY | PG_BINARY, 0);
+	if (fd < 0) {
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not open file \"%s\": %m", mapped->path)));
+	}
+	if ((fstat(fd, &st) != 0) || 
+		((uint64) st.st_ino != mapped->inode) ||
+		((int64) st.st_mtime != mapped->mtime) ||
+		((int64) st.st_size != mapped->size))
+	{
+		CloseTransientFile(fd);
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("bitmap array image \"%s\" has changed", 
+						mapped->path),
+				 errhint("Use veil.map_bitmap_array() to map the new "
+						 "image.")));
+	}
+	map = mmap(NULL, mapped->size, PROT_READ, MAP_SHARED, fd, 0);
+	CloseTransientFile(fd);
+	if (map == MAP_FAILED) {
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not map file \"%s\": %m", mapped->path)));
+	}
+
+	bmarray = vl_malloc(sizeof(BitmapArray) + (sizeof(Bitmap *) * rows));
+	bmarray->type = OBJ_BITMAP_ARRAY;
+	bmarray->bitzero = mapped->bitzero;
+	bmarray->bitmax = mapped->bitmax;
+	bmarray->arrayzero = mapped->arrayzero;
+	bmarray->arraymax = mapped->arraymax;
+	bmarray->shared = false;
+	bmarray->pages = 0;
+	bmarray->pagedir = NULL;
+	DBG_SET_CANARY(*bmarray);
+	DBG_SET_ELEMS(*bmarray, rows);
+	DBG_SET_TRAILERP(*bmarray, bitmap);
+	for (i = 0; i < rows; i++) {
+		bmarray->bitmap[i] = (Bitmap *) ((char *) map + IMAGE_HDRLEN + 
+										 ((int64) i * row_size));
+	}
+
+	if (!mapping) {
+		mapping = vl_malloc(sizeof(ImageMapping));
+		mapping->mapped = mapped;
+		mapping->next = mappings;
+		mappings = mapping;
+	}
+	mapping->inode = mapped->inode;
+	mapping->mtime = mapped->mtime;
+	mapping->size = mapped->size;
+	mapping->map = map;
+	mapping->bmarray = bmarray;
+
+	return bmarray;
+}
@@ -47,11 +47,12 @@ vl_ObjTypeName(ObjType obj)
     static char *names[] = {
 		"Undefined", "ShmemCtl", "Int4", 
 		"Range", "Bitmap", "BitmapArray", 
-		"BitmapHash", "BitmapRef", "Int4Array"
+		"BitmapHash", "BitmapRef", "Int4Array",
+		"MappedBitmapArray", "BitmapClone"
 	};
 
 	if ((obj < OBJ_UNDEFINED) ||
-		(obj > OBJ_INT4_ARRAY)) 
+		(obj > OBJ_BITMAP_CLONE)) 
 	{
 		return "Unknown";
 	}
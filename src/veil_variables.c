@@ -19,6 +19,7 @@
 #include "veil_datatypes.h"
 #include "utils/hsearch.h"
 #include "storage/shmem.h"
+#include "utils/memutils.h"
 
 #include "veil_funcs.h"
 
@@ -88,8 +89,8 @@ vl_lookup_shared_variable(char *name)
 						   name)));
 	}
 
-	var = (VarEntry *) hash_search(shared_hash, (void *) name,
-								   HASH_ENTER, &found);
+	var = (VarEntry *) vl_shared_hash_search(shared_hash, name,
+											 HASH_ENTER, &found);
 
 	if (!var) {
 		ereport(ERROR,
@@ -108,9 +109,53 @@ vl_lookup_shared_variable(char *name)
 	return var;
 }
 
+/** 
+ * Find an existing shared variable, without creating it.
+ * 
+ * @param name The name of the variable.
+ * 
+ * @return Pointer to the shared variable, or NULL if there is no such
+ * shared variable.
+ */
+VarEntry *
+vl_find_shared_variable(char *name)
+{
+	HTAB *shared_hash = vl_get_shared_hash();
+
+	return (VarEntry *) vl_shared_hash_search(shared_hash, name,
+											  HASH_FIND, NULL);
+}
+
+/** 
+ * Find an existing session or shared variable, without creating it,
+ * rebuilding it, or calling its initialiser.
+ * 
+ * @param name The name of the variable.
+ * 
+ * @return Pointer to the session or shared variable, or NULL if there
+ * is no such variable.
+ */
+VarEntry *
+vl_find_variable(char *name)
+{
+	VarEntry *var = NULL;
+
+	if (session_hash) {
+		var = (VarEntry *) hash_search(session_hash, (void *) name,
+									   HASH_FIND, NULL);
+	}
+	if (!var) {
+		var = vl_find_shared_variable(name);
+	}
+	return var;
+}
+
 /** 
  * Lookup a variable by name, creating it as as a session variable if it
- * does not already exist.
+ * does not already exist.  If session initialisation has been deferred
+ * (see veil.lazy_init), the variable's initialiser is called before
+ * it is created.  A derived session variable that has been made stale
+ * by a reset of shared variables is first rebuilt.
  * 
  * @param name The name of the variable
  * 
@@ -131,12 +176,27 @@ vl_lookup_variable(char *name)
 
 	var = (VarEntry *)hash_search(session_hash, (void *) name,
 								  HASH_FIND, &found);
-	if (!var) {
+	if (var) {
+		/* Rebuild the variable if it is derived from shared variables
+		 * that have since been reset. */
+		(void) vl_rebuild_variable(name);
+	}
+	else {
 		/* See whether this is a shared variable. */
-		var = (VarEntry *)hash_search(shared_hash, (void *) name,
-									  HASH_FIND, NULL);
+		var = (VarEntry *) vl_shared_hash_search(shared_hash, name,
+												 HASH_FIND, NULL);
 	}
 
+	if (!var && vl_init_variable(name)) {
+		/* The variable's initialiser has now been called, so look
+		 * again. */
+		var = (VarEntry *)hash_search(session_hash, (void *) name,
+									  HASH_FIND, &found);
+		if (!var) {
+			var = (VarEntry *) vl_shared_hash_search(shared_hash, name,
+													 HASH_FIND, NULL);
+		}
+	}
 
 	if (!var) {
 		/* Create new session variable */
@@ -154,60 +214,62 @@ vl_lookup_variable(char *name)
 }
 
 /** 
- * Return the next variable from a scan of the hash of variables.  Note
- * that this function is not re-entrant.
- * 
- * @param prev The last variable retrieved by a scan, or NULL if
- * starting a new scan.
+ * Begin a scan of all variables, shared and session.  The scan state
+ * is owned by the caller, so any number of scans may be in progress at
+ * once.
  * 
- * @return The next variable encountered in the scan.  NULL if we have
- * finished.
+ * @param scan Caller-owned scan state to be initialised.
  */
-veil_variable_t *
-vl_next_variable(veil_variable_t *prev)
+void
+vl_start_variable_scan(VarScan *scan)
 {
-	static bool doing_shared;
-	static HTAB *hash;
-	static HASH_SEQ_STATUS status;
-	static veil_variable_t result;
-	VarEntry *var;
-
 	if (!session_hash) {
 		session_hash = create_session_hash();
 	}
 
-	if (!prev) {
-		doing_shared = true;
-		/* Initialise a scan of the shared hash. */
-		hash = vl_get_shared_hash();
+	/* Scan the shared hash first, then the session hash. */
+	scan->doing_shared = true;
+	hash_seq_init(&scan->status, vl_get_shared_hash());
+}
 
-		hash_seq_init(&status, hash);
-	}
+/** 
+ * Return the next variable from a scan of the hash of variables.
+ * 
+ * @param scan The scan state, as initialised by
+ * vl_start_variable_scan().
+ * 
+ * @return The next variable encountered in the scan.  NULL if we have
+ * finished.  The result is part of the scan state and is overwritten
+ * by the next call.
+ */
+veil_variable_t *
+vl_next_variable(VarScan *scan)
+{
+	VarEntry *var;
 
-	var = hash_seq_search(&status);
+	var = hash_seq_search(&scan->status);
 
 	if (!var) {
 		/* No more entries from that hash. */
-		if (doing_shared) {
+		if (scan->doing_shared) {
 			/* Switch to, and get var from, the session hash. */
-			doing_shared = false;
-			hash = session_hash;
-			hash_seq_init(&status, hash);
-			var = hash_seq_search(&status);
+			scan->doing_shared = false;
+			hash_seq_init(&scan->status, session_hash);
+			var = hash_seq_search(&scan->status);
 		}
 	}
 
 	if (var) {
 		/* Yay, we have an entry. */
-		result.name = var->key;
-		result.shared = var->shared;
+		scan->result.name = var->key;
+		scan->result.shared = var->shared;
 		if (var->obj) {
-			result.type = vl_ObjTypeName(var->obj->type);
+			scan->result.type = vl_ObjTypeName(var->obj->type);
 		}
 		else {
-			result.type = vl_ObjTypeName(OBJ_UNDEFINED);;
+			scan->result.type = vl_ObjTypeName(OBJ_UNDEFINED);
 		}
-		return &result;
+		return &scan->result;
 	}
 	else {
 		/* Thats all.  There are no more entries */
@@ -250,8 +312,7 @@ vl_NewInt4Array(Int4Array *current, bool shared,
 	int        elems = 1 + max - min;
 
     if (current) {
-		int cur_elems = 1 + current->arraymax - current->arrayzero;
-		if (elems <= cur_elems) {
+		if (elems <= current->allocated) {
 			vl_ClearInt4Array(current);
 			result = current;
 		}
@@ -270,10 +331,82 @@ vl_NewInt4Array(Int4Array *current, bool shared,
 		else {
 			result = vl_malloc(sizeof(Int4Array) + (sizeof(int32) * elems));
 		}
+		result->allocated = elems;
 	}
 	result->type = OBJ_INT4_ARRAY;
 	result->arrayzero = min;
 	result->arraymax = max;
+	vl_ClearInt4Array(result);
+
+	return result;
+}
+
+/** 
+ * Extend an ::Int4Array so that its highest index becomes newmax,
+ * preserving the contents of existing entries and zeroing the new
+ * ones.  If the array has insufficient space allocated, a new array is
+ * allocated with geometric headroom so that a series of small
+ * extensions does not require an allocation and copy each time.  An
+ * array is never shrunk by this function.  Shared memory cannot be
+ * freed, so the old copy of a moved shared array is abandoned until the
+ * next reset of shared variables.  As the allocation at least doubles
+ * each time, the space abandoned by a series of extensions is less than
+ * the final size of the array.
+ * 
+ * @param array The ::Int4Array to be extended.
+ * @param shared Whether the array is in shared or session memory.
+ * @param newmax The new index of the last entry in the array.
+ *
+ * @return The extended array, which may have been moved.
+ */
+Int4Array *
+vl_Int4ArrayExtend(Int4Array *array, bool shared, int32 newmax)
+{
+	Int4Array *result = array;
+	int        cur_elems = 1 + array->arraymax - array->arrayzero;
+	int64      elems;
+	int64      max_elems = (MaxAllocSize - sizeof(Int4Array)) / 
+		sizeof(int32);
+	int        i;
+
+	if (newmax <= array->arraymax) {
+		return array;
+	}
+
+	/* Computed in int64, as the range may exceed that of an int32. */
+	elems = 1 + (int64) newmax - (int64) array->arrayzero;
+	if (elems > max_elems) {
+		ereport(ERROR,
+				(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+				 errmsg("Int4Array cannot be extended to %d", newmax),
+				 errdetail("The array would exceed the maximum "
+						   "allocation size.")));
+	}
+	if (elems > array->allocated) {
+		int alloc = (int) Min(Max(elems, (int64) array->allocated * 2),
+							  max_elems);
+
+		if (shared) {
+			result = vl_shmalloc(sizeof(Int4Array) + (sizeof(int32) * alloc));
+		}
+		else {
+			result = vl_malloc(sizeof(Int4Array) + (sizeof(int32) * alloc));
+		}
+		memcpy(result, array, sizeof(Int4Array) + 
+			   (sizeof(int32) * cur_elems));
+		result->allocated = alloc;
+		if (shared) {
+			vl_free(array);
+		}
+		else {
+			pfree(array);
+		}
+	}
+
+	for (i = cur_elems; i < elems; i++) {
+		result->array[i] = 0;
+	}
+	result->arraymax = newmax;
 
 	return result;
 }